@@ -0,0 +1,27 @@
+local levent = require "levent.levent"
+local http = require "levent.http"
+local websocket = require "levent.http.websocket"
+
+-- every message sent by a member is broadcast to the whole room
+local room = websocket.group()
+
+local function chat(rsp, req)
+    local sock = websocket.upgrade(rsp, req)
+    if not sock then
+        return
+    end
+    room:add(sock)
+    function sock:on_message(opcode, message)
+        room:broadcast(message, opcode)
+    end
+    sock:run()
+end
+
+local function main()
+    local s = http.server("0.0.0.0", 8080)
+    s:route("GET", "/chat", chat)
+    print("serve websocket at ws://127.0.0.1:8080/chat")
+    s:serve()
+end
+
+levent.start(main)
@@ -63,9 +63,14 @@ local collection_meta = {
 	end
 }
 
+-- obj.pool: optional levent.pool, borrow the connection from it instead of dialing
 function mongo.client( obj )
 	obj.port = obj.port or 27017
 	obj.__id = 0
+	if obj.pool then
+		obj.__sock = assert(obj.pool:get(obj.host, obj.port))
+		return setmetatable(obj, client_meta)
+	end
     obj.__sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
 
     assert(obj.__sock:connect(obj.host, obj.port))
@@ -88,7 +93,11 @@ end
 
 function mongo_client:disconnect()
 	if self.__sock then
-        self.__sock:close()
+		if self.pool then
+			self.pool:put(self.__sock)
+		else
+			self.__sock:close()
+		end
 		self.__sock = nil
 	end
 end
@@ -71,6 +71,7 @@
 --]]
 local levent     = require "levent.levent"
 local socket     = require "levent.socket"
+local pool       = require "levent.pool"
 local class      = require "levent.class"
 local ltimeout    = require "levent.timeout"
 local exceptions = require "levent.exceptions"
@@ -87,6 +88,7 @@ local MAX_DOMAIN_LEN = 1024
 local MAX_LABEL_LEN = 63
 local MAX_PACKET_LEN = 2048
 local DNS_HEADER_LEN = 12
+local DEFAULT_TIMEOUT = 1
 
 -- local hosts
 local local_hosts
@@ -386,8 +388,8 @@ local function unpack_response(chunk)
     return answers
 end
 
-local function request(server, chunk, timeout, type)
-    local sock, err = socket.socket(socket.AF_INET, type == "tcp" and socket.SOCK_STREAM or socket.SOCK_DGRAM)
+local function dial(host, port, timeout)
+    local sock, err = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     if not sock then
         return nil, err
     end
@@ -396,13 +398,76 @@ local function request(server, chunk, timeout, type)
         sock:set_timeout(timeout)
     end
 
-    local ok, err = sock:connect(server.host, server.port)
+    local ok, err = sock:connect(host, port)
     if not ok then
+        sock:close()
+        return nil, err
+    end
+    return sock
+end
+
+-- truncated answers are queried again by tcp, keep these connections for a while
+local tcp_pool = pool.new({
+    max_idle = 2,
+    idle_timeout = 10,
+    connect_timeout = DEFAULT_TIMEOUT,
+    dial = dial,
+})
+
+-- socket_util requires dns, it's loaded on first use
+local socket_util
+
+local function tcp_request(server, chunk, timeout)
+    local sock, err = tcp_pool:get(server.host, server.port)
+    if not sock then
+        return nil, err
+    end
+    sock:set_timeout(timeout)
+
+    chunk = pack(">H", #chunk) .. chunk
+    local sent, err = sock:sendall(chunk)
+    if err then
+        tcp_pool:put(sock, true)
+        return nil, err
+    end
+
+    -- length prefix and reply may each come in several segments
+    socket_util = socket_util or require "levent.socket_util"
+    local header, resp
+    header, err = socket_util.read_full(sock, 2)
+    if err == true then
+        err = exception("connection closed")
+    elseif header then
+        resp, err = socket_util.read_full(sock, unpack(">H", header))
+        if err == true then
+            resp, err = nil, exception("short read")
+        end
+    end
+    tcp_pool:put(sock, err ~= nil)
+    if err then
         return nil, err
     end
 
+    return unpack_response(resp)
+end
+
+local function request(server, chunk, timeout, type)
     if type == "tcp" then
-        chunk = pack(">H", #chunk) .. chunk
+        return tcp_request(server, chunk, timeout)
+    end
+
+    local sock, err = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    if not sock then
+        return nil, err
+    end
+
+    if timeout then
+        sock:set_timeout(timeout)
+    end
+
+    local ok, err = sock:connect(server.host, server.port)
+    if not ok then
+        return nil, err
     end
 
     local sent, err = sock:send(chunk)
@@ -414,19 +479,8 @@ local function request(server, chunk, timeout, type)
         return nil, exception("send failed")
     end
 
-    local resp, err
-    if type == "tcp" then
-        local header
-        header, err = sock:recv(2)
-        if err then
-            return nil, err
-        end
-        local len = unpack(">H", header)
-        resp, err = sock:recv(len)
-    else
-        -- only accept first packet, drop others
-        resp, err = sock:recv(MAX_PACKET_LEN)
-    end
+    -- only accept first packet, drop others
+    local resp, err = sock:recv(MAX_PACKET_LEN)
     sock:close()
     if err then
         return nil, err
@@ -634,7 +688,7 @@ end
 
 function dns.resolve(name, qtype, timeout)
     name = name:lower()
-    timeout = timeout or 1
+    timeout = timeout or DEFAULT_TIMEOUT
     qtype = qtype or QTYPE.A
     local ntype = guess_name_type(name)
     if ntype ~= "hostname" then
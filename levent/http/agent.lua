@@ -0,0 +1,227 @@
+local lock     = require "levent.lock"
+local pool     = require "levent.pool"
+local c        = require "levent.http.c"
+local client   = require "levent.http.client"
+local request  = require "levent.http.request"
+local response = require "levent.http.response"
+local util     = require "levent.http.util"
+
+--[[
+-- issue requests over keep-alive connections shared per origin
+--
+-- local a = agent.new({max_per_host = 8})
+-- local rsp, err = a:request("GET", "http://example.com/", {pipeline = true})
+--]]
+
+-- methods safe to send before response of the previous request is read
+local PIPELINE_METHODS = {
+    GET = true,
+    HEAD = true,
+    OPTIONS = true,
+}
+
+local DEFAULT_PIPELINE_DEPTH = 8
+
+local agent = {}
+agent.__index = agent
+
+-- opts:
+--  max_per_host: max connections per origin, nil means unlimited
+--  max_idle: max idle connections kept per origin
+--  idle_timeout: close connections idle longer than this (in seconds)
+--  pipeline_depth: max requests in flight on one pipelined connection
+--  pool: use this connection pool, other pool options are ignored
+function agent.new(opts)
+    opts = opts or {}
+    local obj = {
+        pool = opts.pool or pool.new({
+            max_active = opts.max_per_host,
+            max_idle = opts.max_idle,
+            idle_timeout = opts.idle_timeout,
+        }),
+        pipeline_depth = opts.pipeline_depth or DEFAULT_PIPELINE_DEPTH,
+        -- origin -> list of pipelined connections
+        pipes = {},
+    }
+    return setmetatable(obj, agent)
+end
+
+-- opts:
+--  headers: request headers
+--  body: string or k-v table
+--  pipeline: pipeline GET/OPTIONS requests on a shared connection
+--  stream: don't read body, read it by rsp:read_body and call rsp:close
+--  max_body_size: max size of body read in memory
+function agent:request(method, url, opts)
+    opts = opts or {}
+    local req, err = request.new(method, url, opts.body, opts.headers)
+    if not req then
+        return nil, err
+    end
+
+    if opts.pipeline and not opts.stream and PIPELINE_METHODS[method] then
+        local rsp, err, retry = self:_pipeline(req, opts)
+        if not retry then
+            return rsp, err
+        end
+    end
+    return self:_send(req, opts)
+end
+
+function agent:_send(req, opts)
+    local cli = client.new(req.host, req.port, self.pool)
+    local ok, err = cli:send(req)
+    if not ok then
+        cli:close()
+        return nil, err
+    end
+
+    local rsp, err = cli:get_response(opts)
+    if not rsp then
+        cli:close()
+        return nil, err
+    end
+
+    if opts.stream then
+        -- connection is given back by rsp:close
+        rsp.client = cli
+    else
+        cli:close()
+    end
+    return rsp
+end
+
+-- find a pipelined connection with room, or borrow a new one
+function agent:_get_pipe(host, port)
+    local key = host .. ":" .. port
+    local list = self.pipes[key]
+    if list then
+        for _, pipe in ipairs(list) do
+            if not pipe.broken and #pipe.queue < self.pipeline_depth then
+                return pipe
+            end
+        end
+    end
+
+    local conn, err = self.pool:get(host, port)
+    if not conn then
+        return nil, err
+    end
+
+    local pipe = {
+        key = key,
+        conn = conn,
+        parser = c.new(c.HTTP_RESPONSE),
+        -- one event per request in flight, the first one reads its response
+        queue = {},
+        cached = nil,
+        broken = false,
+    }
+
+    -- list may be changed while waiting for a connection
+    list = self.pipes[key]
+    if not list then
+        list = {}
+        self.pipes[key] = list
+    end
+    list[#list + 1] = pipe
+    return pipe
+end
+
+function agent:_put_pipe(pipe)
+    local list = self.pipes[pipe.key]
+    for i, v in ipairs(list) do
+        if v == pipe then
+            table.remove(list, i)
+            break
+        end
+    end
+    if #list == 0 then
+        self.pipes[pipe.key] = nil
+    end
+    self.pool:put(pipe.conn, pipe.broken or pipe.cached ~= nil)
+end
+
+-- return rsp; or nil, err, retry. retry is true if request failed because
+-- an earlier request broke the pipeline, it could be sent again
+function agent:_pipeline(req, opts)
+    local pipe, err = self:_get_pipe(req.host, req.port)
+    if not pipe then
+        return nil, err
+    end
+
+    local ticket = lock.event()
+    local queue = pipe.queue
+    queue[#queue + 1] = ticket
+
+    -- queued as a whole, so requests of concurrent callers never interleave
+    local conn = pipe.conn
+    local ok, err = conn:write_async(req:pack())
+    if ok == false then
+        ok, err = conn:flush()
+    end
+    if not ok then
+        pipe.broken = true
+    end
+
+    if queue[1] ~= ticket then
+        ticket:wait()
+    end
+
+    local rsp, retry
+    if pipe.broken then
+        err = err or "pipeline broken"
+        retry = true
+    else
+        if req.method == "HEAD" then
+            pipe.parser:skip_body()
+        end
+        local msg, left = util.read_message(conn, pipe.parser, pipe.cached, opts.max_body_size)
+        if not msg then
+            pipe.broken = true
+            err = left
+        elseif not msg.complete then
+            pipe.broken = true
+            err = "connection closed"
+        else
+            pipe.cached = left
+            -- no more response on this connection
+            if not msg.keepalive then
+                pipe.broken = true
+            end
+            rsp = response.new(msg)
+        end
+    end
+
+    table.remove(queue, 1)
+    if queue[1] then
+        queue[1]:set()
+    else
+        self:_put_pipe(pipe)
+    end
+    return rsp, err, retry
+end
+
+-- pool stats with number of pipelined connections and requests in flight
+function agent:stats()
+    local t = self.pool:stats()
+    t.pipes = 0
+    t.pipelined = 0
+    for key, list in pairs(self.pipes) do
+        local ep = t.endpoints[key]
+        for _, pipe in ipairs(list) do
+            t.pipes = t.pipes + 1
+            t.pipelined = t.pipelined + #pipe.queue
+            if ep then
+                ep.pipelined = (ep.pipelined or 0) + #pipe.queue
+            end
+        end
+    end
+    return t
+end
+
+function agent:close()
+    self.pool:close()
+end
+
+return agent
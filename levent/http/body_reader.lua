@@ -0,0 +1,164 @@
+local c    = require "levent.http.c"
+local util = require "levent.http.util"
+
+local READ_SIZE = util.READ_SIZE
+
+--[[
+-- read message body piece by piece, socket is read only when the caller
+-- asks for more, so a slow consumer stalls the peer by tcp flow control
+-- instead of piling the body up in memory
+--
+-- local msg, left = util.read_header(conn, parser, left, chunks)
+-- local body = body_reader.new(conn, parser, msg, left, chunks)
+-- for chunk in body:chunks() do ... end
+--]]
+local body_reader = {}
+body_reader.__index = body_reader
+
+local function init(self, conn, parser, msg, left, chunks)
+    self.conn = conn
+    self.parser = parser
+    self.msg = msg
+    self.left = left
+    -- parsed but not consumed pieces, pieces[head] is the next one
+    self.pieces = chunks or {}
+    self.head = 1
+    self.done = msg.complete or false
+    self.nread = 0
+    self.err = nil
+    return self
+end
+
+function body_reader.new(conn, parser, msg, left, chunks)
+    return init(setmetatable({}, body_reader), conn, parser, msg, left, chunks)
+end
+
+-- reuse reader for the next message on a connection
+body_reader.reset = init
+
+-- parse more data until at least one piece is available or message completes
+function body_reader:_fill()
+    local pieces = self.pieces
+    while self.head > #pieces and not self.done do
+        if self.head > 1 then
+            pieces = {}
+            self.pieces = pieces
+            self.head = 1
+        end
+
+        local s, err = self.left
+        self.left = nil
+        if not s then
+            s, err = self.conn:recv(READ_SIZE)
+            if not s then
+                self.err = err
+                return false
+            end
+        end
+
+        local parsed
+        parsed, err = self.parser:execute(s, nil, self.msg, pieces)
+        if err then
+            self.err = c.http_errno_name(err)
+            return false
+        end
+
+        if self.msg.complete then
+            self.done = true
+        end
+
+        -- socket closed by peer
+        if #s == 0 then
+            if not self.done then
+                self.err = "connection closed"
+                return false
+            end
+            break
+        end
+
+        if parsed < #s then
+            self.left = s:sub(parsed+1)
+        end
+    end
+    return self.head <= #pieces
+end
+
+-- read at most n bytes of body, or the next parsed piece if n is nil
+-- return nil at end of body, or nil, err on failure
+function body_reader:read(n)
+    if self.err then
+        return nil, self.err
+    end
+    if not self:_fill() then
+        return nil, self.err
+    end
+
+    local pieces = self.pieces
+    local head = self.head
+    local piece = pieces[head]
+    if n and #piece > n then
+        pieces[head] = piece:sub(n+1)
+        piece = piece:sub(1, n)
+    else
+        -- consumed pieces are kept until the list is renewed by _fill,
+        -- a hole would make the length, where parser appends, ambiguous
+        self.head = head + 1
+    end
+    self.nread = self.nread + #piece
+    return piece
+end
+
+-- iterate over body pieces, check reader.err after loop for failure
+function body_reader:chunks(n)
+    return function()
+        return self:read(n)
+    end
+end
+
+-- read the rest of body into one string
+-- max: fail with "body too large" if body is longer than max bytes
+function body_reader:read_all(max)
+    local t = {}
+    local size = 0
+    while true do
+        local piece, err = self:read()
+        if not piece then
+            if err then
+                return nil, err
+            end
+            break
+        end
+        size = size + #piece
+        if max and size > max then
+            self.err = "body too large"
+            return nil, self.err
+        end
+        t[#t + 1] = piece
+    end
+    return table.concat(t)
+end
+
+-- drop the rest of body, give up if more than max bytes are left
+-- return true if the whole message is consumed
+function body_reader:discard(max)
+    local size = 0
+    while true do
+        local piece = self:read()
+        if not piece then
+            break
+        end
+        size = size + #piece
+        if max and size > max then
+            self.err = "body too large"
+            break
+        end
+    end
+    return self.done and not self.err
+end
+
+-- data received after the end of this message, e.g. a pipelined request
+function body_reader:leftover()
+    return self.left
+end
+
+return body_reader
@@ -2,27 +2,46 @@ local socketUtil = require "levent.socket_util"
 local c          = require "levent.http.c"
 local response   = require "levent.http.response"
 local util       = require "levent.http.util"
+local bodyReader = require "levent.http.body_reader"
 
 local client = {}
 client.__index = client
 
-function client.new(host, port)
+-- if pool is given, connection is borrowed from it instead of dialing
+function client.new(host, port, pool)
     local obj = {
         host = host,
         port = port,
+        pool = pool,
+        -- whether conn can be reused by others after close
+        reusable = false,
+        -- whether the pending response answers a HEAD request
+        head_only = false,
     }
     return setmetatable(obj, client)
 end
 
+function client:_connect()
+    if self.pool then
+        return self.pool:get(self.host, self.port)
+    end
+    return socketUtil.create_connection(self.host, self.port)
+end
+
 function client:send(request)
     if not self.conn then
-        local conn, err = socketUtil.create_connection(self.host, self.port)
+        local conn, err = self:_connect()
         if not conn then
             return false, err
         end
         self.conn = conn
     end
 
+    -- until response is read out
+    self.reusable = false
+    -- response to HEAD has headers only, whatever its Content-Length says
+    self.head_only = request.method == "HEAD"
+
     local chunk = request:pack()
     local _, err =  self.conn:sendall(chunk)
     if err then
@@ -32,27 +51,74 @@ function client:send(request)
     return true
 end
 
-function client:get_response()
+-- opts:
+--  stream: don't read body, read it by rsp:read_body or rsp:body_chunks
+--  max_body_size: max size of body read in memory, nil means unlimited
+--  raw: keep raw bytes of response for rsp:get_raw, not for stream
+function client:get_response(opts)
     assert(self.conn, "not connected")
     if not self.parser then
         self.parser = c.new(c.HTTP_RESPONSE)
     end
+    if self.head_only then
+        self.parser:skip_body()
+    end
 
-    local msg, left, raw = util.read_message(self.conn, self.parser, self.cached)
+    if opts and opts.stream then
+        return self:_get_response_stream()
+    end
+
+    local max = opts and opts.max_body_size
+    local msg, left, raw = util.read_message(self.conn, self.parser, self.cached, max, opts and opts.raw)
     if not msg then
-        self.conn:close()
+        self:close()
         return nil, left
     end
     msg.raw_response = raw
 
     self.cached = left
+    self.reusable = msg.complete and msg.keepalive and not left
     return response.new(msg)
 end
 
+function client:_get_response_stream()
+    local chunks = {}
+    local msg, left = util.read_header(self.conn, self.parser, self.cached, chunks)
+    if not msg then
+        self:close()
+        return nil, left
+    end
+    if not msg.headers_complete then
+        self:close()
+        return nil, "connection closed"
+    end
+
+    self.cached = nil
+    self.body_reader = bodyReader.new(self.conn, self.parser, msg, left, chunks)
+    return response.new(msg, self.body_reader)
+end
+
 function client:close()
+    -- a streamed response can be reused only if its body is read out
+    local reader = self.body_reader
+    if reader then
+        self.body_reader = nil
+        self.reusable = reader.done and not reader.err and reader.msg.keepalive
+            and not reader:leftover()
+    end
+
     if self.conn then
-        self.conn:close()
+        if self.pool then
+            self.pool:put(self.conn, not self.reusable)
+        else
+            self.conn:close()
+        end
         self.conn = nil
+        if not self.reusable then
+            self.parser = nil
+        end
+        self.cached = nil
+        self.reusable = false
     end
 end
 
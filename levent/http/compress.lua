@@ -0,0 +1,121 @@
+local zlib = require "levent.http.zlib.c"
+
+--[[
+-- content coding of responses: Accept-Encoding negotiation and the
+-- settings a response writer compresses its body by
+--
+-- rsp:compress(req, {level = 6, min_size = 1024})
+--]]
+
+local DEFAULT_LEVEL = 6
+local DEFAULT_MIN_SIZE = 1024
+
+-- preferred first when client accepts them equally
+local ENCODINGS = {"gzip", "deflate"}
+
+local compress = {}
+compress.zlib = zlib
+
+-- quality of each coding in Accept-Encoding: {gzip = 1, ["*"] = 0.5}
+local function parse_accept(s)
+    local t = {}
+    for item in s:gmatch("[^,]+") do
+        local name, params = item:match("^%s*([^;%s]+)%s*(.-)%s*$")
+        if name then
+            local q = params:match("[Qq]%s*=%s*([%d.]+)")
+            t[name:lower()] = q and tonumber(q) or 1
+        end
+    end
+    return t
+end
+
+-- coding to use for Accept-Encoding, nil if none is acceptable
+function compress.negotiate(accept)
+    if not accept or accept == "" then
+        return nil
+    end
+    local t = parse_accept(accept)
+    local best, best_q = nil, 0
+    for _, name in ipairs(ENCODINGS) do
+        local q = t[name] or t["*"] or 0
+        if q > best_q then
+            best, best_q = name, q
+        end
+    end
+    return best
+end
+
+-- whether coding name is acceptable by Accept-Encoding
+function compress.accepts(accept, name)
+    if not accept or accept == "" then
+        return false
+    end
+    local t = parse_accept(accept)
+    return (t[name] or t["*"] or 0) > 0
+end
+
+-- whether compressing a content type pays off, compressed formats like
+-- images and archives don't
+function compress.compressible(content_type)
+    if not content_type then
+        return true
+    end
+    -- an empty one names no type to compress
+    local t = tostring(content_type):match("^%s*([^;%s]+)")
+    if not t then
+        return false
+    end
+    t = t:lower()
+    return t:find("^text/") ~= nil
+        or t:find("[/+]json$") ~= nil
+        or t:find("[/+]xml$") ~= nil
+        or t == "application/javascript"
+        or t == "application/x-www-form-urlencoded"
+        or t == "application/wasm"
+        or t == "image/svg+xml"
+end
+
+-- settings of a response, encoding is nil if client accepts no coding we
+-- support, the response still varies by Accept-Encoding
+-- opts:
+--  level: zlib compression level 1-9, default 6
+--  min_size: bodies smaller than this are sent as is, default 1024
+function compress.new(accept, opts)
+    opts = opts or {}
+    return {
+        encoding = compress.negotiate(accept),
+        level = opts.level or DEFAULT_LEVEL,
+        min_size = opts.min_size or DEFAULT_MIN_SIZE,
+    }
+end
+
+-- whole body compressed at once
+function compress.compress(setting, data)
+    return zlib.compress(data, setting.level, setting.encoding)
+end
+
+-- streaming compressor of a body sent piece by piece
+function compress.deflater(setting)
+    return zlib.deflater(setting.level, setting.encoding)
+end
+
+-- wrap a handler so its responses are compressed, opts as compress.new;
+-- false turns off compression enabled for the whole server
+function compress.handler(handler, opts)
+    return function(rsp, req)
+        rsp:compress(req, opts)
+        return handler(rsp, req)
+    end
+end
+
+-- add a token to Vary
+function compress.add_vary(headers, token)
+    local vary = headers["Vary"]
+    if not vary then
+        headers["Vary"] = token
+    elseif not vary:lower():find(token:lower(), 1, true) and vary ~= "*" then
+        headers["Vary"] = vary .. ", " .. token
+    end
+end
+
+return compress
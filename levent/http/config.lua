@@ -8,6 +8,22 @@ config.HTTP_PORT = 80
 config.HTTP_AGENT = "levent/1.0"
 config.HTTP_ABS_PATH = "/"
 
+-- max message body kept in memory
+config.MAX_BODY_SIZE = 8 * 1024 * 1024
+-- max size of request line and headers
+config.MAX_HEADER_SIZE = 64 * 1024
+
+-- server timeouts in seconds
+-- wait for next request on a keep-alive connection
+config.IDLE_TIMEOUT = 60
+-- read whole request line and headers
+config.HEADER_TIMEOUT = 30
+-- each read of request body, and each write of response
+config.BODY_TIMEOUT = 60
+
+-- upper bounds in seconds of request latency histogram buckets
+config.METRICS_BUCKETS = {0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10}
+
 -- supported methods
 -- http methods is case-sensitive
 config.HTTP_METHODS = {
@@ -29,11 +45,20 @@ config.VALID_SCHEMA = {
 config.WebSocket = {
     VERSION = 13,
     GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11",
+    -- max payload of a frame data messages are split into, false for none
+    FRAGMENT_SIZE = 64 * 1024,
+    -- max size of a message received, fragments included, false for none
+    MAX_MESSAGE_SIZE = 16 * 1024 * 1024,
+    -- seconds a blocking send of frames may take, false for none
+    WRITE_TIMEOUT = 30,
     CODES = {
         CLOSE_NORMAL = 1000,
         CLOSE_GOING_AWAY = 1001,
         CLOSE_PROTOCOL_ERROR = 1002,
         CLOSE_UNSUPPORTED = 1003,
+        -- never sent, reported when connection is lost without a close frame
+        CLOSE_ABNORMAL = 1006,
+        CLOSE_TOO_LARGE = 1009,
     }
 }
 
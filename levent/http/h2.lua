@@ -0,0 +1,1057 @@
+local c              = require "levent.http.h2.c"
+local httpc          = require "levent.http.c"
+local levent         = require "levent.levent"
+local lock           = require "levent.lock"
+local timeout        = require "levent.timeout"
+local util           = require "levent.http.util"
+local responseWriter = require "levent.http.response_writer"
+
+--[[
+-- http/2 over cleartext tcp (h2c), by prior knowledge or by Upgrade: h2c
+--
+-- every stream is served by its own coroutine with the same handler of
+-- http/1.x: handler(rsp, req). request body is delivered as DATA frames
+-- arrive, stream window is given back as the handler reads it
+--]]
+
+local PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+-- frame types
+local DATA          = 0x0
+local HEADERS       = 0x1
+local PRIORITY      = 0x2
+local RST_STREAM    = 0x3
+local SETTINGS      = 0x4
+local PUSH_PROMISE  = 0x5
+local PING          = 0x6
+local GOAWAY        = 0x7
+local WINDOW_UPDATE = 0x8
+local CONTINUATION  = 0x9
+
+-- frame flags
+local FLAG_END_STREAM  = 0x1
+local FLAG_ACK         = 0x1
+local FLAG_END_HEADERS = 0x4
+local FLAG_PADDED      = 0x8
+local FLAG_PRIORITY    = 0x20
+
+-- settings
+local SETTINGS_HEADER_TABLE_SIZE      = 0x1
+local SETTINGS_ENABLE_PUSH            = 0x2
+local SETTINGS_MAX_CONCURRENT_STREAMS = 0x3
+local SETTINGS_INITIAL_WINDOW_SIZE    = 0x4
+local SETTINGS_MAX_FRAME_SIZE         = 0x5
+local SETTINGS_MAX_HEADER_LIST_SIZE   = 0x6
+
+-- error codes
+local NO_ERROR           = 0x0
+local PROTOCOL_ERROR     = 0x1
+local INTERNAL_ERROR     = 0x2
+local FLOW_CONTROL_ERROR = 0x3
+local STREAM_CLOSED      = 0x5
+local FRAME_SIZE_ERROR   = 0x6
+local REFUSED_STREAM     = 0x7
+local CANCEL             = 0x8
+local COMPRESSION_ERROR  = 0x9
+local ENHANCE_YOUR_CALM  = 0xb
+
+local DEFAULT_WINDOW_SIZE = 65535
+local DEFAULT_FRAME_SIZE = 16384
+local DEFAULT_TABLE_SIZE = 4096
+local MAX_WINDOW_SIZE = 0x7fffffff
+local MAX_FRAME_SIZE = 0xffffff
+local MAX_CONCURRENT_STREAMS = 100
+local MAX_HEADER_LIST_SIZE = 65536
+local READ_SIZE = DEFAULT_FRAME_SIZE + c.FRAME_HEADER_SIZE
+-- write_async returns false once a stream queues more than this
+local STREAM_HIGHMARK = 65536
+
+-- not allowed in http/2
+local CONNECTION_HEADERS = {
+    ["connection"] = true,
+    ["keep-alive"] = true,
+    ["proxy-connection"] = true,
+    ["transfer-encoding"] = true,
+    ["upgrade"] = true,
+}
+
+local spack = string.pack
+local sunpack = string.unpack
+local pack_frame = c.pack_frame
+
+local function pack_settings(t)
+    local parts = {}
+    for _, kv in ipairs(t) do
+        parts[#parts + 1] = spack(">I2I4", kv[1], kv[2])
+    end
+    return table.concat(parts)
+end
+
+local function http_date()
+    return httpc.http_date(levent.now())
+end
+
+--[[
+-- stream, also body reader of its request
+--]]
+local Stream = {}
+Stream.__index = Stream
+
+function Stream.new(conn, id)
+    local obj = {
+        conn = conn,
+        id = id,
+        send_window = conn.peer_initial_window,
+        -- bytes received but not given back by WINDOW_UPDATE
+        recv_used = 0,
+        recv_unacked = 0,
+        pieces = {},
+        head = 1,
+        event = lock.event(),
+        recv_ended = false,
+        send_ended = false,
+        err = nil,
+    }
+    return setmetatable(obj, Stream)
+end
+
+function Stream:_on_data(data, end_stream)
+    if #data > 0 then
+        if self.head > #self.pieces then
+            self.pieces = {data}
+            self.head = 1
+        else
+            self.pieces[#self.pieces + 1] = data
+        end
+    end
+    if end_stream then
+        self.recv_ended = true
+    end
+    self.event:set()
+end
+
+-- stream is closed by error, wake up its reader and writers
+function Stream:_abort(err)
+    if not self.err then
+        self.err = err
+        self.event:set()
+        self.conn.window_event:set()
+    end
+end
+
+-- give back n bytes of stream window
+function Stream:_consumed(n)
+    self.recv_unacked = self.recv_unacked + n
+    if self.recv_unacked >= DEFAULT_WINDOW_SIZE // 2 and not self.recv_ended then
+        local n = self.recv_unacked
+        self.recv_unacked = 0
+        self.recv_used = self.recv_used - n
+        self.conn:_write(pack_frame(WINDOW_UPDATE, 0, self.id, spack(">I4", n)))
+    end
+end
+
+-- read at most n bytes of body, nil at end of body
+function Stream:read(n)
+    while self.head > #self.pieces do
+        if self.err then
+            return nil, self.err
+        end
+        if self.recv_ended then
+            return nil
+        end
+        self.event:clear()
+        self.event:wait()
+    end
+
+    local pieces = self.pieces
+    local head = self.head
+    local piece = pieces[head]
+    if n and #piece > n then
+        pieces[head] = piece:sub(n + 1)
+        piece = piece:sub(1, n)
+    else
+        self.head = head + 1
+    end
+    self:_consumed(#piece)
+    return piece
+end
+
+function Stream:chunks(n)
+    return function()
+        return self:read(n)
+    end
+end
+
+function Stream:read_all(max)
+    local t = {}
+    local size = 0
+    while true do
+        local piece, err = self:read()
+        if not piece then
+            if err then
+                return nil, err
+            end
+            break
+        end
+        size = size + #piece
+        if max and size > max then
+            return nil, "body too large"
+        end
+        t[#t + 1] = piece
+    end
+    return table.concat(t)
+end
+
+-- body left is dropped by closing stream after response
+function Stream:discard()
+    return true
+end
+
+function Stream:leftover()
+    return nil
+end
+
+--[[
+-- response writer of a stream
+--]]
+local Response = setmetatable({}, {__index = responseWriter})
+Response.__index = Response
+
+function Response.new(stream, msg)
+    local obj = responseWriter.new(nil, msg)
+    obj.stream = stream
+    obj.can_chunk = false
+    return setmetatable(obj, Response)
+end
+
+local function has_body(code)
+    return code >= 200 and code ~= 204 and code ~= 304
+end
+
+function Response:_header_list()
+    local list = {":status", tostring(self.code or 200)}
+    local headers = self.headers
+    if not headers["Content-Type"] then
+        headers["Content-Type"] = "text/plain"
+    end
+    if not headers["Date"] then
+        headers["Date"] = http_date()
+    end
+    for k, v in pairs(headers) do
+        local name = k:lower()
+        if not CONNECTION_HEADERS[name] then
+            list[#list + 1] = name
+            list[#list + 1] = tostring(v)
+        end
+    end
+    return list
+end
+
+function Response:_send_headers(end_stream)
+    self.header_sent = true
+    local ok, err = self.stream.conn:_send_headers(self.stream, self:_header_list(), end_stream)
+    if not ok then
+        self.err = err
+    end
+    return ok, err
+end
+
+function Response:write_header(code)
+    assert(not self.header_sent, "header already sent")
+    if code then
+        self:set_code(code)
+    end
+    self:_start_deflate()
+    -- no body follows
+    if self.head_only or not has_body(self.code or 200) then
+        return self:_send_headers(true)
+    end
+    return self:_send_headers(false)
+end
+
+function Response:write(chunk)
+    if self.err then
+        return false, self.err
+    end
+    if not self.header_sent then
+        local ok, err = self:write_header()
+        if not ok then
+            return false, err
+        end
+    end
+    if #chunk == 0 or self.stream.send_ended then
+        return true
+    end
+    if self.deflater then
+        local err
+        chunk, err = self:_deflate(chunk)
+        if not chunk then
+            return false, err
+        elseif #chunk == 0 then
+            return true
+        end
+    end
+
+    local ok, err = self.stream.conn:_send_data(self.stream, chunk, false)
+    if not ok then
+        self.err = err
+    end
+    return ok, err
+end
+
+-- queue a piece of body, it's sent by another coroutine within flow
+-- control windows. return false if too much is queued, nil, err if broken
+function Response:write_async(chunk)
+    if self.err then
+        return nil, self.err
+    end
+    if #chunk == 0 then
+        return true
+    end
+    local queue = self.queue
+    if not queue then
+        queue = {}
+        self.queue = queue
+        self.queued = 0
+        self.drained = lock.event()
+    end
+    queue[#queue + 1] = chunk
+    self.queued = self.queued + #chunk
+    if not self.pumping then
+        self.pumping = true
+        self.drained:clear()
+        levent.spawn(self._pump, self)
+    end
+    return self.queued < STREAM_HIGHMARK
+end
+
+function Response:_pump()
+    while #self.queue > 0 and not self.err do
+        local data = table.concat(self.queue)
+        self.queue = {}
+        self:write(data)
+        self.queued = self.queued - #data
+    end
+    self.pumping = false
+    self.drained:set()
+end
+
+function Response:queued_bytes()
+    return self.queued or 0
+end
+
+-- give up an unfinished response by resetting its stream
+function Response:abort(err)
+    self.err = self.err or err or "aborted"
+    local stream = self.stream
+    if not stream.err then
+        stream.conn:_reset_stream(stream, CANCEL)
+    end
+end
+
+-- data has to be framed, so file is read instead of sendfile
+function Response:sendfile(fd, offset, count)
+    return self:_copy_file(fd, offset, count)
+end
+
+function Response:finish()
+    if self.finished then
+        return not self.err, self.err
+    end
+    self.finished = true
+    local stream = self.stream
+    if self.pumping then
+        self.drained:wait()
+    end
+
+    local ok, err = true
+    if not self.header_sent then
+        local payload = self.data
+        if type(payload) == "table" then
+            payload = util.encode_query_string(payload)
+        end
+        payload = self:_encode_payload(payload) or ""
+        if not self.headers["Content-Length"] then
+            self.headers["Content-Length"] = #payload
+        end
+
+        if self.head_only or #payload == 0 or not has_body(self.code or 200) then
+            ok, err = self:_send_headers(true)
+        else
+            ok, err = self:_send_headers(false)
+            if ok then
+                ok, err = stream.conn:_send_data(stream, payload, true)
+            end
+        end
+    elseif not stream.send_ended and not self.err then
+        local tail = ""
+        if self.deflater then
+            tail, err = self:_deflate("", "finish")
+        end
+        if tail then
+            ok, err = stream.conn:_send_data(stream, tail, true)
+        else
+            ok = false
+        end
+    end
+    if not ok then
+        self.err = err
+    end
+    return ok, err
+end
+
+--[[
+-- connection
+--]]
+local Connection = {}
+Connection.__index = Connection
+
+function Connection.new(server, sock)
+    local max_header_size = server.max_header_size or MAX_HEADER_LIST_SIZE
+    local obj = {
+        server = server,
+        sock = sock,
+        encoder = c.new_encoder(),
+        decoder = c.new_decoder(max_header_size),
+        streams = {},
+        -- handlers running, a stream reset by peer counts until its
+        -- handler returns
+        nstream = 0,
+        -- when nstream dropped to 0, idle_timeout counts from it
+        idle_since = levent.now(),
+        last_stream_id = 0,
+        -- flow control of what we send
+        send_window = DEFAULT_WINDOW_SIZE,
+        peer_initial_window = DEFAULT_WINDOW_SIZE,
+        peer_max_frame = DEFAULT_FRAME_SIZE,
+        window_event = lock.event(),
+        -- flow control of what we receive
+        recv_unacked = 0,
+        -- header block in progress: {stream_id, end_stream, parts, size, start}
+        continuation = nil,
+        -- max size of a header block, fragments included
+        max_header_size = max_header_size,
+        closed = false,
+    }
+    return setmetatable(obj, Connection)
+end
+
+-- queue frames at once, so frames of a header block are never interleaved
+-- by other streams, then wait if too much is queued
+function Connection:_write(...)
+    if self.closed then
+        return false, "connection closed"
+    end
+    local sock = self.sock
+    local ok, err
+    for i = 1, select("#", ...) do
+        ok, err = sock:write_async((select(i, ...)))
+        if ok == nil then
+            self:_abort(err)
+            return false, err
+        end
+    end
+    if ok == false then
+        ok, err = sock:wait_writable_below()
+        if not ok then
+            err = err or "connection closed"
+            self:_abort(err)
+            return false, err
+        end
+    end
+    return true
+end
+
+function Connection:_send_headers(stream, list, end_stream)
+    if stream.err then
+        return false, stream.err
+    end
+    -- encode and queue in one go, header blocks must be decoded in the
+    -- order they're encoded
+    local block = self.encoder:encode(list)
+    local max = self.peer_max_frame
+    local flags = end_stream and FLAG_END_STREAM or 0
+    local ok, err
+    if #block <= max then
+        ok, err = self:_write(pack_frame(HEADERS, flags | FLAG_END_HEADERS, stream.id, block))
+    else
+        local frames = {pack_frame(HEADERS, flags, stream.id, block:sub(1, max))}
+        local pos = max + 1
+        while pos <= #block do
+            local piece = block:sub(pos, pos + max - 1)
+            pos = pos + max
+            frames[#frames + 1] = pack_frame(CONTINUATION, pos > #block and FLAG_END_HEADERS or 0, stream.id, piece)
+        end
+        ok, err = self:_write(table.unpack(frames))
+    end
+    if ok and end_stream then
+        self:_send_end(stream)
+    end
+    return ok, err
+end
+
+-- send data within flow control windows
+function Connection:_send_data(stream, data, end_stream)
+    local len = #data
+    if len == 0 then
+        if stream.err then
+            return false, stream.err
+        end
+        local ok, err = self:_write(pack_frame(DATA, FLAG_END_STREAM, stream.id))
+        if ok then
+            self:_send_end(stream)
+        end
+        return ok, err
+    end
+
+    local pos = 1
+    while pos <= len do
+        while not stream.err and (stream.send_window <= 0 or self.send_window <= 0) do
+            self.window_event:clear()
+            self.window_event:wait()
+        end
+        if stream.err then
+            return false, stream.err
+        end
+
+        local n = math.min(len - pos + 1, stream.send_window, self.send_window, self.peer_max_frame)
+        local piece = n == len and data or data:sub(pos, pos + n - 1)
+        pos = pos + n
+        stream.send_window = stream.send_window - n
+        self.send_window = self.send_window - n
+
+        local last = end_stream and pos > len
+        local ok, err = self:_write(pack_frame(DATA, last and FLAG_END_STREAM or 0, stream.id, piece))
+        if not ok then
+            return false, err
+        end
+        if last then
+            self:_send_end(stream)
+        end
+    end
+    return true
+end
+
+-- our side of stream is done
+function Connection:_send_end(stream)
+    stream.send_ended = true
+    if stream.recv_ended then
+        self:_remove_stream(stream)
+    else
+        -- request body is not needed any more
+        self:_reset_stream(stream, NO_ERROR)
+    end
+end
+
+function Connection:_remove_stream(stream)
+    self.streams[stream.id] = nil
+end
+
+function Connection:_reset_stream(stream, code)
+    self:_remove_stream(stream)
+    stream:_abort("stream reset")
+    self:_write(pack_frame(RST_STREAM, 0, stream.id, spack(">I4", code)))
+end
+
+function Connection:_goaway(code, reason)
+    self:_write(pack_frame(GOAWAY, 0, 0, spack(">I4I4", self.last_stream_id, code) .. (reason or "")))
+    self:_abort(reason or "goaway")
+end
+
+function Connection:_abort(err)
+    if self.closed then
+        return
+    end
+    self.closed = true
+    for _, stream in pairs(self.streams) do
+        stream:_abort(err)
+    end
+    self.window_event:set()
+end
+
+function Connection:_apply_settings(payload)
+    if #payload % 6 ~= 0 then
+        return false, FRAME_SIZE_ERROR
+    end
+    for pos = 1, #payload, 6 do
+        local id, value = sunpack(">I2I4", payload, pos)
+        if id == SETTINGS_HEADER_TABLE_SIZE then
+            self.encoder:set_max_table_size(math.min(value, DEFAULT_TABLE_SIZE))
+        elseif id == SETTINGS_ENABLE_PUSH then
+            if value > 1 then
+                return false, PROTOCOL_ERROR
+            end
+        elseif id == SETTINGS_INITIAL_WINDOW_SIZE then
+            if value > MAX_WINDOW_SIZE then
+                return false, FLOW_CONTROL_ERROR
+            end
+            local delta = value - self.peer_initial_window
+            self.peer_initial_window = value
+            for _, stream in pairs(self.streams) do
+                stream.send_window = stream.send_window + delta
+            end
+            self.window_event:set()
+        elseif id == SETTINGS_MAX_FRAME_SIZE then
+            if value < DEFAULT_FRAME_SIZE or value > MAX_FRAME_SIZE then
+                return false, PROTOCOL_ERROR
+            end
+            self.peer_max_frame = value
+        end
+    end
+    return true
+end
+
+-- make request message of http/1.x server from a decoded header list
+local function make_msg(list)
+    local msg = {http_major = 2, http_minor = 0, keepalive = true}
+    local headers = {}
+    for i = 1, #list, 2 do
+        local name, value = list[i], list[i + 1]
+        if name:byte(1) == 58 then -- ':'
+            if name == ":method" then
+                msg.method = value
+            elseif name == ":path" then
+                msg.request_url = value
+            elseif name == ":authority" then
+                msg.authority = value
+            elseif name ~= ":scheme" then
+                return nil
+            end
+        elseif name:find("[A-Z]") or CONNECTION_HEADERS[name] then
+            return nil
+        else
+            local key = util.canonical_header_key(name)
+            local old = headers[key]
+            if old then
+                value = old .. (name == "cookie" and "; " or ", ") .. value
+            end
+            headers[key] = value
+        end
+    end
+    if not msg.method or not msg.request_url then
+        return nil
+    end
+    if msg.authority and not headers["Host"] then
+        headers["Host"] = msg.authority
+    end
+    msg.headers = headers
+
+    local url = httpc.parse_url(msg.request_url)
+    if not url then
+        return nil
+    end
+    msg.host = url.host
+    msg.port = url.port
+    msg.request_path = url.request_path
+    msg.query_string = url.query_string
+    msg.userinfo = url.userinfo
+    return msg
+end
+
+function Connection:_run_stream(stream, msg)
+    local rsp = Response.new(stream, msg)
+    local r = self.server:handle_one_request(msg, stream, nil, rsp)
+    if not r then
+        -- failed after header is sent
+        if not stream.send_ended then
+            self:_reset_stream(stream, INTERNAL_ERROR)
+        end
+    else
+        r:finish()
+    end
+    self.nstream = self.nstream - 1
+    if self.nstream == 0 then
+        self.idle_since = levent.now()
+    end
+end
+
+function Connection:_start_stream(id, msg, end_stream)
+    local stream = Stream.new(self, id)
+    stream.recv_ended = end_stream
+    self.streams[id] = stream
+    self.nstream = self.nstream + 1
+    msg.remote_host = self.remote_host
+    msg.remote_port = self.remote_port
+    levent.spawn(self._run_stream, self, stream, msg)
+    return stream
+end
+
+function Connection:_on_header_block(id, block, end_stream)
+    -- header block must be decoded to keep decoder in sync, even for a
+    -- stream refused later
+    local list, err = self.decoder:decode(block)
+    if not list then
+        return false, COMPRESSION_ERROR, err
+    end
+
+    local stream = self.streams[id]
+    if stream then
+        -- trailers
+        if stream.recv_ended or not end_stream then
+            self:_reset_stream(stream, PROTOCOL_ERROR)
+        else
+            stream:_on_data("", true)
+        end
+        return true
+    end
+
+    if id % 2 == 0 or id <= self.last_stream_id then
+        return false, PROTOCOL_ERROR, "bad stream id"
+    end
+    self.last_stream_id = id
+
+    local msg = make_msg(list)
+    if not msg then
+        self:_write(pack_frame(RST_STREAM, 0, id, spack(">I4", PROTOCOL_ERROR)))
+        return true
+    end
+    if self.nstream >= MAX_CONCURRENT_STREAMS or self.goaway then
+        self:_write(pack_frame(RST_STREAM, 0, id, spack(">I4", REFUSED_STREAM)))
+        return true
+    end
+    self:_start_stream(id, msg, end_stream)
+    return true
+end
+
+-- strip padding, return data or nil if padding is malformed
+local function unpad(flags, payload)
+    if flags & FLAG_PADDED == 0 then
+        return payload
+    end
+    local pad = payload:byte(1)
+    if not pad or pad >= #payload then
+        return nil
+    end
+    return payload:sub(2, #payload - pad)
+end
+
+-- return true; or false, error code, reason to close connection
+function Connection:_on_frame(ftype, flags, id, payload)
+    local cont = self.continuation
+    if cont and (ftype ~= CONTINUATION or id ~= cont[1]) then
+        return false, PROTOCOL_ERROR, "expect continuation"
+    end
+
+    if ftype == DATA then
+        if id == 0 then
+            return false, PROTOCOL_ERROR
+        end
+        -- whole payload counts, padding included
+        local len = #payload
+        self.recv_unacked = self.recv_unacked + len
+        if self.recv_unacked > DEFAULT_WINDOW_SIZE then
+            return false, FLOW_CONTROL_ERROR
+        end
+        if self.recv_unacked >= DEFAULT_WINDOW_SIZE // 2 then
+            self:_write(pack_frame(WINDOW_UPDATE, 0, 0, spack(">I4", self.recv_unacked)))
+            self.recv_unacked = 0
+        end
+
+        local data = unpad(flags, payload)
+        if not data then
+            return false, PROTOCOL_ERROR
+        end
+        local stream = self.streams[id]
+        if not stream then
+            if id > self.last_stream_id then
+                return false, PROTOCOL_ERROR
+            end
+            -- closed or reset already, frames in flight are dropped
+            return true
+        end
+        if stream.recv_ended then
+            self:_reset_stream(stream, STREAM_CLOSED)
+            return true
+        end
+        stream.recv_used = stream.recv_used + len
+        if stream.recv_used > DEFAULT_WINDOW_SIZE then
+            self:_reset_stream(stream, FLOW_CONTROL_ERROR)
+            return true
+        end
+        -- padding is given back at once
+        if len > #data then
+            stream:_consumed(len - #data)
+        end
+        stream:_on_data(data, flags & FLAG_END_STREAM ~= 0)
+    elseif ftype == HEADERS then
+        if id == 0 then
+            return false, PROTOCOL_ERROR
+        end
+        local block = unpad(flags, payload)
+        if not block then
+            return false, PROTOCOL_ERROR
+        end
+        if flags & FLAG_PRIORITY ~= 0 then
+            block = block:sub(6)
+        end
+        local end_stream = flags & FLAG_END_STREAM ~= 0
+        if flags & FLAG_END_HEADERS == 0 then
+            self.continuation = {id, end_stream, {block}, #block, levent.now()}
+            return true
+        end
+        return self:_on_header_block(id, block, end_stream)
+    elseif ftype == CONTINUATION then
+        if not cont then
+            return false, PROTOCOL_ERROR
+        end
+        -- fragments are buffered until the block ends, never beyond limit
+        cont[4] = cont[4] + #payload
+        if cont[4] > self.max_header_size then
+            return false, ENHANCE_YOUR_CALM, "header block too large"
+        end
+        local parts = cont[3]
+        parts[#parts + 1] = payload
+        if flags & FLAG_END_HEADERS == 0 then
+            return true
+        end
+        self.continuation = nil
+        return self:_on_header_block(id, table.concat(parts), cont[2])
+    elseif ftype == SETTINGS then
+        if id ~= 0 then
+            return false, PROTOCOL_ERROR
+        end
+        if flags & FLAG_ACK ~= 0 then
+            return true
+        end
+        local ok, code = self:_apply_settings(payload)
+        if not ok then
+            return false, code
+        end
+        self:_write(pack_frame(SETTINGS, FLAG_ACK, 0))
+    elseif ftype == PING then
+        if #payload ~= 8 then
+            return false, FRAME_SIZE_ERROR
+        end
+        if flags & FLAG_ACK == 0 then
+            self:_write(pack_frame(PING, FLAG_ACK, 0, payload))
+        end
+    elseif ftype == WINDOW_UPDATE then
+        if #payload ~= 4 then
+            return false, FRAME_SIZE_ERROR
+        end
+        local inc = sunpack(">I4", payload) & MAX_WINDOW_SIZE
+        if id == 0 then
+            if inc == 0 then
+                return false, PROTOCOL_ERROR
+            end
+            self.send_window = self.send_window + inc
+            if self.send_window > MAX_WINDOW_SIZE then
+                return false, FLOW_CONTROL_ERROR
+            end
+        else
+            local stream = self.streams[id]
+            if stream then
+                if inc == 0 then
+                    self:_reset_stream(stream, PROTOCOL_ERROR)
+                    return true
+                end
+                stream.send_window = stream.send_window + inc
+                if stream.send_window > MAX_WINDOW_SIZE then
+                    self:_reset_stream(stream, FLOW_CONTROL_ERROR)
+                    return true
+                end
+            end
+        end
+        self.window_event:set()
+    elseif ftype == RST_STREAM then
+        if id == 0 or #payload ~= 4 then
+            return false, PROTOCOL_ERROR
+        end
+        local stream = self.streams[id]
+        if stream then
+            self:_remove_stream(stream)
+            stream:_abort("stream reset by peer")
+        end
+    elseif ftype == GOAWAY then
+        -- no more streams from peer, running ones go on
+        self.goaway = true
+    elseif ftype == PUSH_PROMISE then
+        return false, PROTOCOL_ERROR, "push from client"
+    end
+    -- PRIORITY and unknown frames are ignored
+    return true
+end
+
+-- seconds to wait for more data, nil for no limit, not positive once
+-- expired. a header block must be completed within header_timeout, a
+-- connection without running streams is closed after idle_timeout
+function Connection:_recv_timeout()
+    local server = self.server
+    local cont = self.continuation
+    if cont and server.header_timeout then
+        return cont[5] + server.header_timeout - levent.now()
+    end
+    if server.idle_timeout then
+        if self.nstream == 0 then
+            return self.idle_since + server.idle_timeout - levent.now()
+        end
+        -- checked again later, streams may be done by then
+        return server.idle_timeout
+    end
+end
+
+-- read and dispatch frames until connection closes
+function Connection:_read_frames(data)
+    local sock = self.sock
+    local buf = data or ""
+    local pos = 0
+    local unpack_header = c.unpack_frame_header
+    local header_size = c.FRAME_HEADER_SIZE
+    while not self.closed do
+        local len, ftype, flags, id = unpack_header(buf, pos)
+        if len and len > DEFAULT_FRAME_SIZE then
+            self:_goaway(FRAME_SIZE_ERROR)
+            return
+        end
+
+        local stop = len and pos + header_size + len
+        if stop and stop <= #buf then
+            local payload = buf:sub(pos + header_size + 1, stop)
+            pos = stop
+            local ok, code, reason = self:_on_frame(ftype, flags, id, payload)
+            if not ok then
+                self:_goaway(code, reason)
+                return
+            end
+        else
+            local wait = self:_recv_timeout()
+            if wait and wait <= 0 then
+                self:_goaway(NO_ERROR, "timeout")
+                return
+            end
+            local deadline = timeout.start_new(wait)
+            local s, err = sock:recv(READ_SIZE)
+            deadline:cancel()
+            -- on timeout, whether to close is decided by _recv_timeout
+            if not timeout.is_timeout(err) then
+                if not s or #s == 0 then
+                    self:_abort(err or "connection closed")
+                    return
+                end
+                buf = buf:sub(pos + 1) .. s
+                pos = 0
+            end
+        end
+    end
+end
+
+-- wait for client preface after data already read
+local function read_preface(sock, data)
+    while #data < #PREFACE do
+        local s, err = sock:recv(READ_SIZE)
+        if not s or #s == 0 then
+            return nil, err or "connection closed"
+        end
+        data = data .. s
+    end
+    if data:sub(1, #PREFACE) ~= PREFACE then
+        return nil, "bad preface"
+    end
+    return data:sub(#PREFACE + 1)
+end
+
+function Connection:serve(data, upgrade)
+    local settings = pack_settings({
+        {SETTINGS_MAX_CONCURRENT_STREAMS, MAX_CONCURRENT_STREAMS},
+        {SETTINGS_MAX_HEADER_LIST_SIZE, self.max_header_size},
+    })
+    self:_write(pack_frame(SETTINGS, 0, 0, settings))
+
+    -- request of upgrade is stream 1, half closed already
+    if upgrade then
+        self.last_stream_id = 1
+        local stream = self:_start_stream(1, upgrade.msg, true)
+        if upgrade.body then
+            stream:_on_data(upgrade.body, true)
+        end
+    end
+
+    local deadline = timeout.start_new(self.server.header_timeout)
+    local rest, err = read_preface(self.sock, data or "")
+    deadline:cancel()
+    if not rest then
+        self:_abort(err)
+        return
+    end
+    self:_read_frames(rest)
+end
+
+local h2 = {}
+
+-- check whether connection starts with client preface of prior knowledge
+-- return true or false with data read; or nil, err
+function h2.sniff(sock)
+    local data = ""
+    while #data < #PREFACE do
+        local s, err = sock:recv(READ_SIZE)
+        if not s then
+            return nil, err
+        end
+        if #s == 0 then
+            return false, data
+        end
+        data = data .. s
+        if data:sub(1, #PREFACE) ~= PREFACE:sub(1, #data) then
+            return false, data
+        end
+    end
+    return true, data
+end
+
+-- serve a connection in http/2, data is what's read already
+function h2.serve(server, sock, data)
+    local conn = Connection.new(server, sock)
+    conn.remote_host, conn.remote_port = sock:getpeername()
+    conn:serve(data)
+end
+
+local function get_header(headers, name)
+    for k, v in pairs(headers) do
+        if k:lower() == name then
+            return v
+        end
+    end
+end
+
+-- whether http/1.1 request asks for Upgrade: h2c
+function h2.is_upgrade(msg)
+    local headers = msg.headers or {}
+    local upgrade = get_header(headers, "upgrade")
+    return upgrade ~= nil and upgrade:lower():find("h2c", 1, true) ~= nil
+        and get_header(headers, "http2-settings") ~= nil
+end
+
+-- switch an http/1.1 connection to http/2, the request is answered on
+-- stream 1. body: request body read already, data: bytes after request
+function h2.upgrade(server, sock, msg, body, data)
+    local settings = c.decode_base64url(get_header(msg.headers, "http2-settings"))
+    local conn = Connection.new(server, sock)
+    if not settings or not conn:_apply_settings(settings) then
+        return false, "bad HTTP2-Settings"
+    end
+
+    local _, err = sock:sendall("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n")
+    if err then
+        return false, err
+    end
+
+    -- headers of the original request are kept, except those of upgrade
+    local headers = {}
+    for k, v in pairs(msg.headers) do
+        local name = k:lower()
+        if not CONNECTION_HEADERS[name] and name ~= "http2-settings" then
+            headers[k] = v
+        end
+    end
+    msg.headers = headers
+    msg.http_major = 2
+    msg.http_minor = 0
+    msg.upgrade = nil
+
+    conn.remote_host, conn.remote_port = msg.remote_host, msg.remote_port
+    conn:serve(data, {msg = msg, body = body})
+    return true
+end
+
+h2.PREFACE = PREFACE
+return h2
@@ -2,54 +2,85 @@ local client  = require "levent.http.client"
 local server  = require "levent.http.server"
 local request = require "levent.http.request"
 local config  = require "levent.http.config"
+local agent   = require "levent.http.agent"
+local static  = require "levent.http.static"
+local proxy   = require "levent.http.proxy"
+local upstream = require "levent.http.upstream"
+local sse     = require "levent.http.sse"
+local compress = require "levent.http.compress"
 
 local http_methods = config.HTTP_METHODS
 
-local function send_request(request)
-    local cli = client.new(request.host, request.port)
-    local ok, err = cli:send(request)
-    if not ok then
-        cli:close()
-        return nil, err
-    end
-    local response, err = cli:get_response()
-    if err then
-        cli:close()
-        return nil, err
-    end
-    cli:close()
-    return response
-end
+-- keep-alive connections shared by http.request/http.get/http.post
+local default_agent = agent.new()
 
 local http = {}
+
+-- send a request by default agent, see agent:request for opts
+function http.request(method, url, opts)
+    return default_agent:request(method, url, opts)
+end
+
 function http.get(url, headers)
-    local request, err = request.new(http_methods.GET, url, nil, headers)
-    if not request then
-        return nil, err
-    end
-    return send_request(request)
+    return default_agent:request(http_methods.GET, url, {headers = headers})
 end
 
 -- body could be nil, string, or k-v table
 function http.post(url, body, headers)
-    local request, err = request.new(http_methods.POST, url, body, headers)
-    if not request then
-        return nil, err
-    end
-    return send_request(request)
+    return default_agent:request(http_methods.POST, url, {body = body, headers = headers})
+end
+
+function http.agent(opts)
+    return agent.new(opts)
+end
+
+function http.stats()
+    return default_agent:stats()
 end
 
-function http.client(ip, port)
-    return client.new(ip, port)
+function http.client(ip, port, pool)
+    return client.new(ip, port, pool)
 end
 
-function http.server(ip, port)
+function http.server(ip, port, opts)
     if not ip then
         ip = "0.0.0.0"
     end
-    return server.new(ip, port)
+    return server.new(ip, port, opts)
+end
+
+-- handler serving files under root, see static.new for opts
+function http.static(root, opts)
+    return static.handler(root, opts)
+end
+
+-- handler proxying requests to backend, backend is an upstream or list of
+-- servers, see proxy.new and upstream.new for opts
+function http.proxy(backend, opts)
+    return proxy.handler(backend, opts)
+end
+
+function http.upstream(servers, opts)
+    return upstream.new(servers, opts)
+end
+
+-- switch response to server-sent events, see sse.new
+function http.sse(rsp, req, opts)
+    return sse.new(rsp, req, opts)
+end
+
+-- topics of server-sent events, see sse.broadcaster for opts
+function http.broadcaster(opts)
+    return sse.broadcaster(opts)
+end
+
+-- wrap handler to compress its responses by Accept-Encoding, see
+-- compress.new for opts, false turns off compression of server
+function http.compress(handler, opts)
+    return compress.handler(handler, opts)
 end
 
-http.request = request.new
+http.new_request = request.new
+http.pool = default_agent.pool
 return http
 
@@ -0,0 +1,389 @@
+local util = require "levent.http.util"
+
+--[[
+-- streaming multipart/form-data parser, parts are read as they arrive
+--
+-- local mp = multipart.new(function() return req:read_body() end, boundary)
+-- for part in mp:parts() do
+--     if part.filename then
+--         part:save("/tmp/upload")
+--     else
+--         local value = part:read_all()
+--     end
+-- end
+-- if mp.err then ... end
+--]]
+
+local DEFAULT_MAX_HEADER_SIZE = 8192
+local DEFAULT_MAX_FIELD_SIZE = 1024 * 1024
+local DEFAULT_MAX_FILES = 16
+
+local multipart = {}
+multipart.__index = multipart
+
+local part = {}
+part.__index = part
+
+-- boundary of a multipart Content-Type, nil if it's not multipart
+function multipart.boundary(content_type)
+    if not content_type or not content_type:lower():match("^%s*multipart/") then
+        return nil
+    end
+    local boundary = content_type:match(';%s*[Bb][Oo][Uu][Nn][Dd][Aa][Rr][Yy]="([^"]+)"')
+        or content_type:match(";%s*[Bb][Oo][Uu][Nn][Dd][Aa][Rr][Yy]=([^%s;]+)")
+    if not boundary or #boundary > 70 then
+        return nil
+    end
+    return boundary
+end
+
+-- parameters of Content-Disposition: form-data; name="a"; filename="b"
+local function parse_disposition(s)
+    local params = {}
+    for k, quoted in s:gmatch(';%s*([%w%-%*]+)%s*=%s*(%b"")') do
+        params[k:lower()] = quoted:sub(2, -2):gsub('\\(.)', '%1')
+    end
+    for k, v in s:gmatch(';%s*([%w%-%*]+)%s*=%s*([^%s";]+)') do
+        params[k:lower()] = params[k:lower()] or v
+    end
+    return params
+end
+
+-- read: function return next piece of body, nil at end or nil, err
+-- opts:
+--  max_header_size: max size of headers of a part, default 8192
+--  max_size: max size of the whole body, nil means unlimited
+function multipart.new(read, boundary, opts)
+    opts = opts or {}
+    local obj = {
+        read = read,
+        delimiter = "\r\n--" .. boundary,
+        -- first delimiter may be at the very beginning
+        buf = "\r\n",
+        pos = 1,
+        max_header_size = opts.max_header_size or DEFAULT_MAX_HEADER_SIZE,
+        max_size = opts.max_size,
+        -- bytes of body read so far
+        size = 0,
+        -- "preamble", "body" of current part, "next" after a delimiter, "done"
+        state = "preamble",
+        current = nil,
+        err = nil,
+    }
+    return setmetatable(obj, multipart)
+end
+
+-- next piece of body; nil at end or nil, err
+function multipart:_read()
+    local s, err = self.read()
+    if s then
+        self.size = self.size + #s
+        if self.max_size and self.size > self.max_size then
+            return nil, "multipart body too large"
+        end
+    end
+    return s, err
+end
+
+-- read more data into buffer, false at end of body
+function multipart:_fill()
+    local s, err = self:_read()
+    if not s then
+        self.err = err or "unexpected end of multipart body"
+        return false
+    end
+    if self.pos > #self.buf then
+        self.buf = s
+    else
+        self.buf = self.buf:sub(self.pos) .. s
+    end
+    self.pos = 1
+    return true
+end
+
+-- next piece of data before delimiter; nil, true when delimiter is reached
+function multipart:_read_data()
+    local delimiter = self.delimiter
+    while true do
+        local buf, pos = self.buf, self.pos
+        local i = buf:find(delimiter, pos, true)
+        if i then
+            self.pos = i + #delimiter
+            if i > pos then
+                return buf:sub(pos, i - 1), true
+            end
+            return nil, true
+        end
+        -- hold back a tail which may be the start of a delimiter
+        local stop = #buf
+        local cr = buf:find("\r", math.max(pos, #buf - #delimiter + 2), true)
+        if cr then
+            stop = cr - 1
+        end
+        if stop >= pos then
+            self.pos = stop + 1
+            return buf:sub(pos, stop), false
+        end
+        if not self:_fill() then
+            return nil
+        end
+    end
+end
+
+-- read a line of at most max bytes
+function multipart:_read_line(max)
+    while true do
+        local i = self.buf:find("\r\n", self.pos, true)
+        if i then
+            local line = self.buf:sub(self.pos, i - 1)
+            self.pos = i + 2
+            return line
+        end
+        if #self.buf - self.pos + 1 > max then
+            self.err = "multipart header too large"
+            return nil
+        end
+        if not self:_fill() then
+            return nil
+        end
+    end
+end
+
+function multipart:_read_headers()
+    local headers = {}
+    local size = 0
+    while true do
+        local line = self:_read_line(self.max_header_size - size)
+        if not line then
+            return nil
+        end
+        if line == "" then
+            return headers
+        end
+        size = size + #line + 2
+        local k, v = line:match("^([^:%s]+)%s*:%s*(.-)%s*$")
+        if not k then
+            self.err = "bad multipart header"
+            return nil
+        end
+        headers[util.canonical_header_key(k)] = v
+    end
+end
+
+-- next part, nil at end of body or on error (kept in mp.err)
+function multipart:next_part()
+    if self.state == "body" then
+        self.current:discard()
+    end
+    if self.err then
+        return nil, self.err
+    end
+
+    if self.state == "preamble" then
+        while true do
+            local data, found = self:_read_data()
+            if found then
+                break
+            end
+            if not data then
+                return nil, self.err
+            end
+        end
+        self.state = "next"
+    end
+    if self.state == "done" then
+        return nil
+    end
+
+    -- `--` after delimiter ends body, otherwise optional spaces and CRLF
+    while #self.buf - self.pos + 1 < 2 do
+        if not self:_fill() then
+            return nil, self.err
+        end
+    end
+    if self.buf:sub(self.pos, self.pos + 1) == "--" then
+        self.state = "done"
+        -- drain epilogue
+        while true do
+            local s, err = self:_read()
+            if not s then
+                self.err = err
+                return nil, err
+            end
+        end
+    end
+    local line = self:_read_line(self.max_header_size)
+    if not line then
+        return nil, self.err
+    end
+    if not line:match("^[ \t]*$") then
+        self.err = "bad multipart delimiter"
+        return nil, self.err
+    end
+
+    local headers = self:_read_headers()
+    if not headers then
+        return nil, self.err
+    end
+    local params = parse_disposition(headers["Content-Disposition"] or "")
+    local p = setmetatable({
+        mp = self,
+        headers = headers,
+        name = params.name,
+        filename = params.filename,
+        content_type = headers["Content-Type"],
+        done = false,
+    }, part)
+    self.state = "body"
+    self.current = p
+    return p
+end
+
+-- for part in mp:parts() do ... end
+function multipart:parts()
+    return function()
+        return self:next_part()
+    end
+end
+
+-- read next piece of part, nil at end of part or nil, err
+function part:read()
+    if self.done then
+        return nil
+    end
+    local mp = self.mp
+    local data, found = mp:_read_data()
+    if found then
+        self.done = true
+        mp.state = "next"
+    elseif not data then
+        self.done = true
+        return nil, mp.err
+    end
+    if not data then
+        return nil
+    end
+    return data
+end
+
+-- read whole part, at most max bytes
+function part:read_all(max)
+    local pieces = {}
+    local size = 0
+    while true do
+        local piece, err = self:read()
+        if not piece then
+            if err then
+                return nil, err
+            end
+            break
+        end
+        size = size + #piece
+        if max and size > max then
+            return nil, "multipart field too large"
+        end
+        pieces[#pieces + 1] = piece
+    end
+    return table.concat(pieces)
+end
+
+-- stream part to file at path, return size written
+function part:save(path)
+    local f, err = io.open(path, "wb")
+    if not f then
+        return nil, err
+    end
+    local size = 0
+    while true do
+        local piece
+        piece, err = self:read()
+        if not piece then
+            break
+        end
+        size = size + #piece
+        local ok
+        ok, err = f:write(piece)
+        if not ok then
+            break
+        end
+    end
+    f:close()
+    if err then
+        os.remove(path)
+        return nil, err
+    end
+    return size
+end
+
+function part:discard()
+    while self:read() do end
+end
+
+-- same as urlencoded forms, repeated names are collected in an array
+local function add_value(t, k, v)
+    local old = t[k]
+    if old == nil then
+        t[k] = v
+    elseif type(old) == "table" and not old.filename then
+        old[#old + 1] = v
+    else
+        t[k] = {old, v}
+    end
+end
+
+-- read all parts into a table, values of fields are kept in memory and
+-- file parts are streamed to on_file
+-- opts:
+--  max_field_size: max size of a field which is not a file, default 1M
+--  max_files: max number of file parts, default 16
+--  on_file: function(part) return value kept in the table for a file part,
+--    default saves it as a temp file and returns
+--    {filename = , content_type = , path = , size = }, path is to be
+--    removed by caller. on error, temp files saved already are removed
+function multipart:read_form(opts)
+    opts = opts or {}
+    local max_field_size = opts.max_field_size or DEFAULT_MAX_FIELD_SIZE
+    local max_files = opts.max_files or DEFAULT_MAX_FILES
+    local on_file = opts.on_file
+    local t = {}
+    local paths = {}
+    local nfile = 0
+    local err
+    for p in self:parts() do
+        local v
+        if p.filename then
+            nfile = nfile + 1
+            if nfile > max_files then
+                err = "too many files in multipart form"
+            elseif on_file then
+                v, err = on_file(p)
+            else
+                local path = os.tmpname()
+                local size
+                size, err = p:save(path)
+                if size then
+                    paths[#paths + 1] = path
+                    v = {filename = p.filename, content_type = p.content_type, path = path, size = size}
+                end
+            end
+        else
+            v, err = p:read_all(max_field_size)
+        end
+        if err then
+            self.err = err
+            break
+        end
+        if p.name and v ~= nil then
+            add_value(t, p.name, v)
+        end
+    end
+    if self.err then
+        for _, path in ipairs(paths) do
+            os.remove(path)
+        end
+        return nil, self.err
+    end
+    return t
+end
+
+return multipart
@@ -0,0 +1,292 @@
+local c          = require "levent.http.c"
+local util       = require "levent.http.util"
+local bodyReader = require "levent.http.body_reader"
+local upstream   = require "levent.http.upstream"
+
+--[[
+-- reverse proxy handler, bodies are streamed in both directions
+--
+-- s:route(nil, "/api/*path", http.proxy({"10.0.0.1:8080", "10.0.0.2:8080"}, {
+--     balance = "hash",
+--     hash_key = function(req) return req.remote_host end,
+-- }))
+--]]
+
+local DEFAULT_TIMEOUT = 60
+local DEFAULT_RETRIES = 1
+
+-- hop-by-hop headers are not forwarded, Expect is dropped too as body is
+-- streamed to upstream without waiting for 100-continue
+local HOP_HEADERS = {
+    ["connection"] = true,
+    ["keep-alive"] = true,
+    ["proxy-connection"] = true,
+    ["proxy-authenticate"] = true,
+    ["proxy-authorization"] = true,
+    ["te"] = true,
+    ["trailer"] = true,
+    ["transfer-encoding"] = true,
+    ["upgrade"] = true,
+    ["expect"] = true,
+}
+
+-- copy end-to-end headers, also skip those listed in Connection
+local function copy_headers(src, dst)
+    local skip
+    for k, v in pairs(src) do
+        if k:lower() == "connection" then
+            for token in v:gmatch("[^,%s]+") do
+                skip = skip or {}
+                skip[token:lower()] = true
+            end
+        end
+    end
+
+    for k, v in pairs(src) do
+        local lk = k:lower()
+        if not HOP_HEADERS[lk] and not (skip and skip[lk]) then
+            dst[util.canonical_header_key(k)] = v
+        end
+    end
+    return dst
+end
+
+local function get_header(headers, name)
+    local v = headers[name]
+    if v then
+        return v
+    end
+    name = name:lower()
+    for k, v in pairs(headers) do
+        if k:lower() == name then
+            return v
+        end
+    end
+end
+
+-- responses without body whatever their headers say
+local function no_body(method, code)
+    return method == "HEAD" or code < 200 or code == 204 or code == 304
+end
+
+local function is_timeout(err)
+    return tostring(err):find("Timeout", 1, true) ~= nil
+end
+
+local proxy = {}
+proxy.__index = proxy
+
+-- backend: an upstream, or list of servers to create one with opts
+-- opts (and upstream.new opts):
+--  timeout: seconds to wait on upstream io, default 60
+--  retries: other servers tried if a server can't be reached, default 1
+--  hash_key: function(req) return key for hash balance, default remote host
+--  rewrite: function(req) return path sent to upstream, default request url
+--  host: Host sent to upstream, default the Host of request
+function proxy.new(backend, opts)
+    opts = opts or {}
+    if getmetatable(backend) ~= upstream then
+        backend = upstream.new(backend, opts)
+    end
+    local obj = {
+        upstream = backend,
+        timeout = opts.timeout or DEFAULT_TIMEOUT,
+        retries = opts.retries or DEFAULT_RETRIES,
+        hash_key = opts.hash_key or function(req) return req.remote_host end,
+        rewrite = opts.rewrite,
+        host = opts.host,
+    }
+    return setmetatable(obj, proxy)
+end
+
+function proxy:_request_headers(req)
+    local headers = copy_headers(req.headers or {}, {})
+    local xff = headers["X-Forwarded-For"]
+    if req.remote_host then
+        headers["X-Forwarded-For"] = xff and (xff .. ", " .. req.remote_host) or req.remote_host
+    end
+    if headers["Host"] then
+        headers["X-Forwarded-Host"] = headers["X-Forwarded-Host"] or headers["Host"]
+    end
+    headers["X-Forwarded-Proto"] = headers["X-Forwarded-Proto"] or "http"
+    if self.host then
+        headers["Host"] = self.host
+    end
+    return headers
+end
+
+-- send request head to a server, a server which can't be reached is marked
+-- failed and the next one is tried
+function proxy:_connect(req, head)
+    local up = self.upstream
+    local key = self.hash_key(req)
+    local err
+    for _ = 0, self.retries do
+        local s
+        s, err = up:pick(key)
+        if not s then
+            break
+        end
+
+        local conn
+        conn, err = up:get(s)
+        if conn then
+            conn:set_timeout(self.timeout)
+            local _
+            _, err = conn:sendall(head)
+            if not err then
+                return s, conn
+            end
+            up:put(s, conn, true)
+        end
+        up:fail(s)
+    end
+    return nil, err
+end
+
+-- stream request body to upstream
+local function send_body(req, conn, chunked)
+    while true do
+        local piece, err = req:read_body()
+        if not piece then
+            if err then
+                return false, err
+            end
+            break
+        end
+        local _
+        if chunked then
+            _, err = conn:sendallv({string.format("%x\r\n", #piece), piece, "\r\n"})
+        else
+            _, err = conn:sendall(piece)
+        end
+        if err then
+            return false, err
+        end
+    end
+    if chunked then
+        local _, err = conn:sendall("0\r\n\r\n")
+        if err then
+            return false, err
+        end
+    end
+    return true
+end
+
+-- read header of the final response, interim (1xx) responses are dropped.
+-- return parser, msg, left, chunks; or nil, err
+local function read_response_header(conn, method)
+    local left
+    while true do
+        -- a new parser for each response, skip_body is for one message
+        local parser = c.new(c.HTTP_RESPONSE)
+        if method == "HEAD" then
+            parser:skip_body()
+        end
+        local chunks = {}
+        local msg
+        msg, left = util.read_header(conn, parser, left, chunks)
+        if not msg then
+            return nil, left
+        end
+        if not msg.headers_complete then
+            return nil, "connection closed"
+        end
+        local code = msg.status_code
+        if not c.status_text(code) then
+            return nil, "bad status code"
+        end
+        -- upgrade isn't proxied
+        if code == 101 then
+            return nil, "unexpected 101"
+        end
+        if code >= 200 then
+            return parser, msg, left, chunks
+        end
+    end
+end
+
+function proxy:serve(rsp, req)
+    local headers = self:_request_headers(req)
+    local chunked = false
+    local has_body = get_header(req.headers or {}, "Content-Length") ~= nil
+    if not has_body and get_header(req.headers or {}, "Transfer-Encoding") then
+        headers["Transfer-Encoding"] = "chunked"
+        has_body = true
+        chunked = true
+    end
+
+    local path = self.rewrite and self.rewrite(req) or req.request_url
+    local head = c.pack_request(req.method, path, headers)
+    local up = self.upstream
+    local s, conn = self:_connect(req, head)
+    if not s then
+        rsp:set_code(502)
+        return
+    end
+
+    if has_body then
+        local ok, err = send_body(req, conn, chunked)
+        if not ok then
+            up:put(s, conn, true)
+            rsp:set_code(502)
+            return
+        end
+    end
+
+    local parser, msg, left, chunks = read_response_header(conn, req.method)
+    if not parser then
+        up:put(s, conn, true)
+        up:fail(s)
+        rsp:set_code(is_timeout(msg) and 504 or 502)
+        return
+    end
+    up:success(s)
+
+    local code = msg.status_code
+    rsp:set_code(code)
+    copy_headers(msg.headers or {}, rsp.headers)
+    local body = bodyReader.new(conn, parser, msg, left, chunks)
+    if no_body(req.method, code) then
+        rsp:write_header()
+        body:discard()
+    else
+        while true do
+            local piece, err = body:read()
+            if not piece then
+                if err then
+                    up:put(s, conn, true)
+                    up:fail(s)
+                    -- header is sent, peer sees a truncated response
+                    error(string.format("read upstream %s failed: %s", s.key, err))
+                end
+                break
+            end
+            local ok = rsp:write(piece)
+            if not ok then
+                break
+            end
+        end
+    end
+
+    local reusable = body.done and not body.err and msg.keepalive and not body:leftover()
+    up:put(s, conn, not reusable)
+end
+
+function proxy:stats()
+    return self.upstream:stats()
+end
+
+function proxy:close()
+    self.upstream:close()
+end
+
+-- return a handler of http server
+function proxy.handler(backend, opts)
+    local p = proxy.new(backend, opts)
+    return function(rsp, req)
+        return p:serve(rsp, req)
+    end, p
+end
+
+return proxy
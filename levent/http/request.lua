@@ -100,18 +100,7 @@ function request:pack()
         self.headers[ct] = len
     end
 
-    local t = {}
-    t[1] = string.format("%s %s %s/%s", method, path, config.HTTP_SCHEMA, config.HTTP_VERSION)
-    for k,v in pairs(self.headers) do
-        t[#t + 1] = string.format("%s: %s", k, v)
-    end
-
-    if len > 0 then
-        t[#t + 1] = "\r\n" .. payload
-    else
-        t[#t + 1] = "\r\n"
-    end
-    return table.concat(t, "\r\n")
+    return c.pack_request(method, path, self.headers, len > 0 and payload or nil)
 end
 
 return request
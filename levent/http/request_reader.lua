@@ -1,37 +1,150 @@
-local config = require "levent.http.config"
-local util   = require "levent.http.util"
+local config    = require "levent.http.config"
+local util      = require "levent.http.util"
+local multipart = require "levent.http.multipart"
 
 local methods  = config.HTTP_METHODS
 local parse_query_string = util.parse_query_string
 
 local request_reader = {}
-request_reader.__index = request_reader
+
+-- body is read on first access
+function request_reader.__index(self, k)
+    local v = request_reader[k]
+    if v == nil and k == "body" then
+        v = self:get_body()
+    end
+    return v
+end
 
 -- msg {
 --  method string # GET, POST, PUT, HEAD ...
 --  request_url string # /index?param=value
 --  request_path string # /index
 --  query_string string # param=value
+--  params table # path params of matched route
 --  headers table # all headers
---  body string # post data
+--  body string # post data, read on demand
 --  remote_host string
 --  remote_port int
 -- }
-function request_reader.new(msg)
+-- reader: body reader of msg, nil if body is already in msg.body
+-- max_body_size: max size of body kept in memory by get_body
+function request_reader.new(msg, reader, max_body_size)
+    msg.body_reader = reader
+    msg.max_body_size = max_body_size
     return setmetatable(msg, request_reader)
 end
 
--- query form
-function request_reader:get_form()
+-- header value by case-insensitive name
+function request_reader:get_header(name)
+    local headers = self.headers
+    if not headers then
+        return nil
+    end
+    local v = headers[name]
+    if v then
+        return v
+    end
+    name = name:lower()
+    for k, v in pairs(headers) do
+        if k:lower() == name then
+            return v
+        end
+    end
+end
+
+-- read at most n bytes of body, return nil at end of body
+function request_reader:read_body(n)
+    local reader = rawget(self, "body_reader")
+    if not reader then
+        return nil
+    end
+    return reader:read(n)
+end
+
+-- for chunk in req:body_chunks() do ... end
+function request_reader:body_chunks(n)
+    return function()
+        return self:read_body(n)
+    end
+end
+
+-- read the rest of body, return nil if there is no body
+function request_reader:get_body()
+    local body = rawget(self, "body")
+    if body then
+        return body
+    end
+
+    local reader = rawget(self, "body_reader")
+    if not reader then
+        return nil
+    end
+
+    local err
+    body, err = reader:read_all(self.max_body_size)
+    if not body then
+        return nil, err
+    end
+    if #body == 0 then
+        return nil
+    end
+    rawset(self, "body", body)
+    return body
+end
+
+-- streaming parser of multipart/form-data body, nil if body isn't multipart
+-- opts: see multipart.new
+function request_reader:multipart(opts)
+    local boundary = multipart.boundary(self:get_header("Content-Type"))
+    if not boundary then
+        return nil
+    end
+
+    local read
+    local body = rawget(self, "body")
+    if body then
+        read = function()
+            local s = body
+            body = nil
+            return s
+        end
+    else
+        read = function()
+            return self:read_body()
+        end
+    end
+    return multipart.new(read, boundary, opts)
+end
+
+-- query form, file parts of a multipart form are saved as temp files,
+-- return forms, and err if a multipart form is refused, on every call
+-- opts: see multipart.new and multipart:read_form, max_size of multipart
+-- body defaults to max_body_size
+function request_reader:get_form(opts)
     if self.forms then
-        return self.forms
+        return self.forms, self.form_err
     end
 
     self.forms = {}
+    local err
     if self.method == methods.POST or self.method == methods.PUT then
-        parse_query_string(self.body, self.forms)
+        opts = opts or {}
+        local mp = self:multipart({
+            max_header_size = opts.max_header_size,
+            max_size = opts.max_size or self.max_body_size,
+        })
+        if mp then
+            local forms
+            forms, err = mp:read_form(opts)
+            self.forms = forms or self.forms
+            -- body is gone, later calls get the same error
+            self.form_err = err
+        else
+            parse_query_string(self:get_body(), self.forms)
+        end
     end
-    return self.forms
+    return self.forms, err
 end
 
 -- all
@@ -4,7 +4,9 @@ local parse_query_string = util.parse_query_string
 local response = {}
 response.__index = response
 
-function response.new(parsed)
+-- reader: body reader of a streamed response
+function response.new(parsed, reader)
+    parsed.body_reader = reader
     local headers = parsed.headers
     local cheaders = {}
     parsed.headers = cheaders
@@ -28,16 +30,39 @@ function response:get_headers()
 end
 
 function response:get_data()
+    if not self.body and self.body_reader then
+        local body, err = self.body_reader:read_all()
+        if not body then
+            return nil, err
+        end
+        self.body = body
+    end
     return self.body
 end
 
+-- read at most n bytes of a streamed body, return nil at end of body
+function response:read_body(n)
+    if not self.body_reader then
+        return nil
+    end
+    return self.body_reader:read(n)
+end
+
+-- for chunk in rsp:body_chunks() do ... end
+function response:body_chunks(n)
+    return function()
+        return self:read_body(n)
+    end
+end
+
 function response:get_args()
     if self.args then
         return self.args
     end
     self.args = {}
-    if self.body then
-        parse_query_string(self.body, self.args)
+    local body = self:get_data()
+    if body then
+        parse_query_string(body, self.args)
     end
     return self.args
 end
@@ -46,9 +71,20 @@ function response:get_version()
     return self.http_major, self.http_minor
 end
 
+-- raw bytes of response, only kept if asked by opts.raw of get_response
 function response:get_raw()
     return self.raw_response
 end
 
+-- give back connection of a streamed response, it's reused only if body
+-- is read out
+function response:close()
+    local cli = self.client
+    if cli then
+        self.client = nil
+        cli:close()
+    end
+end
+
 return response
 
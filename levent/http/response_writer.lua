@@ -1,56 +1,45 @@
-local config = require "levent.http.config"
+local c    = require "levent.http.c"
+local hub  = require "levent.hub"
+local file = require "levent.file.c"
 local util = require "levent.http.util"
+local compress = require "levent.http.compress"
 
 local encode_query_string = util.encode_query_string
 
+-- seconds to send what's queued of an aborted response
+local ABORT_TIMEOUT = 1
+-- file is read in pieces of this size when it has to be compressed
+local SENDFILE_READ_SIZE = 64 * 1024
+
 local response_writer = {}
 response_writer.__index = response_writer
 
-local http_status_msg = {
-    [100] = "Continue",
-    [101] = "Switching Protocols",
-    [200] = "OK",
-    [201] = "Created",
-    [202] = "Accepted",
-    [203] = "Non-Authoritative Information",
-    [204] = "No Content",
-    [205] = "Reset Content",
-    [206] = "Partial Content",
-    [300] = "Multiple Choices",
-    [301] = "Moved Permanently",
-    [302] = "Found",
-    [303] = "See Other",
-    [304] = "Not Modified",
-    [305] = "Use Proxy",
-    [307] = "Temporary Redirect",
-    [400] = "Bad Request",
-    [401] = "Unauthorized",
-    [402] = "Payment Required",
-    [403] = "Forbidden",
-    [404] = "Not Found",
-    [405] = "Method Not Allowed",
-    [406] = "Not Acceptable",
-    [407] = "Proxy Authentication Required",
-    [408] = "Request Time-out",
-    [409] = "Conflict",
-    [410] = "Gone",
-    [411] = "Length Required",
-    [412] = "Precondition Failed",
-    [413] = "Request Entity Too Large",
-    [414] = "Request-URI Too Large",
-    [415] = "Unsupported Media Type",
-    [416] = "Requested range not satisfiable",
-    [417] = "Expectation Failed",
-    [500] = "Internal Server Error",
-    [501] = "Not Implemented",
-    [502] = "Bad Gateway",
-    [503] = "Service Unavailable",
-    [504] = "Gateway Time-out",
-    [505] = "HTTP Version not supported",
-}
-
-function response_writer.new()
-    return setmetatable({headers = {}}, response_writer)
+local function init(self, conn, msg)
+    self.conn = conn
+    -- chunked transfer-encoding is defined since http/1.1
+    self.can_chunk = not msg or msg.http_major ~= 1 or msg.http_minor ~= 0
+    -- response of HEAD has headers only
+    self.head_only = msg and msg.method == "HEAD" or false
+    return self
+end
+
+-- conn and msg are needed by streaming api: write_header, write and finish
+function response_writer.new(conn, msg)
+    local obj = setmetatable({headers = {}}, response_writer)
+    return init(obj, conn, msg)
+end
+
+-- make a finished writer ready for the next response, its tables are reused
+function response_writer:reset(conn, msg)
+    local headers = self.headers
+    for k in pairs(headers) do
+        headers[k] = nil
+    end
+    for k in pairs(self) do
+        self[k] = nil
+    end
+    self.headers = headers
+    return init(self, conn, msg)
 end
 
 function response_writer:set_header(header, value)
@@ -67,7 +56,7 @@ function response_writer:set_headers(headers)
 end
 
 function response_writer:set_code(code)
-    assert(http_status_msg[code], code)
+    assert(c.status_text(code), code)
     self.code = code
 end
 
@@ -75,23 +64,82 @@ function response_writer:set_data(data)
     self.data = data
 end
 
-function response_writer:pack()
-    local code = self.code or 200
-    local t = {}
-    t[1] = string.format("%s/%s %d %s", config.HTTP_SCHEMA, config.HTTP_VERSION, code, http_status_msg[code])
+local function has_body(code)
+    return code >= 200 and code ~= 204 and code ~= 304
+end
+
+-- compress body by Accept-Encoding of req, see compress.new for opts.
+-- opts of false turns compression off
+function response_writer:compress(req, opts)
+    if opts == false then
+        self.compression = nil
+        return
+    end
+    self.compression = compress.new(req:get_header("Accept-Encoding"), opts)
+end
+
+-- whether body is to be compressed, size is nil for a streaming body.
+-- Content-Encoding is set if so
+function response_writer:_use_compression(size)
+    local setting = self.compression
+    local headers = self.headers
+    if not setting or self.head_only or headers["Content-Encoding"]
+        or not has_body(self.code or 200)
+        or not compress.compressible(headers["Content-Type"])
+        or (size and size < setting.min_size) then
+        return false
+    end
+    -- the response would be different for another Accept-Encoding
+    compress.add_vary(headers, "Accept-Encoding")
+    if not setting.encoding then
+        return false
+    end
+    headers["Content-Encoding"] = setting.encoding
+    return true
+end
+
+-- whole body in a single piece, compressed if it should be
+function response_writer:_encode_payload(payload)
+    if payload and not self.headers["Content-Length"] and self:_use_compression(#payload) then
+        payload = assert(compress.compress(self.compression, payload))
+    end
+    return payload
+end
+
+-- a streaming body of unknown length is compressed piece by piece
+function response_writer:_start_deflate()
+    if not self.headers["Content-Length"] and self:_use_compression() then
+        self.deflater = compress.deflater(self.compression)
+    end
+end
+
+-- compress a piece of body, every piece is flushed out so the peer sees
+-- it at once. mode "finish" returns tail of the compressed body
+function response_writer:_deflate(chunk, mode)
+    local data, err = self.deflater:deflate(chunk, mode or "sync")
+    if not data then
+        self.err = err
+    end
+    return data, err
+end
 
-    self.headers["Date"] = os.date("!%a, %d %b %Y %H:%M:%S GMT") -- rfc1123-date
+-- status line, headers and body, only the header part if body is nil
+function response_writer:_pack(body)
     local cl = "Content-Type"
     if not self.headers[cl] then
         self.headers[cl] = "text/plain"
     end
+    return c.pack_response(self.code or 200, self.headers, body, hub.loop:now())
+end
 
+function response_writer:pack()
     local payload
     if type(self.data) == "table" then
         payload = encode_query_string(self.data)
     else
         payload = self.data
     end
+    payload = self:_encode_payload(payload)
     local len = payload and #payload or 0
 
     local ct = "Content-Length"
@@ -99,17 +147,250 @@ function response_writer:pack()
         self.headers[ct] = len
     end
 
-    for k,v in pairs(self.headers) do
-        t[#t+1] = string.format("%s: %s", k, tostring(v))
+    if self.head_only then
+        return self:_pack()
+    end
+    return self:_pack(payload)
+end
+
+-- whether status line and headers are sent by streaming api
+function response_writer:header_written()
+    return self.header_sent or false
+end
+
+-- send status line and headers, body is sent by write later.
+-- body is chunked if Content-Length is not set, for http/1.0 peer it's
+-- ended by closing connection instead
+function response_writer:write_header(code)
+    assert(self.conn, "no connection to write")
+    assert(not self.header_sent, "header already sent")
+    if code then
+        self:set_code(code)
+    end
+
+    self:_start_deflate()
+    local headers = self.headers
+    if not self.head_only and has_body(self.code or 200) and not headers["Content-Length"] then
+        if self.can_chunk then
+            headers["Transfer-Encoding"] = "chunked"
+            self.chunked = true
+        else
+            headers["Connection"] = "close"
+            self.must_close = true
+        end
+    end
+
+    self.header_sent = true
+    local _, err = self.conn:sendall(self:_pack())
+    if err then
+        self.err = err
+        return false, err
+    end
+    return true
+end
+
+-- send a piece of body, header is sent first if not yet
+function response_writer:write(chunk)
+    if self.err then
+        return false, self.err
+    end
+    if not self.header_sent then
+        local ok, err = self:write_header()
+        if not ok then
+            return false, err
+        end
+    end
+
+    -- an empty chunk ends chunked body, skip it
+    if #chunk == 0 or self.head_only then
+        return true
+    end
+    if self.deflater then
+        local err
+        chunk, err = self:_deflate(chunk)
+        if not chunk then
+            return false, err
+        elseif #chunk == 0 then
+            return true
+        end
     end
 
-    if len > 0 then
-        t[#t + 1] = "\r\n" .. payload
+    local _, err
+    if self.chunked then
+        _, err = self.conn:sendallv({string.format("%x\r\n", #chunk), chunk, "\r\n"})
     else
-        t[#t + 1] = "\r\n"
+        _, err = self.conn:sendall(chunk)
+    end
+    if err then
+        self.err = err
+        return false, err
     end
-    return table.concat(t, "\r\n")
+    return true
 end
 
-return response_writer
+-- queue a piece of body and return at once, it's written by output chain
+-- of connection. return false if too much is queued, nil, err if broken
+function response_writer:write_async(chunk)
+    if self.err then
+        return nil, self.err
+    end
+    if not self.header_sent then
+        local ok, err = self:write_header()
+        if not ok then
+            return nil, err
+        end
+    end
+    if #chunk == 0 or self.head_only then
+        return true
+    end
+    if self.deflater then
+        local err
+        chunk, err = self:_deflate(chunk)
+        if not chunk then
+            return nil, err
+        elseif #chunk == 0 then
+            return true
+        end
+    end
+
+    local conn = self.conn
+    local ok, err
+    if self.chunked then
+        conn:write_async(string.format("%x\r\n", #chunk))
+        conn:write_async(chunk)
+        ok, err = conn:write_async("\r\n")
+    else
+        ok, err = conn:write_async(chunk)
+    end
+    if ok == nil then
+        self.err = err
+    end
+    return ok, err
+end
+
+-- bytes queued by write_async but not sent yet
+function response_writer:queued_bytes()
+    return self.conn:queued_bytes()
+end
+
+-- give up an unfinished response, connection is closed after handler
+-- returns, and data still queued is given ABORT_TIMEOUT to be sent
+function response_writer:abort(err)
+    self.err = self.err or err or "aborted"
+    self.must_close = true
+    self.conn:set_timeout(ABORT_TIMEOUT)
+    self.conn:cancel_read()
+end
+
+-- send count bytes of file fd from offset as (a piece of) body by sendfile
+function response_writer:sendfile(fd, offset, count)
+    if self.err then
+        return false, self.err
+    end
+    if not self.header_sent then
+        local ok, err = self:write_header()
+        if not ok then
+            return false, err
+        end
+    end
+    if count == 0 or self.head_only then
+        return true
+    end
+    if self.deflater then
+        return self:_copy_file(fd, offset, count)
+    end
 
+    local conn = self.conn
+    local sent, err
+    if self.chunked then
+        sent, err = conn:sendall(string.format("%x\r\n", count))
+    end
+    if not err then
+        sent, err = conn:sendfile(fd, offset, count)
+        if not err and sent < count then
+            err = "file truncated"
+        end
+    end
+    if not err and self.chunked then
+        sent, err = conn:sendall("\r\n")
+    end
+    if err then
+        self.err = err
+        return false, err
+    end
+    return true
+end
+
+-- send file by reading it, for a body which has to be transformed
+function response_writer:_copy_file(fd, offset, count)
+    while count > 0 do
+        local data, err = file.read(fd, offset, math.min(count, SENDFILE_READ_SIZE))
+        if not data then
+            return false, err
+        end
+        if #data == 0 then
+            return false, "file truncated"
+        end
+        local ok, err = self:write(data)
+        if not ok then
+            return false, err
+        end
+        offset = offset + #data
+        count = count - #data
+    end
+    return true
+end
+
+-- complete response: send the last chunk of a streaming response, or send
+-- the whole response if streaming api is not used
+function response_writer:finish()
+    if self.finished then
+        return true
+    end
+    self.finished = true
+
+    local data
+    if self.err then
+        return false, self.err
+    elseif not self.header_sent then
+        -- queue whole response, responses of pipelined requests are written
+        -- together by one writev once the coroutine waits for more input
+        local ok, err = self.conn:write_async(self:pack())
+        if ok == false then
+            ok, err = self.conn:flush()
+        end
+        if not ok then
+            self.err = err
+            return false, err
+        end
+        return true
+    end
+
+    local tail
+    if self.deflater then
+        local err
+        tail, err = self:_deflate("", "finish")
+        if not tail then
+            return false, err
+        end
+    end
+    if self.chunked then
+        data = "0\r\n\r\n"
+        if tail and #tail > 0 then
+            data = string.format("%x\r\n", #tail) .. tail .. "\r\n" .. data
+        end
+    elseif tail and #tail > 0 then
+        data = tail
+    else
+        return true
+    end
+
+    local _, err = self.conn:sendall(data)
+    if err then
+        self.err = err
+        return false, err
+    end
+    return true
+end
+
+return response_writer
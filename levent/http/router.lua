@@ -0,0 +1,71 @@
+local c = require "levent.http.router.c"
+
+--[[
+-- routes compiled into a radix tree, lookup cost depends on path length
+-- only, not on number of routes
+--
+-- local r = router.new()
+-- r:add("GET", "/users/:id", get_user)
+-- r:add(nil, "/static/*path", serve_static) -- any method
+-- local handler, params = r:match("GET", "/users/42") -- params.id == "42"
+--]]
+local ANY = "*"
+
+local router = {}
+router.__index = router
+
+function router.new()
+    local obj = {
+        tree = c.new(),
+        -- route id -> {[method] = handler}
+        routes = {},
+        -- pattern -> route id
+        patterns = {},
+    }
+    return setmetatable(obj, router)
+end
+
+-- method: nil or "*" for any method
+function router:add(method, pattern, handler)
+    method = method or ANY
+    local id = self.patterns[pattern]
+    if not id then
+        local err
+        id, err = self.tree:insert(pattern)
+        if not id then
+            return false, err
+        end
+        self.patterns[pattern] = id
+        self.routes[id] = {}
+    end
+
+    local methods = self.routes[id]
+    if methods[method] then
+        return false, "repeated route"
+    end
+    methods[method] = handler
+    return true
+end
+
+-- return handler, params, route id; or nil, code (404 or 405), route id
+function router:match(method, path)
+    local id, params = self.tree:match(path)
+    if not id then
+        return nil, 404
+    end
+
+    local methods = self.routes[id]
+    -- HEAD is served by GET handler, response writer drops the body
+    local handler = methods[method] or (method == "HEAD" and methods.GET) or methods[ANY]
+    if not handler then
+        return nil, 405, id
+    end
+    return handler, params, id
+end
+
+-- route id of pattern, nil if not added
+function router:id(pattern)
+    return self.patterns[pattern]
+end
+
+return router
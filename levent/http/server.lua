@@ -4,92 +4,337 @@ local httpUtil       = require "levent.http.util"
 local socketUtil     = require "levent.socket_util"
 local responseWriter = require "levent.http.response_writer"
 local requestReader  = require "levent.http.request_reader"
+local bodyReader     = require "levent.http.body_reader"
+local config         = require "levent.http.config"
+local router         = require "levent.http.router"
+local h2             = require "levent.http.h2"
+local lock           = require "levent.lock"
+local timeout        = require "levent.timeout"
+local log            = require "levent.log"
+local metrics        = require "levent.http.metrics.c"
+
+-- per connection objects kept for reuse by later connections
+local MAX_FREE_STATES = 256
+-- metrics slot of requests matching no route
+local UNMATCHED_SLOT = 0
 
 local server = {}
 server.__index = server
 
-function server.new(ip, port)
+-- nil for no timeout
+local function seconds(v, default)
+    if v == nil then
+        v = default
+    end
+    if not v or v <= 0 then
+        return nil
+    end
+    return v
+end
+
+-- opts:
+--  max_body_size: max request body kept in memory, also the most unread
+--  body drained to keep a connection alive, default config.MAX_BODY_SIZE
+--  max_header_size: max size of request line and headers,
+--  default config.MAX_HEADER_SIZE
+--  idle_timeout: seconds to wait for next request on a keep-alive
+--  connection, or on an http/2 connection without running streams,
+--  default config.IDLE_TIMEOUT
+--  header_timeout: seconds to read request line and headers, or an
+--  http/2 preface and header block, default config.HEADER_TIMEOUT
+--  body_timeout: seconds for each read of request body and each write of
+--  response, default config.BODY_TIMEOUT
+--  max_requests: requests served on a connection before it's closed,
+--  nil means unlimited
+--  max_conns: max concurrent connections, no more connection is accepted
+--  until one closes, nil means unlimited
+--  h2: serve http/2 over cleartext (prior knowledge or Upgrade: h2c),
+--  default true
+--  compress: compress responses by Accept-Encoding, true or opts of
+--  compress.new; a route may override it by http.compress
+--  metrics: record requests of each route, true or
+--    {path = , buckets = , prefix = }, metrics are served at path in
+--    prometheus text format if path is set. buckets are upper bounds of
+--    latency histogram, default config.METRICS_BUCKETS
+-- timeouts of false or 0 mean no timeout
+function server.new(ip, port, opts)
+    opts = opts or {}
     local obj = {
         ip = ip,
         port = port,
-        handlers = {}
+        router = router.new(),
+        max_body_size = opts.max_body_size or config.MAX_BODY_SIZE,
+        max_header_size = opts.max_header_size or config.MAX_HEADER_SIZE,
+        idle_timeout = seconds(opts.idle_timeout, config.IDLE_TIMEOUT),
+        header_timeout = seconds(opts.header_timeout, config.HEADER_TIMEOUT),
+        body_timeout = seconds(opts.body_timeout, config.BODY_TIMEOUT),
+        max_requests = opts.max_requests,
+        max_conns = opts.max_conns,
+        nconn = 0,
+        -- set when a connection slot is freed
+        conn_freed = lock.event(),
+        h2 = opts.h2 ~= false,
+        compress = opts.compress,
+        metrics = nil,
+        metrics_prefix = nil,
+        free_states = {},
     }
-    return setmetatable(obj, server)
+    setmetatable(obj, server)
+    if opts.metrics then
+        local m = opts.metrics == true and {} or opts.metrics
+        obj.metrics = metrics.new(m.buckets or config.METRICS_BUCKETS)
+        obj.metrics:define(UNMATCHED_SLOT, "unmatched")
+        obj.metrics_prefix = m.prefix
+        if m.path then
+            obj:route("GET", m.path, function(rsp, req)
+                rsp:set_header("Content-Type", "text/plain; version=0.0.4")
+                rsp:set_data(obj:expose_metrics())
+            end)
+        end
+    end
+    return obj
 end
 
+-- metrics in prometheus text format, nil if metrics are not enabled
+function server:expose_metrics()
+    if self.metrics then
+        return self.metrics:expose(self.metrics_prefix)
+    end
+end
+
+-- route added, label it in metrics by its pattern
+function server:_add_route(method, pattern, handler)
+    local ok, err = self.router:add(method, pattern, handler)
+    if ok and self.metrics then
+        self.metrics:define(self.router:id(pattern), pattern)
+    end
+    return ok, err
+end
+
+-- parser, message, body reader and response writer of a connection, they
+-- are reset for each request instead of being created again
+function server:_get_state()
+    local free = self.free_states
+    local n = #free
+    if n > 0 then
+        local state = free[n]
+        free[n] = nil
+        state.parser:reset()
+        return state
+    end
+    return {
+        parser = c.new(c.HTTP_REQUEST),
+        msg = {},
+        chunks = {},
+        body = nil,
+        rsp = nil,
+    }
+end
+
+function server:_put_state(state)
+    local free = self.free_states
+    if #free < MAX_FREE_STATES then
+        free[#free + 1] = state
+    end
+end
+
+local function clear(t)
+    for k in pairs(t) do
+        t[k] = nil
+    end
+end
+
+-- message table is also the request reader passed to handler
+local function reset_msg(msg)
+    setmetatable(msg, nil)
+    clear(msg)
+end
+
+-- handlers: {[pattern] = handler}, handle any method
 function server:register(handlers)
     for k, v in pairs(handlers) do
-        assert(not self.handlers[k], "repeated register:" .. k)
-        self.handlers[k] = v
+        assert(self:_add_route(nil, k, v), "repeated register:" .. k)
     end
 end
 
-function server:handle_one_request(msg)
+-- pattern: /users/:id matches one segment as params.id,
+--          /static/*path matches the rest as params.path
+-- method: nil or "*" for any method
+function server:route(method, pattern, handler)
+    local ok, err = self:_add_route(method, pattern, handler)
+    assert(ok, string.format("register %s failed: %s", pattern, err))
+end
+
+-- rsp: response writer, a http/1.x one on conn is created if nil
+function server:handle_one_request(msg, body, conn, rsp)
     local path = msg.request_path
-    local rsp = responseWriter.new()
-    local handler = self.handlers[path]
+    rsp = rsp or responseWriter.new(conn, msg)
+    local handler, params, slot
+    if path then
+        handler, params, slot = self.router:match(msg.method, path)
+    end
+    local m, start = self.metrics
+    if m then
+        slot = slot or UNMATCHED_SLOT
+        start = m:start(slot)
+    end
     if not handler then
-        rsp:set_code(404)
+        rsp:set_code(params or 404)
     else
-        req = requestReader.new(msg)
+        msg.params = params
+        local req = requestReader.new(msg, body, self.max_body_size)
+        if self.compress then
+            rsp:compress(req, self.compress ~= true and self.compress or nil)
+        end
         local ok, err = xpcall(handler, debug.traceback, rsp, req)
         if not ok then
-            print(string.format("handle request[%s] failed: %s", path, err))
+            log.error("handle request failed", "path", path, "err", err)
+            -- too late to report error, drop connection
+            if rsp:header_written() then
+                if m then
+                    m:finish(slot, rsp.code or 200, start)
+                end
+                return nil
+            end
             rsp:set_code(502)
             rsp:set_data(err)
         end
     end
 
+    if m then
+        m:finish(slot, rsp.code or 200, start)
+    end
     return rsp
 end
 
+-- objects passed to handler are reused by the next request on the
+-- connection, handler shouldn't keep them after it returns
 function server:handle_conn(conn)
     local host, port = conn:getpeername()
-    print("new connection:", host, port)
-    local parser = c.new(c.HTTP_REQUEST)
+    log.debug("new connection", "host", host, "port", port)
     local cached
+    if self.h2 then
+        local deadline = timeout.start_new(self.header_timeout)
+        local is_h2, data = h2.sniff(conn)
+        deadline:cancel()
+        if is_h2 ~= false then
+            if is_h2 then
+                h2.serve(self, conn, data)
+            end
+            conn:close()
+            log.debug("connection close", "host", host, "port", port)
+            return
+        end
+        cached = data
+    end
+
+    local state = self:_get_state()
+    local parser, msg, chunks = state.parser, state.msg, state.chunks
+    -- state is kept by h2 after upgrade, or lost along with a failed handler
+    local reusable = true
+    local nreq = 0
     while true do
-        local msg, left = httpUtil.read_message(conn, parser, cached)
-        if not msg then
-            print("read request failed:", left)
+        reset_msg(msg)
+        clear(chunks)
+        -- wait for the first bytes of request
+        if not cached or #cached == 0 then
+            conn:set_timeout(nreq == 0 and self.header_timeout or self.idle_timeout)
+            local s = conn:recv(httpUtil.READ_SIZE)
+            if not s or #s == 0 then
+                break
+            end
+            cached = s
+        end
+
+        local deadline = timeout.start_new(self.header_timeout)
+        local ok, left = httpUtil.read_header(conn, parser, cached, chunks, msg, self.max_header_size)
+        deadline:cancel()
+        if not ok then
+            log.debug("read request failed", "host", host, "port", port, "err", left)
             break
         end
+        nreq = nreq + 1
+        conn:set_timeout(self.body_timeout)
 
         -- connection close
-        if not msg.complete then
+        if not msg.headers_complete then
             break
         end
-        local url = c.parse_url(msg.request_url)
-        if not url then
+
+        -- url info: host, port, request_path, query_string, userinfo
+        if not c.parse_url(msg.request_url, false, msg) then
             break
         end
 
-        -- url info
-        msg.host = url.host
-        msg.port = url.port
-        msg.request_path = url.request_path
-        msg.query_string = url.query_string
-        msg.userinfo = url.userinfo
-
         -- remote info
         msg.remote_host = host
         msg.remote_port = port
 
-        local rsp = self:handle_one_request(msg)
-        if not rsp then
+        local body = state.body
+        if body then
+            body:reset(conn, parser, msg, left, chunks)
+        else
+            body = bodyReader.new(conn, parser, msg, left, chunks)
+            state.body = body
+        end
+        if self.h2 and h2.is_upgrade(msg) then
+            -- whole request is read before switching protocol
+            local data = body:read_all(self.max_body_size)
+            if not data then
+                break
+            end
+            if h2.upgrade(self, conn, msg, data ~= "" and data or nil, body:leftover()) then
+                reusable = false
+                break
+            end
+            -- bad HTTP2-Settings, go on in http/1.1
+            msg.body = data ~= "" and data or nil
+        end
+
+        local rsp = state.rsp
+        if rsp then
+            rsp:reset(conn, msg)
+        else
+            rsp = responseWriter.new(conn, msg)
+            state.rsp = rsp
+        end
+        local last = self.max_requests and nreq >= self.max_requests
+        if last then
+            rsp:set_header("Connection", "close")
+        end
+        if not self:handle_one_request(msg, body, conn, rsp) then
+            reusable = false
+            break
+        end
+
+        if not rsp:finish() or rsp.must_close then
             break
         end
 
-        conn:sendall(rsp:pack())
+        -- skip body not read by handler
+        if not body:discard(self.max_body_size) then
+            break
+        end
 
-        if not msg.keepalive then
+        if last or not msg.keepalive then
             break
         end
 
-        cached = left
+        cached = body:leftover()
     end
     conn:close()
-    print("connection close:", host, port)
+    if reusable then
+        reset_msg(msg)
+        clear(chunks)
+        if state.body then
+            state.body:reset(nil, nil, msg)
+        end
+        if state.rsp then
+            state.rsp:reset()
+        end
+        self:_put_state(state)
+    end
+    log.debug("connection close", "host", host, "port", port)
 end
 
 function server:serve()
@@ -100,23 +345,49 @@ function server:serve()
 
     self.ln = ln
     while self.ln do
-        local conn, err = ln:accept()
-        if conn then
-            levent.spawn(self.handle_conn, self, conn)
-        end
+        -- at capacity, listener isn't watched until a connection closes,
+        -- new connections wait in backlog of kernel
+        if self.max_conns and self.nconn >= self.max_conns then
+            self.conn_freed:clear()
+            self.conn_freed:wait()
+        else
+            local conn, err = ln:accept()
+            if conn then
+                self.nconn = self.nconn + 1
+                if self.metrics then
+                    self.metrics:connection(1)
+                end
+                levent.spawn(self._run_conn, self, conn)
+            end
 
-        if err then
-            print("accept error:", err)
+            -- listener closed by server:close
+            if err and self.ln then
+                log.error("accept failed", "err", err)
+            end
         end
     end
     return true
 end
 
+function server:_run_conn(conn)
+    local ok, err = xpcall(self.handle_conn, debug.traceback, self, conn)
+    if not ok then
+        log.error("handle connection failed", "err", err)
+        conn:close()
+    end
+    self.nconn = self.nconn - 1
+    if self.metrics then
+        self.metrics:connection(-1)
+    end
+    self.conn_freed:set()
+end
+
 function server:close()
     if self.ln then
         local ln = self.ln
         self.ln = nil
         ln:close()
+        self.conn_freed:set()
     end
 end
 
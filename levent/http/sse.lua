@@ -0,0 +1,358 @@
+local hub    = require "levent.hub"
+local lock   = require "levent.lock"
+local util   = require "levent.http.util"
+
+--[[
+-- server-sent events, and a broadcaster fanning events of topics out to
+-- subscribers. an event is formatted once and the same string is queued to
+-- every subscriber without blocking the publisher
+--
+-- local bus = sse.broadcaster({history = 100, heartbeat = 15})
+-- s:route("GET", "/events", function(rsp, req)
+--     local stream = sse.new(rsp, req)
+--     bus:subscribe("news", stream, req:get_header("Last-Event-ID"))
+--     stream:wait()
+-- end)
+-- bus:publish("news", {event = "update", data = "..."})
+--]]
+
+local DEFAULT_MAX_QUEUE = 1024 * 1024
+local DEFAULT_HISTORY = 16
+
+-- CR or LF would end a field and start one of client's choosing, and id
+-- with NUL is ignored by browsers, they're all stripped
+local function field_value(v)
+    return (tostring(v):gsub("[\r\n\0]", ""))
+end
+
+-- event: string as data, or {data = , event = , id = , retry = }
+local function format(ev)
+    if type(ev) ~= "table" then
+        ev = {data = ev}
+    end
+    local t = {}
+    if ev.id then
+        t[#t + 1] = "id: " .. field_value(ev.id) .. "\n"
+    end
+    if ev.event then
+        t[#t + 1] = "event: " .. field_value(ev.event) .. "\n"
+    end
+    if ev.retry then
+        t[#t + 1] = string.format("retry: %d\n", math.floor(ev.retry))
+    end
+    local data = tostring(ev.data or "")
+    -- every line of data is a data field, a lone CR ends a line too
+    data = data:gsub("\r\n?", "\n")
+    for line in (data .. "\n"):gmatch("(.-)\n") do
+        t[#t + 1] = "data: " .. line .. "\n"
+    end
+    t[#t + 1] = "\n"
+    return table.concat(t)
+end
+
+local sse = {}
+sse.format = format
+
+--[[
+-- response in event stream mode
+--]]
+local stream = {}
+stream.__index = stream
+
+-- switch rsp to an event stream, headers are sent at once
+-- opts:
+--  retry: reconnection time in milliseconds told to client
+function sse.new(rsp, req, opts)
+    opts = opts or {}
+    rsp:set_header("Content-Type", "text/event-stream")
+    rsp:set_header("Cache-Control", "no-cache")
+    -- no buffering by proxies like nginx
+    rsp:set_header("X-Accel-Buffering", "no")
+    -- stream of http/1.x ends with connection
+    rsp.must_close = true
+    local obj = {
+        rsp = rsp,
+        req = req,
+        -- http/2 stream, nil for http/1.x
+        h2 = rsp.stream,
+        closed = false,
+        -- topics subscribed: broadcaster -> {topic = true}
+        topics = {},
+        -- events dropped while lagging behind
+        dropped = 0,
+    }
+    setmetatable(obj, stream)
+    if not obj.h2 then
+        -- a stream may stay quiet for long, timeout set by server is dropped
+        rsp.conn:set_timeout(nil)
+    end
+    if not rsp:write_header() then
+        obj.closed = true
+    elseif opts.retry then
+        obj:send_raw(string.format("retry: %d\n\n", math.floor(opts.retry)))
+    end
+    return obj
+end
+
+-- queue formatted data, return false if stream is broken
+function stream:send_raw(data)
+    if self.closed then
+        return false
+    end
+    local ok, err = self.rsp:write_async(data)
+    if ok == nil then
+        self:close(err)
+        return false
+    end
+    return true
+end
+
+-- send an event to this stream only
+function stream:send(ev)
+    return self:send_raw(format(ev))
+end
+
+-- comment line, ignored by client, keeps idle connection alive
+function stream:comment(text)
+    return self:send_raw(": " .. (text or "") .. "\n\n")
+end
+
+-- bytes queued but not sent yet
+function stream:queued_bytes()
+    return self.rsp:queued_bytes()
+end
+
+-- wait until client goes away or stream is closed
+function stream:wait()
+    if self.h2 then
+        local s = self.h2
+        while not self.closed and not s.err do
+            s.event:clear()
+            s.event:wait()
+        end
+    else
+        -- nothing more is expected from client, recv returns once the
+        -- connection is closed
+        local conn = self.rsp.conn
+        while not self.closed do
+            local data = conn:recv(util.READ_SIZE)
+            if not data or #data == 0 then
+                break
+            end
+        end
+    end
+    self:close()
+end
+
+-- stop the stream, handler waiting in wait() returns. with err, data still
+-- queued is dropped and connection (or http/2 stream) is reset
+function stream:close(err)
+    if self.closed then
+        return
+    end
+    self.closed = true
+    for bus, topics in pairs(self.topics) do
+        for topic in pairs(topics) do
+            bus:unsubscribe(topic, self)
+        end
+    end
+    if err then
+        self.rsp:abort(err)
+    end
+    if self.h2 then
+        self.h2.event:set()
+    else
+        self.rsp.conn:cancel_read()
+    end
+end
+
+--[[
+-- broadcaster
+--]]
+local broadcaster = {}
+broadcaster.__index = broadcaster
+
+-- opts:
+--  max_queue: bytes queued on a subscriber before it's treated as lagging,
+--  default 1M
+--  policy: "close" lagging subscribers (default), or "drop" events for them
+--  until they catch up
+--  history: events kept per topic, replayed to subscribers reconnecting
+--  with Last-Event-ID and returned by poll, default 16
+--  heartbeat: seconds between comments sent to all subscribers, nil for none
+function sse.broadcaster(opts)
+    opts = opts or {}
+    local obj = {
+        max_queue = opts.max_queue or DEFAULT_MAX_QUEUE,
+        policy = opts.policy or "close",
+        history = opts.history or DEFAULT_HISTORY,
+        topics = {},
+        timer = nil,
+    }
+    assert(obj.policy == "close" or obj.policy == "drop", "unknown policy: " .. tostring(obj.policy))
+    assert(obj.history >= 1, "history should be at least 1")
+    setmetatable(obj, broadcaster)
+    if opts.heartbeat then
+        obj.timer = hub.loop:timer(opts.heartbeat, opts.heartbeat)
+        obj.timer:start(function()
+            obj:_heartbeat()
+        end)
+        hub.loop:unref()
+    end
+    return obj
+end
+
+function broadcaster:_topic(name)
+    local topic = self.topics[name]
+    if not topic then
+        topic = {
+            subscribers = {},
+            count = 0,
+            -- ring of {id = , event = , data = , raw = formatted}
+            events = {},
+            first = 1,
+            last = 0,
+            seq = 0,
+            -- wakes up long pollers
+            event = lock.event(),
+        }
+        self.topics[name] = topic
+    end
+    return topic
+end
+
+-- queue data to a subscriber by lag policy
+function broadcaster:_push(s, data)
+    if s:queued_bytes() > self.max_queue then
+        if self.policy == "drop" then
+            s.dropped = s.dropped + 1
+            return
+        end
+        s:close("lagging")
+        return
+    end
+    s:send_raw(data)
+end
+
+-- publish an event to all subscribers of topic, ids are assigned by
+-- sequence of topic. return id of the event
+function broadcaster:publish(name, ev)
+    local topic = self:_topic(name)
+    if type(ev) ~= "table" then
+        ev = {data = ev}
+    end
+    topic.seq = topic.seq + 1
+    local id = topic.seq
+    local data = format({id = id, event = ev.event, data = ev.data, retry = ev.retry})
+
+    topic.last = topic.last + 1
+    topic.events[topic.last] = {id = id, event = ev.event, data = ev.data, raw = data}
+    if topic.last - topic.first + 1 > self.history then
+        topic.events[topic.first] = nil
+        topic.first = topic.first + 1
+    end
+
+    -- a lagging subscriber may be removed while iterating, which is fine
+    -- as fields are only cleared
+    for s in pairs(topic.subscribers) do
+        self:_push(s, data)
+    end
+
+    topic.event:set()
+    topic.event = lock.event()
+    return id
+end
+
+-- events of topic in history with id greater than last_id
+function broadcaster:_since(topic, last_id)
+    local t = {}
+    last_id = tonumber(last_id)
+    if not last_id then
+        return t
+    end
+    for i = topic.first, topic.last do
+        local e = topic.events[i]
+        if e.id > last_id then
+            t[#t + 1] = e
+        end
+    end
+    return t
+end
+
+-- add stream to topic, events after last_id in history are sent first
+function broadcaster:subscribe(name, s, last_id)
+    if s.closed then
+        return false
+    end
+    local topic = self:_topic(name)
+    for _, e in ipairs(self:_since(topic, last_id)) do
+        s:send_raw(e.raw)
+    end
+    if not topic.subscribers[s] then
+        topic.subscribers[s] = true
+        topic.count = topic.count + 1
+        s.topics[self] = s.topics[self] or {}
+        s.topics[self][name] = true
+    end
+    return true
+end
+
+function broadcaster:unsubscribe(name, s)
+    local topic = self.topics[name]
+    if topic and topic.subscribers[s] then
+        topic.subscribers[s] = nil
+        topic.count = topic.count - 1
+        s.topics[self][name] = nil
+    end
+end
+
+-- long poll: events after last_id, wait at most sec for new ones if none
+-- return list of {id = , event = , data = }, empty if timed out
+function broadcaster:poll(name, last_id, sec)
+    local topic = self:_topic(name)
+    if last_id == nil then
+        last_id = topic.seq
+    end
+    local t = self:_since(topic, last_id)
+    if #t == 0 then
+        topic.event:wait(sec)
+        t = self:_since(topic, last_id)
+    end
+    return t
+end
+
+-- number of subscribers of topic
+function broadcaster:count(name)
+    local topic = self.topics[name]
+    return topic and topic.count or 0
+end
+
+function broadcaster:_heartbeat()
+    local done = {}
+    for _, topic in pairs(self.topics) do
+        for s in pairs(topic.subscribers) do
+            if not done[s] then
+                done[s] = true
+                self:_push(s, ": ping\n\n")
+            end
+        end
+    end
+end
+
+-- close all subscribers and stop heartbeat
+function broadcaster:close()
+    if self.timer then
+        hub.loop:ref()
+        self.timer:stop()
+        self.timer = nil
+    end
+    for _, topic in pairs(self.topics) do
+        for s in pairs(topic.subscribers) do
+            s:close()
+        end
+        topic.event:set()
+    end
+    self.topics = {}
+end
+
+return sse
@@ -0,0 +1,387 @@
+local hub  = require "levent.hub"
+local file = require "levent.file.c"
+local compress = require "levent.http.compress"
+
+--[[
+-- serve files under a directory
+--
+-- s:route("GET", "/static/*path", http.static("/var/www", {max_age = 3600}))
+--
+-- opened files are cached with their validators, a cached file is dropped
+-- once it is changed on disk. with precompressed set, a.js.gz is sent for
+-- a.js to clients accepting gzip
+--]]
+
+local DEFAULT_MAX_ENTRIES = 1024
+local DEFAULT_INDEX = "index.html"
+-- used by ev_stat if inotify is not available
+local DEFAULT_STAT_INTERVAL = 1
+
+local MIME_TYPES = {
+    html = "text/html; charset=utf-8",
+    htm  = "text/html; charset=utf-8",
+    txt  = "text/plain; charset=utf-8",
+    css  = "text/css; charset=utf-8",
+    js   = "application/javascript; charset=utf-8",
+    json = "application/json",
+    xml  = "application/xml",
+    svg  = "image/svg+xml",
+    png  = "image/png",
+    jpg  = "image/jpeg",
+    jpeg = "image/jpeg",
+    gif  = "image/gif",
+    ico  = "image/x-icon",
+    webp = "image/webp",
+    woff = "font/woff",
+    woff2 = "font/woff2",
+    pdf  = "application/pdf",
+    wasm = "application/wasm",
+}
+local DEFAULT_MIME_TYPE = "application/octet-stream"
+
+local MONTHS = {
+    Jan = 1, Feb = 2, Mar = 3, Apr = 4, May = 5, Jun = 6,
+    Jul = 7, Aug = 8, Sep = 9, Oct = 10, Nov = 11, Dec = 12,
+}
+
+local function http_date(t)
+    return os.date("!%a, %d %b %Y %H:%M:%S GMT", t)
+end
+
+-- parse IMF-fixdate: Sun, 06 Nov 1994 08:49:37 GMT
+local function parse_http_date(s)
+    local d, mon, y, h, m, sec = s:match("^%a+, (%d%d) (%a%a%a) (%d%d%d%d) (%d%d):(%d%d):(%d%d) GMT$")
+    mon = mon and MONTHS[mon]
+    if not mon then
+        return nil
+    end
+    y, d = tonumber(y), tonumber(d)
+    -- days since epoch, by days_from_civil
+    if mon <= 2 then
+        y = y - 1
+    end
+    local era = y // 400
+    local yoe = y - era * 400
+    local doy = (153 * (mon > 2 and mon - 3 or mon + 9) + 2) // 5 + d - 1
+    local doe = yoe * 365 + yoe // 4 - yoe // 100 + doy
+    local days = era * 146097 + doe - 719468
+    return days * 86400 + tonumber(h) * 3600 + tonumber(m) * 60 + tonumber(sec)
+end
+
+-- unescape %XX only, `+` is literal in path
+local function unescape_path(s)
+    return (s:gsub("%%(%x%x)", function(h) return string.char(tonumber(h, 16)) end))
+end
+
+-- clean relative path, nil if it tries to leave root
+local function clean_path(path)
+    if path:find("\0", 1, true) then
+        return nil
+    end
+    local parts = {}
+    for seg in path:gmatch("[^/\\]+") do
+        if seg == ".." then
+            return nil
+        elseif seg ~= "." then
+            parts[#parts + 1] = seg
+        end
+    end
+    return table.concat(parts, "/")
+end
+
+-- parse single range of `bytes=` unit, return first, last;
+-- nil if range should be ignored; false if range is not satisfiable
+local function parse_range(s, size)
+    local spec = s:match("^%s*bytes%s*=%s*(.-)%s*$")
+    -- multiple ranges are served as a whole
+    if not spec or spec:find(",", 1, true) then
+        return nil
+    end
+    local first, last = spec:match("^(%d*)%-(%d*)$")
+    if not first or (first == "" and last == "") then
+        return nil
+    end
+    if first == "" then
+        -- suffix range: last n bytes
+        local n = tonumber(last)
+        if n == 0 or size == 0 then
+            return false
+        end
+        return math.max(size - n, 0), size - 1
+    end
+    first = tonumber(first)
+    last = last == "" and size - 1 or math.min(tonumber(last), size - 1)
+    if first >= size or first > last then
+        return false
+    end
+    return first, last
+end
+
+local static = {}
+static.__index = static
+
+-- opts:
+--  index: file served for a directory, default index.html
+--  max_entries: max cached files, default 1024
+--  max_age: add Cache-Control: max-age if set
+--  mime_types: extension -> content type, override the defaults
+--  stat_interval: interval to poll files if inotify is not available
+--  precompressed: serve .gz sibling of a file if there is one
+function static.new(root, opts)
+    opts = opts or {}
+    local obj = {
+        root = root:gsub("/+$", ""),
+        index = opts.index or DEFAULT_INDEX,
+        max_entries = opts.max_entries or DEFAULT_MAX_ENTRIES,
+        cache_control = opts.max_age and string.format("max-age=%d", opts.max_age),
+        mime_types = setmetatable(opts.mime_types or {}, {__index = MIME_TYPES}),
+        stat_interval = opts.stat_interval or DEFAULT_STAT_INTERVAL,
+        precompressed = opts.precompressed or false,
+        -- path -> entry
+        entries = {},
+        nentry = 0,
+        tick = 0,
+    }
+    return setmetatable(obj, static)
+end
+
+local function release(entry)
+    entry.refs = entry.refs - 1
+    if entry.stale and entry.refs == 0 then
+        file.close(entry.fd)
+    end
+end
+
+-- drop a cached file, its fd is closed once no response is using it
+function static:invalidate(path)
+    local entry = self.entries[path]
+    if not entry then
+        return
+    end
+    self.entries[path] = nil
+    self.nentry = self.nentry - 1
+
+    -- watcher is unref-ed when started
+    hub.loop:ref()
+    entry.watcher:stop()
+    entry.stale = true
+    entry.refs = entry.refs + 1
+    release(entry)
+end
+
+function static:_evict()
+    local oldest
+    for _, entry in pairs(self.entries) do
+        if entry.refs == 0 and (not oldest or entry.used < oldest.used) then
+            oldest = entry
+        end
+    end
+    if oldest then
+        self:invalidate(oldest.path)
+    end
+end
+
+function static:_open(path)
+    local fd, err = file.open(path)
+    if not fd then
+        return nil, err
+    end
+    local size, mtime, is_regular = file.fstat(fd)
+    if not size then
+        file.close(fd)
+        return nil, mtime
+    end
+    if not is_regular then
+        file.close(fd)
+        return nil, "not a regular file"
+    end
+
+    local ext = path:match("%.([^./]+)$")
+    local entry = {
+        path = path,
+        fd = fd,
+        size = size,
+        mtime = mtime,
+        etag = string.format('"%x-%x"', mtime, size),
+        last_modified = http_date(mtime),
+        content_type = ext and self.mime_types[ext:lower()] or DEFAULT_MIME_TYPE,
+        -- whether there is a .gz sibling, nil if not looked up yet
+        gz = nil,
+        -- responses sending this file
+        refs = 0,
+        used = 0,
+    }
+
+    local w = hub.loop:stat(path, self.stat_interval)
+    w:start(self.invalidate, self, path)
+    -- cache should not keep the loop running
+    hub.loop:unref()
+    entry.watcher = w
+    return entry
+end
+
+-- get cached file, open it on miss
+function static:_get(path)
+    local entry = self.entries[path]
+    if not entry then
+        local err
+        entry, err = self:_open(path)
+        if not entry then
+            return nil, err
+        end
+        if self.nentry >= self.max_entries then
+            self:_evict()
+        end
+        self.entries[path] = entry
+        self.nentry = self.nentry + 1
+    end
+    self.tick = self.tick + 1
+    entry.used = self.tick
+    return entry
+end
+
+-- find file of request path: the file itself, or index file of a directory
+function static:_lookup(rel)
+    local path = rel == "" and self.root or self.root .. "/" .. rel
+    local entry, err = self:_get(path)
+    if not entry and err == "not a regular file" then
+        entry, err = self:_get(path .. "/" .. self.index)
+    end
+    return entry, err
+end
+
+-- cached .gz sibling of a file, nil if there isn't one
+function static:_gzipped(entry)
+    if entry.gz == false then
+        return nil
+    end
+    local gz = self:_get(entry.path .. ".gz")
+    entry.gz = gz ~= nil
+    return gz
+end
+
+local function not_modified(req, entry)
+    local inm = req:get_header("If-None-Match")
+    if inm then
+        if inm == "*" then
+            return true
+        end
+        for tag in inm:gmatch("[^,%s]+") do
+            if tag:gsub("^W/", "") == entry.etag then
+                return true
+            end
+        end
+        -- If-Modified-Since is ignored if If-None-Match is present
+        return false
+    end
+
+    local ims = req:get_header("If-Modified-Since")
+    if ims then
+        local t = parse_http_date(ims)
+        return t ~= nil and entry.mtime <= t
+    end
+    return false
+end
+
+function static:serve(rsp, req)
+    local method = req.method
+    if method ~= "GET" and method ~= "HEAD" then
+        rsp:set_header("Allow", "GET, HEAD")
+        rsp:set_code(405)
+        return
+    end
+
+    local params = req.params
+    local rel = params and params.path or req.request_path or ""
+    rel = clean_path(unescape_path(rel))
+    if not rel then
+        rsp:set_code(403)
+        return
+    end
+
+    local entry = self:_lookup(rel)
+    if not entry then
+        rsp:set_code(404)
+        return
+    end
+
+    local content_type = entry.content_type
+    if self.precompressed then
+        local gz = self:_gzipped(entry)
+        if gz then
+            rsp:set_header("Vary", "Accept-Encoding")
+            if compress.accepts(req:get_header("Accept-Encoding"), "gzip") then
+                -- validators and ranges are of the compressed file
+                entry = gz
+                rsp:set_header("Content-Encoding", "gzip")
+            end
+        end
+    end
+
+    rsp:set_header("ETag", entry.etag)
+    rsp:set_header("Last-Modified", entry.last_modified)
+    rsp:set_header("Accept-Ranges", "bytes")
+    if self.cache_control then
+        rsp:set_header("Cache-Control", self.cache_control)
+    end
+
+    if not_modified(req, entry) then
+        rsp:write_header(304)
+        return
+    end
+
+    local size = entry.size
+    local first, last = 0, size - 1
+    local range = req:get_header("Range")
+    if range then
+        -- range is honored only if file is still the one client has
+        local if_range = req:get_header("If-Range")
+        if if_range and if_range ~= entry.etag and if_range ~= entry.last_modified then
+            range = nil
+        end
+    end
+    if range then
+        local f, l = parse_range(range, size)
+        if f == false then
+            rsp:set_header("Content-Range", string.format("bytes */%d", size))
+            rsp:set_code(416)
+            return
+        elseif f then
+            first, last = f, l
+            rsp:set_header("Content-Range", string.format("bytes %d-%d/%d", first, last, size))
+            rsp:set_code(206)
+        end
+    end
+
+    local count = last - first + 1
+    rsp:set_header("Content-Type", content_type)
+    rsp:set_header("Content-Length", count)
+    if method == "HEAD" then
+        rsp:write_header()
+        return
+    end
+
+    entry.refs = entry.refs + 1
+    local ok, err = rsp:sendfile(entry.fd, first, count)
+    release(entry)
+    if not ok then
+        error(err)
+    end
+end
+
+-- close all cached files
+function static:close()
+    for path in pairs(self.entries) do
+        self:invalidate(path)
+    end
+end
+
+-- return a handler of http server
+function static.handler(root, opts)
+    local s = static.new(root, opts)
+    return function(rsp, req)
+        return s:serve(rsp, req)
+    end, s
+end
+
+return static
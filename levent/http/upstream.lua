@@ -0,0 +1,216 @@
+local hub  = require "levent.hub"
+local pool = require "levent.pool"
+
+--[[
+-- a group of backend servers sharing keep-alive connection pool
+--
+-- local up = upstream.new({"10.0.0.1:8080", {host = "10.0.0.2", port = 8080, weight = 2}},
+--                         {balance = "least_conn"})
+-- local server = up:pick()
+-- local conn = up:get(server)
+-- ...
+-- up:put(server, conn)
+-- up:success(server) -- or up:fail(server)
+--
+-- a server failing max_fails times in a row is ejected for fail_timeout
+-- seconds, then it's tried again and ejected at its next failure
+--]]
+
+local DEFAULT_MAX_FAILS = 3
+local DEFAULT_FAIL_TIMEOUT = 10
+-- points on hash ring per unit of weight
+local HASH_POINTS = 100
+
+-- fnv-1a
+local function hash(s)
+    local h = 2166136261
+    for i = 1, #s do
+        h = ((h ~ s:byte(i)) * 16777619) & 0xffffffff
+    end
+    return h
+end
+
+local function parse_server(s)
+    if type(s) == "table" then
+        return {host = s.host, port = s.port, weight = s.weight or 1}
+    end
+    local host, port = s:match("^(.+):(%d+)$")
+    assert(host, "bad server: " .. s)
+    return {host = host, port = tonumber(port), weight = 1}
+end
+
+local upstream = {}
+upstream.__index = upstream
+
+local balancers = {}
+
+-- smooth weighted round robin
+function balancers.round_robin(self)
+    local best
+    local total = 0
+    for _, s in ipairs(self.servers) do
+        if self:is_available(s) then
+            s.current = s.current + s.weight
+            total = total + s.weight
+            if not best or s.current > best.current then
+                best = s
+            end
+        end
+    end
+    if best then
+        best.current = best.current - total
+    end
+    return best
+end
+
+-- fewest active connections relative to weight, ties are rotated
+function balancers.least_conn(self)
+    local servers = self.servers
+    local n = #servers
+    local best
+    self.rotate = self.rotate % n + 1
+    for i = 0, n - 1 do
+        local s = servers[(self.rotate + i - 1) % n + 1]
+        if self:is_available(s) and (not best or s.active * best.weight < best.active * s.weight) then
+            best = s
+        end
+    end
+    return best
+end
+
+-- consistent hash, a key sticks to its server until that server is ejected
+function balancers.hash(self, key)
+    local ring = self.ring
+    local n = #ring
+    local h = hash(tostring(key or ""))
+    -- first point not less than h
+    local lo, hi = 1, n + 1
+    while lo < hi do
+        local mid = (lo + hi) // 2
+        if ring[mid].hash < h then
+            lo = mid + 1
+        else
+            hi = mid
+        end
+    end
+    for i = 0, n - 1 do
+        local s = ring[(lo + i - 1) % n + 1].server
+        if self:is_available(s) then
+            return s
+        end
+    end
+end
+
+-- servers: list of "host:port" or {host = host, port = port, weight = 1}
+-- opts:
+--  balance: "round_robin" (default), "least_conn" or "hash"
+--  max_fails: failures in a row to eject a server, default 3
+--  fail_timeout: seconds an ejected server is kept out, default 10
+--  max_conns: max connections per server, nil means unlimited
+--  max_idle: max idle connections kept per server
+--  idle_timeout: close connections idle longer than this (in seconds)
+--  connect_timeout: timeout for dialing a server
+function upstream.new(servers, opts)
+    opts = opts or {}
+    local balance = opts.balance or "round_robin"
+    local obj = {
+        servers = {},
+        balance = assert(balancers[balance], "unknown balance: " .. balance),
+        max_fails = opts.max_fails or DEFAULT_MAX_FAILS,
+        fail_timeout = opts.fail_timeout or DEFAULT_FAIL_TIMEOUT,
+        pool = pool.new({
+            max_active = opts.max_conns,
+            max_idle = opts.max_idle,
+            idle_timeout = opts.idle_timeout,
+            connect_timeout = opts.connect_timeout,
+        }),
+        rotate = 0,
+        ring = {},
+    }
+    for i, v in ipairs(servers) do
+        local s = parse_server(v)
+        s.key = s.host .. ":" .. s.port
+        s.current = 0
+        s.active = 0
+        s.fails = 0
+        s.ejected_until = nil
+        obj.servers[i] = s
+
+        for k = 1, HASH_POINTS * s.weight do
+            obj.ring[#obj.ring + 1] = {hash = hash(s.key .. "#" .. k), server = s}
+        end
+    end
+    assert(#obj.servers > 0, "no server")
+    table.sort(obj.ring, function(a, b) return a.hash < b.hash end)
+    return setmetatable(obj, upstream)
+end
+
+function upstream:is_available(s)
+    local t = s.ejected_until
+    if not t then
+        return true
+    end
+    if hub.loop:now() < t then
+        return false
+    end
+    -- on probation: ejected again at the next failure
+    s.ejected_until = nil
+    s.fails = self.max_fails - 1
+    return true
+end
+
+-- pick a server, key is used by hash balance
+function upstream:pick(key)
+    local s = self.balance(self, key)
+    if not s then
+        return nil, "no available upstream"
+    end
+    return s
+end
+
+-- borrow a connection to server
+function upstream:get(s)
+    local conn, err = self.pool:get(s.host, s.port)
+    if not conn then
+        return nil, err
+    end
+    s.active = s.active + 1
+    return conn
+end
+
+-- give back a connection, close it if `close` is true
+function upstream:put(s, conn, close)
+    s.active = s.active - 1
+    self.pool:put(conn, close)
+end
+
+function upstream:fail(s)
+    s.fails = s.fails + 1
+    if s.fails >= self.max_fails then
+        s.ejected_until = hub.loop:now() + self.fail_timeout
+    end
+end
+
+function upstream:success(s)
+    s.fails = 0
+end
+
+function upstream:stats()
+    local t = {}
+    local now = hub.loop:now()
+    for i, s in ipairs(self.servers) do
+        t[i] = {
+            server = s.key,
+            active = s.active,
+            fails = s.fails,
+            ejected = s.ejected_until ~= nil and now < s.ejected_until,
+        }
+    end
+    return t
+end
+
+function upstream:close()
+    self.pool:close()
+end
+
+return upstream
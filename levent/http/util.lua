@@ -1,16 +1,23 @@
-local c = require "levent.http.c"
+local c    = require "levent.http.c"
+local form = require "levent.http.form.c"
 
 local util = {}
 
-function util.read_message(conn, parser, left)
+local READ_SIZE = 4096
+
+-- read until a whole message is parsed, body is kept in msg.body
+-- max: max size of body, nil means unlimited
+-- keep_raw: raw bytes of message are returned too
+function util.read_message(conn, parser, left, max, keep_raw)
     local msg = {}
-    local raw = {}
+    local raw = keep_raw and {} or nil
     while not msg.complete do
         local parsed, s, err
         if left then
             s = left
+            left = nil
         else
-            s, err = conn:recv(4096)
+            s, err = conn:recv(READ_SIZE)
             if not s then
                 return nil, err
             end
@@ -21,67 +28,87 @@ function util.read_message(conn, parser, left)
             return nil, c.http_errno_name(err)
         end
 
+        if max and msg.body and #msg.body > max then
+            return nil, "body too large"
+        end
+
         -- socket closed by peer
         if #s == 0 then
             break
         end
 
         if parsed < #s then
-            table.insert(raw, s:sub(1, parsed))
             left = s:sub(parsed+1)
-        else
-            table.insert(raw, s)
+            if raw then
+                raw[#raw + 1] = s:sub(1, parsed)
+            end
+        elseif raw then
+            raw[#raw + 1] = s
         end
     end
 
     -- return raw msg at last
-    return msg, left, table.concat(raw)
+    return msg, left, raw and table.concat(raw)
 end
 
-function util.canonical_header_key(key)
-    return key:lower():gsub("%f[^\0%-]%l",string.upper)
-end
+-- read until headers of a message are parsed, body is left to a body reader
+-- chunks: receives body pieces parsed along with headers
+-- msg: an empty table to reuse, a new one is created if nil
+-- max: max size of request line (or status line) and headers
+function util.read_header(conn, parser, left, chunks, msg, max)
+    msg = msg or {}
+    local size = 0
+    while not msg.headers_complete do
+        local parsed, s, err
+        if left then
+            s = left
+            left = nil
+        else
+            s, err = conn:recv(READ_SIZE)
+            if not s then
+                return nil, err
+            end
+        end
 
-local function escape(s)
-    return s:gsub("[^a-zA-Z0-9-_.~]", function(c) 
-        return string.format("%%%02x",string.byte(c)) 
-    end)
-end
+        parsed, err = parser:execute(s, nil, msg, chunks)
+        if err then
+            return nil, c.http_errno_name(err)
+        end
 
-local function unescape(s)
-    return s:gsub("%%%x%x", function(ss) 
-        return string.char(tonumber("0x" .. ss:sub(2))) 
-    end)
-end
+        size = size + parsed
+        if max and size > max then
+            return nil, "header too large"
+        end
 
-function util.parse_query_string(s, t)
-    if not s then
-        return
-    end
+        -- socket closed by peer
+        if #s == 0 then
+            break
+        end
 
-    for k,v in s:gmatch("([^&;]+)=([^&;]+)") do
-        if #k > 0 then
-            t[unescape(k)] = unescape(v)
+        if parsed < #s then
+            left = s:sub(parsed+1)
         end
     end
+    return msg, left
 end
 
-function util.encode_query_string(t)
-    if not t then
-        return ""
-    end
+-- content-type -> Content-Type
+util.canonical_header_key = c.canonical_header_key
 
-    local tt = {}
-    for k,v in pairs(t) do
-        if type(v) ~= "string" then
-            v = tostring(v)
-        end
-        tt[#tt + 1] = string.format("%s=%s",escape(k),escape(v))
+-- parse `k1=v1&k2=v2` into t, `+` is decoded as space and the value of a
+-- repeated key is an array of all its values
+function util.parse_query_string(s, t)
+    if not s then
+        return
     end
-    return table.concat(tt, "&")
+    form.parse_query(s, t)
 end
 
-util.escape = escape
-util.unescape = unescape
+-- an array value is encoded as repeated keys
+util.encode_query_string = form.encode_query
+
+util.READ_SIZE = READ_SIZE
+util.escape = form.escape
+util.unescape = form.unescape
 return util
 
@@ -1,17 +1,22 @@
 local crypto    = require "crypto"
 local levent    = require "levent.levent"
-local util      = require "levent.socket_util"
 local client    = require "levent.http.client"
 local config    = require "levent.http.config"
 local request   = require "levent.http.request"
-local server    = require "levent.http.server"
+local timeout   = require "levent.timeout"
+local c         = require "levent.http.ws.c"
 
 local assert        = assert
+local ipairs        = ipairs
+local next          = next
+local pairs         = pairs
 local pcall         = pcall
+local rawget        = rawget
 local rawset        = rawset
 local select        = select
 local setmetatable  = setmetatable
 local tonumber      = tonumber
+local mmin          = math.min
 local mrandom       = math.random
 local schar         = string.char
 local sformat       = string.format
@@ -21,6 +26,11 @@ local ssub          = string.sub
 local sunpack       = string.unpack
 local tconcat       = table.concat
 
+local mask_payload          = c.mask
+local pack_frame            = c.pack_frame
+local pack_header           = c.pack_header
+local unpack_frame_header   = c.unpack_frame_header
+
 local http_methods = config.HTTP_METHODS
 local codes = config.WebSocket.CODES
 
@@ -31,9 +41,13 @@ local CLOSE         = 0x8
 local PING          = 0x9
 local PONG          = 0xA
 
-local MAX_FRAME_BINLEN = 16
-local MAX_FRAME_SIZE = 1 << MAX_FRAME_BINLEN
-local MAX_BUFFER_LENGTH = 1 << 8
+local READ_SIZE = 65536
+-- bytes queued on a member of group before it's treated as lagging
+local DEFAULT_MAX_QUEUE = 1024 * 1024
+-- seconds to send what's queued of an aborted connection
+local ABORT_TIMEOUT = 1
+-- payload of control frames
+local MAX_CONTROL_SIZE = 125
 
 local registrable = {
     on_message  = true,
@@ -55,93 +69,135 @@ local function get_sha1(...)
     end)
 end
 
-local function push_string(t, s, n)
-    if n < MAX_BUFFER_LENGTH then
-        n = n + 1
-    else
-        t[1] = tconcat(t, "", 1, n)
-        n = 2
-    end
-    t[n] = s
-    return n
+-- Sec-WebSocket-Accept of Sec-WebSocket-Key
+local function accept_key(key)
+    return crypto.base64(get_sha1(key, config.WebSocket.GUID))
 end
 
-local function apply_mask(str, mask)
-    return sgsub(str, "..?.?.?", function(part)
-        local n = #part
-        local m = mask >> ((4 - n) << 3)
-        local fmt = sformat(">I%d", n)
-        return spack(fmt, sunpack(fmt, part) ~ m)
-    end)
+-- make sure at least n bytes are buffered after self.pos, the buffer is
+-- rebuilt once however many reads it takes
+local function fill(self, n)
+    local buf, pos = self.buf, self.pos
+    local size = #buf - pos
+    if size >= n then
+        return true
+    end
+    local t = {pos == 0 and buf or ssub(buf, pos + 1)}
+    while size < n do
+        local s, err = self.conn:recv(READ_SIZE)
+        if not s or #s == 0 then
+            return nil, err or "connection closed"
+        end
+        t[#t + 1] = s
+        size = size + #s
+    end
+    self.buf = tconcat(t)
+    self.pos = 0
+    return true
 end
 
-local function get_payload(conn, length)
-    local payload_buffer = {}
-    local stage = length >> MAX_FRAME_BINLEN
-    if stage > 0 then
-        local n = 0
-        for _ = 1, stage do
-            n = push_string(payload_buffer, util.read_full(conn, MAX_FRAME_SIZE), n)
+-- read a frame, return fin, opcode, unmasked payload; or nil, err, and a
+-- close code as the third value if the frame is refused. received is the
+-- size of the message so far, a frame is refused before its payload is read
+-- if the message would grow beyond max_message_size
+local function read(self, received)
+    while true do
+        local fin, opcode, length, header_size, key = unpack_frame_header(self.buf, self.pos)
+        if fin == nil and opcode then
+            return nil, opcode, codes.CLOSE_PROTOCOL_ERROR
         end
-        length = length & (MAX_FRAME_SIZE - 1)
-        if length > 0 then
-            n = push_string(payload_buffer, util.read_full(conn, length), n)
+        local ok, err
+        if fin == nil then
+            ok, err = fill(self, #self.buf - self.pos + 1)
+        else
+            -- frames of client are masked, those of server are not
+            if self.mask == (key ~= nil) then
+                return nil, "bad masking", codes.CLOSE_PROTOCOL_ERROR
+            end
+            -- 0x3-0x7 and 0xB-0xF are reserved
+            if (opcode > BINARY and opcode < CLOSE) or opcode > PONG then
+                return nil, "reserved opcode", codes.CLOSE_PROTOCOL_ERROR
+            end
+            local max = self.max_message_size
+            if opcode >= CLOSE then
+                if not fin or length > MAX_CONTROL_SIZE then
+                    return nil, "bad control frame", codes.CLOSE_PROTOCOL_ERROR
+                end
+            elseif max and length > max - (opcode == CONTINUATION and received or 0) then
+                return nil, "message too large", codes.CLOSE_TOO_LARGE
+            end
+            ok, err = fill(self, header_size + length)
+            if ok then
+                local from = self.pos + header_size
+                local payload
+                if key then
+                    payload = mask_payload(self.buf, key, from, length)
+                else
+                    payload = ssub(self.buf, from + 1, from + length)
+                end
+                self.pos = from + length
+                if self.pos == #self.buf then
+                    self.buf, self.pos = "", 0
+                end
+                return fin, opcode, payload
+            end
+        end
+        if not ok then
+            return nil, err
         end
-        return tconcat(payload_buffer, "", 1, n)
-    end
-    return util.read_full(conn, length)
-end
-
-local function read(conn)
-    local fin_op, mask_len = sunpack(">I1I1", util.read_full(conn, 2))
-    local fin       = fin_op & 0x80 ~= 0
-    local opcode    = fin_op & 0x0F
-    local mask      = mask_len & 0x80 ~= 0
-    local length    = mask_len & 0x7F
-    if length == 126 then
-        length = sunpack(">I2", util.read_full(conn, 2))
-    elseif length == 127 then
-        length = sunpack(">I8", util.read_full(conn, 8))
-    end
-    local payload
-    if mask then
-        mask = sunpack(">I4", util.read_full(conn, 4))
-        payload = apply_mask(get_payload(conn, length), mask)
-    else
-        payload = get_payload(conn, length)
     end
+end
 
-    return fin, opcode, payload
+local function new_key()
+    return spack(">I4", mrandom(0, 0xFFFFFFFF))
 end
 
-local function write(conn, opcode, payload, mask, not_fin)
+-- send a message as frames of at most self.fragment_size bytes of payload,
+-- control frames are never fragmented. headers and payloads of all frames
+-- go out by one vectored write, which gives up after self.write_timeout.
+-- return true, or nil, err and the connection is aborted
+local function write(self, opcode, payload)
+    payload = payload or ""
     local length = #payload
-    if length > MAX_BUFFER_LENGTH and opcode ~= CLOSE and opcode ~= PING and opcode ~= PONG then
-        for l = 1, length, MAX_BUFFER_LENGTH do
-            local r = l + MAX_BUFFER_LENGTH - 1
-            write(conn, l == 1 and opcode or 0x0, ssub(payload, l, r), mask, r < length)
+    local size = self.fragment_size
+    local mask = self.mask
+    local t
+    if opcode >= CLOSE or not size or length <= size then
+        local key = mask and new_key() or nil
+        t = {
+            pack_header(opcode, length, true, key),
+            key and mask_payload(payload, key) or payload,
+        }
+    else
+        t = {}
+        for from = 0, length - 1, size do
+            local n = mmin(size, length - from)
+            local key = mask and new_key() or nil
+            t[#t + 1] = pack_header(from == 0 and opcode or CONTINUATION, n, from + n == length, key)
+            t[#t + 1] = key and mask_payload(payload, key, from, n) or ssub(payload, from + 1, from + n)
         end
-        return
     end
-    local prefix = 
-        (not_fin and 0x0000 or 0x8000) |    -- fin
-        (opcode << 8) |                     -- opcode
-        (mask and 0x0080 or 0x0000)         -- mask
-    if length < 126 then
-        prefix = spack(">I2", prefix | length)
-    elseif length < (1 << 16) then
-        prefix = spack(">I2I2", prefix | 126, length)
+    local conn = self.conn
+    local ok, err
+    -- frames of a member of group, or behind queued ones, are queued too.
+    -- a lagging peer is left to the group instead of blocking the reader
+    if next(self.groups) or conn:queued_bytes() > 0 then
+        for i = 1, #t do
+            ok, err = conn:write_async(t[i])
+            if ok == nil then
+                break
+            end
+        end
     else
-        prefix = spack(">I2I8", prefix | 127, length)
+        local deadline = timeout.start_new(self.write_timeout)
+        ok, err = conn:sendallv(t)
+        deadline:cancel()
     end
-    if mask then
-        mask = mrandom(0, 0xFFFFFFFF)
-        payload = apply_mask(payload, mask)
-        mask = spack(">I4", mask)
-    else
-        mask = ""
+    if ok == nil then
+        self:abort()
+        return nil, err
     end
-    conn:sendall(sformat("%s%s%s", prefix, mask, payload))
+    return true
 end
 
 local function encode_close_msg(code, reason)
@@ -165,14 +221,81 @@ local function try_handle(self, method, ...)
     return self[method] and self[method](self, ...)
 end
 
-local function run(self)
+-- fragment size of opts, false for none
+local function fragment_size(opts)
+    local size = config.WebSocket.FRAGMENT_SIZE
+    if opts and opts.fragment_size ~= nil then
+        size = opts.fragment_size
+    end
+    if not size or size <= 0 then
+        return false
+    end
+    return size
+end
+
+local function new(conn, mask, buf, opts)
+    local max_message_size = config.WebSocket.MAX_MESSAGE_SIZE
+    if opts and opts.max_message_size ~= nil then
+        max_message_size = opts.max_message_size
+    end
+    local write_timeout = config.WebSocket.WRITE_TIMEOUT
+    if opts and opts.write_timeout ~= nil then
+        write_timeout = opts.write_timeout
+    end
+    return setmetatable({
+        conn = conn,
+        mask = mask,
+        -- max payload of a frame of data messages, false for unfragmented
+        fragment_size = fragment_size(opts),
+        -- max size of a message received, false for unlimited
+        max_message_size = max_message_size,
+        -- seconds a blocking send may take, false for none
+        write_timeout = write_timeout,
+        -- frames may follow the handshake in the same read
+        buf = buf or "",
+        pos = 0,
+        -- groups joined: group -> true
+        groups = {},
+        -- subprotocol agreed in handshake, false for none
+        protocol = false,
+    }, ws)
+end
+
+-- drop the connection, it leaves all groups. what's still queued is sent
+-- within write timeout, or the shorter one set by abort
+local function shutdown(self)
     local conn = self.conn
-    local t, n, first_opcode = {}, 0
+    self.conn = nil
+    for g in pairs(self.groups) do
+        g:remove(self)
+    end
+    if not conn:get_timeout() then
+        conn:set_timeout(self.write_timeout or nil)
+    end
+    conn:close()
+end
+
+-- read and dispatch frames until connection closes, handler of a server
+-- side websocket calls it and returns after it
+function ws:run()
+    -- payloads of frames of the message being received, and their size
+    local t, n, size, first_opcode = {}, 0, 0
     while true do
         if self.conn == nil then
             return
         end
-        local fin, opcode, payload = read(conn)
+        local fin, opcode, payload = read(self, size)
+        if fin == nil then
+            -- closed by ourselves while reading
+            if self.conn == nil then
+                return
+            end
+            if payload then
+                return self:error(payload)
+            end
+            shutdown(self)
+            return try_handle(self, "on_close", codes.CLOSE_ABNORMAL)
+        end
         if opcode == CLOSE then
             try_handle(self, "on_close", decode_close_msg(payload))
             self:close(codes.CLOSE_GOING_AWAY)
@@ -192,10 +315,19 @@ local function run(self)
                 end
                 first_opcode = opcode
                 n = 0
+                size = 0
             end
-            n = push_string(t, payload, n)
+            n = n + 1
+            t[n] = payload
+            size = size + #payload
             if fin then
-                local message = tconcat(t, "", 1, n)
+                -- joined once into a buffer of the message size
+                local message = n == 1 and payload or tconcat(t, "", 1, n)
+                for i = 1, n do
+                    t[i] = nil
+                end
+                n = 0
+                size = 0
                 try_handle(self, "on_message", first_opcode, message)
                 first_opcode = nil
             end
@@ -208,32 +340,76 @@ function ws:__newindex(k, v)
     rawset(self, k, v)
 end
 
+-- return false if connection is closed, nil, err if sending fails and the
+-- connection is aborted
 function ws:send(opcode, payload)
-    write(self.conn, opcode, payload, self.mask)
+    if not self.conn then
+        return false
+    end
+    return write(self, opcode, payload)
+end
+
+-- max payload of frames a data message is split into, false or 0 to send
+-- every message in one frame
+function ws:set_fragment_size(size)
+    self.fragment_size = fragment_size({fragment_size = size})
 end
 
 function ws:text(message)
-    self:send(TEXT, message)
+    return self:send(TEXT, message)
 end
 
 function ws:binary(binstr)
-    self:send(BINARY, binstr)
+    return self:send(BINARY, binstr)
+end
+
+-- queue a built frame and return at once, nil, err if connection is broken
+function ws:send_frame(frame)
+    if not self.conn then
+        return nil, "closed"
+    end
+    local ok, err = self.conn:write_async(frame)
+    if ok == nil then
+        self:abort()
+    end
+    return ok, err
+end
+
+-- bytes queued but not sent yet
+function ws:queued_bytes()
+    return self.conn and self.conn:queued_bytes() or 0
 end
 
 function ws:close(code, reason)
+    if not self.conn then
+        return
+    end
     code = code or codes.CLOSE_NORMAL
     local close_msg = encode_close_msg(code, reason)
     self:send(CLOSE, close_msg)
-    self.conn:close()
-    self.conn = nil
+    shutdown(self)
+end
+
+-- drop the connection without close handshake, data still queued is given
+-- ABORT_TIMEOUT to be sent. run returns and on_close gets CLOSE_ABNORMAL
+function ws:abort()
+    local conn = self.conn
+    if not conn then
+        return
+    end
+    for g in pairs(self.groups) do
+        g:remove(self)
+    end
+    conn:set_timeout(ABORT_TIMEOUT)
+    conn:cancel_read()
 end
 
 function ws:ping(payload)
-    self:send(PING, payload)
+    return self:send(PING, payload)
 end
 
 function ws:pong(payload)
-    self:send(PONG, payload)
+    return self:send(PONG, payload)
 end
 
 function ws:error(...)
@@ -241,7 +417,15 @@ function ws:error(...)
     self:close(...)
 end
 
-function ws.client(url)
+-- opts:
+--  fragment_size: max payload of a frame, default config.WebSocket.FRAGMENT_SIZE,
+--  false for unfragmented
+--  max_message_size: a larger message received is refused and connection
+--  is closed with CLOSE_TOO_LARGE, default config.WebSocket.MAX_MESSAGE_SIZE,
+--  false for unlimited
+--  write_timeout: seconds a blocking send may take before connection is
+--  aborted, default config.WebSocket.WRITE_TIMEOUT, false for none
+function ws.client(url, opts)
     local key = crypto.base64(crypto.rand.bytes(16))
     local request_headers = {
         Connection = "upgrade",
@@ -262,13 +446,185 @@ function ws.client(url)
     assert(response_headers.Connection and response_headers.Connection:lower() == "upgrade", response_headers.Connection)
     assert(response_headers.Upgrade and response_headers.Upgrade:lower() == "websocket", response_headers.Upgrade)
     local accept = response_headers["Sec-Websocket-Accept"]
-    assert(accept and accept == crypto.base64(get_sha1(key, config.WebSocket.GUID)))
-    local obj = setmetatable({
-        conn = cli.conn,
-        mask = true,
-    }, ws)
-    levent.spawn(run, obj)
+    assert(accept and accept == accept_key(key))
+    local obj = new(cli.conn, true, cli.cached, opts)
+    levent.spawn(obj.run, obj)
+    return obj
+end
+
+-- whether comma separated list of header has token
+local function has_token(value, token)
+    if not value then
+        return false
+    end
+    for item in value:gmatch("[^,]+") do
+        if item:match("^%s*(.-)%s*$"):lower() == token then
+            return true
+        end
+    end
+    return false
+end
+
+-- switch the connection of a http/1.1 request to websocket, in a handler
+-- of http.server. 101 is sent at once, the handler then sets callbacks and
+-- calls ws:run, the connection is closed after handler returns.
+-- return nil, err with error status set on rsp if request isn't a valid
+-- websocket handshake
+-- opts:
+--  protocols: subprotocols supported, the first one offered by client
+--  in Sec-WebSocket-Protocol is chosen
+--  fragment_size, max_message_size, write_timeout: as ws.client
+--
+-- s:route("GET", "/chat", function(rsp, req)
+--     local sock = ws.upgrade(rsp, req)
+--     if sock then
+--         function sock:on_message(opcode, message) ... end
+--         sock:run()
+--     end
+-- end)
+function ws.upgrade(rsp, req, opts)
+    if rsp.stream then
+        rsp:set_code(400)
+        return nil, "websocket over http/2 is not supported"
+    end
+    local key = req:get_header("Sec-WebSocket-Key")
+    if req.method ~= http_methods.GET or not key
+        or not has_token(req:get_header("Upgrade"), "websocket")
+        or not has_token(req:get_header("Connection"), "upgrade") then
+        rsp:set_code(400)
+        return nil, "bad handshake"
+    end
+    if tonumber(req:get_header("Sec-WebSocket-Version")) ~= config.WebSocket.VERSION then
+        rsp:set_code(426)
+        rsp:set_header("Sec-WebSocket-Version", config.WebSocket.VERSION)
+        return nil, "unsupported version"
+    end
+
+    local protocol
+    local offered = req:get_header("Sec-WebSocket-Protocol")
+    if opts and opts.protocols and offered then
+        for _, p in ipairs(opts.protocols) do
+            if has_token(offered, p:lower()) then
+                protocol = p
+                break
+            end
+        end
+    end
+
+    -- data sent by client right after handshake
+    local reader = rawget(req, "body_reader")
+    local left
+    if reader then
+        if not reader:discard() then
+            rsp:set_code(400)
+            return nil, "bad handshake"
+        end
+        left = reader:leftover()
+    end
+
+    rsp:compress(req, false)
+    rsp:set_header("Upgrade", "websocket")
+    rsp:set_header("Connection", "Upgrade")
+    rsp:set_header("Sec-WebSocket-Accept", accept_key(key))
+    if protocol then
+        rsp:set_header("Sec-WebSocket-Protocol", protocol)
+    end
+    -- connection isn't reused by http after handler returns
+    rsp.must_close = true
+    local conn = rsp.conn
+    -- messages may be rare, timeout set by server is dropped. sending is
+    -- bounded by write_timeout instead
+    conn:set_timeout(nil)
+    local ok, err = rsp:write_header(101)
+    if not ok then
+        return nil, err
+    end
+    local obj = new(conn, false, left, opts)
+    obj.protocol = protocol or false
     return obj
 end
 
+--[[
+-- group of websockets a message is broadcast to. a frame of server side
+-- websockets is unmasked, so it's built once and the same string is queued
+-- to every member without blocking the sender. members lagging behind
+-- are aborted
+--
+-- local room = ws.group()
+-- room:add(sock)
+-- room:broadcast("hello")
+--]]
+local group = {}
+group.__index = group
+
+-- opts:
+--  max_queue: bytes queued on a member before it's treated as lagging,
+--  default 1M
+function ws.group(opts)
+    opts = opts or {}
+    local obj = {
+        max_queue = opts.max_queue or DEFAULT_MAX_QUEUE,
+        members = {},
+        count = 0,
+    }
+    return setmetatable(obj, group)
+end
+
+-- return false if websocket is closed
+function group:add(s)
+    if not s.conn then
+        return false
+    end
+    if not self.members[s] then
+        self.members[s] = true
+        self.count = self.count + 1
+        s.groups[self] = true
+    end
+    return true
+end
+
+function group:remove(s)
+    if self.members[s] then
+        self.members[s] = nil
+        self.count = self.count - 1
+        s.groups[self] = nil
+    end
+end
+
+function group:size()
+    return self.count
+end
+
+-- send a message to all members, opcode defaults to TEXT.
+-- return number of members it's queued to
+function group:broadcast(payload, opcode)
+    opcode = opcode or TEXT
+    local frame
+    local n = 0
+    -- a member may be removed while iterating, which is fine as fields are
+    -- only cleared
+    for s in pairs(self.members) do
+        if s:queued_bytes() > self.max_queue then
+            s:abort()
+        else
+            local data
+            if s.mask then
+                -- client side frames need a key of their own
+                data = pack_frame(opcode, payload, true, new_key())
+            else
+                frame = frame or pack_frame(opcode, payload)
+                data = frame
+            end
+            if s:send_frame(data) ~= nil then
+                n = n + 1
+            end
+        end
+    end
+    return n
+end
+
+ws.TEXT = TEXT
+ws.BINARY = BINARY
+ws.codes = codes
+
 return ws
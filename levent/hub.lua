@@ -2,6 +2,7 @@ local c          = require "levent.c"
 local class      = require "levent.class"
 local exceptions = require "levent.exceptions"
 local loop       = require "levent.loop"
+local log        = require "levent.log"
 
 local unique = c.unique
 
@@ -61,7 +62,7 @@ end
 
 function Hub:handle_error(co, msg)
     if not class.isinstance(msg, exceptions.KillError) then
-        print("error:", co, msg)
+        log.error("coroutine failed", "co", co, "err", msg)
     end
 end
 
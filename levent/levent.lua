@@ -5,6 +5,7 @@
 local hub        = require "levent.hub"
 local coroutines = require "levent.coroutines"
 local exceptions = require "levent.exceptions"
+local log        = require "levent.log"
 
 local kill_error = exceptions.KillError.new()
 
@@ -61,6 +62,8 @@ end
 function levent.start(f, ...)
     levent.spawn(f, ...)
     hub:run()
+    -- messages logged after the loop stopped
+    log.flush()
 end
 
 function levent.exit()
@@ -153,7 +153,7 @@ function Semaphore:wait(sec)
     self.links[waiter] = true
 
     local t = timeout.start_new(sec)
-    local ok, val = xpcall(waiter.get, waiter)
+    local ok, val = xpcall(waiter.get, debug.traceback, waiter)
     self.links[waiter] = nil
     t:cancel()
     if not ok then
@@ -184,6 +184,7 @@ function Semaphore:_notify()
         end
         waiter:switch(true)
     end
+    self.notifier = false
 end
 
 local lock = {}
@@ -0,0 +1,358 @@
+local file  = require "levent.file.c"
+local errno = require "levent.errno.c"
+
+--[[
+-- leveled logger with structured fields
+--
+-- log.info("connection close", "host", host, "port", port)
+-- => 2026-01-02 03:04:05 INFO connection close host=127.0.0.1 port=8080
+--
+-- messages under current level are dropped before anything is formatted.
+-- lines are queued and written by the loop without blocking the caller:
+-- files are appended once per loop iteration, pipes and terminals are
+-- written when they are writable. when more than max_buffer bytes wait,
+-- new messages are dropped and counted
+--]]
+
+local LEVELS = {
+    debug = 1,
+    info  = 2,
+    warn  = 3,
+    error = 4,
+    off   = 5,
+}
+local NAMES = {"DEBUG", "INFO", "WARN", "ERROR"}
+
+local DEFAULT_MAX_BUFFER = 1024 * 1024
+-- a write of at most PIPE_BUF bytes to a writable pipe doesn't block
+local PIPE_WRITE_SIZE = 4096
+local FILE_WRITE_SIZE = 64 * 1024
+local STDERR_FD = 2
+
+-- required on first use, hub requires this module
+local hub
+
+local ESCAPES = {['"'] = '\\"', ["\\"] = "\\\\", ["\n"] = "\\n", ["\r"] = "\\r", ["\t"] = "\\t"}
+
+-- value of a field, quoted if it contains spaces or quotes, a message
+-- always takes one line
+local function field_value(v)
+    v = tostring(v)
+    if v == "" or v:find('[%s"=]') then
+        return '"' .. v:gsub('[\\"\n\r\t]', ESCAPES) .. '"'
+    end
+    return v
+end
+
+-- timestamp is formatted once a second
+local last_time, last_date
+
+-- a line of message with fields of key, value pairs
+local function format(lv, msg, ...)
+    local now = os.time()
+    if now ~= last_time then
+        last_time = now
+        last_date = os.date("%Y-%m-%d %H:%M:%S", now)
+    end
+    local t = {last_date, NAMES[lv], tostring(msg)}
+    local n = select("#", ...)
+    for i = 1, n - 1, 2 do
+        local k, v = select(i, ...)
+        t[#t + 1] = tostring(k) .. "=" .. field_value(v)
+    end
+    return table.concat(t, " ") .. "\n"
+end
+
+--[[
+-- queue of lines written to a fd in background
+--]]
+local writer = {}
+writer.__index = writer
+
+function writer.new(fd, path, max_buffer)
+    local _, _, regular = file.fstat(fd)
+    local obj = {
+        fd = fd,
+        -- reopened on SIGHUP if set
+        path = path,
+        regular = regular or false,
+        max_buffer = max_buffer or DEFAULT_MAX_BUFFER,
+        lines = {},
+        first = 1,
+        last = 0,
+        bytes = 0,
+        -- data taken from lines but not written yet
+        cur = nil,
+        -- messages dropped in all, and since last notice
+        dropped = 0,
+        lost = 0,
+        scheduled = false,
+        watcher = nil,
+    }
+    return setmetatable(obj, writer)
+end
+
+function writer:push(line)
+    if self.bytes + #line > self.max_buffer then
+        self.dropped = self.dropped + 1
+        self.lost = self.lost + 1
+        return false
+    end
+    self.last = self.last + 1
+    self.lines[self.last] = line
+    self.bytes = self.bytes + #line
+    self:_schedule()
+    return true
+end
+
+-- lines of about size bytes joined, nil if none
+function writer:_take(size)
+    local lines = self.lines
+    local t = {}
+    local n = 0
+    if self.lost > 0 then
+        t[1] = format(3, "log messages dropped", "count", self.lost)
+        n = #t[1]
+        self.lost = 0
+    end
+    while self.first <= self.last and n < size do
+        local line = lines[self.first]
+        lines[self.first] = nil
+        self.first = self.first + 1
+        self.bytes = self.bytes - #line
+        t[#t + 1] = line
+        n = n + #line
+    end
+    if #t == 0 then
+        return nil
+    end
+    return table.concat(t)
+end
+
+function writer:pending()
+    return self.bytes + (self.cur and #self.cur or 0)
+end
+
+function writer:_schedule()
+    if self.scheduled then
+        return
+    end
+    hub = hub or require "levent.hub"
+    self.scheduled = true
+    if self.regular then
+        hub.loop:run_callback(self._drain, self)
+    else
+        if not self.watcher then
+            self.watcher = hub.loop:io(self.fd, hub.loop.EV_WRITE)
+        end
+        self.watcher:start(self._on_writable, self)
+    end
+end
+
+-- write a piece of pending data, at most size bytes. return false if
+-- nothing is left to write
+function writer:_write_some(size)
+    local data = self.cur or self:_take(size)
+    if not data then
+        return false
+    end
+    local n, err = file.write(self.fd, data, size)
+    if not n then
+        if err == errno.EAGAIN or err == errno.EINTR then
+            self.cur = data
+            return true
+        end
+        -- broken output, what's queued is lost
+        self.dropped = self.dropped + self.last - self.first + 1
+        self.lines, self.first, self.last, self.bytes = {}, 1, 0, 0
+        self.cur = nil
+        return false
+    end
+    self.cur = n < #data and data:sub(n + 1) or nil
+    return true
+end
+
+-- regular file never blocks for long, write all in one go
+function writer:_drain()
+    self.scheduled = false
+    while self:_write_some(FILE_WRITE_SIZE) do end
+end
+
+-- one write per readiness, a second one might block
+function writer:_on_writable()
+    if not self:_write_some(PIPE_WRITE_SIZE) and not self.cur then
+        self.watcher:stop()
+        self.scheduled = false
+    end
+end
+
+-- write all pending data, blocking
+function writer:flush()
+    if self.watcher and self.scheduled then
+        self.watcher:stop()
+    end
+    self.scheduled = false
+    while self:_write_some(FILE_WRITE_SIZE) do end
+end
+
+-- open path again, after it's moved by logrotate
+function writer:reopen()
+    if not self.path then
+        return true
+    end
+    local fd, err = file.open(self.path, "a")
+    if not fd then
+        return nil, err
+    end
+    local rescheduled = self.scheduled
+    if self.watcher then
+        self.watcher:stop()
+        self.watcher = nil
+    end
+    self.scheduled = false
+    file.close(self.fd)
+    self.fd = fd
+    local _, _, regular = file.fstat(fd)
+    self.regular = regular or false
+    if rescheduled then
+        self:_schedule()
+    end
+    return true
+end
+
+function writer:close()
+    self:flush()
+    if self.path then
+        file.close(self.fd)
+    end
+end
+
+local log = {}
+log.format = format
+
+local level = LEVELS.info
+-- lua file written synchronously, set by set_output
+local output = nil
+-- background writer, stderr by default
+local out_writer = nil
+local hup_signal = nil
+
+local function get_writer()
+    if not out_writer then
+        out_writer = writer.new(STDERR_FD)
+    end
+    return out_writer
+end
+
+-- name: debug, info, warn, error or off
+function log.set_level(name)
+    level = assert(LEVELS[name], "unknown log level: " .. tostring(name))
+end
+
+function log.get_level()
+    for name, v in pairs(LEVELS) do
+        if v == level then
+            return name
+        end
+    end
+end
+
+-- whether messages of level name are written
+function log.enabled(name)
+    return LEVELS[name] >= level
+end
+
+-- write to a lua file synchronously, nil to go back to background writer
+function log.set_output(f)
+    output = f
+end
+
+-- log to file at path in background, it's reopened on SIGHUP
+-- opts:
+--  max_buffer: bytes queued before messages are dropped, default 1M
+--  reopen_on_hup: default true
+function log.open(path, opts)
+    opts = opts or {}
+    local fd, err = file.open(path, "a")
+    if not fd then
+        return nil, err
+    end
+    if out_writer then
+        out_writer:close()
+    end
+    out_writer = writer.new(fd, path, opts.max_buffer)
+    output = nil
+    if opts.reopen_on_hup ~= false and not hup_signal then
+        local signal = require "levent.signal"
+        hup_signal = signal.signal(signal.SIGHUP, log.reopen)
+        -- logger shouldn't keep the loop running
+        hup_signal:unref()
+    end
+    return true
+end
+
+-- close log file opened by log.open, later messages go to stderr
+function log.close()
+    if out_writer then
+        out_writer:close()
+        out_writer = nil
+    end
+end
+
+-- reopen log file, called on SIGHUP
+function log.reopen()
+    if out_writer then
+        return out_writer:reopen()
+    end
+    return true
+end
+
+-- write all queued messages, blocking
+function log.flush()
+    if out_writer then
+        out_writer:flush()
+    end
+end
+
+-- {dropped = messages dropped, pending = bytes not written yet}
+function log.stats()
+    local w = get_writer()
+    return {dropped = w.dropped, pending = w:pending()}
+end
+
+
+local function emit(lv, msg, ...)
+    local line = format(lv, msg, ...)
+    if output then
+        output:write(line)
+        output:flush()
+    else
+        get_writer():push(line)
+    end
+end
+
+function log.debug(msg, ...)
+    if level <= 1 then
+        emit(1, msg, ...)
+    end
+end
+
+function log.info(msg, ...)
+    if level <= 2 then
+        emit(2, msg, ...)
+    end
+end
+
+function log.warn(msg, ...)
+    if level <= 3 then
+        emit(3, msg, ...)
+    end
+end
+
+function log.error(msg, ...)
+    if level <= 4 then
+        emit(4, msg, ...)
+    end
+end
+
+return log
@@ -1,5 +1,6 @@
 local class = require "levent.class"
 local ev = require "levent.ev.c"
+local log = require "levent.log"
 
 local tpack = table.pack
 local tunpack = table.unpack
@@ -120,6 +121,15 @@ function Loop:now()
     return self.cobj:now()
 end
 
+-- an unref-ed active watcher won't keep the loop running
+function Loop:ref()
+    self.cobj:ref()
+end
+
+function Loop:unref()
+    self.cobj:unref()
+end
+
 function Loop:_add_watchers(w)
     self.watchers[w:id()] = w
 end
@@ -142,6 +152,14 @@ function Loop:signal(signum)
     return self:_create_watcher("signal", signum)
 end
 
+-- watch attributes of path, interval 0 means a suitable default
+function Loop:stat(path, interval)
+    local o = self:_create_watcher("stat", path, interval)
+    -- c watcher refers to path
+    o.path = path
+    return o
+end
+
 function Loop:callback(id, revents)
     local w = assert(self.watchers[id], id)
     w:run_callback(revents)
@@ -168,7 +186,7 @@ function Loop:run_callback(func, ...)
 end
 
 function Loop:handle_error(watcher, msg)
-    print("error:", watcher, msg)
+    log.error("watcher callback failed", "watcher", watcher, "err", msg)
 end
 
 local loop = {}
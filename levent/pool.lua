@@ -0,0 +1,213 @@
+--[[
+-- client side connection pool, keyed by host:port
+--
+-- local p = pool.new({max_idle = 8, max_active = 64})
+-- local conn, err = p:get(host, port)
+-- ... use conn ...
+-- p:put(conn)       -- give it back for reuse
+-- p:put(conn, true) -- broken or in unknown state, close it
+--]]
+
+local class   = require "levent.class"
+local errno   = require "levent.errno.c"
+local hub     = require "levent.hub"
+local lock    = require "levent.lock"
+
+local tremove = table.remove
+
+-- socket_util depends on dns, and dns borrows its tcp connections from a pool,
+-- so socket_util can't be required while this module is loading
+local function default_dial(host, port, timeout)
+    local socket_util = require "levent.socket_util"
+    return socket_util.create_connection(host, port, timeout)
+end
+
+-- an idle connection must have nothing to read: a readable idle connection
+-- is either closed by peer or out of sync with its protocol
+local function is_alive(sock)
+    local data, err = sock.cobj:recv(1)
+    return data == nil and (err == errno.EAGAIN or err == errno.EWOULDBLOCK)
+end
+
+local Endpoint = class("Endpoint")
+function Endpoint:_init(host, port, max_active)
+    self.host = host
+    self.port = port
+    -- stack of {sock, since}, the top one is the most recently returned
+    self.idle = {}
+    self.active = 0
+    if max_active then
+        self.sem = lock.semaphore(max_active)
+    end
+end
+
+local Pool = class("Pool")
+
+-- opts:
+--  max_idle: max idle connections kept per endpoint, default 16
+--  max_active: max borrowed connections per endpoint, nil means unlimited
+--  idle_timeout: close connections idle longer than this (in seconds), default 60
+--  check_interval: seconds between two liveness checks, default 30
+--  connect_timeout: timeout for dialing a new connection
+--  dial: function(host, port, timeout) returns a connected socket
+function Pool:_init(opts)
+    opts = opts or {}
+    self.max_idle = opts.max_idle or 16
+    if opts.max_active and opts.max_active > 0 then
+        self.max_active = opts.max_active
+    end
+    self.idle_timeout = opts.idle_timeout or 60
+    self.check_interval = opts.check_interval or 30
+    self.connect_timeout = opts.connect_timeout
+    self.dial = opts.dial or default_dial
+
+    self.endpoints = {}
+    self.owners = setmetatable({}, {__mode = "k"})
+    self.nidle = 0
+    self.timer = nil
+    self.closed = false
+end
+
+function Pool:_endpoint(host, port)
+    local key = host .. ":" .. port
+    local ep = self.endpoints[key]
+    if not ep then
+        ep = Endpoint.new(host, port, self.max_active)
+        self.endpoints[key] = ep
+    end
+    return ep
+end
+
+-- borrow a connection to host:port, sec is how long to wait for a free slot
+-- when max_active connections are already borrowed
+function Pool:get(host, port, sec)
+    if self.closed then
+        return nil, "pool closed"
+    end
+
+    local ep = self:_endpoint(host, port)
+    if ep.sem and not ep.sem:acquire(sec) then
+        return nil, "too many active connections"
+    end
+
+    local idle = ep.idle
+    local sock
+    while #idle > 0 do
+        local item = tremove(idle)
+        self.nidle = self.nidle - 1
+        if is_alive(item.sock) then
+            sock = item.sock
+            break
+        end
+        item.sock:close()
+    end
+
+    if not sock then
+        local err
+        sock, err = self.dial(host, port, self.connect_timeout)
+        if not sock then
+            if ep.sem then
+                ep.sem:release()
+            end
+            return nil, err
+        end
+    end
+
+    ep.active = ep.active + 1
+    self.owners[sock] = ep
+    return sock
+end
+
+-- give back a connection, close it if `close` is true
+function Pool:put(sock, close)
+    local ep = assert(self.owners[sock], "connection not borrowed from this pool")
+    self.owners[sock] = nil
+    ep.active = ep.active - 1
+    if ep.sem then
+        ep.sem:release()
+    end
+
+    if close or self.closed or #ep.idle >= self.max_idle then
+        sock:close()
+        return
+    end
+
+    ep.idle[#ep.idle + 1] = {sock = sock, since = hub.loop:now()}
+    self.nidle = self.nidle + 1
+    self:_start_check()
+end
+
+function Pool:_start_check()
+    if self.timer or self.check_interval <= 0 then
+        return
+    end
+    self.timer = hub.loop:timer(self.check_interval, self.check_interval)
+    self.timer:start(self._check, self)
+    -- idle connections shouldn't keep the loop running
+    hub.loop:unref()
+end
+
+function Pool:_stop_check()
+    if self.timer then
+        hub.loop:ref()
+        self.timer:stop()
+        self.timer = nil
+    end
+end
+
+-- evict expired or dead idle connections
+function Pool:_check()
+    local deadline = hub.loop:now() - self.idle_timeout
+    for key, ep in pairs(self.endpoints) do
+        local idle = ep.idle
+        local len = #idle
+        local n = 0
+        for i = 1, len do
+            local item = idle[i]
+            if item.since > deadline and is_alive(item.sock) then
+                n = n + 1
+                idle[n] = item
+            else
+                item.sock:close()
+                self.nidle = self.nidle - 1
+            end
+        end
+        for i = n + 1, len do
+            idle[i] = nil
+        end
+
+        if n == 0 and ep.active == 0 then
+            self.endpoints[key] = nil
+        end
+    end
+
+    if self.nidle == 0 then
+        self:_stop_check()
+    end
+end
+
+function Pool:stats()
+    local t = {idle = self.nidle, active = 0, endpoints = {}}
+    for key, ep in pairs(self.endpoints) do
+        t.active = t.active + ep.active
+        t.endpoints[key] = {idle = #ep.idle, active = ep.active}
+    end
+    return t
+end
+
+-- close all idle connections, borrowed connections are closed when they're put back
+function Pool:close()
+    self.closed = true
+    for _, ep in pairs(self.endpoints) do
+        for _, item in ipairs(ep.idle) do
+            item.sock:close()
+        end
+        ep.idle = {}
+    end
+    self.nidle = 0
+    self:_stop_check()
+end
+
+local pool = {}
+pool.new = Pool.new
+return pool
@@ -13,11 +13,19 @@ function Signal:_init(signum, handler, ...)
     self.watcher:start(handler, ...)
 end
 
+-- an unref-ed signal won't keep the loop running
 function Signal:unref()
-    self.watcher:unref()
+    if not self.unrefed then
+        self.unrefed = true
+        hub.loop:unref()
+    end
 end
 
 function Signal:cancel()
+    if self.unrefed then
+        self.unrefed = false
+        hub.loop:ref()
+    end
     self.watcher:stop()
 end
 
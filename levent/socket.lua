@@ -5,13 +5,17 @@
 
 local c       = require "levent.socket.c"
 local errno   = require "levent.errno.c"
+local file    = require "levent.file.c"
 
 local class   = require "levent.class"
 local hub     = require "levent.hub"
 local timeout = require "levent.timeout"
+local log     = require "levent.log"
 
 local closed_socket = setmetatable({}, {__index = function(t, key)
-    if key == "send" or key == "recv" or key=="sendto" or key == "recvfrom" or key == "accept" then
+    if key == "send" or key == "recv" or key=="sendto" or key == "recvfrom" or key == "accept"
+        or key == "sendv" or key == "connect_send" or key == "send_zerocopy" or key == "recv_zerocopy"
+        or key == "sendfile" then
         return function(...)
             return nil, errno.EBADF
         end
@@ -26,7 +30,7 @@ local function _wait(watcher, sec)
 
     local ok, excepiton = xpcall(hub.wait, debug.traceback, hub, watcher)
     if not ok then
-        print(ok, excepiton)
+        log.debug("wait failed", "err", excepiton)
     end
     if t then
         t:cancel()
@@ -34,6 +38,50 @@ local function _wait(watcher, sec)
     return ok, excepiton
 end
 
+-- writes smaller than this are coalesced if autocork is enabled without size
+local DEFAULT_CORK_SIZE = 4096
+-- corked data more than this is flushed at once
+local MAX_CORK_BUFFER = 65536
+-- default watermarks of output chain, see write_async
+local DEFAULT_HIGHMARK = 65536
+local DEFAULT_LOWMARK = 16384
+
+-- sends with at least this bytes use MSG_ZEROCOPY if zerocopy is enabled without threshold
+local DEFAULT_ZEROCOPY_SIZE = 65536
+-- keep pinned data of a closed socket alive for a while, kernel may still be sending it
+local ZEROCOPY_LINGER = 30
+
+-- timer -> pinned data of closed sockets
+local lingering = {}
+
+local function linger_pinned(pinned)
+    local t = hub.loop:timer(ZEROCOPY_LINGER)
+    lingering[t] = pinned
+    t:start(function()
+        lingering[t] = nil
+        hub.loop:ref()
+        t:stop()
+    end)
+    hub.loop:unref()
+end
+
+-- sockets with queued data, flushed before the loop polls again
+local corked = {}
+local flush_scheduled = false
+
+local function flush_corked()
+    flush_scheduled = false
+    local socks = corked
+    corked = {}
+    -- one failed socket doesn't hold up the rest
+    for sock in pairs(socks) do
+        local ok, err = xpcall(sock._drain, debug.traceback, sock)
+        if not ok then
+            log.error("drain failed", "err", err)
+        end
+    end
+end
+
 local Socket = class("Socket")
 
 function Socket:_init(cobj)
@@ -45,6 +93,27 @@ function Socket:_init(cobj)
     self._write_event = loop:io(self.cobj:fileno(), loop.EV_WRITE)
     -- timeout
     self.timeout = nil
+
+    -- output chain, see set_autocork and write_async
+    self._cork = nil
+    self._wbuf = {}
+    self._wbuf_from = 0
+    self._wbuf_size = 0
+    self._wbuf_err = nil
+    self._draining = false
+    -- a coroutine is blocked on write watcher, _drain leaves chain to it
+    self._flushing = false
+    self._highmark = DEFAULT_HIGHMARK
+    self._lowmark = DEFAULT_LOWMARK
+    self._on_drain = nil
+    -- waiter -> lowmark
+    self._writable_waiters = {}
+    self._is_in_notify = false
+
+    -- zerocopy, see set_zerocopy
+    self._zerocopy = nil
+    self._zc_pinned = nil
+    self._zc_pending = 0
 end
 
 function Socket:setblocking(flag)
@@ -128,6 +197,8 @@ function Socket:_recv(func, ...)
         if not ok then
             return nil, exception
         end
+        -- zerocopy completions wake up watchers too
+        self:_reap_zerocopy()
     end
 end
 
@@ -152,19 +223,409 @@ function Socket:_send(func, ...)
         if not self:_need_block(err) then
             return nil, err
         end
-        local ok, exception = _wait(self._write_event, self.timeout)
+        local ok, exception = self:_wait_write()
         if not ok then
             return nil, exception
         end
+        self:_reap_zerocopy()
     end
 end
 
 -- args: data, from
 -- from: count from 0
 function Socket:send(data, from)
+    if self._cork then
+        return self:_send_corked(data, from)
+    end
+    if #self._wbuf > 0 then
+        -- keep order: queued data goes first
+        local ok, err = self:flush()
+        if not ok then
+            return nil, err
+        end
+    end
+    return self:_send_direct(data, from)
+end
+
+function Socket:_send_direct(data, from)
+    if self._zerocopy and #data - (from or 0) >= self._zerocopy then
+        return self:_send_zerocopy(data, from)
+    end
     return self:_send(self.cobj.send, data, from)
 end
 
+-- send large payload by MSG_ZEROCOPY to avoid copying it into kernel (linux only).
+-- sent data is pinned until kernel reports completion in socket's error queue,
+-- which is read before every zerocopy send and on every wakeup of write watcher.
+-- threshold: sends smaller than it are copied as usual, false to disable
+function Socket:set_zerocopy(threshold)
+    if not threshold then
+        self._zerocopy = nil
+        return true
+    end
+
+    if not c.SO_ZEROCOPY then
+        return false, "zerocopy is not supported"
+    end
+
+    local ok, err = self.cobj:setsockopt(c.SOL_SOCKET, c.SO_ZEROCOPY, 1)
+    if not ok then
+        return false, errno.strerror(err)
+    end
+    if threshold == true then
+        threshold = DEFAULT_ZEROCOPY_SIZE
+    end
+    self._zerocopy = threshold
+    self._zc_pinned = self._zc_pinned or {}
+    return true
+end
+
+-- pending zerocopy sends
+function Socket:zerocopy_pending()
+    return self._zc_pending
+end
+
+-- release data of completed zerocopy sends
+function Socket:_reap_zerocopy()
+    if self._zc_pending == 0 then
+        return
+    end
+
+    local pinned = self._zc_pinned
+    while true do
+        local lo, hi, copied = self.cobj:recv_zerocopy()
+        if not lo then
+            break
+        end
+
+        local id = lo
+        while true do
+            if pinned[id] then
+                pinned[id] = nil
+                self._zc_pending = self._zc_pending - 1
+            end
+            if id == hi then
+                break
+            end
+            id = (id + 1) & 0xffffffff
+        end
+
+        -- kernel copied data anyway (e.g. loopback), zerocopy only adds cost
+        if copied then
+            self._zerocopy = nil
+        end
+    end
+end
+
+function Socket:_send_zerocopy(data, from)
+    local cobj = self.cobj
+    while true do
+        self:_reap_zerocopy()
+        local nwrite, id = cobj:send_zerocopy(data, from)
+        if nwrite then
+            self._zc_pinned[id] = data
+            self._zc_pending = self._zc_pending + 1
+            return nwrite
+        end
+
+        local err = id
+        -- out of optmem for notifications, copy instead
+        if err == errno.ENOBUFS then
+            return self:_send(cobj.send, data, from)
+        end
+
+        if not self:_need_block(err) then
+            return nil, err
+        end
+        local ok, exception = self:_wait_write()
+        if not ok then
+            return nil, exception
+        end
+    end
+end
+
+-- coalesce writes smaller than size, and send them with one writev before
+-- the loop polls again. size: false to disable, true for default size
+function Socket:set_autocork(size)
+    if size == true then
+        size = DEFAULT_CORK_SIZE
+    end
+    if size then
+        self._cork = size
+    else
+        self._cork = nil
+        return self:flush()
+    end
+    return true
+end
+
+function Socket:_send_corked(data, from)
+    local err = self._wbuf_err
+    if err then
+        self._wbuf_err = nil
+        return nil, err
+    end
+
+    local len = #data - (from or 0)
+    if len >= self._cork or self._wbuf_size + len > MAX_CORK_BUFFER then
+        -- keep order: corked data goes first
+        local ok, err = self:flush()
+        if not ok then
+            return nil, err
+        end
+        return self:_send_direct(data, from)
+    end
+
+    self:_queue(data, from)
+    self:_schedule_flush()
+    return len
+end
+
+-- queue data and return at once, queued data is written by write watcher.
+-- returns false if queued bytes are above high watermark, the caller should
+-- slow down by wait_writable_below; returns nil, err if socket is broken
+function Socket:write_async(data)
+    local err = self._wbuf_err
+    if err then
+        self._wbuf_err = nil
+        return nil, err
+    end
+    if self.cobj == closed_socket then
+        return nil, errno.EBADF
+    end
+
+    if #data > 0 then
+        self:_queue(data)
+        self:_schedule_flush()
+    end
+    return self._wbuf_size < self._highmark
+end
+
+function Socket:set_watermarks(high, low)
+    assert(not low or not high or low <= high, "low watermark is greater than high")
+    self._highmark = high or DEFAULT_HIGHMARK
+    self._lowmark = low or DEFAULT_LOWMARK
+end
+
+-- wake up the coroutine waiting to read this socket, its recv returns
+-- nil, err
+function Socket:cancel_read(err)
+    hub:cancel_wait(self._read_event, err)
+end
+
+-- bytes queued but not written yet
+function Socket:queued_bytes()
+    return self._wbuf_size
+end
+
+-- callback(sock) is called when all queued data is written
+function Socket:on_drain(callback)
+    self._on_drain = callback
+end
+
+-- wait until queued bytes drop to lowmark or below
+function Socket:wait_writable_below(lowmark, sec)
+    lowmark = lowmark or self._lowmark
+    if self._wbuf_size <= lowmark then
+        return true
+    end
+
+    local waiter = hub:waiter()
+    self._writable_waiters[waiter] = lowmark
+
+    local t = timeout.start_new(sec)
+    local ok, val = xpcall(waiter.get, debug.traceback, waiter)
+    self._writable_waiters[waiter] = nil
+    t:cancel()
+    if not ok then
+        return false, val
+    end
+    return val
+end
+
+function Socket:_notify_writable()
+    self._is_in_notify = false
+    local size = self._wbuf_size
+    local alive = self.cobj ~= closed_socket and not self._wbuf_err
+    local ready = {}
+    for waiter, lowmark in pairs(self._writable_waiters) do
+        if not alive or size <= lowmark then
+            ready[#ready + 1] = waiter
+        end
+    end
+    for _, waiter in ipairs(ready) do
+        self._writable_waiters[waiter] = nil
+        waiter:switch(alive)
+    end
+end
+
+function Socket:_wakeup_writers()
+    if not self._is_in_notify and next(self._writable_waiters) then
+        self._is_in_notify = true
+        hub.loop:run_callback(self._notify_writable, self)
+    end
+end
+
+-- output chain is empty now
+function Socket:_drained()
+    self:_wakeup_writers()
+    if self._on_drain then
+        hub.loop:run_callback(self._on_drain, self)
+    end
+end
+
+function Socket:_schedule_flush()
+    if not corked[self] then
+        corked[self] = true
+        if not flush_scheduled then
+            flush_scheduled = true
+            hub.loop:run_callback(flush_corked)
+        end
+    end
+end
+
+-- append data to output chain
+function Socket:_queue(data, from)
+    if from and from > 0 then
+        data = data:sub(from + 1)
+    end
+    local buf = self._wbuf
+    buf[#buf + 1] = data
+    self._wbuf_size = self._wbuf_size + #data
+end
+
+-- drop n bytes written from output chain
+function Socket:_consume(n)
+    local buf = self._wbuf
+    local len = #buf
+    self._wbuf_size = self._wbuf_size - n
+    n = n + self._wbuf_from
+    local i = 1
+    while i <= len and n >= #buf[i] do
+        n = n - #buf[i]
+        i = i + 1
+    end
+    if i > 1 then
+        table.move(buf, i, len, 1)
+        for j = len - i + 2, len do
+            buf[j] = nil
+        end
+    end
+    self._wbuf_from = n
+end
+
+-- write output chain without blocking, return true if all is written
+function Socket:_write_chain()
+    local buf = self._wbuf
+    while #buf > 0 do
+        local nwrite, err = self.cobj:sendv(buf, self._wbuf_from)
+        if not nwrite then
+            return false, err
+        end
+        self:_consume(nwrite)
+    end
+    return true
+end
+
+function Socket:_reset_chain()
+    self._wbuf = {}
+    self._wbuf_from = 0
+    self._wbuf_size = 0
+end
+
+-- wait until socket is writable, write watcher is taken over from _drain
+-- meanwhile. chain queued by others while waiting is drained after it
+function Socket:_wait_write()
+    self:_stop_drain()
+    self._flushing = true
+    corked[self] = nil
+    local ok, exception = _wait(self._write_event, self.timeout)
+    self._flushing = false
+    if #self._wbuf > 0 then
+        self:_schedule_flush()
+    end
+    return ok, exception
+end
+
+-- called in hub, continue by write watcher if socket is not writable
+function Socket:_drain()
+    if self._flushing then
+        return
+    end
+    self:_reap_zerocopy()
+    if #self._wbuf == 0 then
+        self:_stop_drain()
+        return
+    end
+
+    local ok, err = self:_write_chain()
+    if ok then
+        self:_stop_drain()
+        self:_drained()
+        return
+    end
+
+    if err == errno.EWOULDBLOCK or err == errno.EAGAIN then
+        if not self._draining then
+            self._write_event:start(self._drain, self)
+            self._draining = true
+        end
+        self:_wakeup_writers()
+        return
+    end
+
+    -- report error by next send
+    self._wbuf_err = err
+    self:_reset_chain()
+    self:_stop_drain()
+    self:_wakeup_writers()
+end
+
+function Socket:_stop_drain()
+    if self._draining then
+        self._draining = false
+        self._write_event:stop()
+    end
+end
+
+-- write out all corked data
+function Socket:flush()
+    local err = self._wbuf_err
+    if err then
+        self._wbuf_err = nil
+        return nil, err
+    end
+
+    if #self._wbuf == 0 then
+        return true
+    end
+
+    -- take over write watcher from _drain
+    self:_stop_drain()
+    while true do
+        local ok, err = self:_write_chain()
+        if ok then
+            self:_drained()
+            return true
+        end
+
+        if not self:_need_block(err) then
+            if err == errno.EWOULDBLOCK or err == errno.EAGAIN then
+                self:_drain()
+            else
+                self:_reset_chain()
+                self:_wakeup_writers()
+            end
+            return nil, err
+        end
+
+        local ok, exception = self:_wait_write()
+        if not ok then
+            return nil, exception
+        end
+    end
+end
+
 -- args: 
 function Socket:sendto(ip, port, data, from)
     return self:_send(self.cobj.sendto, ip, port, data, from)
@@ -185,6 +646,65 @@ function Socket:sendall(data, from)
     return sent
 end
 
+-- write strings of list t in order with one writev if possible
+function Socket:sendallv(t)
+    local err = self._wbuf_err
+    if err then
+        self._wbuf_err = nil
+        return nil, err
+    end
+    if self.cobj == closed_socket then
+        return nil, errno.EBADF
+    end
+
+    for i = 1, #t do
+        if #t[i] > 0 then
+            self:_queue(t[i])
+        end
+    end
+    return self:flush()
+end
+
+-- max bytes read by one step if sendfile is not supported
+local SENDFILE_READ_SIZE = 65536
+
+-- send count bytes of file fd from offset, return bytes sent, or sent, err
+function Socket:sendfile(fd, offset, count)
+    if #self._wbuf > 0 then
+        -- keep order: queued data goes first
+        local ok, err = self:flush()
+        if not ok then
+            return 0, err
+        end
+    end
+
+    local sent = 0
+    local sendfile = self.cobj.sendfile
+    while sent < count do
+        local nwrite, err
+        if sendfile then
+            nwrite, err = self:_send(sendfile, fd, offset + sent, count - sent)
+        else
+            local data
+            data, err = file.read(fd, offset + sent, math.min(count - sent, SENDFILE_READ_SIZE))
+            if data then
+                nwrite, err = self:sendall(data)
+            end
+        end
+        if nwrite then
+            sent = sent + nwrite
+        end
+        if err then
+            return sent, err
+        end
+        -- file is truncated
+        if nwrite == 0 then
+            break
+        end
+    end
+    return sent
+end
+
 function Socket:connect(ip, port)
     while true do
         local ok, err = self.cobj:connect(ip, port)
@@ -204,6 +724,25 @@ function Socket:connect(ip, port)
     end
 end
 
+-- connect and send data, data is carried by SYN if tcp fast open is available,
+-- which saves one RTT. returns bytes sent like send
+function Socket:connect_send(ip, port, data, from)
+    local nwrite, err = self.cobj:connect_send(ip, port, data, from)
+    if nwrite and nwrite > 0 then
+        return nwrite
+    end
+
+    -- no fast open cookie yet or fast open is disabled, nothing is sent
+    if err and err ~= errno.EINPROGRESS and err ~= errno.EOPNOTSUPP then
+        return nil, err
+    end
+    local ok, err = self:connect(ip, port)
+    if not ok then
+        return nil, err
+    end
+    return self:send(data, from)
+end
+
 function Socket:fileno()
     return self.cobj:fileno()
 end
@@ -226,10 +765,27 @@ end
 
 function Socket:close()
     if self.cobj ~= closed_socket then
+        if #self._wbuf > 0 then
+            if coroutine.running() == hub.co then
+                self:_write_chain()
+            else
+                self:flush()
+            end
+        end
+        self:_stop_drain()
+        self:_reset_chain()
+        corked[self] = nil
+        self:_reap_zerocopy()
+        if self._zc_pending > 0 then
+            linger_pinned(self._zc_pinned)
+            self._zc_pinned = {}
+            self._zc_pending = 0
+        end
         hub:cancel_wait(self._read_event)
         hub:cancel_wait(self._write_event)
         self.cobj:close()
         self.cobj = closed_socket
+        self:_wakeup_writers()
     end
 end
 
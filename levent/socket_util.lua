@@ -24,7 +24,12 @@ function util.create_connection(host, port, timeout)
     return sock
 end
 
-function util.listen(ip, port)
+-- opts:
+--  backlog: listen backlog
+--  fastopen: queue length of tcp fast open requests, accept data in SYN
+--  defer_accept: seconds, wake up accept only when data arrived
+-- options unsupported by the platform are ignored
+function util.listen(ip, port, opts)
     local sock, err= socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     if not sock then
         return nil, err
@@ -35,7 +40,15 @@ function util.listen(ip, port)
         return nil, err
     end
 
-    local ok, err = sock:listen()
+    opts = opts or {}
+    if opts.fastopen and socket.TCP_FASTOPEN then
+        sock:setsockopt(socket.IPPROTO_TCP, socket.TCP_FASTOPEN, opts.fastopen)
+    end
+    if opts.defer_accept and socket.TCP_DEFER_ACCEPT then
+        sock:setsockopt(socket.IPPROTO_TCP, socket.TCP_DEFER_ACCEPT, opts.defer_accept)
+    end
+
+    local ok, err = sock:listen(opts.backlog)
     if not ok then
         return nil, err
     end
@@ -27,6 +27,12 @@
 
 #undef EBADF
 #define EBADF WSAEBADF
+
+#undef EOPNOTSUPP
+#define EOPNOTSUPP WSAEOPNOTSUPP
+
+#undef ENOBUFS
+#define ENOBUFS WSAENOBUFS
 #endif
 
 static int lstrerror(lua_State *L) {
@@ -49,8 +55,11 @@ LUALIB_API int luaopen_levent_errno_c(lua_State *L) {
     ADD_CONSTANT(L, EINPROGRESS);
     ADD_CONSTANT(L, EALREADY);
     ADD_CONSTANT(L, EAGAIN);
+    ADD_CONSTANT(L, EINTR);
     ADD_CONSTANT(L, EISCONN);
     ADD_CONSTANT(L, EBADF);
+    ADD_CONSTANT(L, EOPNOTSUPP);
+    ADD_CONSTANT(L, ENOBUFS);
 
     return 1;
 }
@@ -459,6 +459,28 @@ static const struct luaL_Reg methods_idle[] = {
     {NULL, NULL}
 };
 
+// ev_stat
+WATCHER_COMMON_METHODS(stat)
+
+// path must be kept alive by caller as long as watcher is used
+static int stat_init(lua_State *L) {
+    ev_stat *w = get_stat(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    double interval = luaL_optnumber(L, 3, 0);
+    ev_stat_init(w, watcher_cb, path, interval);
+    return 0;
+}
+
+static const struct luaL_Reg mt_stat[] = {
+    {"__tostring", stat_tostring},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg methods_stat[] = {
+    WATCHER_METAMETHOD_TABLE(stat),
+    {NULL, NULL}
+};
+
 // create_metatable_*
 METATABLE_BUILDER(loop, LOOP_METATABLE)
 METATABLE_BUILDER(io, WATCHER_METATABLE(io))
@@ -467,6 +489,7 @@ METATABLE_BUILDER(signal, WATCHER_METATABLE(signal))
 METATABLE_BUILDER(prepare, WATCHER_METATABLE(prepare))
 METATABLE_BUILDER(check, WATCHER_METATABLE(check))
 METATABLE_BUILDER(idle, WATCHER_METATABLE(idle))
+METATABLE_BUILDER(stat, WATCHER_METATABLE(stat))
 
 struct luaL_Reg ev_module_methods[] = {
     {"version", ev_version},
@@ -478,6 +501,7 @@ struct luaL_Reg ev_module_methods[] = {
     {"new_prepare", new_prepare},
     {"new_check", new_check},
     {"new_idle", new_idle},
+    {"new_stat", new_stat},
     {NULL, NULL}
 };
 
@@ -492,6 +516,7 @@ LUALIB_API int luaopen_levent_ev_c(lua_State *L) {
     CREATE_METATABLE(prepare, L);
     CREATE_METATABLE(check, L);
     CREATE_METATABLE(idle, L);
+    CREATE_METATABLE(stat, L);
 
     luaL_newlib(L, ev_module_methods);
 
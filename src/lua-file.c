@@ -0,0 +1,169 @@
+/* lua-file.c
+ * file access by descriptor, used to send files by sendfile and to write
+ * logs
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define open _open
+#define close _close
+#define write _write
+#define fstat _fstat
+#define stat _stat
+#define O_CLOEXEC 0
+#else
+#include <unistd.h>
+#endif
+
+#include "levent.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+// max bytes returned by one read
+#define MAX_READ_SIZE (1024*1024)
+
+/*
+ *   args: path, mode
+ *   mode: "r" read only (default), "a" write only appending, created if
+ *   not exists
+ *   return fd
+ */
+static int
+lopen(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    const char *mode = luaL_optstring(L, 2, "r");
+    int fd;
+    if(strcmp(mode, "r") == 0) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    } else if(strcmp(mode, "a") == 0) {
+        fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    } else {
+        return luaL_argerror(L, 2, "bad mode");
+    }
+    if(fd < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, errno);
+        return 2;
+    }
+    lua_pushinteger(L, fd);
+    return 1;
+}
+
+/*
+ *   args: fd
+ *   return size, mtime, is regular file
+ */
+static int
+lfstat(lua_State *L) {
+    struct stat st;
+    int fd = luaL_checkinteger(L, 1);
+    if(fstat(fd, &st) != 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, errno);
+        return 2;
+    }
+    lua_pushinteger(L, (lua_Integer)st.st_size);
+    lua_pushinteger(L, (lua_Integer)st.st_mtime);
+    lua_pushboolean(L, (st.st_mode & S_IFMT) == S_IFREG);
+    return 3;
+}
+
+/*
+ *   args: fd, offset, count
+ *   return data read, empty string at end of file
+ */
+static int
+lread(lua_State *L) {
+    luaL_Buffer b;
+    char *p;
+    int n;
+    int fd = luaL_checkinteger(L, 1);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    size_t count = (size_t)luaL_checkinteger(L, 3);
+    if(count > MAX_READ_SIZE) {
+        count = MAX_READ_SIZE;
+    }
+
+    p = luaL_buffinitsize(L, &b, count);
+#ifdef _WIN32
+    if(_lseeki64(fd, offset, SEEK_SET) < 0) {
+        n = -1;
+    } else {
+        n = _read(fd, p, (unsigned int)count);
+    }
+#else
+    n = (int)pread(fd, p, count, (off_t)offset);
+#endif
+    if(n < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, errno);
+        return 2;
+    }
+    luaL_pushresultsize(&b, n);
+    return 1;
+}
+
+/*
+ *   args: fd, data, count
+ *   write at most count bytes of data, whole data if count is nil
+ *   return bytes written
+ */
+static int
+lwrite(lua_State *L) {
+    size_t len;
+    int fd = luaL_checkinteger(L, 1);
+    const char *data = luaL_checklstring(L, 2, &len);
+    lua_Integer count = luaL_optinteger(L, 3, (lua_Integer)len);
+    int n;
+    if(count >= 0 && (size_t)count < len) {
+        len = (size_t)count;
+    }
+#ifdef _WIN32
+    n = write(fd, data, (unsigned int)len);
+#else
+    n = (int)write(fd, data, len);
+#endif
+    if(n < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, errno);
+        return 2;
+    }
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+static int
+lclose(lua_State *L) {
+    int fd = luaL_checkinteger(L, 1);
+    if(close(fd) != 0) {
+        lua_pushboolean(L, 0);
+        lua_pushinteger(L, errno);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static const struct luaL_Reg file_module_methods[] = {
+    {"open", lopen},
+    {"fstat", lfstat},
+    {"read", lread},
+    {"write", lwrite},
+    {"close", lclose},
+    {NULL, NULL}
+};
+
+LUALIB_API int luaopen_levent_file_c(lua_State *L) {
+    luaL_checkversion(L);
+
+    luaL_newlib(L, file_module_methods);
+    return 1;
+}
@@ -0,0 +1,967 @@
+/* lua-h2.c
+ * http/2 frame header and HPACK (RFC 7541) header compression
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "levent.h"
+
+#define HPACK_ENCODER_METATABLE "hpack_encoder_metatable"
+#define HPACK_DECODER_METATABLE "hpack_decoder_metatable"
+
+#define FRAME_HEADER_SIZE 9
+#define DEFAULT_TABLE_SIZE 4096
+#define DEFAULT_MAX_HEADER_LIST 65536
+// size of an entry is length of name and value plus 32
+#define ENTRY_OVERHEAD 32
+
+typedef struct static_entry_t {
+    const char *name;
+    size_t nlen;
+    const char *value;
+    size_t vlen;
+} static_entry_t;
+
+#define STATIC_ENTRY(n, v) {n, sizeof(n) - 1, v, sizeof(v) - 1}
+
+static const static_entry_t static_table[] = {
+    STATIC_ENTRY(":authority", ""),
+    STATIC_ENTRY(":method", "GET"),
+    STATIC_ENTRY(":method", "POST"),
+    STATIC_ENTRY(":path", "/"),
+    STATIC_ENTRY(":path", "/index.html"),
+    STATIC_ENTRY(":scheme", "http"),
+    STATIC_ENTRY(":scheme", "https"),
+    STATIC_ENTRY(":status", "200"),
+    STATIC_ENTRY(":status", "204"),
+    STATIC_ENTRY(":status", "206"),
+    STATIC_ENTRY(":status", "304"),
+    STATIC_ENTRY(":status", "400"),
+    STATIC_ENTRY(":status", "404"),
+    STATIC_ENTRY(":status", "500"),
+    STATIC_ENTRY("accept-charset", ""),
+    STATIC_ENTRY("accept-encoding", "gzip, deflate"),
+    STATIC_ENTRY("accept-language", ""),
+    STATIC_ENTRY("accept-ranges", ""),
+    STATIC_ENTRY("accept", ""),
+    STATIC_ENTRY("access-control-allow-origin", ""),
+    STATIC_ENTRY("age", ""),
+    STATIC_ENTRY("allow", ""),
+    STATIC_ENTRY("authorization", ""),
+    STATIC_ENTRY("cache-control", ""),
+    STATIC_ENTRY("content-disposition", ""),
+    STATIC_ENTRY("content-encoding", ""),
+    STATIC_ENTRY("content-language", ""),
+    STATIC_ENTRY("content-length", ""),
+    STATIC_ENTRY("content-location", ""),
+    STATIC_ENTRY("content-range", ""),
+    STATIC_ENTRY("content-type", ""),
+    STATIC_ENTRY("cookie", ""),
+    STATIC_ENTRY("date", ""),
+    STATIC_ENTRY("etag", ""),
+    STATIC_ENTRY("expect", ""),
+    STATIC_ENTRY("expires", ""),
+    STATIC_ENTRY("from", ""),
+    STATIC_ENTRY("host", ""),
+    STATIC_ENTRY("if-match", ""),
+    STATIC_ENTRY("if-modified-since", ""),
+    STATIC_ENTRY("if-none-match", ""),
+    STATIC_ENTRY("if-range", ""),
+    STATIC_ENTRY("if-unmodified-since", ""),
+    STATIC_ENTRY("last-modified", ""),
+    STATIC_ENTRY("link", ""),
+    STATIC_ENTRY("location", ""),
+    STATIC_ENTRY("max-forwards", ""),
+    STATIC_ENTRY("proxy-authenticate", ""),
+    STATIC_ENTRY("proxy-authorization", ""),
+    STATIC_ENTRY("range", ""),
+    STATIC_ENTRY("referer", ""),
+    STATIC_ENTRY("refresh", ""),
+    STATIC_ENTRY("retry-after", ""),
+    STATIC_ENTRY("server", ""),
+    STATIC_ENTRY("set-cookie", ""),
+    STATIC_ENTRY("strict-transport-security", ""),
+    STATIC_ENTRY("transfer-encoding", ""),
+    STATIC_ENTRY("user-agent", ""),
+    STATIC_ENTRY("vary", ""),
+    STATIC_ENTRY("via", ""),
+    STATIC_ENTRY("www-authenticate", ""),
+};
+
+#define STATIC_TABLE_SIZE (sizeof(static_table) / sizeof(static_table[0]))
+
+typedef struct huff_code_t {
+    uint32_t code;
+    uint8_t len;
+} huff_code_t;
+
+// canonical codes of byte 0-255, EOS is 30 ones
+static const huff_code_t huff_codes[256] = {
+    {0x00001ff8, 13}, {0x007fffd8, 23}, {0x0fffffe2, 28}, {0x0fffffe3, 28},
+    {0x0fffffe4, 28}, {0x0fffffe5, 28}, {0x0fffffe6, 28}, {0x0fffffe7, 28},
+    {0x0fffffe8, 28}, {0x00ffffea, 24}, {0x3ffffffc, 30}, {0x0fffffe9, 28},
+    {0x0fffffea, 28}, {0x3ffffffd, 30}, {0x0fffffeb, 28}, {0x0fffffec, 28},
+    {0x0fffffed, 28}, {0x0fffffee, 28}, {0x0fffffef, 28}, {0x0ffffff0, 28},
+    {0x0ffffff1, 28}, {0x0ffffff2, 28}, {0x3ffffffe, 30}, {0x0ffffff3, 28},
+    {0x0ffffff4, 28}, {0x0ffffff5, 28}, {0x0ffffff6, 28}, {0x0ffffff7, 28},
+    {0x0ffffff8, 28}, {0x0ffffff9, 28}, {0x0ffffffa, 28}, {0x0ffffffb, 28},
+    {0x00000014, 6}, {0x000003f8, 10}, {0x000003f9, 10}, {0x00000ffa, 12},
+    {0x00001ff9, 13}, {0x00000015, 6}, {0x000000f8, 8}, {0x000007fa, 11},
+    {0x000003fa, 10}, {0x000003fb, 10}, {0x000000f9, 8}, {0x000007fb, 11},
+    {0x000000fa, 8}, {0x00000016, 6}, {0x00000017, 6}, {0x00000018, 6},
+    {0x00000000, 5}, {0x00000001, 5}, {0x00000002, 5}, {0x00000019, 6},
+    {0x0000001a, 6}, {0x0000001b, 6}, {0x0000001c, 6}, {0x0000001d, 6},
+    {0x0000001e, 6}, {0x0000001f, 6}, {0x0000005c, 7}, {0x000000fb, 8},
+    {0x00007ffc, 15}, {0x00000020, 6}, {0x00000ffb, 12}, {0x000003fc, 10},
+    {0x00001ffa, 13}, {0x00000021, 6}, {0x0000005d, 7}, {0x0000005e, 7},
+    {0x0000005f, 7}, {0x00000060, 7}, {0x00000061, 7}, {0x00000062, 7},
+    {0x00000063, 7}, {0x00000064, 7}, {0x00000065, 7}, {0x00000066, 7},
+    {0x00000067, 7}, {0x00000068, 7}, {0x00000069, 7}, {0x0000006a, 7},
+    {0x0000006b, 7}, {0x0000006c, 7}, {0x0000006d, 7}, {0x0000006e, 7},
+    {0x0000006f, 7}, {0x00000070, 7}, {0x00000071, 7}, {0x00000072, 7},
+    {0x000000fc, 8}, {0x00000073, 7}, {0x000000fd, 8}, {0x00001ffb, 13},
+    {0x0007fff0, 19}, {0x00001ffc, 13}, {0x00003ffc, 14}, {0x00000022, 6},
+    {0x00007ffd, 15}, {0x00000003, 5}, {0x00000023, 6}, {0x00000004, 5},
+    {0x00000024, 6}, {0x00000005, 5}, {0x00000025, 6}, {0x00000026, 6},
+    {0x00000027, 6}, {0x00000006, 5}, {0x00000074, 7}, {0x00000075, 7},
+    {0x00000028, 6}, {0x00000029, 6}, {0x0000002a, 6}, {0x00000007, 5},
+    {0x0000002b, 6}, {0x00000076, 7}, {0x0000002c, 6}, {0x00000008, 5},
+    {0x00000009, 5}, {0x0000002d, 6}, {0x00000077, 7}, {0x00000078, 7},
+    {0x00000079, 7}, {0x0000007a, 7}, {0x0000007b, 7}, {0x00007ffe, 15},
+    {0x000007fc, 11}, {0x00003ffd, 14}, {0x00001ffd, 13}, {0x0ffffffc, 28},
+    {0x000fffe6, 20}, {0x003fffd2, 22}, {0x000fffe7, 20}, {0x000fffe8, 20},
+    {0x003fffd3, 22}, {0x003fffd4, 22}, {0x003fffd5, 22}, {0x007fffd9, 23},
+    {0x003fffd6, 22}, {0x007fffda, 23}, {0x007fffdb, 23}, {0x007fffdc, 23},
+    {0x007fffdd, 23}, {0x007fffde, 23}, {0x00ffffeb, 24}, {0x007fffdf, 23},
+    {0x00ffffec, 24}, {0x00ffffed, 24}, {0x003fffd7, 22}, {0x007fffe0, 23},
+    {0x00ffffee, 24}, {0x007fffe1, 23}, {0x007fffe2, 23}, {0x007fffe3, 23},
+    {0x007fffe4, 23}, {0x001fffdc, 21}, {0x003fffd8, 22}, {0x007fffe5, 23},
+    {0x003fffd9, 22}, {0x007fffe6, 23}, {0x007fffe7, 23}, {0x00ffffef, 24},
+    {0x003fffda, 22}, {0x001fffdd, 21}, {0x000fffe9, 20}, {0x003fffdb, 22},
+    {0x003fffdc, 22}, {0x007fffe8, 23}, {0x007fffe9, 23}, {0x001fffde, 21},
+    {0x007fffea, 23}, {0x003fffdd, 22}, {0x003fffde, 22}, {0x00fffff0, 24},
+    {0x001fffdf, 21}, {0x003fffdf, 22}, {0x007fffeb, 23}, {0x007fffec, 23},
+    {0x001fffe0, 21}, {0x001fffe1, 21}, {0x003fffe0, 22}, {0x001fffe2, 21},
+    {0x007fffed, 23}, {0x003fffe1, 22}, {0x007fffee, 23}, {0x007fffef, 23},
+    {0x000fffea, 20}, {0x003fffe2, 22}, {0x003fffe3, 22}, {0x003fffe4, 22},
+    {0x007ffff0, 23}, {0x003fffe5, 22}, {0x003fffe6, 22}, {0x007ffff1, 23},
+    {0x03ffffe0, 26}, {0x03ffffe1, 26}, {0x000fffeb, 20}, {0x0007fff1, 19},
+    {0x003fffe7, 22}, {0x007ffff2, 23}, {0x003fffe8, 22}, {0x01ffffec, 25},
+    {0x03ffffe2, 26}, {0x03ffffe3, 26}, {0x03ffffe4, 26}, {0x07ffffde, 27},
+    {0x07ffffdf, 27}, {0x03ffffe5, 26}, {0x00fffff1, 24}, {0x01ffffed, 25},
+    {0x0007fff2, 19}, {0x001fffe3, 21}, {0x03ffffe6, 26}, {0x07ffffe0, 27},
+    {0x07ffffe1, 27}, {0x03ffffe7, 26}, {0x07ffffe2, 27}, {0x00fffff2, 24},
+    {0x001fffe4, 21}, {0x001fffe5, 21}, {0x03ffffe8, 26}, {0x03ffffe9, 26},
+    {0x0ffffffd, 28}, {0x07ffffe3, 27}, {0x07ffffe4, 27}, {0x07ffffe5, 27},
+    {0x000fffec, 20}, {0x00fffff3, 24}, {0x000fffed, 20}, {0x001fffe6, 21},
+    {0x003fffe9, 22}, {0x001fffe7, 21}, {0x001fffe8, 21}, {0x007ffff3, 23},
+    {0x003fffea, 22}, {0x003fffeb, 22}, {0x01ffffee, 25}, {0x01ffffef, 25},
+    {0x00fffff4, 24}, {0x00fffff5, 24}, {0x03ffffea, 26}, {0x007ffff4, 23},
+    {0x03ffffeb, 26}, {0x07ffffe6, 27}, {0x03ffffec, 26}, {0x03ffffed, 26},
+    {0x07ffffe7, 27}, {0x07ffffe8, 27}, {0x07ffffe9, 27}, {0x07ffffea, 27},
+    {0x07ffffeb, 27}, {0x0ffffffe, 28}, {0x07ffffec, 27}, {0x07ffffed, 27},
+    {0x07ffffee, 27}, {0x07ffffef, 27}, {0x07fffff0, 27}, {0x03ffffee, 26},
+};
+
+#define HUFF_EOS 256
+
+// decoding tree: child > 0 is an inner node, child < 0 is symbol -child-1
+typedef struct huff_node_t {
+    int16_t child[2];
+} huff_node_t;
+
+static huff_node_t huff_tree[256];
+static int huff_tree_ready = 0;
+
+static void
+huff_add(int sym, uint32_t code, int len, int *nnode) {
+    int i, bit, node = 0;
+    for(i = len - 1; i > 0; i--) {
+        bit = (code >> i) & 1;
+        if(huff_tree[node].child[bit] == 0) {
+            huff_tree[node].child[bit] = (int16_t)(*nnode)++;
+        }
+        node = huff_tree[node].child[bit];
+    }
+    huff_tree[node].child[code & 1] = (int16_t)(-sym - 1);
+}
+
+static void
+huff_build(void) {
+    int i, nnode = 1;
+    if(huff_tree_ready) {
+        return;
+    }
+    memset(huff_tree, 0, sizeof(huff_tree));
+    for(i = 0; i < 256; i++) {
+        huff_add(i, huff_codes[i].code, huff_codes[i].len, &nnode);
+    }
+    huff_add(HUFF_EOS, 0x3fffffff, 30, &nnode);
+    huff_tree_ready = 1;
+}
+
+// growable output buffer
+typedef struct buffer_t {
+    char *data;
+    size_t size;
+    size_t cap;
+} buffer_t;
+
+static int
+buffer_reserve(buffer_t *b, size_t len) {
+    if(b->size + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 256;
+        char *data;
+        while(cap < b->size + len) {
+            cap *= 2;
+        }
+        data = (char*)realloc(b->data, cap);
+        if(data == NULL) {
+            return -1;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    return 0;
+}
+
+static int
+buffer_append(buffer_t *b, const void *data, size_t len) {
+    if(buffer_reserve(b, len) != 0) {
+        return -1;
+    }
+    memcpy(b->data + b->size, data, len);
+    b->size += len;
+    return 0;
+}
+
+static void
+buffer_free(buffer_t *b) {
+    free(b->data);
+    b->data = NULL;
+    b->size = 0;
+    b->cap = 0;
+}
+
+// return -1 on invalid code or padding
+static int
+huff_decode(const uint8_t *src, size_t len, buffer_t *out) {
+    size_t i;
+    int bit, next, node = 0, depth = 0, ones = 1;
+    for(i = 0; i < len; i++) {
+        for(bit = 7; bit >= 0; bit--) {
+            int b = (src[i] >> bit) & 1;
+            next = huff_tree[node].child[b];
+            depth++;
+            if(!b) {
+                ones = 0;
+            }
+            if(next < 0) {
+                char c;
+                if(-next - 1 == HUFF_EOS) {
+                    return -1;
+                }
+                c = (char)(-next - 1);
+                if(buffer_append(out, &c, 1) != 0) {
+                    return -1;
+                }
+                node = 0;
+                depth = 0;
+                ones = 1;
+            } else if(next == 0) {
+                return -1;
+            } else {
+                node = next;
+            }
+        }
+    }
+    // padding is the most significant bits of EOS, shorter than a byte
+    if(depth > 7 || !ones) {
+        return -1;
+    }
+    return 0;
+}
+
+static size_t
+huff_length(const uint8_t *src, size_t len) {
+    size_t i, bits = 0;
+    for(i = 0; i < len; i++) {
+        bits += huff_codes[src[i]].len;
+    }
+    return (bits + 7) / 8;
+}
+
+static int
+huff_encode(const uint8_t *src, size_t len, buffer_t *out) {
+    size_t i;
+    uint64_t acc = 0;
+    int nbits = 0;
+    for(i = 0; i < len; i++) {
+        const huff_code_t *h = &huff_codes[src[i]];
+        acc = (acc << h->len) | h->code;
+        nbits += h->len;
+        while(nbits >= 8) {
+            uint8_t c = (uint8_t)(acc >> (nbits - 8));
+            nbits -= 8;
+            if(buffer_append(out, &c, 1) != 0) {
+                return -1;
+            }
+        }
+    }
+    if(nbits > 0) {
+        // pad with ones
+        uint8_t c = (uint8_t)((acc << (8 - nbits)) | (0xff >> nbits));
+        if(buffer_append(out, &c, 1) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// integer with n bits prefix, first byte carries flags in the other bits
+static int
+encode_int(buffer_t *out, uint8_t flags, int prefix, uint32_t v) {
+    uint8_t buf[8];
+    size_t n = 0;
+    uint32_t max = (1u << prefix) - 1;
+    if(v < max) {
+        buf[n++] = flags | (uint8_t)v;
+    } else {
+        buf[n++] = flags | (uint8_t)max;
+        v -= max;
+        while(v >= 128) {
+            buf[n++] = (uint8_t)(v & 0x7f) | 0x80;
+            v >>= 7;
+        }
+        buf[n++] = (uint8_t)v;
+    }
+    return buffer_append(out, buf, n);
+}
+
+static int
+decode_int(const uint8_t *p, size_t len, size_t *pos, int prefix, uint32_t *out) {
+    uint32_t max = (1u << prefix) - 1;
+    uint32_t v = p[*pos] & max;
+    int m = 0;
+    (*pos)++;
+    if(v < max) {
+        *out = v;
+        return 0;
+    }
+    while(*pos < len) {
+        uint8_t b = p[(*pos)++];
+        if(m > 21) {
+            return -1;
+        }
+        v += (uint32_t)(b & 0x7f) << m;
+        m += 7;
+        if(!(b & 0x80)) {
+            *out = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int
+encode_string(buffer_t *out, const char *s, size_t len) {
+    size_t hlen = huff_length((const uint8_t*)s, len);
+    if(hlen < len) {
+        if(encode_int(out, 0x80, 7, (uint32_t)hlen) != 0) {
+            return -1;
+        }
+        return huff_encode((const uint8_t*)s, len, out);
+    }
+    if(encode_int(out, 0, 7, (uint32_t)len) != 0) {
+        return -1;
+    }
+    return buffer_append(out, s, len);
+}
+
+// dynamic table, a ring of entries, the newest has the smallest index
+typedef struct hentry_t {
+    // name followed by value
+    char *data;
+    size_t nlen;
+    size_t vlen;
+} hentry_t;
+
+typedef struct htable_t {
+    hentry_t *ents;
+    size_t cap;
+    size_t start;
+    size_t count;
+    size_t size;
+    size_t max_size;
+} htable_t;
+
+INLINE static size_t
+entry_size(size_t nlen, size_t vlen) {
+    return nlen + vlen + ENTRY_OVERHEAD;
+}
+
+// i from 0, the newest entry
+INLINE static hentry_t*
+table_get(htable_t *t, size_t i) {
+    return &t->ents[(t->start + t->count - 1 - i) % t->cap];
+}
+
+static void
+table_evict(htable_t *t) {
+    hentry_t *e = &t->ents[t->start];
+    t->size -= entry_size(e->nlen, e->vlen);
+    free(e->data);
+    e->data = NULL;
+    t->start = (t->start + 1) % t->cap;
+    t->count--;
+}
+
+static void
+table_set_max(htable_t *t, size_t max_size) {
+    t->max_size = max_size;
+    while(t->count > 0 && t->size > max_size) {
+        table_evict(t);
+    }
+}
+
+static int
+table_add(htable_t *t, const char *name, size_t nlen, const char *value, size_t vlen) {
+    size_t esize = entry_size(nlen, vlen);
+    hentry_t *e;
+    char *data;
+    while(t->count > 0 && t->size + esize > t->max_size) {
+        table_evict(t);
+    }
+    // an entry larger than the table empties it
+    if(esize > t->max_size) {
+        return 0;
+    }
+
+    data = (char*)malloc(nlen + vlen + 1);
+    if(data == NULL) {
+        return -1;
+    }
+    memcpy(data, name, nlen);
+    memcpy(data + nlen, value, vlen);
+
+    if(t->count == t->cap) {
+        size_t i, cap = t->cap ? t->cap * 2 : 16;
+        hentry_t *ents = (hentry_t*)malloc(cap * sizeof(hentry_t));
+        if(ents == NULL) {
+            free(data);
+            return -1;
+        }
+        for(i = 0; i < t->count; i++) {
+            ents[i] = t->ents[(t->start + i) % t->cap];
+        }
+        free(t->ents);
+        t->ents = ents;
+        t->cap = cap;
+        t->start = 0;
+    }
+
+    e = &t->ents[(t->start + t->count) % t->cap];
+    e->data = data;
+    e->nlen = nlen;
+    e->vlen = vlen;
+    t->count++;
+    t->size += esize;
+    return 0;
+}
+
+static void
+table_free(htable_t *t) {
+    while(t->count > 0) {
+        table_evict(t);
+    }
+    free(t->ents);
+    t->ents = NULL;
+    t->cap = 0;
+}
+
+// get name and value of index, static table first
+static int
+table_lookup(htable_t *t, uint32_t index, const char **name, size_t *nlen,
+    const char **value, size_t *vlen) {
+    if(index == 0) {
+        return -1;
+    }
+    if(index <= STATIC_TABLE_SIZE) {
+        const static_entry_t *s = &static_table[index - 1];
+        *name = s->name;
+        *nlen = s->nlen;
+        *value = s->value;
+        *vlen = s->vlen;
+        return 0;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if(index >= t->count) {
+        return -1;
+    }
+    {
+        hentry_t *e = table_get(t, index);
+        *name = e->data;
+        *nlen = e->nlen;
+        *value = e->data + e->nlen;
+        *vlen = e->vlen;
+    }
+    return 0;
+}
+
+/*
+ * encoder
+ */
+typedef struct hpack_encoder_t {
+    htable_t table;
+    buffer_t out;
+    // table size updates to emit at the start of next block
+    int pending;
+    size_t min_size;
+} hpack_encoder_t;
+
+// values never put into table, so they can't be probed by compression
+INLINE static int
+is_sensitive(const char *name, size_t nlen) {
+    return (nlen == 13 && memcmp(name, "authorization", 13) == 0)
+        || (nlen == 19 && memcmp(name, "proxy-authorization", 19) == 0);
+}
+
+// return index of exact match, or 0; name_index gets index of name match
+static uint32_t
+encoder_find(hpack_encoder_t *e, const char *name, size_t nlen,
+    const char *value, size_t vlen, uint32_t *name_index) {
+    size_t i;
+    *name_index = 0;
+    for(i = 0; i < STATIC_TABLE_SIZE; i++) {
+        const static_entry_t *s = &static_table[i];
+        if(s->nlen == nlen && memcmp(s->name, name, nlen) == 0) {
+            if(s->vlen == vlen && memcmp(s->value, value, vlen) == 0) {
+                return (uint32_t)i + 1;
+            }
+            if(*name_index == 0) {
+                *name_index = (uint32_t)i + 1;
+            }
+        }
+    }
+    for(i = 0; i < e->table.count; i++) {
+        hentry_t *h = table_get(&e->table, i);
+        if(h->nlen == nlen && memcmp(h->data, name, nlen) == 0) {
+            if(h->vlen == vlen && memcmp(h->data + nlen, value, vlen) == 0) {
+                return (uint32_t)(STATIC_TABLE_SIZE + 1 + i);
+            }
+            if(*name_index == 0) {
+                *name_index = (uint32_t)(STATIC_TABLE_SIZE + 1 + i);
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+encode_field(hpack_encoder_t *e, const char *name, size_t nlen, const char *value, size_t vlen) {
+    buffer_t *out = &e->out;
+    uint32_t name_index;
+    uint32_t index = encoder_find(e, name, nlen, value, vlen, &name_index);
+    int ret;
+    if(index) {
+        return encode_int(out, 0x80, 7, index);
+    }
+
+    if(is_sensitive(name, nlen)) {
+        // never indexed
+        ret = encode_int(out, 0x10, 4, name_index);
+    } else if(entry_size(nlen, vlen) <= e->table.max_size / 2) {
+        // incremental indexing, skip values too large to stay long in table
+        ret = encode_int(out, 0x40, 6, name_index);
+        if(ret == 0 && table_add(&e->table, name, nlen, value, vlen) != 0) {
+            return -1;
+        }
+    } else {
+        // without indexing
+        ret = encode_int(out, 0, 4, name_index);
+    }
+    if(ret != 0) {
+        return -1;
+    }
+    if(name_index == 0 && encode_string(out, name, nlen) != 0) {
+        return -1;
+    }
+    return encode_string(out, value, vlen);
+}
+
+INLINE static hpack_encoder_t*
+get_encoder(lua_State *L) {
+    return (hpack_encoder_t*)luaL_checkudata(L, 1, HPACK_ENCODER_METATABLE);
+}
+
+// encoder:encode({name1, value1, name2, value2, ...}) return header block
+// names should be lower case, pseudo headers first
+static int
+lencoder_encode(lua_State *L) {
+    hpack_encoder_t *e = get_encoder(L);
+    lua_Integer i, n;
+    int ok = 0;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = (lua_Integer)lua_rawlen(L, 2);
+    e->out.size = 0;
+
+    if(e->pending) {
+        e->pending = 0;
+        if(e->min_size < e->table.max_size) {
+            ok |= encode_int(&e->out, 0x20, 5, (uint32_t)e->min_size);
+        }
+        ok |= encode_int(&e->out, 0x20, 5, (uint32_t)e->table.max_size);
+    }
+
+    for(i = 1; i + 1 <= n && ok == 0; i += 2) {
+        size_t nlen, vlen;
+        const char *name, *value;
+        lua_rawgeti(L, 2, i);
+        lua_rawgeti(L, 2, i + 1);
+        name = lua_tolstring(L, -2, &nlen);
+        value = lua_tolstring(L, -1, &vlen);
+        if(name == NULL || value == NULL) {
+            return luaL_error(L, "header name and value should be string");
+        }
+        ok = encode_field(e, name, nlen, value, vlen);
+        lua_pop(L, 2);
+    }
+    if(ok != 0) {
+        return luaL_error(L, "out of memory");
+    }
+    lua_pushlstring(L, e->out.data, e->out.size);
+    if(e->out.cap > 65536) {
+        buffer_free(&e->out);
+    }
+    return 1;
+}
+
+// encoder:set_max_table_size(n) by SETTINGS_HEADER_TABLE_SIZE of peer
+static int
+lencoder_set_max_table_size(lua_State *L) {
+    hpack_encoder_t *e = get_encoder(L);
+    size_t size = (size_t)luaL_checkinteger(L, 2);
+    if(!e->pending || size < e->min_size) {
+        e->min_size = size;
+    }
+    e->pending = 1;
+    table_set_max(&e->table, size);
+    return 0;
+}
+
+static int
+lencoder_gc(lua_State *L) {
+    hpack_encoder_t *e = get_encoder(L);
+    table_free(&e->table);
+    buffer_free(&e->out);
+    return 0;
+}
+
+static int
+lnew_encoder(lua_State *L) {
+    hpack_encoder_t *e = (hpack_encoder_t*)lua_newuserdata(L, sizeof(hpack_encoder_t));
+    memset(e, 0, sizeof(*e));
+    e->table.max_size = DEFAULT_TABLE_SIZE;
+    luaL_getmetatable(L, HPACK_ENCODER_METATABLE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/*
+ * decoder
+ */
+typedef struct hpack_decoder_t {
+    htable_t table;
+    // max table size we allow by SETTINGS_HEADER_TABLE_SIZE
+    size_t settings_size;
+    size_t max_header_list;
+    buffer_t name;
+    buffer_t value;
+} hpack_decoder_t;
+
+INLINE static hpack_decoder_t*
+get_decoder(lua_State *L) {
+    return (hpack_decoder_t*)luaL_checkudata(L, 1, HPACK_DECODER_METATABLE);
+}
+
+static int
+decode_string(const uint8_t *p, size_t len, size_t *pos, buffer_t *out) {
+    uint32_t slen;
+    int huff;
+    out->size = 0;
+    if(*pos >= len) {
+        return -1;
+    }
+    huff = p[*pos] & 0x80;
+    if(decode_int(p, len, pos, 7, &slen) != 0 || slen > len - *pos) {
+        return -1;
+    }
+    if(huff) {
+        if(huff_decode(p + *pos, slen, out) != 0) {
+            return -1;
+        }
+    } else if(buffer_append(out, p + *pos, slen) != 0) {
+        return -1;
+    }
+    *pos += slen;
+    return 0;
+}
+
+#define DECODE_FAIL(msg) do { err = msg; goto fail; } while(0)
+
+// decoder:decode(block) return {name1, value1, ...}; or nil, err
+// err means the connection should be closed by COMPRESSION_ERROR
+static int
+ldecoder_decode(lua_State *L) {
+    hpack_decoder_t *d = get_decoder(L);
+    size_t len, pos = 0, total = 0;
+    const uint8_t *p = (const uint8_t*)luaL_checklstring(L, 2, &len);
+    const char *err = NULL;
+    lua_Integer n = 0;
+    lua_newtable(L);
+
+    while(pos < len) {
+        uint8_t b = p[pos];
+        uint32_t index;
+        const char *name, *value;
+        size_t nlen, vlen;
+
+        if(b & 0x80) {
+            // indexed
+            if(decode_int(p, len, &pos, 7, &index) != 0
+                || table_lookup(&d->table, index, &name, &nlen, &value, &vlen) != 0) {
+                DECODE_FAIL("invalid index");
+            }
+        } else if((b & 0xe0) == 0x20) {
+            // dynamic table size update
+            uint32_t size;
+            if(decode_int(p, len, &pos, 5, &size) != 0 || size > d->settings_size) {
+                DECODE_FAIL("invalid table size update");
+            }
+            table_set_max(&d->table, size);
+            continue;
+        } else {
+            // literal, with incremental indexing if 01xxxxxx
+            int indexing = (b & 0xc0) == 0x40;
+            if(decode_int(p, len, &pos, indexing ? 6 : 4, &index) != 0) {
+                DECODE_FAIL("invalid literal");
+            }
+            if(index) {
+                const char *v;
+                size_t l;
+                if(table_lookup(&d->table, index, &name, &nlen, &v, &l) != 0) {
+                    DECODE_FAIL("invalid index");
+                }
+                d->name.size = 0;
+                if(buffer_append(&d->name, name, nlen) != 0) {
+                    DECODE_FAIL("out of memory");
+                }
+            } else if(decode_string(p, len, &pos, &d->name) != 0) {
+                DECODE_FAIL("invalid name");
+            }
+            if(decode_string(p, len, &pos, &d->value) != 0) {
+                DECODE_FAIL("invalid value");
+            }
+            name = d->name.data ? d->name.data : "";
+            nlen = d->name.size;
+            value = d->value.data ? d->value.data : "";
+            vlen = d->value.size;
+            if(indexing && table_add(&d->table, name, nlen, value, vlen) != 0) {
+                DECODE_FAIL("out of memory");
+            }
+        }
+
+        total += entry_size(nlen, vlen);
+        if(total > d->max_header_list) {
+            DECODE_FAIL("header list too large");
+        }
+        lua_pushlstring(L, name, nlen);
+        lua_rawseti(L, -2, ++n);
+        lua_pushlstring(L, value, vlen);
+        lua_rawseti(L, -2, ++n);
+    }
+    return 1;
+
+fail:
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+}
+
+// decoder:set_max_table_size(n) after our SETTINGS_HEADER_TABLE_SIZE is acked
+static int
+ldecoder_set_max_table_size(lua_State *L) {
+    hpack_decoder_t *d = get_decoder(L);
+    d->settings_size = (size_t)luaL_checkinteger(L, 2);
+    if(d->table.max_size > d->settings_size) {
+        table_set_max(&d->table, d->settings_size);
+    }
+    return 0;
+}
+
+static int
+ldecoder_gc(lua_State *L) {
+    hpack_decoder_t *d = get_decoder(L);
+    table_free(&d->table);
+    buffer_free(&d->name);
+    buffer_free(&d->value);
+    return 0;
+}
+
+// new_decoder([max_header_list_size])
+static int
+lnew_decoder(lua_State *L) {
+    size_t max_list = (size_t)luaL_optinteger(L, 1, DEFAULT_MAX_HEADER_LIST);
+    hpack_decoder_t *d = (hpack_decoder_t*)lua_newuserdata(L, sizeof(hpack_decoder_t));
+    memset(d, 0, sizeof(*d));
+    d->table.max_size = DEFAULT_TABLE_SIZE;
+    d->settings_size = DEFAULT_TABLE_SIZE;
+    d->max_header_list = max_list;
+    luaL_getmetatable(L, HPACK_DECODER_METATABLE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/*
+ * frame
+ */
+
+// pack_frame(type, flags, stream_id, payload) return frame
+static int
+lpack_frame(lua_State *L) {
+    luaL_Buffer b;
+    uint8_t h[FRAME_HEADER_SIZE];
+    size_t len = 0;
+    int type = (int)luaL_checkinteger(L, 1);
+    int flags = (int)luaL_checkinteger(L, 2);
+    uint32_t sid = (uint32_t)luaL_checkinteger(L, 3) & 0x7fffffff;
+    const char *payload = luaL_optlstring(L, 4, "", &len);
+    if(len > 0xffffff) {
+        return luaL_argerror(L, 4, "payload too large");
+    }
+
+    h[0] = (uint8_t)(len >> 16);
+    h[1] = (uint8_t)(len >> 8);
+    h[2] = (uint8_t)len;
+    h[3] = (uint8_t)type;
+    h[4] = (uint8_t)flags;
+    h[5] = (uint8_t)(sid >> 24);
+    h[6] = (uint8_t)(sid >> 16);
+    h[7] = (uint8_t)(sid >> 8);
+    h[8] = (uint8_t)sid;
+
+    luaL_buffinit(L, &b);
+    luaL_addlstring(&b, (const char*)h, FRAME_HEADER_SIZE);
+    luaL_addlstring(&b, payload, len);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+// unpack_frame_header(data, from) return length, type, flags, stream_id;
+// nil if less than a frame header from offset `from`(count from 0)
+static int
+lunpack_frame_header(lua_State *L) {
+    size_t len;
+    const uint8_t *p = (const uint8_t*)luaL_checklstring(L, 1, &len);
+    size_t from = (size_t)luaL_optinteger(L, 2, 0);
+    if(from > len || len - from < FRAME_HEADER_SIZE) {
+        return 0;
+    }
+    p += from;
+    lua_pushinteger(L, ((lua_Integer)p[0] << 16) | (p[1] << 8) | p[2]);
+    lua_pushinteger(L, p[3]);
+    lua_pushinteger(L, p[4]);
+    lua_pushinteger(L, (((lua_Integer)p[5] & 0x7f) << 24) | (p[6] << 16) | (p[7] << 8) | p[8]);
+    return 4;
+}
+
+INLINE static int
+base64url_value(uint8_t c) {
+    if(c >= 'A' && c <= 'Z') return c - 'A';
+    if(c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if(c >= '0' && c <= '9') return c - '0' + 52;
+    if(c == '-' || c == '+') return 62;
+    if(c == '_' || c == '/') return 63;
+    return -1;
+}
+
+// decode_base64url(s) return data, or nil if s is malformed
+// used by HTTP2-Settings of h2c upgrade
+static int
+ldecode_base64url(lua_State *L) {
+    luaL_Buffer b;
+    size_t len, i;
+    uint32_t acc = 0;
+    int nbits = 0;
+    const uint8_t *s = (const uint8_t*)luaL_checklstring(L, 1, &len);
+    while(len > 0 && s[len - 1] == '=') {
+        len--;
+    }
+
+    luaL_buffinit(L, &b);
+    for(i = 0; i < len; i++) {
+        int v = base64url_value(s[i]);
+        if(v < 0) {
+            return 0;
+        }
+        acc = (acc << 6) | (uint32_t)v;
+        nbits += 6;
+        if(nbits >= 8) {
+            nbits -= 8;
+            luaL_addchar(&b, (char)((acc >> nbits) & 0xff));
+        }
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static const struct luaL_Reg h2_module_methods[] = {
+    {"new_encoder", lnew_encoder},
+    {"new_decoder", lnew_decoder},
+    {"pack_frame", lpack_frame},
+    {"unpack_frame_header", lunpack_frame_header},
+    {"decode_base64url", ldecode_base64url},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg encoder_methods[] = {
+    {"encode", lencoder_encode},
+    {"set_max_table_size", lencoder_set_max_table_size},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg decoder_methods[] = {
+    {"decode", ldecoder_decode},
+    {"set_max_table_size", ldecoder_set_max_table_size},
+    {NULL, NULL}
+};
+
+LUALIB_API int luaopen_levent_http_h2_c(lua_State *L) {
+    luaL_checkversion(L);
+    huff_build();
+
+    if(luaL_newmetatable(L, HPACK_ENCODER_METATABLE)) {
+        lua_pushcfunction(L, lencoder_gc);
+        lua_setfield(L, -2, "__gc");
+
+        luaL_newlib(L, encoder_methods);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 1);
+
+    if(luaL_newmetatable(L, HPACK_DECODER_METATABLE)) {
+        lua_pushcfunction(L, ldecoder_gc);
+        lua_setfield(L, -2, "__gc");
+
+        luaL_newlib(L, decoder_methods);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 1);
+
+    luaL_newlib(L, h2_module_methods);
+    lua_pushinteger(L, FRAME_HEADER_SIZE);
+    lua_setfield(L, -2, "FRAME_HEADER_SIZE");
+    return 1;
+}
@@ -0,0 +1,325 @@
+/* lua-http-form.c
+ * percent encoding and application/x-www-form-urlencoded codec
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "levent.h"
+
+#define FORM_BUFFER_METATABLE "http_form_buffer_metatable"
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+INLINE static int
+hex_value(char c) {
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// unreserved characters of rfc3986 are kept as is
+INLINE static int
+is_unreserved(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+        || c == '-' || c == '_' || c == '.' || c == '~';
+}
+
+// growable buffer shared by escape functions as upvalue
+typedef struct form_buffer_t {
+    char *buf;
+    size_t size;
+    size_t cap;
+} form_buffer_t;
+
+// keep buffer larger than this only for one call
+#define MAX_IDLE_FORM_BUFFER (64*1024)
+
+static void
+reserve(lua_State *L, form_buffer_t *b, size_t len) {
+    if(b->size + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 1024;
+        char *buf;
+        while(cap < b->size + len) {
+            cap *= 2;
+        }
+        buf = (char*)realloc(b->buf, cap);
+        if(buf == NULL) {
+            luaL_error(L, "out of memory");
+        }
+        b->buf = buf;
+        b->cap = cap;
+    }
+}
+
+static form_buffer_t*
+buffer_begin(lua_State *L) {
+    form_buffer_t *b = (form_buffer_t*)lua_touserdata(L, lua_upvalueindex(1));
+    b->size = 0;
+    return b;
+}
+
+static void
+buffer_end(lua_State *L, form_buffer_t *b) {
+    lua_pushlstring(L, b->buf, b->size);
+    b->size = 0;
+    if(b->cap > MAX_IDLE_FORM_BUFFER) {
+        free(b->buf);
+        b->buf = NULL;
+        b->cap = 0;
+    }
+}
+
+static void
+add_escaped(lua_State *L, form_buffer_t *b, const char *s, size_t len) {
+    size_t i;
+    char *out;
+    // 3 bytes at most for each byte
+    reserve(L, b, len * 3);
+    out = b->buf + b->size;
+    for(i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if(is_unreserved(c)) {
+            *out++ = c;
+        } else {
+            *out++ = '%';
+            *out++ = hex_digits[c >> 4];
+            *out++ = hex_digits[c & 0xf];
+        }
+    }
+    b->size = out - b->buf;
+}
+
+static void
+add_char(lua_State *L, form_buffer_t *b, char c) {
+    reserve(L, b, 1);
+    b->buf[b->size++] = c;
+}
+
+// decode %XX, and `+` as space if plus is set. malformed escapes are kept
+static void
+add_unescaped(luaL_Buffer *b, const char *s, size_t len, int plus) {
+    size_t i = 0;
+    while(i < len) {
+        char c = s[i];
+        if(c == '%' && i + 2 < len && hex_value(s[i+1]) >= 0 && hex_value(s[i+2]) >= 0) {
+            luaL_addchar(b, (char)(hex_value(s[i+1]) << 4 | hex_value(s[i+2])));
+            i += 3;
+            continue;
+        }
+        luaL_addchar(b, (plus && c == '+') ? ' ' : c);
+        i++;
+    }
+}
+
+// push s unescaped, no copy if there is nothing to decode
+static void
+push_unescaped(lua_State *L, const char *s, size_t len, int plus) {
+    luaL_Buffer b;
+    size_t i;
+    for(i = 0; i < len; i++) {
+        if(s[i] == '%' || (plus && s[i] == '+')) {
+            break;
+        }
+    }
+    if(i == len) {
+        lua_pushlstring(L, s, len);
+        return;
+    }
+    luaL_buffinit(L, &b);
+    luaL_addlstring(&b, s, i);
+    add_unescaped(&b, s + i, len - i, plus);
+    luaL_pushresult(&b);
+}
+
+/*
+ *   args: s
+ *   escape all but unreserved characters as %XX
+ */
+static int
+lescape(lua_State *L) {
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    form_buffer_t *b = buffer_begin(L);
+    add_escaped(L, b, s, len);
+    buffer_end(L, b);
+    return 1;
+}
+
+/*
+ *   args: s, plus
+ *   decode %XX, `+` is decoded as space if plus is true
+ */
+static int
+lunescape(lua_State *L) {
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    push_unescaped(L, s, len, lua_toboolean(L, 2));
+    return 1;
+}
+
+// t[key] = value, repeated keys are collected in an array.
+// key and value are on top of stack and popped
+static void
+add_pair(lua_State *L, int t) {
+    lua_pushvalue(L, -2);
+    lua_rawget(L, t);
+    switch(lua_type(L, -1)) {
+    case LUA_TNIL:
+        lua_pop(L, 1);
+        lua_rawset(L, t);
+        break;
+    case LUA_TTABLE:
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, (lua_Integer)lua_rawlen(L, -2) + 1);
+        lua_pop(L, 2);
+        break;
+    default:
+        // {old, value}
+        lua_createtable(L, 2, 0);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, 1);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, 2);
+        lua_rawset(L, t);
+        break;
+    }
+}
+
+/*
+ *   args: s, t
+ *   decode `k1=v1&k2=v2` into t, `;` separates pairs too. a key without
+ *   `=` has value "", the value of a repeated key is an array
+ *   return t, a new table if t is nil
+ */
+static int
+lparse_query(lua_State *L) {
+    size_t len;
+    const char *s = luaL_optlstring(L, 1, "", &len);
+    const char *end = s + len;
+    if(lua_isnoneornil(L, 2)) {
+        lua_settop(L, 1);
+        lua_newtable(L);
+    } else {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_settop(L, 2);
+    }
+
+    while(s < end) {
+        const char *p = s;
+        const char *eq = NULL;
+        while(p < end && *p != '&' && *p != ';') {
+            if(eq == NULL && *p == '=') {
+                eq = p;
+            }
+            p++;
+        }
+        if(eq == NULL) {
+            eq = p;
+        }
+        if(eq > s) {
+            push_unescaped(L, s, eq - s, 1);
+            if(eq < p) {
+                push_unescaped(L, eq + 1, p - eq - 1, 1);
+            } else {
+                lua_pushliteral(L, "");
+            }
+            add_pair(L, 2);
+        }
+        s = p + 1;
+    }
+    return 1;
+}
+
+/*
+ *   args: t
+ *   encode t as `k1=v1&k2=v2`, an array value is encoded as repeated keys
+ */
+static int
+lencode_query(lua_State *L) {
+    form_buffer_t *b;
+    if(lua_isnoneornil(L, 1)) {
+        lua_pushliteral(L, "");
+        return 1;
+    }
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    b = buffer_begin(L);
+    lua_pushnil(L);
+    while(lua_next(L, 1) != 0) {
+        size_t klen, vlen;
+        const char *k, *v;
+        lua_Integer i, n = 1;
+        int array = lua_type(L, -1) == LUA_TTABLE;
+        // stack: key, value, key string
+        lua_pushvalue(L, -2);
+        k = luaL_tolstring(L, -1, &klen);
+        lua_replace(L, -2);
+        if(array) {
+            n = (lua_Integer)lua_rawlen(L, -2);
+        }
+        for(i = 1; i <= n; i++) {
+            if(array) {
+                lua_rawgeti(L, -2, i);
+            } else {
+                lua_pushvalue(L, -2);
+            }
+            v = luaL_tolstring(L, -1, &vlen);
+            if(b->size > 0) {
+                add_char(L, b, '&');
+            }
+            add_escaped(L, b, k, klen);
+            add_char(L, b, '=');
+            add_escaped(L, b, v, vlen);
+            lua_pop(L, 2);
+        }
+        lua_pop(L, 2);
+    }
+    buffer_end(L, b);
+    return 1;
+}
+
+static int
+lform_buffer_gc(lua_State *L) {
+    form_buffer_t *b = (form_buffer_t*)lua_touserdata(L, 1);
+    free(b->buf);
+    b->buf = NULL;
+    b->cap = 0;
+    return 0;
+}
+
+static const struct luaL_Reg form_module_methods[] = {
+    {"unescape", lunescape},
+    {"parse_query", lparse_query},
+    {NULL, NULL}
+};
+
+// upvalue 1: form buffer
+static const struct luaL_Reg form_buffer_methods[] = {
+    {"escape", lescape},
+    {"encode_query", lencode_query},
+    {NULL, NULL}
+};
+
+LUALIB_API int luaopen_levent_http_form_c(lua_State *L) {
+    luaL_checkversion(L);
+
+    luaL_newlib(L, form_module_methods);
+
+    lua_newuserdata(L, sizeof(form_buffer_t));
+    memset(lua_touserdata(L, -1), 0, sizeof(form_buffer_t));
+    if(luaL_newmetatable(L, FORM_BUFFER_METATABLE)) {
+        lua_pushcfunction(L, lform_buffer_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    luaL_setfuncs(L, form_buffer_methods, 1);
+    return 1;
+}
@@ -0,0 +1,373 @@
+/* lua-http-metrics.c
+ * request counters, latency histograms and gauges of http server, kept in
+ * C so that recording a request costs no allocation
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "levent.h"
+
+#define METRICS_METATABLE "http_metrics_metatable"
+
+// status codes counted one by one
+#define MIN_CODE 100
+#define MAX_CODE 599
+#define NCODE (MAX_CODE - MIN_CODE + 1)
+#define MAX_BUCKETS 64
+
+typedef struct route_metrics_t {
+    // value of label route, NULL if slot is not defined
+    char *name;
+    lua_Integer inflight;
+    uint64_t requests;
+    uint64_t codes[NCODE];
+    // requests by upper bound of latency, not cumulative
+    uint64_t buckets[MAX_BUCKETS];
+    double sum;
+} route_metrics_t;
+
+typedef struct metrics_t {
+    double bounds[MAX_BUCKETS];
+    int nbucket;
+    route_metrics_t **routes;
+    int nroute;
+    lua_Integer conns_open;
+    uint64_t conns_total;
+} metrics_t;
+
+// monotonic time in seconds
+static double
+now_seconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static metrics_t*
+check_metrics(lua_State *L) {
+    return (metrics_t*)luaL_checkudata(L, 1, METRICS_METATABLE);
+}
+
+// route of slot, grow routes if needed
+static route_metrics_t*
+get_route(lua_State *L, metrics_t *m, lua_Integer slot) {
+    luaL_argcheck(L, slot >= 0 && slot < 0x10000, 2, "bad slot");
+    if(slot >= m->nroute) {
+        int n = m->nroute ? m->nroute : 16;
+        route_metrics_t **routes;
+        while(n <= slot) {
+            n *= 2;
+        }
+        routes = (route_metrics_t**)realloc(m->routes, n * sizeof(route_metrics_t*));
+        if(routes == NULL) {
+            luaL_error(L, "out of memory");
+        }
+        memset(routes + m->nroute, 0, (n - m->nroute) * sizeof(route_metrics_t*));
+        m->routes = routes;
+        m->nroute = n;
+    }
+    if(m->routes[slot] == NULL) {
+        route_metrics_t *r = (route_metrics_t*)calloc(1, sizeof(route_metrics_t));
+        if(r == NULL) {
+            luaL_error(L, "out of memory");
+        }
+        m->routes[slot] = r;
+    }
+    return m->routes[slot];
+}
+
+// new(bounds) bounds: upper bounds of latency buckets in seconds, ascending
+static int
+lnew(lua_State *L) {
+    metrics_t *m;
+    int i, n;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    n = (int)lua_rawlen(L, 1);
+    luaL_argcheck(L, n > 0 && n <= MAX_BUCKETS, 1, "bad number of buckets");
+
+    m = (metrics_t*)lua_newuserdata(L, sizeof(metrics_t));
+    memset(m, 0, sizeof(*m));
+    for(i = 0; i < n; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        m->bounds[i] = luaL_checknumber(L, -1);
+        lua_pop(L, 1);
+        luaL_argcheck(L, i == 0 || m->bounds[i] > m->bounds[i-1], 1, "buckets not ascending");
+    }
+    m->nbucket = n;
+    luaL_getmetatable(L, METRICS_METATABLE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+// metrics:define(slot, name) name a slot, only named slots are exposed
+static int
+ldefine(lua_State *L) {
+    metrics_t *m = check_metrics(L);
+    route_metrics_t *r = get_route(L, m, luaL_checkinteger(L, 2));
+    size_t len;
+    const char *name = luaL_checklstring(L, 3, &len);
+    char *copy = (char*)malloc(len + 1);
+    if(copy == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+    memcpy(copy, name, len + 1);
+    free(r->name);
+    r->name = copy;
+    return 0;
+}
+
+// metrics:start(slot) -> start time to pass to finish
+static int
+lstart(lua_State *L) {
+    metrics_t *m = check_metrics(L);
+    route_metrics_t *r = get_route(L, m, luaL_checkinteger(L, 2));
+    r->inflight++;
+    lua_pushnumber(L, now_seconds());
+    return 1;
+}
+
+// metrics:finish(slot, code, start) -> seconds elapsed
+static int
+lfinish(lua_State *L) {
+    metrics_t *m = check_metrics(L);
+    route_metrics_t *r = get_route(L, m, luaL_checkinteger(L, 2));
+    lua_Integer code = luaL_checkinteger(L, 3);
+    double elapsed = now_seconds() - luaL_checknumber(L, 4);
+    int i;
+
+    if(elapsed < 0) {
+        elapsed = 0;
+    }
+    r->inflight--;
+    r->requests++;
+    if(code >= MIN_CODE && code <= MAX_CODE) {
+        r->codes[code - MIN_CODE]++;
+    }
+    r->sum += elapsed;
+    for(i = 0; i < m->nbucket; i++) {
+        if(elapsed <= m->bounds[i]) {
+            r->buckets[i]++;
+            break;
+        }
+    }
+    lua_pushnumber(L, elapsed);
+    return 1;
+}
+
+// metrics:connection(delta) +1 for an accepted connection, -1 for a closed
+static int
+lconnection(lua_State *L) {
+    metrics_t *m = check_metrics(L);
+    lua_Integer delta = luaL_checkinteger(L, 2);
+    m->conns_open += delta;
+    if(delta > 0) {
+        m->conns_total += delta;
+    }
+    return 0;
+}
+
+// metrics:get(slot) -> {requests = , inflight = , sum = , codes = {[code] = n}}
+static int
+lget(lua_State *L) {
+    metrics_t *m = check_metrics(L);
+    lua_Integer slot = luaL_checkinteger(L, 2);
+    route_metrics_t *r;
+    int i;
+    if(slot < 0 || slot >= m->nroute || m->routes[slot] == NULL) {
+        return 0;
+    }
+    r = m->routes[slot];
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, (lua_Integer)r->requests);
+    lua_setfield(L, -2, "requests");
+    lua_pushinteger(L, r->inflight);
+    lua_setfield(L, -2, "inflight");
+    lua_pushnumber(L, r->sum);
+    lua_setfield(L, -2, "sum");
+    lua_newtable(L);
+    for(i = 0; i < NCODE; i++) {
+        if(r->codes[i] > 0) {
+            lua_pushinteger(L, (lua_Integer)r->codes[i]);
+            lua_rawseti(L, -2, i + MIN_CODE);
+        }
+    }
+    lua_setfield(L, -2, "codes");
+    return 1;
+}
+
+// label value with \, " and newline escaped
+static void
+add_label(luaL_Buffer *b, const char *s) {
+    for(; *s; s++) {
+        switch(*s) {
+            case '\\': luaL_addstring(b, "\\\\"); break;
+            case '"': luaL_addstring(b, "\\\""); break;
+            case '\n': luaL_addstring(b, "\\n"); break;
+            default: luaL_addchar(b, *s); break;
+        }
+    }
+}
+
+static void
+add_fmt(luaL_Buffer *b, const char *fmt, ...) {
+    char buf[128];
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if(n > 0) {
+        luaL_addlstring(b, buf, n < (int)sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+    }
+}
+
+// start a sample: prefix_name{route="..."
+static void
+add_sample(luaL_Buffer *b, const char *prefix, const char *name, const route_metrics_t *r) {
+    luaL_addstring(b, prefix);
+    luaL_addstring(b, name);
+    luaL_addstring(b, "{route=\"");
+    add_label(b, r->name);
+    luaL_addchar(b, '"');
+}
+
+static void
+add_header(luaL_Buffer *b, const char *prefix, const char *name, const char *type, const char *help) {
+    luaL_addstring(b, "# HELP ");
+    luaL_addstring(b, prefix);
+    luaL_addstring(b, name);
+    luaL_addchar(b, ' ');
+    luaL_addstring(b, help);
+    luaL_addstring(b, "\n# TYPE ");
+    luaL_addstring(b, prefix);
+    luaL_addstring(b, name);
+    luaL_addchar(b, ' ');
+    luaL_addstring(b, type);
+    luaL_addchar(b, '\n');
+}
+
+// metrics:expose(prefix) -> metrics in prometheus text format
+static int
+lexpose(lua_State *L) {
+    metrics_t *m = check_metrics(L);
+    const char *prefix = luaL_optstring(L, 2, "levent_");
+    luaL_Buffer b;
+    int i, j;
+
+    luaL_buffinit(L, &b);
+
+    add_header(&b, prefix, "http_requests_total", "counter", "Requests served by route and status code.");
+    for(i = 0; i < m->nroute; i++) {
+        route_metrics_t *r = m->routes[i];
+        if(r == NULL || r->name == NULL) {
+            continue;
+        }
+        for(j = 0; j < NCODE; j++) {
+            if(r->codes[j] > 0) {
+                add_sample(&b, prefix, "http_requests_total", r);
+                add_fmt(&b, ",code=\"%d\"} %llu\n", j + MIN_CODE, (unsigned long long)r->codes[j]);
+            }
+        }
+    }
+
+    add_header(&b, prefix, "http_requests_in_flight", "gauge", "Requests being handled by route.");
+    for(i = 0; i < m->nroute; i++) {
+        route_metrics_t *r = m->routes[i];
+        if(r == NULL || r->name == NULL) {
+            continue;
+        }
+        add_sample(&b, prefix, "http_requests_in_flight", r);
+        add_fmt(&b, "} %lld\n", (long long)r->inflight);
+    }
+
+    add_header(&b, prefix, "http_request_duration_seconds", "histogram", "Time to handle a request by route.");
+    for(i = 0; i < m->nroute; i++) {
+        route_metrics_t *r = m->routes[i];
+        uint64_t count = 0;
+        if(r == NULL || r->name == NULL) {
+            continue;
+        }
+        for(j = 0; j < m->nbucket; j++) {
+            count += r->buckets[j];
+            add_sample(&b, prefix, "http_request_duration_seconds_bucket", r);
+            add_fmt(&b, ",le=\"%g\"} %llu\n", m->bounds[j], (unsigned long long)count);
+        }
+        add_sample(&b, prefix, "http_request_duration_seconds_bucket", r);
+        add_fmt(&b, ",le=\"+Inf\"} %llu\n", (unsigned long long)r->requests);
+        add_sample(&b, prefix, "http_request_duration_seconds_sum", r);
+        add_fmt(&b, "} %.9g\n", r->sum);
+        add_sample(&b, prefix, "http_request_duration_seconds_count", r);
+        add_fmt(&b, "} %llu\n", (unsigned long long)r->requests);
+    }
+
+    add_header(&b, prefix, "http_connections_open", "gauge", "Connections open.");
+    luaL_addstring(&b, prefix);
+    add_fmt(&b, "http_connections_open %lld\n", (long long)m->conns_open);
+    add_header(&b, prefix, "http_connections_total", "counter", "Connections accepted.");
+    luaL_addstring(&b, prefix);
+    add_fmt(&b, "http_connections_total %llu\n", (unsigned long long)m->conns_total);
+
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static int
+lmetrics_gc(lua_State *L) {
+    metrics_t *m = check_metrics(L);
+    int i;
+    for(i = 0; i < m->nroute; i++) {
+        if(m->routes[i]) {
+            free(m->routes[i]->name);
+            free(m->routes[i]);
+        }
+    }
+    free(m->routes);
+    m->routes = NULL;
+    m->nroute = 0;
+    return 0;
+}
+
+static const struct luaL_Reg metrics_methods[] = {
+    {"define", ldefine},
+    {"start", lstart},
+    {"finish", lfinish},
+    {"connection", lconnection},
+    {"get", lget},
+    {"expose", lexpose},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg metrics_module_methods[] = {
+    {"new", lnew},
+    {NULL, NULL}
+};
+
+LUALIB_API int luaopen_levent_http_metrics_c(lua_State *L) {
+    luaL_checkversion(L);
+
+    if(luaL_newmetatable(L, METRICS_METATABLE)) {
+        luaL_newlib(L, metrics_methods);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, lmetrics_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_pop(L, 1);
+
+    luaL_newlib(L, metrics_module_methods);
+    return 1;
+}
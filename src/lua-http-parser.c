@@ -3,11 +3,17 @@
  * date: 2014-09-19
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include "http_parser.h"
 
 #include "levent.h"
 
 #define HTTP_PARSER_METATABLE "http_parser_metatable"
+#define PACK_BUFFER_METATABLE "http_pack_buffer_metatable"
 
 #define FIELD_TYPE "is_request"
 #define FIELD_METHOD "method"
@@ -21,112 +27,326 @@
 #define FIELD_HTTP_MAJOR "http_major"
 #define FIELD_HTTP_MINOR "http_minor"
 #define FIELD_COMPLETE "complete"
+#define FIELD_HEADERS_COMPLETE "headers_complete"
+
+// well-known header names, pushed from interned strings instead of
+// creating them from the raw bytes every time
+typedef struct known_header_t {
+    const char *name;
+    size_t len;
+} known_header_t;
+
+#define KNOWN_HEADER(name) {name, sizeof(name) - 1}
+
+static const known_header_t known_headers[] = {
+    KNOWN_HEADER("Host"),
+    KNOWN_HEADER("User-Agent"),
+    KNOWN_HEADER("Accept"),
+    KNOWN_HEADER("Accept-Charset"),
+    KNOWN_HEADER("Accept-Encoding"),
+    KNOWN_HEADER("Accept-Language"),
+    KNOWN_HEADER("Accept-Ranges"),
+    KNOWN_HEADER("Age"),
+    KNOWN_HEADER("Allow"),
+    KNOWN_HEADER("Authorization"),
+    KNOWN_HEADER("Cache-Control"),
+    KNOWN_HEADER("Connection"),
+    KNOWN_HEADER("Content-Disposition"),
+    KNOWN_HEADER("Content-Encoding"),
+    KNOWN_HEADER("Content-Language"),
+    KNOWN_HEADER("Content-Length"),
+    KNOWN_HEADER("Content-Range"),
+    KNOWN_HEADER("Content-Type"),
+    KNOWN_HEADER("Cookie"),
+    KNOWN_HEADER("Date"),
+    KNOWN_HEADER("ETag"),
+    KNOWN_HEADER("Expect"),
+    KNOWN_HEADER("Expires"),
+    KNOWN_HEADER("If-Match"),
+    KNOWN_HEADER("If-Modified-Since"),
+    KNOWN_HEADER("If-None-Match"),
+    KNOWN_HEADER("If-Range"),
+    KNOWN_HEADER("If-Unmodified-Since"),
+    KNOWN_HEADER("Keep-Alive"),
+    KNOWN_HEADER("Last-Modified"),
+    KNOWN_HEADER("Location"),
+    KNOWN_HEADER("Origin"),
+    KNOWN_HEADER("Pragma"),
+    KNOWN_HEADER("Proxy-Connection"),
+    KNOWN_HEADER("Range"),
+    KNOWN_HEADER("Referer"),
+    KNOWN_HEADER("Sec-WebSocket-Accept"),
+    KNOWN_HEADER("Sec-WebSocket-Extensions"),
+    KNOWN_HEADER("Sec-WebSocket-Key"),
+    KNOWN_HEADER("Sec-WebSocket-Protocol"),
+    KNOWN_HEADER("Sec-WebSocket-Version"),
+    KNOWN_HEADER("Server"),
+    KNOWN_HEADER("Set-Cookie"),
+    KNOWN_HEADER("TE"),
+    KNOWN_HEADER("Trailer"),
+    KNOWN_HEADER("Transfer-Encoding"),
+    KNOWN_HEADER("Upgrade"),
+    KNOWN_HEADER("Vary"),
+    KNOWN_HEADER("Via"),
+    KNOWN_HEADER("WWW-Authenticate"),
+    KNOWN_HEADER("X-Forwarded-For"),
+    KNOWN_HEADER("X-Forwarded-Proto"),
+    KNOWN_HEADER("X-Real-IP"),
+    KNOWN_HEADER("X-Requested-With"),
+};
+
+#define KNOWN_HEADERS_COUNT (sizeof(known_headers)/sizeof(known_headers[0]))
+
+// scratch buffer larger than this is released after each message
+#define MAX_IDLE_SCRATCH (16*1024)
+
+enum {
+    CB_NONE = 0,
+    CB_FIELD,
+    CB_VALUE,
+};
+
+typedef struct span_t {
+    size_t off;
+    size_t len;
+} span_t;
+
+typedef struct header_t {
+    span_t field;
+    span_t value;
+} header_t;
+
+typedef struct lhttp_parser_t {
+    http_parser parser;
+
+    // stack index of message table and interned names during execute
+    int msg;
+    int names;
+    // stack index of body chunk list in stream mode, 0 otherwise
+    int chunks;
+
+    // next response has no body, e.g. response of HEAD
+    int skip_body;
+
+    int is_request;
+    int has_url;
+    int has_status;
+    span_t url;
+    span_t status;
+
+    // last header callback, a field follows a value starts a new header
+    int last_cb;
+    int nheader;
+    int header_cap;
+    header_t *headers;
+
+    // url, status and headers are accumulated here
+    char *buf;
+    size_t size;
+    size_t cap;
+} lhttp_parser_t;
+
+static int
+scratch_append(lhttp_parser_t *p, span_t *span, const char *at, size_t length) {
+    if(p->size + length > p->cap) {
+        size_t cap = p->cap ? p->cap : 1024;
+        char *buf;
+        while(cap < p->size + length) {
+            cap *= 2;
+        }
+        buf = (char*)realloc(p->buf, cap);
+        if(buf == NULL) {
+            return -1;
+        }
+        p->buf = buf;
+        p->cap = cap;
+    }
+    if(span->len == 0) {
+        span->off = p->size;
+    }
+    memcpy(p->buf + p->size, at, length);
+    p->size += length;
+    span->len += length;
+    return 0;
+}
+
+static void
+scratch_reset(lhttp_parser_t *p) {
+    p->is_request = 0;
+    p->has_url = 0;
+    p->has_status = 0;
+    memset(&p->url, 0, sizeof(p->url));
+    memset(&p->status, 0, sizeof(p->status));
+    p->last_cb = CB_NONE;
+    p->nheader = 0;
+    p->size = 0;
+    if(p->cap > MAX_IDLE_SCRATCH) {
+        free(p->buf);
+        p->buf = NULL;
+        p->cap = 0;
+    }
+}
+
+static void
+push_header_name(lua_State *L, lhttp_parser_t *p, span_t *field) {
+    const char *name = p->buf + field->off;
+    size_t i;
+    for(i = 0; i < KNOWN_HEADERS_COUNT; i++) {
+        const known_header_t *known = &known_headers[i];
+        if(known->len == field->len && memcmp(known->name, name, field->len) == 0) {
+            lua_rawgeti(L, p->names, (lua_Integer)i + 1);
+            return;
+        }
+    }
+    lua_pushlstring(L, name, field->len);
+}
+
+// set collected headers into msg.headers, create it if not exists
+static void
+set_headers(lua_State *L, lhttp_parser_t *p) {
+    int i;
+    lua_getfield(L, p->msg, FIELD_HEADERS);
+    if(!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, p->nheader);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, p->msg, FIELD_HEADERS);
+    }
+
+    for(i = 0; i < p->nheader; i++) {
+        header_t *h = &p->headers[i];
+        push_header_name(L, p, &h->field);
+        lua_pushlstring(L, p->buf + h->value.off, h->value.len);
+        lua_rawset(L, -3);
+    }
+    lua_pop(L, 1);
+    p->nheader = 0;
+    p->last_cb = CB_NONE;
+}
 
 // parser cb
 static int
 on_message_begin(http_parser *parser) {
+    lhttp_parser_t *p = (lhttp_parser_t*)parser;
     lua_State *L = (lua_State*)parser->data;
+    scratch_reset(p);
     lua_pushboolean(L, 0);
-    lua_setfield(L, -2, FIELD_COMPLETE);
+    lua_setfield(L, p->msg, FIELD_COMPLETE);
     return 0;
 }
 
 static int
 on_url(http_parser *parser, const char *at, size_t length) {
-    lua_State *L = (lua_State*)parser->data;
-    lua_getfield(L, -1, FIELD_REQUEST_URL);
-    if(lua_isnil(L, -1)) {
-        lua_pop(L, 1);
-        lua_pushlstring(L, at, length);
-    } else {
-        lua_pushlstring(L, at, length);
-        lua_concat(L, 2);
-    }
-    lua_setfield(L, -2, FIELD_REQUEST_URL);
-
+    lhttp_parser_t *p = (lhttp_parser_t*)parser;
     // only request callback on_url
-    lua_pushboolean(L, 1);
-    lua_setfield(L, -2, FIELD_TYPE);
-    return 0;
+    p->is_request = 1;
+    p->has_url = 1;
+    return scratch_append(p, &p->url, at, length);
 }
 
 static int
 on_status(http_parser *parser, const char *at, size_t length) {
-    lua_State *L = (lua_State*)parser->data;
-    lua_getfield(L, -1, FIELD_STATUS);
-    if(lua_isnil(L, -1)) {
-        lua_pop(L, 1);
-        lua_pushlstring(L, at, length);
-    } else {
-        lua_pushlstring(L, at, length);
-        lua_concat(L, 2);
-    }
-    lua_setfield(L, -2, FIELD_STATUS);
-    return 0;
+    lhttp_parser_t *p = (lhttp_parser_t*)parser;
+    p->has_status = 1;
+    return scratch_append(p, &p->status, at, length);
 }
 
 static int
 on_header_field(http_parser *parser, const char *at, size_t length) {
-    lua_State *L = (lua_State*)parser->data;
-    int len = luaL_len(L, -1);
-    if(len % 2 == 0) {
-        lua_pushlstring(L, at, length);
-        lua_rawseti(L, -2, len+1);
-    } else {
-        lua_rawgeti(L, -1, len);
-        lua_pushlstring(L, at, length);
-        lua_concat(L, 2);
-        lua_rawseti(L, -2, len);
+    lhttp_parser_t *p = (lhttp_parser_t*)parser;
+    if(p->last_cb != CB_FIELD) {
+        if(p->nheader == p->header_cap) {
+            int cap = p->header_cap ? p->header_cap * 2 : 16;
+            header_t *headers = (header_t*)realloc(p->headers, cap * sizeof(header_t));
+            if(headers == NULL) {
+                return -1;
+            }
+            p->headers = headers;
+            p->header_cap = cap;
+        }
+        memset(&p->headers[p->nheader], 0, sizeof(header_t));
+        p->nheader++;
+        p->last_cb = CB_FIELD;
     }
-    return 0;
+    return scratch_append(p, &p->headers[p->nheader - 1].field, at, length);
 }
 
 static int
 on_header_value(http_parser *parser, const char *at, size_t length) {
-    lua_State *L = (lua_State*)parser->data;
-    int len = luaL_len(L, -1);
-    if(len % 2 != 0) {
-        lua_pushlstring(L, at, length);
-        lua_rawseti(L, -2, len+1);
-    } else {
-        lua_rawgeti(L, -1, len);
-        lua_pushlstring(L, at, length);
-        lua_concat(L, 2);
-        lua_rawseti(L, -2, len);
+    lhttp_parser_t *p = (lhttp_parser_t*)parser;
+    if(p->nheader == 0) {
+        return -1;
     }
-    return 0;
+    p->last_cb = CB_VALUE;
+    return scratch_append(p, &p->headers[p->nheader - 1].value, at, length);
 }
 
 static int
 on_headers_complete(http_parser *parser) {
-    int is_request;
+    lhttp_parser_t *p = (lhttp_parser_t*)parser;
     lua_State *L = (lua_State*)parser->data;
+    int tidx = p->msg;
+
     // http version
     lua_pushinteger(L, parser->http_major);
-    lua_setfield(L, -2, FIELD_HTTP_MAJOR);
+    lua_setfield(L, tidx, FIELD_HTTP_MAJOR);
 
     lua_pushinteger(L, parser->http_minor);
-    lua_setfield(L, -2, FIELD_HTTP_MINOR);
+    lua_setfield(L, tidx, FIELD_HTTP_MINOR);
+
+    if(p->has_url) {
+        lua_pushlstring(L, p->buf + p->url.off, p->url.len);
+        lua_setfield(L, tidx, FIELD_REQUEST_URL);
+    }
+
+    if(p->has_status) {
+        lua_pushlstring(L, p->buf + p->status.off, p->status.len);
+        lua_setfield(L, tidx, FIELD_STATUS);
+    }
 
     // optional field
-    lua_getfield(L, -1, FIELD_TYPE);
-    is_request = lua_toboolean(L, -1);
-    lua_pop(L, 1);
-    if(is_request) {
+    if(p->is_request) {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, tidx, FIELD_TYPE);
         lua_pushstring(L, http_method_str(parser->method));
-        lua_setfield(L, -2, FIELD_METHOD);
+        lua_setfield(L, tidx, FIELD_METHOD);
     } else {
         // response
         lua_pushinteger(L, parser->status_code);
-        lua_setfield(L, -2, FIELD_STATUS_CODE);
+        lua_setfield(L, tidx, FIELD_STATUS_CODE);
+    }
+
+    set_headers(L, p);
+
+    lua_pushboolean(L, http_should_keep_alive(parser));
+    lua_setfield(L, tidx, FIELD_KEEPALIVE);
+
+    lua_pushboolean(L, 1);
+    lua_setfield(L, tidx, FIELD_HEADERS_COMPLETE);
+
+    // stream mode: let caller decide how to consume the body
+    if(p->chunks) {
+        http_parser_pause(parser, 1);
+    }
+
+    // returning 1 tells http_parser that message has no body
+    if(p->skip_body) {
+        p->skip_body = 0;
+        return 1;
     }
     return 0;
 }
 
 static int
 on_body(http_parser *parser, const char *at, size_t length) {
+    lhttp_parser_t *p = (lhttp_parser_t*)parser;
     lua_State *L = (lua_State*)parser->data;
-    lua_getfield(L, -1, FIELD_BODY);
+    if(p->chunks) {
+        lua_pushlstring(L, at, length);
+        lua_rawseti(L, p->chunks, (lua_Integer)lua_rawlen(L, p->chunks) + 1);
+        return 0;
+    }
+    lua_getfield(L, p->msg, FIELD_BODY);
     if(lua_isnil(L, -1)) {
         lua_pop(L, 1);
         lua_pushlstring(L, at, length);
@@ -134,43 +354,20 @@ on_body(http_parser *parser, const char *at, size_t length) {
         lua_pushlstring(L, at, length);
         lua_concat(L, 2);
     }
-    lua_setfield(L, -2, FIELD_BODY);
+    lua_setfield(L, p->msg, FIELD_BODY);
     return 0;
 }
 
 static int
 on_message_complete(http_parser *parser) {
-    lua_State *L;
-    int i, tidx, len;
-
-    L = (lua_State*)parser->data;
-    tidx = lua_absindex(L, -1);
-
-    // compose headers
-    len = luaL_len(L, tidx);
-    if(len % 2 != 0) {
-        return 0;
-    }
-
-    L = (lua_State*)parser->data;
-    lua_getfield(L, tidx, FIELD_HEADERS);
-    if(!lua_istable(L, -1)) {
-        lua_pop(L, 1);
-        lua_newtable(L);
-        lua_pushvalue(L, -1);
-        lua_setfield(L, tidx, FIELD_HEADERS);
-    }
+    lhttp_parser_t *p = (lhttp_parser_t*)parser;
+    lua_State *L = (lua_State*)parser->data;
+    int tidx = p->msg;
 
-    for(i=1; i<len; i=i+2) {
-        lua_rawgeti(L, tidx, i); // header field
-        lua_rawgeti(L, tidx, i+1); // header value
-        lua_settable(L, -3);
-        lua_pushnil(L);
-        lua_rawseti(L, tidx, i);
-        lua_pushnil(L);
-        lua_rawseti(L, tidx, i + 1);
+    // trailing headers of chunked message
+    if(p->nheader > 0) {
+        set_headers(L, p);
     }
-    lua_pop(L, 1); // pop headers table
 
     // upgrade
     if(parser->upgrade) {
@@ -220,11 +417,14 @@ set_url_field(lua_State *L, const char* field, enum http_parser_url_fields uf,
     }
 }
 
+// parse_url(url, is_connect, t)
+// fields are set to t if given, so a message table gets them without an
+// intermediate table
 static int
 lparse_url(lua_State *L) {
     size_t len;
     const char *buf;
-    int is_connect, port;
+    int is_connect;
     struct http_parser_url u;
 
     buf = luaL_checklstring(L, 1, &len);
@@ -237,7 +437,11 @@ lparse_url(lua_State *L) {
     if(http_parser_parse_url(buf, len, is_connect, &u) != 0) {
         return 0;
     }
-    lua_createtable(L, 0, UF_MAX);
+    if(lua_istable(L, 3)) {
+        lua_settop(L, 3);
+    } else {
+        lua_createtable(L, 0, UF_MAX);
+    }
     set_url_field(L, "schema", UF_SCHEMA, &u, buf, -2);
     set_url_field(L, "host", UF_HOST, &u, buf, -2);
     set_url_field(L, "request_path", UF_PATH, &u, buf, -2);
@@ -266,16 +470,341 @@ lhttp_errno_description(lua_State *L) {
     return 1;
 }
 
-INLINE static http_parser*
+// status lines are preformatted
+typedef struct status_t {
+    int code;
+    const char *text;
+    const char *line;
+    size_t len;
+} status_t;
+
+#define STATUS(code, text) {code, text, "HTTP/1.1 " #code " " text "\r\n", sizeof("HTTP/1.1 " #code " " text "\r\n") - 1}
+
+static const status_t statuses[] = {
+    STATUS(100, "Continue"),
+    STATUS(101, "Switching Protocols"),
+    STATUS(200, "OK"),
+    STATUS(201, "Created"),
+    STATUS(202, "Accepted"),
+    STATUS(203, "Non-Authoritative Information"),
+    STATUS(204, "No Content"),
+    STATUS(205, "Reset Content"),
+    STATUS(206, "Partial Content"),
+    STATUS(300, "Multiple Choices"),
+    STATUS(301, "Moved Permanently"),
+    STATUS(302, "Found"),
+    STATUS(303, "See Other"),
+    STATUS(304, "Not Modified"),
+    STATUS(305, "Use Proxy"),
+    STATUS(307, "Temporary Redirect"),
+    STATUS(308, "Permanent Redirect"),
+    STATUS(400, "Bad Request"),
+    STATUS(401, "Unauthorized"),
+    STATUS(402, "Payment Required"),
+    STATUS(403, "Forbidden"),
+    STATUS(404, "Not Found"),
+    STATUS(405, "Method Not Allowed"),
+    STATUS(406, "Not Acceptable"),
+    STATUS(407, "Proxy Authentication Required"),
+    STATUS(408, "Request Time-out"),
+    STATUS(409, "Conflict"),
+    STATUS(410, "Gone"),
+    STATUS(411, "Length Required"),
+    STATUS(412, "Precondition Failed"),
+    STATUS(413, "Request Entity Too Large"),
+    STATUS(414, "Request-URI Too Large"),
+    STATUS(415, "Unsupported Media Type"),
+    STATUS(416, "Requested range not satisfiable"),
+    STATUS(417, "Expectation Failed"),
+    STATUS(422, "Unprocessable Entity"),
+    STATUS(426, "Upgrade Required"),
+    STATUS(428, "Precondition Required"),
+    STATUS(429, "Too Many Requests"),
+    STATUS(431, "Request Header Fields Too Large"),
+    STATUS(451, "Unavailable For Legal Reasons"),
+    STATUS(500, "Internal Server Error"),
+    STATUS(501, "Not Implemented"),
+    STATUS(502, "Bad Gateway"),
+    STATUS(503, "Service Unavailable"),
+    STATUS(504, "Gateway Time-out"),
+    STATUS(505, "HTTP Version not supported"),
+};
+
+#define STATUS_COUNT (sizeof(statuses)/sizeof(statuses[0]))
+
+// reason phrase of a code not in statuses, by its class
+static const char *status_classes[] = {
+    "Informational",
+    "Success",
+    "Redirection",
+    "Client Error",
+    "Server Error",
+};
+
+INLINE static int
+valid_status(int code) {
+    return code >= 100 && code <= 599;
+}
+
+static const status_t*
+find_status(int code) {
+    size_t i;
+    for(i = 0; i < STATUS_COUNT; i++) {
+        if(statuses[i].code == code) {
+            return &statuses[i];
+        }
+    }
+    return NULL;
+}
+
+// "Date: <rfc1123-date>\r\n", formatted at most once per second
+static time_t date_sec = -1;
+static char date_line[64];
+static size_t date_len;
+
+static void
+update_date(time_t sec) {
+    struct tm tm;
+    size_t n;
+    if(sec == date_sec) {
+        return;
+    }
+#ifdef _WIN32
+    gmtime_s(&tm, &sec);
+#else
+    gmtime_r(&sec, &tm);
+#endif
+    n = strftime(date_line, sizeof(date_line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    date_len = n;
+    date_sec = sec;
+}
+
+// growable buffer shared by pack functions as upvalue
+typedef struct pack_buffer_t {
+    char *buf;
+    size_t size;
+    size_t cap;
+} pack_buffer_t;
+
+// keep buffer larger than this only for one message
+#define MAX_IDLE_PACK_BUFFER (64*1024)
+
+static void
+pack_append(lua_State *L, pack_buffer_t *b, const char *data, size_t len) {
+    if(b->size + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 1024;
+        char *buf;
+        while(cap < b->size + len) {
+            cap *= 2;
+        }
+        buf = (char*)realloc(b->buf, cap);
+        if(buf == NULL) {
+            luaL_error(L, "out of memory");
+        }
+        b->buf = buf;
+        b->cap = cap;
+    }
+    memcpy(b->buf + b->size, data, len);
+    b->size += len;
+}
+
+#define pack_literal(L, b, s) pack_append(L, b, "" s, sizeof(s) - 1)
+
+static pack_buffer_t*
+pack_begin(lua_State *L) {
+    pack_buffer_t *b = (pack_buffer_t*)lua_touserdata(L, lua_upvalueindex(1));
+    b->size = 0;
+    return b;
+}
+
+static void
+pack_end(lua_State *L, pack_buffer_t *b) {
+    lua_pushlstring(L, b->buf, b->size);
+    b->size = 0;
+    if(b->cap > MAX_IDLE_PACK_BUFFER) {
+        free(b->buf);
+        b->buf = NULL;
+        b->cap = 0;
+    }
+}
+
+// write `k: v\r\n` for all headers, return whether Date is given
+static int
+pack_headers(lua_State *L, pack_buffer_t *b, int index) {
+    int has_date = 0;
+    if(lua_isnoneornil(L, index)) {
+        return 0;
+    }
+    luaL_checktype(L, index, LUA_TTABLE);
+    lua_pushnil(L);
+    while(lua_next(L, index) != 0) {
+        size_t klen, vlen;
+        const char *k, *v;
+        if(lua_type(L, -2) != LUA_TSTRING) {
+            luaL_error(L, "header name should be string");
+        }
+        k = lua_tolstring(L, -2, &klen);
+        v = luaL_tolstring(L, -1, &vlen);
+        if(klen == 4 && memcmp(k, "Date", 4) == 0) {
+            has_date = 1;
+        }
+        pack_append(L, b, k, klen);
+        pack_literal(L, b, ": ");
+        pack_append(L, b, v, vlen);
+        pack_literal(L, b, "\r\n");
+        lua_pop(L, 2);
+    }
+    return has_date;
+}
+
+static void
+pack_body(lua_State *L, pack_buffer_t *b, int index) {
+    size_t len;
+    const char *body;
+    pack_literal(L, b, "\r\n");
+    if(!lua_isnoneornil(L, index)) {
+        body = luaL_checklstring(L, index, &len);
+        pack_append(L, b, body, len);
+    }
+}
+
+// pack_response(code, headers, body, now)
+// Date header is added from now (seconds) if headers has no Date
+static int
+lpack_response(lua_State *L) {
+    int code = (int)luaL_checkinteger(L, 1);
+    const status_t *status = find_status(code);
+    pack_buffer_t *b;
+    luaL_argcheck(L, valid_status(code), 1, "bad status code");
+
+    b = pack_begin(L);
+    if(status) {
+        pack_append(L, b, status->line, status->len);
+    } else {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", code, status_classes[code / 100 - 1]);
+        pack_append(L, b, line, (size_t)n);
+    }
+    if(!pack_headers(L, b, 2) && !lua_isnoneornil(L, 4)) {
+        update_date((time_t)luaL_checknumber(L, 4));
+        pack_append(L, b, date_line, date_len);
+    }
+    pack_body(L, b, 3);
+    pack_end(L, b);
+    return 1;
+}
+
+// http_date(now) return rfc1123-date of now (seconds), from the same cache
+// as Date header of pack_response
+static int
+lhttp_date(lua_State *L) {
+    update_date((time_t)luaL_checknumber(L, 1));
+    // without "Date: " and "\r\n"
+    lua_pushlstring(L, date_line + 6, date_len - 8);
+    return 1;
+}
+
+// pack_request(method, path, headers, body)
+static int
+lpack_request(lua_State *L) {
+    size_t mlen, plen;
+    const char *method = luaL_checklstring(L, 1, &mlen);
+    const char *path = luaL_checklstring(L, 2, &plen);
+    pack_buffer_t *b = pack_begin(L);
+
+    pack_append(L, b, method, mlen);
+    pack_literal(L, b, " ");
+    pack_append(L, b, path, plen);
+    pack_literal(L, b, " HTTP/1.1\r\n");
+    pack_headers(L, b, 3);
+    pack_body(L, b, 4);
+    pack_end(L, b);
+    return 1;
+}
+
+static int
+lpack_buffer_gc(lua_State *L) {
+    pack_buffer_t *b = (pack_buffer_t*)lua_touserdata(L, 1);
+    free(b->buf);
+    b->buf = NULL;
+    b->cap = 0;
+    return 0;
+}
+
+// status_text(code) return reason phrase, nil if code isn't 100~599
+static int
+lstatus_text(lua_State *L) {
+    int code = (int)luaL_checkinteger(L, 1);
+    const status_t *status = find_status(code);
+    if(status) {
+        lua_pushstring(L, status->text);
+    } else if(valid_status(code)) {
+        lua_pushstring(L, status_classes[code / 100 - 1]);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+INLINE static int
+is_lower(char c) {
+    return c >= 'a' && c <= 'z';
+}
+
+INLINE static int
+is_upper(char c) {
+    return c >= 'A' && c <= 'Z';
+}
+
+// Content-Type for content-type: upper case the first letter of each
+// dash separated word, lower case the rest. canonical key is returned as is
+static int
+lcanonical_header_key(lua_State *L) {
+    size_t len, i;
+    char buf[256];
+    char *out;
+    int upper = 1;
+    const char *key = luaL_checklstring(L, 1, &len);
+
+    for(i = 0; i < len; i++) {
+        char c = key[i];
+        if((upper && is_lower(c)) || (!upper && is_upper(c))) {
+            break;
+        }
+        upper = (c == '-');
+    }
+    if(i == len) {
+        lua_settop(L, 1);
+        return 1;
+    }
+
+    out = len <= sizeof(buf) ? buf : (char*)lua_newuserdata(L, len);
+    memcpy(out, key, i);
+    for(; i < len; i++) {
+        char c = key[i];
+        if(upper && is_lower(c)) {
+            c = c - 'a' + 'A';
+        } else if(!upper && is_upper(c)) {
+            c = c - 'A' + 'a';
+        }
+        out[i] = c;
+        upper = (c == '-');
+    }
+    lua_pushlstring(L, out, len);
+    return 1;
+}
+
+INLINE static lhttp_parser_t*
 get_http_parser(lua_State *L, int index) {
-    http_parser *parser = (http_parser*) luaL_checkudata(L, index, HTTP_PARSER_METATABLE);
-    return parser;
+    lhttp_parser_t *p = (lhttp_parser_t*) luaL_checkudata(L, index, HTTP_PARSER_METATABLE);
+    return p;
 }
 
 static int lnew(lua_State *L) {
     enum http_parser_type type = luaL_optinteger(L, 1, HTTP_BOTH);
-    http_parser *parser = (http_parser*) lua_newuserdata(L, sizeof(http_parser));
-    http_parser_init(parser, type);
+    lhttp_parser_t *p = (lhttp_parser_t*) lua_newuserdata(L, sizeof(lhttp_parser_t));
+    memset(p, 0, sizeof(*p));
+    http_parser_init(&p->parser, type);
     luaL_getmetatable(L, HTTP_PARSER_METATABLE);
     lua_setmetatable(L, -2);
     return 1;
@@ -287,12 +816,26 @@ static const struct luaL_Reg http_module_methods[] = {
     {"http_errno_name", lhttp_errno_name},
     {"http_errno_description", lhttp_errno_description},
     {"new", lnew},
+    {"status_text", lstatus_text},
+    {"canonical_header_key", lcanonical_header_key},
+    {"http_date", lhttp_date},
+    {NULL, NULL}
+};
+
+// upvalue 1: pack buffer
+static const struct luaL_Reg http_pack_methods[] = {
+    {"pack_response", lpack_response},
+    {"pack_request", lpack_request},
     {NULL, NULL}
 };
 
+// parser:execute(data, from, msg [, chunks])
+// with chunks given (stream mode), parser pauses once headers complete,
+// and body pieces are appended to chunks instead of msg.body
 static int lparser_execute(lua_State *L) {
     size_t len;
-    http_parser *parser = get_http_parser(L, 1);
+    lhttp_parser_t *p = get_http_parser(L, 1);
+    http_parser *parser = &p->parser;
     const char *data = luaL_checklstring(L, 2, &len);
     size_t from = (size_t)luaL_optinteger(L, 3, 0);
     luaL_checktype(L, 4, LUA_TTABLE);
@@ -301,6 +844,13 @@ static int lparser_execute(lua_State *L) {
         return luaL_argerror(L, 3, "should be less than length of argument #2");
     }
 
+    p->msg = 4;
+    p->names = lua_upvalueindex(1);
+    p->chunks = 0;
+    if(!lua_isnoneornil(L, 5)) {
+        luaL_checktype(L, 5, LUA_TTABLE);
+        p->chunks = 5;
+    }
     parser->data = (void*)L;
     lua_pushinteger(L, http_parser_execute(parser, &settings, data + from, len - from));
     if(HPE_PAUSED == parser->http_errno) {
@@ -313,8 +863,44 @@ static int lparser_execute(lua_State *L) {
     return 2;
 }
 
+// parser:skip_body() the next response has no body whatever its headers
+// say, call it before parsing response of a HEAD request
+static int lparser_skip_body(lua_State *L) {
+    lhttp_parser_t *p = get_http_parser(L, 1);
+    p->skip_body = 1;
+    return 0;
+}
+
+// parser:reset() make parser ready for a new connection
+static int lparser_reset(lua_State *L) {
+    lhttp_parser_t *p = get_http_parser(L, 1);
+    http_parser_init(&p->parser, (enum http_parser_type)p->parser.type);
+    p->skip_body = 0;
+    scratch_reset(p);
+    return 0;
+}
+
+static int lparser_gc(lua_State *L) {
+    lhttp_parser_t *p = get_http_parser(L, 1);
+    free(p->buf);
+    free(p->headers);
+    p->buf = NULL;
+    p->headers = NULL;
+    p->cap = 0;
+    p->header_cap = 0;
+    return 0;
+}
+
+static const struct luaL_Reg http_parser_mt[] = {
+    {"__gc", lparser_gc},
+    {NULL, NULL}
+};
+
+// upvalue 1: interned known header names
 static const struct luaL_Reg http_parser_metamethods[] = {
     {"execute", lparser_execute},
+    {"skip_body", lparser_skip_body},
+    {"reset", lparser_reset},
     {NULL, NULL}
 };
 
@@ -322,12 +908,30 @@ LUALIB_API int luaopen_levent_http_c(lua_State *L) {
     luaL_checkversion(L);
 
     if(luaL_newmetatable(L, HTTP_PARSER_METATABLE)) {
-        luaL_newlib(L, http_parser_metamethods);
+        size_t i;
+        luaL_setfuncs(L, http_parser_mt, 0);
+
+        luaL_newlibtable(L, http_parser_metamethods);
+        lua_createtable(L, KNOWN_HEADERS_COUNT, 0);
+        for(i = 0; i < KNOWN_HEADERS_COUNT; i++) {
+            lua_pushlstring(L, known_headers[i].name, known_headers[i].len);
+            lua_rawseti(L, -2, (lua_Integer)i + 1);
+        }
+        luaL_setfuncs(L, http_parser_metamethods, 1);
         lua_setfield(L, -2, "__index");
     }
     lua_pop(L, 1);
 
     luaL_newlib(L, http_module_methods);
+
+    lua_newuserdata(L, sizeof(pack_buffer_t));
+    memset(lua_touserdata(L, -1), 0, sizeof(pack_buffer_t));
+    if(luaL_newmetatable(L, PACK_BUFFER_METATABLE)) {
+        lua_pushcfunction(L, lpack_buffer_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    luaL_setfuncs(L, http_pack_methods, 1);
     ADD_CONSTANT(L, HTTP_REQUEST);
     ADD_CONSTANT(L, HTTP_RESPONSE);
     ADD_CONSTANT(L, HTTP_BOTH);
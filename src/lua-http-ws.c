@@ -0,0 +1,206 @@
+/* lua-http-ws.c
+ * websocket (RFC 6455) frame header and payload masking
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "levent.h"
+
+#define MASK_KEY_SIZE 4
+
+// xor len bytes of src with key into dst, a machine word at a time, which
+// compilers turn into vector instructions where available
+static void
+apply_mask(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t key[MASK_KEY_SIZE]) {
+    uint8_t k[8];
+    uint64_t kw;
+    size_t i;
+    for(i = 0; i < sizeof(k); i++) {
+        k[i] = key[i & 3];
+    }
+    memcpy(&kw, k, sizeof(kw));
+
+    for(i = 0; i + sizeof(kw) <= len; i += sizeof(kw)) {
+        uint64_t w;
+        memcpy(&w, src + i, sizeof(w));
+        w ^= kw;
+        memcpy(dst + i, &w, sizeof(w));
+    }
+    for(; i < len; i++) {
+        dst[i] = src[i] ^ k[i & 7];
+    }
+}
+
+static const uint8_t *
+check_key(lua_State *L, int idx) {
+    size_t len;
+    const char *key = luaL_checklstring(L, idx, &len);
+    luaL_argcheck(L, len == MASK_KEY_SIZE, idx, "mask key must be 4 bytes");
+    return (const uint8_t*)key;
+}
+
+// length of header of a payload of len bytes
+static size_t
+header_size(uint64_t len, int masked) {
+    size_t n = len < 126 ? 2 : (len <= 0xffff ? 4 : 10);
+    return masked ? n + MASK_KEY_SIZE : n;
+}
+
+static size_t
+write_header(uint8_t *h, int fin, int opcode, uint64_t len, const uint8_t *key) {
+    size_t n = 2;
+    int i;
+    h[0] = (uint8_t)((fin ? 0x80 : 0) | (opcode & 0x0f));
+    h[1] = key ? 0x80 : 0;
+    if(len < 126) {
+        h[1] |= (uint8_t)len;
+    } else if(len <= 0xffff) {
+        h[1] |= 126;
+        h[2] = (uint8_t)(len >> 8);
+        h[3] = (uint8_t)len;
+        n = 4;
+    } else {
+        h[1] |= 127;
+        for(i = 0; i < 8; i++) {
+            h[2 + i] = (uint8_t)(len >> (56 - 8 * i));
+        }
+        n = 10;
+    }
+    if(key) {
+        memcpy(h + n, key, MASK_KEY_SIZE);
+        n += MASK_KEY_SIZE;
+    }
+    return n;
+}
+
+// mask(data, key, from, len) return data[from, from + len) xor key
+// from counts from 0, len defaults to the rest of data. masking is its own
+// inverse, it unmasks as well
+static int
+lmask(lua_State *L) {
+    size_t len;
+    const uint8_t *data = (const uint8_t*)luaL_checklstring(L, 1, &len);
+    const uint8_t *key = check_key(L, 2);
+    size_t from = (size_t)luaL_optinteger(L, 3, 0);
+    size_t n;
+    luaL_Buffer b;
+    luaL_argcheck(L, from <= len, 3, "out of range");
+    n = (size_t)luaL_optinteger(L, 4, (lua_Integer)(len - from));
+    luaL_argcheck(L, n <= len - from, 4, "out of range");
+
+    apply_mask((uint8_t*)luaL_buffinitsize(L, &b, n), data + from, n, key);
+    luaL_pushresultsize(&b, n);
+    return 1;
+}
+
+// pack_frame(opcode, payload, fin, key) return frame
+// fin defaults to true, payload is masked by key if given
+static int
+lpack_frame(lua_State *L) {
+    size_t len, hlen;
+    int opcode = (int)luaL_checkinteger(L, 1);
+    const uint8_t *payload = (const uint8_t*)luaL_optlstring(L, 2, "", &len);
+    int fin = lua_isnoneornil(L, 3) || lua_toboolean(L, 3);
+    const uint8_t *key = lua_isnoneornil(L, 4) ? NULL : check_key(L, 4);
+    uint8_t *p;
+    luaL_Buffer b;
+
+    hlen = header_size(len, key != NULL);
+    p = (uint8_t*)luaL_buffinitsize(L, &b, hlen + len);
+    write_header(p, fin, opcode, len, key);
+    if(key) {
+        apply_mask(p + hlen, payload, len, key);
+    } else {
+        memcpy(p + hlen, payload, len);
+    }
+    luaL_pushresultsize(&b, hlen + len);
+    return 1;
+}
+
+// pack_header(opcode, length, fin, key) return header of a frame whose
+// payload of length bytes is sent separately, masked by key if given
+static int
+lpack_header(lua_State *L) {
+    uint8_t h[2 + 8 + MASK_KEY_SIZE];
+    int opcode = (int)luaL_checkinteger(L, 1);
+    lua_Integer len = luaL_checkinteger(L, 2);
+    int fin = lua_isnoneornil(L, 3) || lua_toboolean(L, 3);
+    const uint8_t *key = lua_isnoneornil(L, 4) ? NULL : check_key(L, 4);
+    size_t n;
+    luaL_argcheck(L, len >= 0, 2, "negative length");
+
+    n = write_header(h, fin, opcode, (uint64_t)len, key);
+    lua_pushlstring(L, (const char*)h, n);
+    return 1;
+}
+
+// unpack_frame_header(data, from) return fin, opcode, length, header size, key
+// from counts from 0, key is nil for unmasked frames. return nothing if data
+// holds less than a frame header, nil and error on a malformed header
+static int
+lunpack_frame_header(lua_State *L) {
+    size_t len, hlen;
+    const uint8_t *p = (const uint8_t*)luaL_checklstring(L, 1, &len);
+    size_t from = (size_t)luaL_optinteger(L, 2, 0);
+    uint64_t plen;
+    int masked, i;
+    if(from > len || len - from < 2) {
+        return 0;
+    }
+    p += from;
+    len -= from;
+
+    if(p[0] & 0x70) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "reserved bits set");
+        return 2;
+    }
+    masked = p[1] & 0x80;
+    plen = p[1] & 0x7f;
+    hlen = plen < 126 ? 2 : (plen == 126 ? 4 : 10);
+    if(masked) {
+        hlen += MASK_KEY_SIZE;
+    }
+    if(len < hlen) {
+        return 0;
+    }
+    if(plen == 126) {
+        plen = ((uint64_t)p[2] << 8) | p[3];
+    } else if(plen == 127) {
+        plen = 0;
+        for(i = 0; i < 8; i++) {
+            plen = (plen << 8) | p[2 + i];
+        }
+        if(plen >> 63) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "bad payload length");
+            return 2;
+        }
+    }
+
+    lua_pushboolean(L, p[0] & 0x80);
+    lua_pushinteger(L, p[0] & 0x0f);
+    lua_pushinteger(L, (lua_Integer)plen);
+    lua_pushinteger(L, (lua_Integer)hlen);
+    if(masked) {
+        lua_pushlstring(L, (const char*)p + hlen - MASK_KEY_SIZE, MASK_KEY_SIZE);
+    } else {
+        lua_pushnil(L);
+    }
+    return 5;
+}
+
+static const struct luaL_Reg ws_module_methods[] = {
+    {"mask", lmask},
+    {"pack_frame", lpack_frame},
+    {"pack_header", lpack_header},
+    {"unpack_frame_header", lunpack_frame_header},
+    {NULL, NULL}
+};
+
+LUALIB_API int luaopen_levent_http_ws_c(lua_State *L) {
+    luaL_checkversion(L);
+    luaL_newlib(L, ws_module_methods);
+    return 1;
+}
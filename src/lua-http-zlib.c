@@ -0,0 +1,240 @@
+/* lua-http-zlib.c
+ * gzip and deflate content coding by zlib
+ */
+
+#include <string.h>
+#include <zlib.h>
+
+#include "levent.h"
+
+#define DEFLATER_METATABLE "http_zlib_deflater_metatable"
+
+// window bits of formats: gzip wrapper, zlib wrapper (http "deflate"), and
+// both detected by header when inflating
+#define GZIP_WINDOW_BITS 31
+#define DEFLATE_WINDOW_BITS 15
+#define AUTO_WINDOW_BITS 47
+
+typedef struct deflater_t {
+    z_stream zs;
+    int active;
+} deflater_t;
+
+static int
+window_bits(lua_State *L, int idx, const char *def) {
+    const char *format = luaL_optstring(L, idx, def);
+    if(strcmp(format, "gzip") == 0) {
+        return GZIP_WINDOW_BITS;
+    }
+    if(strcmp(format, "deflate") == 0) {
+        return DEFLATE_WINDOW_BITS;
+    }
+    if(strcmp(format, "auto") == 0) {
+        return AUTO_WINDOW_BITS;
+    }
+    return luaL_argerror(L, idx, "unknown format");
+}
+
+static int
+check_level(lua_State *L, int idx) {
+    int level = (int)luaL_optinteger(L, idx, Z_DEFAULT_COMPRESSION);
+    luaL_argcheck(L, level >= Z_DEFAULT_COMPRESSION && level <= Z_BEST_COMPRESSION, idx, "bad level");
+    return level;
+}
+
+static int
+push_zerror(lua_State *L, z_stream *zs, int ret) {
+    lua_pushnil(L);
+    lua_pushstring(L, zs->msg ? zs->msg : zError(ret));
+    return 2;
+}
+
+// run deflate until input is consumed, and for a flush until output is
+// drained, appending output to b
+static int
+run_deflate(z_stream *zs, luaL_Buffer *b, int flush) {
+    int ret;
+    do {
+        zs->next_out = (Bytef*)luaL_prepbuffer(b);
+        zs->avail_out = LUAL_BUFFERSIZE;
+        ret = deflate(zs, flush);
+        if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            return ret;
+        }
+        luaL_addsize(b, LUAL_BUFFERSIZE - zs->avail_out);
+    } while(zs->avail_out == 0 || (flush == Z_NO_FLUSH && zs->avail_in > 0));
+    return Z_OK;
+}
+
+// compress(data, level, format) -> string
+// format: "gzip" (default) or "deflate"
+static int
+lcompress(lua_State *L) {
+    size_t len;
+    const char *data = luaL_checklstring(L, 1, &len);
+    int level = check_level(L, 2);
+    int wbits = window_bits(L, 3, "gzip");
+    z_stream zs;
+    luaL_Buffer b;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    ret = deflateInit2(&zs, level, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY);
+    if(ret != Z_OK) {
+        return push_zerror(L, &zs, ret);
+    }
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = (uInt)len;
+
+    luaL_buffinit(L, &b);
+    ret = run_deflate(&zs, &b, Z_FINISH);
+    deflateEnd(&zs);
+    if(ret != Z_OK) {
+        return push_zerror(L, &zs, ret);
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+// uncompress(data, format, max) -> string
+// format: "auto" (default), "gzip" or "deflate"; fail if output exceeds max
+static int
+luncompress(lua_State *L) {
+    size_t len;
+    const char *data = luaL_checklstring(L, 1, &len);
+    int wbits = window_bits(L, 2, "auto");
+    lua_Integer max = luaL_optinteger(L, 3, 0);
+    z_stream zs;
+    luaL_Buffer b;
+    size_t total = 0;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    ret = inflateInit2(&zs, wbits);
+    if(ret != Z_OK) {
+        return push_zerror(L, &zs, ret);
+    }
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = (uInt)len;
+
+    luaL_buffinit(L, &b);
+    do {
+        zs.next_out = (Bytef*)luaL_prepbuffer(&b);
+        zs.avail_out = LUAL_BUFFERSIZE;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if(ret != Z_OK && ret != Z_STREAM_END) {
+            if(ret == Z_BUF_ERROR) {
+                ret = Z_DATA_ERROR;
+                zs.msg = "truncated data";
+            }
+            break;
+        }
+        luaL_addsize(&b, LUAL_BUFFERSIZE - zs.avail_out);
+        total += LUAL_BUFFERSIZE - zs.avail_out;
+        if(max > 0 && total > (size_t)max) {
+            inflateEnd(&zs);
+            lua_pushnil(L);
+            lua_pushliteral(L, "data too large");
+            return 2;
+        }
+    } while(ret != Z_STREAM_END);
+    inflateEnd(&zs);
+    if(ret != Z_STREAM_END) {
+        return push_zerror(L, &zs, ret);
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+// deflater(level, format) -> streaming compressor
+static int
+ldeflater(lua_State *L) {
+    int level = check_level(L, 1);
+    int wbits = window_bits(L, 2, "gzip");
+    deflater_t *d = (deflater_t*)lua_newuserdata(L, sizeof(deflater_t));
+    int ret;
+
+    memset(d, 0, sizeof(*d));
+    ret = deflateInit2(&d->zs, level, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY);
+    if(ret != Z_OK) {
+        return push_zerror(L, &d->zs, ret);
+    }
+    d->active = 1;
+    luaL_getmetatable(L, DEFLATER_METATABLE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static const char *const flush_modes[] = {"none", "sync", "finish", NULL};
+static const int flush_values[] = {Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FINISH};
+
+// deflater:deflate(data, mode) -> compressed string, may be empty
+// mode: "none" (default) buffers output, "sync" flushes all of it out to
+// a byte boundary, "finish" ends the stream
+static int
+ldeflater_deflate(lua_State *L) {
+    deflater_t *d = (deflater_t*)luaL_checkudata(L, 1, DEFLATER_METATABLE);
+    size_t len;
+    const char *data = luaL_optlstring(L, 2, "", &len);
+    int flush = flush_values[luaL_checkoption(L, 3, "none", flush_modes)];
+    luaL_Buffer b;
+    int ret;
+
+    if(!d->active) {
+        return luaL_error(L, "deflater is finished");
+    }
+    d->zs.next_in = (Bytef*)data;
+    d->zs.avail_in = (uInt)len;
+
+    luaL_buffinit(L, &b);
+    ret = run_deflate(&d->zs, &b, flush);
+    // input isn't kept by zlib beyond this call
+    d->zs.next_in = NULL;
+    if(ret != Z_OK) {
+        return push_zerror(L, &d->zs, ret);
+    }
+    if(flush == Z_FINISH) {
+        deflateEnd(&d->zs);
+        d->active = 0;
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static int
+ldeflater_close(lua_State *L) {
+    deflater_t *d = (deflater_t*)luaL_checkudata(L, 1, DEFLATER_METATABLE);
+    if(d->active) {
+        deflateEnd(&d->zs);
+        d->active = 0;
+    }
+    return 0;
+}
+
+static const struct luaL_Reg deflater_methods[] = {
+    {"deflate", ldeflater_deflate},
+    {"close", ldeflater_close},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg zlib_module_methods[] = {
+    {"compress", lcompress},
+    {"uncompress", luncompress},
+    {"deflater", ldeflater},
+    {NULL, NULL}
+};
+
+LUALIB_API int luaopen_levent_http_zlib_c(lua_State *L) {
+    luaL_checkversion(L);
+
+    if(luaL_newmetatable(L, DEFLATER_METATABLE)) {
+        luaL_newlib(L, deflater_methods);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, ldeflater_close);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_pop(L, 1);
+
+    luaL_newlib(L, zlib_module_methods);
+    return 1;
+}
@@ -0,0 +1,369 @@
+/* lua-router.c
+ * radix tree for http routes
+ */
+
+// pattern:
+//  /users              static path
+//  /users/:id/files    `:id` matches one non-empty path segment
+//  /static/*path       `*path` matches the rest of path, must be the last
+//
+// static match is preferred to param match, which is preferred to wildcard
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "levent.h"
+
+#define ROUTER_METATABLE "router_metatable"
+#define MAX_PARAMS 32
+
+typedef struct rnode_t {
+    // static part matched by this node, empty for param and wildcard node
+    char *prefix;
+    size_t len;
+
+    // static children, their prefixes start with distinct bytes
+    struct rnode_t **children;
+    int nchild;
+    int cap;
+
+    // child matching one path segment, and child matching the rest
+    struct rnode_t *param;
+    struct rnode_t *wild;
+
+    // name of param or wildcard node
+    char *name;
+    size_t name_len;
+
+    // route id, 0 if no route ends here
+    int id;
+} rnode_t;
+
+typedef struct router_t {
+    rnode_t *root;
+    int nroute;
+} router_t;
+
+typedef struct capture_t {
+    const rnode_t *node;
+    const char *value;
+    size_t len;
+} capture_t;
+
+static rnode_t*
+node_new(const char *prefix, size_t len) {
+    rnode_t *n = (rnode_t*)calloc(1, sizeof(rnode_t));
+    if(n == NULL) {
+        return NULL;
+    }
+    if(len > 0) {
+        n->prefix = (char*)malloc(len);
+        if(n->prefix == NULL) {
+            free(n);
+            return NULL;
+        }
+        memcpy(n->prefix, prefix, len);
+        n->len = len;
+    }
+    return n;
+}
+
+static void
+node_free(rnode_t *n) {
+    int i;
+    if(n == NULL) {
+        return;
+    }
+    for(i = 0; i < n->nchild; i++) {
+        node_free(n->children[i]);
+    }
+    node_free(n->param);
+    node_free(n->wild);
+    free(n->children);
+    free(n->prefix);
+    free(n->name);
+    free(n);
+}
+
+static int
+node_add_child(rnode_t *n, rnode_t *child) {
+    if(n->nchild == n->cap) {
+        int cap = n->cap ? n->cap * 2 : 4;
+        rnode_t **children = (rnode_t**)realloc(n->children, cap * sizeof(rnode_t*));
+        if(children == NULL) {
+            return -1;
+        }
+        n->children = children;
+        n->cap = cap;
+    }
+    n->children[n->nchild++] = child;
+    return 0;
+}
+
+INLINE static rnode_t*
+node_find_child(const rnode_t *n, char c) {
+    int i;
+    for(i = 0; i < n->nchild; i++) {
+        if(n->children[i]->prefix[0] == c) {
+            return n->children[i];
+        }
+    }
+    return NULL;
+}
+
+// get param or wildcard child named `name`, create it if not exists
+static rnode_t*
+node_named_child(rnode_t **slot, const char *name, size_t len, const char **err) {
+    rnode_t *n = *slot;
+    if(n) {
+        if(n->name_len != len || memcmp(n->name, name, len) != 0) {
+            *err = "conflict param name";
+            return NULL;
+        }
+        return n;
+    }
+
+    n = node_new(NULL, 0);
+    if(n == NULL || (n->name = (char*)malloc(len + 1)) == NULL) {
+        free(n);
+        *err = "out of memory";
+        return NULL;
+    }
+    memcpy(n->name, name, len);
+    n->name[len] = 0;
+    n->name_len = len;
+    *slot = n;
+    return n;
+}
+
+// insert rest of pattern p under n, whose prefix is matched already
+static int
+node_insert(rnode_t *n, const char *p, size_t len, int id, const char **err) {
+    size_t i, k;
+    rnode_t *child;
+
+    if(len == 0) {
+        if(n->id) {
+            *err = "repeated route";
+            return -1;
+        }
+        n->id = id;
+        return 0;
+    }
+
+    if(p[0] == ':') {
+        for(i = 1; i < len && p[i] != '/'; i++);
+        if(i == 1) {
+            *err = "empty param name";
+            return -1;
+        }
+        child = node_named_child(&n->param, p + 1, i - 1, err);
+        if(child == NULL) {
+            return -1;
+        }
+        return node_insert(child, p + i, len - i, id, err);
+    }
+
+    if(p[0] == '*') {
+        if(len == 1 || memchr(p, '/', len) != NULL) {
+            *err = "wildcard should be named and be the last";
+            return -1;
+        }
+        child = node_named_child(&n->wild, p + 1, len - 1, err);
+        if(child == NULL) {
+            return -1;
+        }
+        return node_insert(child, p + len, 0, id, err);
+    }
+
+    // static part ends at the next param or wildcard
+    for(i = 0; i < len && p[i] != ':' && p[i] != '*'; i++);
+
+    child = node_find_child(n, p[0]);
+    if(child == NULL) {
+        child = node_new(p, i);
+        if(child == NULL || node_add_child(n, child) != 0) {
+            node_free(child);
+            *err = "out of memory";
+            return -1;
+        }
+        return node_insert(child, p + i, len - i, id, err);
+    }
+
+    for(k = 0; k < i && k < child->len && child->prefix[k] == p[k]; k++);
+    if(k < child->len) {
+        // split child at k: mid takes the common prefix
+        int j;
+        rnode_t *mid = node_new(child->prefix, k);
+        char *rest = (char*)malloc(child->len - k);
+        if(mid == NULL || rest == NULL || node_add_child(mid, child) != 0) {
+            node_free(mid);
+            free(rest);
+            *err = "out of memory";
+            return -1;
+        }
+        memcpy(rest, child->prefix + k, child->len - k);
+        free(child->prefix);
+        child->prefix = rest;
+        child->len -= k;
+        for(j = 0; j < n->nchild; j++) {
+            if(n->children[j] == child) {
+                n->children[j] = mid;
+                break;
+            }
+        }
+        child = mid;
+    }
+    return node_insert(child, p + k, len - k, id, err);
+}
+
+// match rest of path under n, whose prefix is matched already
+static int
+node_match(const rnode_t *n, const char *path, size_t len, capture_t *caps, int *ncap) {
+    const rnode_t *child;
+    int id;
+
+    if(len == 0) {
+        if(n->id) {
+            return n->id;
+        }
+    } else {
+        child = node_find_child(n, path[0]);
+        if(child && child->len <= len && memcmp(child->prefix, path, child->len) == 0) {
+            id = node_match(child, path + child->len, len - child->len, caps, ncap);
+            if(id) {
+                return id;
+            }
+        }
+
+        if(n->param && *ncap < MAX_PARAMS) {
+            size_t i;
+            for(i = 0; i < len && path[i] != '/'; i++);
+            if(i > 0) {
+                int saved = *ncap;
+                caps[saved].node = n->param;
+                caps[saved].value = path;
+                caps[saved].len = i;
+                *ncap = saved + 1;
+                id = node_match(n->param, path + i, len - i, caps, ncap);
+                if(id) {
+                    return id;
+                }
+                *ncap = saved;
+            }
+        }
+    }
+
+    if(n->wild && n->wild->id && *ncap < MAX_PARAMS) {
+        caps[*ncap].node = n->wild;
+        caps[*ncap].value = path;
+        caps[*ncap].len = len;
+        (*ncap)++;
+        return n->wild->id;
+    }
+    return 0;
+}
+
+INLINE static router_t*
+get_router(lua_State *L, int index) {
+    router_t *r = (router_t*)luaL_checkudata(L, index, ROUTER_METATABLE);
+    if(r->root == NULL) {
+        luaL_error(L, "router is released");
+    }
+    return r;
+}
+
+// tree:insert(pattern) return route id, or nil, err
+static int
+linsert(lua_State *L) {
+    size_t len;
+    const char *err = NULL;
+    router_t *r = get_router(L, 1);
+    const char *pattern = luaL_checklstring(L, 2, &len);
+    if(len == 0 || pattern[0] != '/') {
+        lua_pushnil(L);
+        lua_pushliteral(L, "pattern should start with /");
+        return 2;
+    }
+
+    if(node_insert(r->root, pattern, len, r->nroute + 1, &err) != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+    r->nroute++;
+    lua_pushinteger(L, r->nroute);
+    return 1;
+}
+
+// tree:match(path) return route id, params; or nil if no route matched
+static int
+lmatch(lua_State *L) {
+    size_t len;
+    int i, id, ncap = 0;
+    capture_t caps[MAX_PARAMS];
+    router_t *r = get_router(L, 1);
+    const char *path = luaL_checklstring(L, 2, &len);
+
+    id = node_match(r->root, path, len, caps, &ncap);
+    if(id == 0) {
+        return 0;
+    }
+
+    lua_pushinteger(L, id);
+    lua_createtable(L, 0, ncap);
+    for(i = 0; i < ncap; i++) {
+        lua_pushlstring(L, caps[i].node->name, caps[i].node->name_len);
+        lua_pushlstring(L, caps[i].value, caps[i].len);
+        lua_rawset(L, -3);
+    }
+    return 2;
+}
+
+static int
+lrelease(lua_State *L) {
+    router_t *r = (router_t*)luaL_checkudata(L, 1, ROUTER_METATABLE);
+    node_free(r->root);
+    r->root = NULL;
+    return 0;
+}
+
+static int
+lnew(lua_State *L) {
+    router_t *r = (router_t*)lua_newuserdata(L, sizeof(router_t));
+    r->nroute = 0;
+    r->root = node_new(NULL, 0);
+    if(r->root == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+    luaL_getmetatable(L, ROUTER_METATABLE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static const struct luaL_Reg router_module_methods[] = {
+    {"new", lnew},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg router_methods[] = {
+    {"insert", linsert},
+    {"match", lmatch},
+    {NULL, NULL}
+};
+
+LUALIB_API int luaopen_levent_http_router_c(lua_State *L) {
+    luaL_checkversion(L);
+
+    if(luaL_newmetatable(L, ROUTER_METATABLE)) {
+        lua_pushcfunction(L, lrelease);
+        lua_setfield(L, -2, "__gc");
+
+        luaL_newlib(L, router_methods);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 1);
+
+    luaL_newlib(L, router_module_methods);
+    return 1;
+}
@@ -32,14 +32,31 @@ Module interface:
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE 1
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#define HAVE_SENDFILE 1
+#endif
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define HAVE_ZEROCOPY 1
+#endif
+
 #include "levent.h"
 
 #define SOCKET_METATABLE "socket_metatable"
+
+// max buffers gathered by one sendv
+#define MAX_IOVEC 64
 /*
 #if !defined(NI_MAXHOST)
 #define NI_MAXHOST 1025
@@ -55,6 +72,10 @@ typedef struct _sock_t {
     int family;
     int type;
     int protocol;
+#ifdef HAVE_ZEROCOPY
+    // id of next zerocopy send, kernel counts them the same way
+    unsigned int zc_next;
+#endif
 #ifdef _WIN32
     // default: libev suppose you input operating-system file handle on windows
     int handle;
@@ -85,6 +106,9 @@ _setsock(lua_State *L, int fd, int family, int type, int protocol) {
     nsock->family = family;
     nsock->type = type;
     nsock->protocol = protocol;
+#ifdef HAVE_ZEROCOPY
+    nsock->zc_next = 0;
+#endif
 #ifdef _WIN32
     nsock->handle = _open_osfhandle(fd, 0);
 #endif
@@ -333,6 +357,252 @@ _sock_send(lua_State *L) {
     return 1;
 }
 
+#ifdef HAVE_SENDFILE
+/*
+ *   args: file fd, offset, count
+ *   send count bytes of file from offset by kernel, return bytes sent
+ */
+static int
+_sock_sendfile(lua_State *L) {
+    socket_t *sock = _getsock(L, 1);
+    int fd = luaL_checkinteger(L, 2);
+    off_t offset = (off_t)luaL_checkinteger(L, 3);
+    size_t count = (size_t)luaL_checkinteger(L, 4);
+#if defined(__linux__)
+    ssize_t nwrite = sendfile(sock->fd, fd, &offset, count);
+    if(nwrite < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, errno);
+        return 2;
+    }
+    lua_pushinteger(L, nwrite);
+#else
+    // part of data may be sent even if it fails with EAGAIN
+    off_t nwrite = 0;
+#if defined(__APPLE__)
+    int ret;
+    nwrite = count;
+    ret = sendfile(fd, sock->fd, offset, &nwrite, NULL, 0);
+#else
+    int ret = sendfile(fd, sock->fd, offset, count, NULL, &nwrite, 0);
+#endif
+    if(ret < 0 && (nwrite == 0 || errno != EAGAIN)) {
+        lua_pushnil(L);
+        lua_pushinteger(L, errno);
+        return 2;
+    }
+    lua_pushinteger(L, nwrite);
+#endif
+    return 1;
+}
+#endif
+
+#ifdef HAVE_ZEROCOPY
+/*
+ *   args: data, from
+ *   send by MSG_ZEROCOPY, SO_ZEROCOPY must be set on socket.
+ *   return bytes sent and id of this send, data must be kept unchanged
+ *   until the id is reported by recv_zerocopy
+ */
+static int
+_sock_send_zerocopy(lua_State *L) {
+    socket_t *sock = _getsock(L, 1);
+    size_t len;
+    const char* buf = luaL_checklstring(L, 2, &len);
+    size_t from = luaL_optinteger(L, 3, 0);
+    int nwrite;
+
+    if (len <= from) {
+        return luaL_argerror(L, 3, "should be less than length of argument #2");
+    }
+
+    nwrite = send(sock->fd, buf+from, len - from, MSG_NOSIGNAL | MSG_ZEROCOPY);
+    if(nwrite < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, errno);
+        return 2;
+    }
+    lua_pushinteger(L, nwrite);
+    lua_pushinteger(L, sock->zc_next++);
+    return 2;
+}
+
+/*
+ *   read one completion from error queue,
+ *   return range [lo, hi] of completed send ids, and whether kernel copied data
+ */
+static int
+_sock_recv_zerocopy(lua_State *L) {
+    socket_t *sock = _getsock(L, 1);
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if(recvmsg(sock->fd, &msg, MSG_ERRQUEUE) < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, errno);
+        return 2;
+    }
+
+    cm = CMSG_FIRSTHDR(&msg);
+    if(cm == NULL) {
+        lua_pushnil(L);
+        lua_pushinteger(L, EAGAIN);
+        return 2;
+    }
+
+    serr = (struct sock_extended_err*)CMSG_DATA(cm);
+    if(serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, serr->ee_errno ? (int)serr->ee_errno : EIO);
+        return 2;
+    }
+
+    lua_pushinteger(L, serr->ee_info);
+    lua_pushinteger(L, serr->ee_data);
+    lua_pushboolean(L, serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+    return 3;
+}
+#endif
+
+/*
+ *   args: table of strings, from
+ *   gather strings in table into one send, from: offset in the first string
+ */
+static int
+_sock_sendv(lua_State *L) {
+    const char *buf;
+    size_t from, len;
+    int i, n, cnt, nwrite;
+#ifdef _WIN32
+    WSABUF iov[MAX_IOVEC];
+    DWORD sent;
+#else
+    struct iovec iov[MAX_IOVEC];
+    struct msghdr msg;
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+#endif
+
+    socket_t *sock = _getsock(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    from = luaL_optinteger(L, 3, 0);
+
+    n = luaL_len(L, 2);
+    if(n > MAX_IOVEC) {
+        n = MAX_IOVEC;
+    }
+
+    cnt = 0;
+    for(i = 1; i <= n; i++) {
+        // strings are kept alive by the table
+        lua_rawgeti(L, 2, i);
+        buf = lua_tolstring(L, -1, &len);
+        lua_pop(L, 1);
+        if(buf == NULL) {
+            return luaL_argerror(L, 2, "should be an array of strings");
+        }
+        if(i == 1) {
+            if(len < from) {
+                return luaL_argerror(L, 3, "should be less than length of the first string");
+            }
+            buf += from;
+            len -= from;
+        }
+        if(len == 0) {
+            continue;
+        }
+#ifdef _WIN32
+        iov[cnt].buf = (char*)buf;
+        iov[cnt].len = (ULONG)len;
+#else
+        iov[cnt].iov_base = (void*)buf;
+        iov[cnt].iov_len = len;
+#endif
+        cnt++;
+    }
+
+    if(cnt == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+#ifdef _WIN32
+    nwrite = WSASend(sock->fd, iov, cnt, &sent, 0, NULL, NULL) == 0 ? (int)sent : -1;
+#else
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+    nwrite = sendmsg(sock->fd, &msg, flags);
+#endif
+    if(nwrite < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, errno);
+        return 2;
+    }
+    lua_pushinteger(L, nwrite);
+    return 1;
+}
+
+/*
+ *   args: host, port, data, from
+ *   connect and send data within SYN if tcp fast open is supported,
+ *   otherwise only connect, and data should be sent after connected
+ */
+static int
+_sock_connect_send(lua_State *L) {
+    const char *host, *port, *buf;
+    size_t from, len;
+    int flags = 0;
+    int err, nwrite;
+    struct addrinfo *res = 0;
+
+    socket_t *sock = _getsock(L, 1);
+    host = luaL_checkstring(L, 2);
+    luaL_checkinteger(L, 3);
+    port = lua_tostring(L, 3);
+
+    buf = luaL_checklstring(L, 4, &len);
+    from = luaL_optinteger(L, 5, 0);
+
+    if (len <= from) {
+        return luaL_argerror(L, 5, "should be less than length of argument #4");
+    }
+
+    err = _getsockaddrarg(sock, host, port, &res);
+    if(err != 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, err);
+        return 2;
+    }
+
+#ifdef MSG_FASTOPEN
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+    nwrite = sendto(sock->fd, buf + from, len - from, flags | MSG_FASTOPEN, res->ai_addr, res->ai_addrlen);
+#else
+    (void)flags;
+    nwrite = connect(sock->fd, res->ai_addr, res->ai_addrlen);
+#endif
+    freeaddrinfo(res);
+
+    if(nwrite < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, errno);
+        return 2;
+    }
+    lua_pushinteger(L, nwrite);
+    return 1;
+}
+
 static int
 _sock_recvfrom(lua_State *L) {
     socklen_t addr_len;
@@ -605,9 +875,18 @@ static const struct luaL_Reg socket_mt[] = {
 static const struct luaL_Reg socket_methods[] = {
     {"setblocking", _sock_setblocking},
     {"connect", _sock_connect},
+    {"connect_send", _sock_connect_send},
 
     {"recv", _sock_recv},
     {"send", _sock_send},
+    {"sendv", _sock_sendv},
+#ifdef HAVE_SENDFILE
+    {"sendfile", _sock_sendfile},
+#endif
+#ifdef HAVE_ZEROCOPY
+    {"send_zerocopy", _sock_send_zerocopy},
+    {"recv_zerocopy", _sock_recv_zerocopy},
+#endif
 
     {"recvfrom", _sock_recvfrom},
     {"sendto", _sock_sendto},
@@ -706,6 +985,27 @@ LUALIB_API int luaopen_levent_socket_c(lua_State *L) {
 #endif
 #ifdef SO_LINGER_SEC
     ADD_CONSTANT(L, SO_LINGER_SEC);
+#endif
+#ifdef HAVE_ZEROCOPY
+    ADD_CONSTANT(L, SO_ZEROCOPY);
+#endif
+
+    // tcp opt, level: IPPROTO_TCP
+    ADD_CONSTANT(L, TCP_NODELAY);
+#ifdef TCP_KEEPIDLE
+    ADD_CONSTANT(L, TCP_KEEPIDLE);
+#endif
+#ifdef TCP_KEEPINTVL
+    ADD_CONSTANT(L, TCP_KEEPINTVL);
+#endif
+#ifdef TCP_KEEPCNT
+    ADD_CONSTANT(L, TCP_KEEPCNT);
+#endif
+#ifdef TCP_FASTOPEN
+    ADD_CONSTANT(L, TCP_FASTOPEN);
+#endif
+#ifdef TCP_DEFER_ACCEPT
+    ADD_CONSTANT(L, TCP_DEFER_ACCEPT);
 #endif
     return 1;
 }
@@ -0,0 +1,108 @@
+local levent = require "levent.levent"
+local socket = require "levent.socket"
+
+local port = 8861
+local count = 100
+
+function client()
+    local sock, err = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    assert(sock, err)
+    assert(sock:connect("127.0.0.1", port))
+    sock:set_autocork(true)
+    for i=1, count do
+        assert(sock:sendall(string.format("%04d", i)) == 4)
+    end
+    -- large write goes after corked data
+    sock:sendall(string.rep("x", 8192))
+    sock:close()
+end
+
+-- a coroutine blocked in send (flushing queued data) while others queue
+-- more, later writes must still drain
+local function test_blocked_flush(ln)
+    local r = assert(socket.socket(socket.AF_INET, socket.SOCK_STREAM))
+    assert(r:connect("127.0.0.1", port))
+    local w = assert(ln:accept())
+    local sizes = {4 * 1024 * 1024, 1024 * 1024, 65536, 16 * 1024 * 1024}
+
+    -- fills kernel buffer, the rest waits for write watcher
+    assert(w:write_async(string.rep("a", sizes[1])) ~= nil)
+    levent.sleep(0.01)
+    local sent
+    levent.spawn(function()
+        sent = w:sendall(string.rep("b", sizes[2]))
+    end)
+    levent.sleep(0.01)
+    assert(w:write_async(string.rep("c", sizes[3])) ~= nil)
+
+    local total = 0
+    local reading = true
+    local paused = false
+    levent.spawn(function()
+        while true do
+            while paused do
+                levent.sleep(0.01)
+            end
+            local data = r:recv(65536)
+            if not data or #data == 0 then
+                break
+            end
+            total = total + #data
+        end
+        reading = false
+    end)
+    while not sent do
+        levent.sleep(0.01)
+    end
+    assert(sent == sizes[2])
+    assert(w:wait_writable_below(0, 5))
+
+    -- a later burst isn't stuck, it fills kernel buffer while reader pauses
+    paused = true
+    levent.sleep(0.01)
+    assert(w:write_async(string.rep("d", sizes[4])) ~= nil)
+    levent.sleep(0.05)
+    paused = false
+    assert(w:wait_writable_below(0, 5), w:queued_bytes())
+    w:close()
+    while reading do
+        levent.sleep(0.01)
+    end
+    assert(total == sizes[1] + sizes[2] + sizes[3] + sizes[4], total)
+    r:close()
+end
+
+function start()
+    local sock, err = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    assert(sock, err)
+    assert(sock:bind("0.0.0.0", port))
+    sock:listen()
+    levent.spawn(client)
+
+    local csock = assert(sock:accept())
+    local t = {}
+    local recvs = 0
+    while true do
+        local data = csock:recv(65536)
+        if not data or #data == 0 then
+            break
+        end
+        recvs = recvs + 1
+        t[#t+1] = data
+    end
+    local data = table.concat(t)
+    print("recv times:", recvs, "bytes:", #data)
+
+    local expect = {}
+    for i=1, count do
+        expect[i] = string.format("%04d", i)
+    end
+    expect[#expect+1] = string.rep("x", 8192)
+    assert(data == table.concat(expect))
+    csock:close()
+
+    test_blocked_flush(sock)
+    sock:close()
+end
+
+levent.start(start)
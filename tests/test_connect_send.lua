@@ -0,0 +1,93 @@
+local levent = require "levent.levent"
+local socket = require "levent.socket"
+local errno  = require "levent.errno.c"
+local socket_util = require "levent.socket_util"
+
+local port = 8880
+local DATA = "hello fast open"
+
+-- replace connect_send of sock's cobj, other methods are passed through
+local function hook_connect_send(sock, f)
+    local cobj = sock.cobj
+    sock.cobj = setmetatable({connect_send = function(_, ...)
+        return f(cobj, ...)
+    end}, {__index = function(_, k)
+        local v = cobj[k]
+        if type(v) == "function" then
+            return function(_, ...)
+                return v(cobj, ...)
+            end
+        end
+        return v
+    end})
+end
+
+-- connect_send to listener, return what's accepted and whether data was
+-- carried by SYN
+local function connect_send(ln, hook)
+    local sock = assert(socket.socket(socket.AF_INET, socket.SOCK_STREAM))
+    local in_syn = false
+    hook_connect_send(sock, hook or function(cobj, ...)
+        local nwrite, err = cobj:connect_send(...)
+        in_syn = nwrite ~= nil and nwrite > 0
+        return nwrite, err
+    end)
+    assert(sock:connect_send("127.0.0.1", port, DATA) == #DATA)
+    local conn = assert(ln:accept())
+    conn:set_timeout(5)
+    local data = socket_util.read_full(conn, #DATA)
+    -- nothing more than data
+    conn:set_timeout(0.1)
+    assert(not conn:recv(100))
+    conn:close()
+    sock:close()
+    return data, in_syn
+end
+
+function start()
+    -- no fast open on listener: connect, then send
+    local ln = assert(socket_util.listen("127.0.0.1", port))
+    local data, in_syn = connect_send(ln)
+    assert(data == DATA and not in_syn)
+
+    -- fast open is disabled on client side
+    data = connect_send(ln, function()
+        return nil, errno.EOPNOTSUPP
+    end)
+    assert(data == DATA)
+
+    -- data taken by kernel with SYN isn't sent again, kernel accepting it
+    -- is simulated by connect and send
+    data = connect_send(ln, function(cobj, ip, p, d)
+        while true do
+            local ok, err = cobj:connect(ip, p)
+            if ok or err == errno.EISCONN then
+                break
+            end
+            levent.sleep(0.01)
+        end
+        return cobj:send(d)
+    end)
+    assert(data == DATA)
+    ln:close()
+
+    -- the first connection gets a cookie, data goes with SYN from then on
+    -- if kernel enables fast open for servers. accept wakes up only when
+    -- data arrives, whichever way it's sent
+    ln = assert(socket_util.listen("127.0.0.1", port, {fastopen = 16, defer_accept = 1}))
+    local syn = 0
+    for _ = 1, 3 do
+        data, in_syn = connect_send(ln)
+        assert(data == DATA)
+        if in_syn then
+            syn = syn + 1
+        end
+    end
+    if syn == 0 then
+        print("data is never sent with SYN, fast open is disabled by kernel")
+    end
+    ln:close()
+    print("test pass")
+end
+
+levent.start(start)
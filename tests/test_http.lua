@@ -30,7 +30,7 @@ function start_client(n)
     cli = http.client("127.0.0.1", port)
     for i=1,n do
         local data = "中国" .. i
-        local req = http.request("POST", "http://127.0.0.1/hello", {name=data})
+        local req = http.new_request("POST", "http://127.0.0.1/hello", {name=data})
         local ok, err = cli:send(req)
         assert(ok, err)
         local rsp = cli:get_response()
@@ -41,7 +41,7 @@ function start_client(n)
     for i=1, n do
         local a = i
         local b = i+1
-        local req = http.request("POST", "http://127.0.0.1/add", {a=a, b=b})
+        local req = http.new_request("POST", "http://127.0.0.1/add", {a=a, b=b})
         local ok, err = cli:send(req)
         assert(ok, err)
         local rsp = cli:get_response()
@@ -0,0 +1,83 @@
+local levent = require "levent.levent"
+local http   = require "levent.http"
+
+local port = 8863
+local conns = 0
+
+function start()
+    local s = http.server("127.0.0.1", port)
+    s:route("GET", "/echo/:n", function(rsp, req)
+        rsp:set_data(req.params.n)
+    end)
+    s:route("POST", "/echo/:n", function(rsp, req)
+        rsp:set_data(req:get_body())
+    end)
+    s:route("GET", "/head", function(rsp, req)
+        rsp:set_data(string.rep("h", 100))
+    end)
+    levent.spawn(s.serve, s)
+    levent.sleep(0.1)
+
+    local a = http.agent({max_per_host = 2, pipeline_depth = 4})
+    local url = "http://127.0.0.1:" .. port .. "/echo/"
+
+    -- concurrent pipelined requests share at most 2 connections
+    local n = 20
+    local done = 0
+    local max_pipes = 0
+    for i = 1, n do
+        levent.spawn(function()
+            local rsp, err = a:request("GET", url .. i, {pipeline = true})
+            assert(rsp, err)
+            assert(rsp:get_data() == tostring(i), rsp:get_data())
+            local stats = a:stats()
+            if stats.pipes > max_pipes then
+                max_pipes = stats.pipes
+            end
+            done = done + 1
+        end)
+    end
+    while done < n do
+        levent.sleep(0.01)
+    end
+    local stats = a:stats()
+    print("max pipes:", max_pipes, "idle:", stats.idle, "active:", stats.active)
+    assert(max_pipes <= 2)
+    assert(stats.active == 0 and stats.pipelined == 0)
+
+    -- sequential requests reuse one keep-alive connection
+    for i = 1, 5 do
+        local rsp, err = a:request("POST", url .. i, {body = "data" .. i})
+        assert(rsp, err)
+        assert(rsp:get_data() == "data" .. i)
+    end
+    stats = a:stats()
+    print("idle:", stats.idle, "active:", stats.active)
+    assert(stats.active == 0 and stats.idle <= 2)
+
+    -- streamed response gives back its connection by close
+    local rsp = assert(a:request("GET", url .. "stream", {stream = true}))
+    assert(a:stats().active == 1)
+    assert(rsp:read_body() == "stream")
+    assert(rsp:read_body() == nil)
+    rsp:close()
+    assert(a:stats().active == 0)
+
+    -- response to HEAD has no body, connection is still usable after it
+    local head = "http://127.0.0.1:" .. port .. "/head"
+    rsp = assert(http.request("HEAD", head))
+    assert(rsp:get_code() == 200 and (rsp:get_data() or "") == "")
+    assert(rsp:get_headers()["Content-Length"] == "100")
+    for _, pipeline in ipairs({false, true}) do
+        rsp = assert(a:request("HEAD", head, {pipeline = pipeline}))
+        assert(rsp:get_code() == 200 and (rsp:get_data() or "") == "")
+        rsp = assert(a:request("GET", head, {pipeline = pipeline}))
+        assert(rsp:get_data() == string.rep("h", 100))
+    end
+    http.pool:close()
+
+    a:close()
+    s:close()
+end
+
+levent.start(start)
@@ -1185,6 +1185,25 @@ local function test_parse_url()
     assert(t.request_path == "/t/134467")
     assert(t.query_string == "uid=1827")
     assert(t.fragment == "reply22")
+
+    -- fields are set to the given table
+    local msg = {request_url = "/a/b?c=d"}
+    assert(c.parse_url(msg.request_url, false, msg) == msg)
+    assert(msg.request_path == "/a/b" and msg.query_string == "c=d")
+end
+
+local function test_parser_reset()
+    local parser = c.new(c.HTTP_REQUEST)
+    local msg = {}
+    -- a half parsed request is dropped by reset
+    parser:execute("POST /x HTTP/1.1\r\nContent-Length: 10\r\n\r\nabc", nil, msg)
+    assert(not msg.complete)
+    parser:reset()
+    msg = {}
+    local raw = "GET /y HTTP/1.1\r\nHost: a\r\n\r\n"
+    local parsed, err = parser:execute(raw, nil, msg)
+    assert(not err and parsed == #raw)
+    assert(msg.complete and msg.request_url == "/y" and msg.headers.Host == "a")
 end
 
 local function message_eq(msg, ret)
@@ -1355,6 +1374,7 @@ end
 
 local function main()
     test_parse_url()
+    test_parser_reset()
 
     for i, request in ipairs(requests) do
         test_message(request)
@@ -0,0 +1,146 @@
+local levent   = require "levent.levent"
+local http     = require "levent.http"
+local compress = require "levent.http.compress"
+local zlib     = require "levent.http.zlib.c"
+
+local port = 8875
+local root = os.tmpname()
+os.remove(root)
+os.execute("mkdir -p " .. root)
+
+local function write_file(path, data)
+    local f = assert(io.open(root .. "/" .. path, "wb"))
+    f:write(data)
+    f:close()
+end
+
+local function header(rsp, name)
+    return rsp:get_headers()[name]
+end
+
+local function test_codec()
+    local data = string.rep("levent compress ", 10000)
+    for _, format in ipairs({"gzip", "deflate"}) do
+        local z = assert(zlib.compress(data, 6, format))
+        assert(#z < #data / 10)
+        assert(zlib.uncompress(z, format) == data)
+        assert(zlib.uncompress(z) == data)
+    end
+    assert(zlib.compress("", 1) and zlib.uncompress(zlib.compress("")) == "")
+    assert(not zlib.uncompress("not compressed"))
+    assert(not zlib.uncompress(zlib.compress(data):sub(1, 100)))
+    local _, err = zlib.uncompress(zlib.compress(data), "gzip", 1000)
+    assert(err == "data too large", err)
+
+    -- streaming output decodes as one body
+    local d = zlib.deflater(6, "gzip")
+    local t = {}
+    for i = 1, 100 do
+        t[#t + 1] = d:deflate(data:sub(i * 100, i * 100 + 99), i % 10 == 0 and "sync" or "none")
+    end
+    t[#t + 1] = d:deflate("", "finish")
+    assert(zlib.uncompress(table.concat(t)) == data:sub(100, 10099))
+    assert(not pcall(d.deflate, d, "more"))
+
+    assert(compress.negotiate("gzip, deflate, br") == "gzip")
+    assert(compress.negotiate("deflate;q=1, gzip;q=0.5") == "deflate")
+    assert(compress.negotiate("gzip;q=0, *") == "deflate")
+    assert(compress.negotiate("br, identity") == nil)
+    assert(compress.negotiate(nil) == nil)
+    assert(compress.accepts("deflate, gzip;q=0.1", "gzip"))
+    assert(not compress.accepts("gzip;q=0", "gzip"))
+    assert(compress.compressible("application/json; charset=utf-8"))
+    assert(compress.compressible("text/html"))
+    assert(not compress.compressible("image/png"))
+    assert(not compress.compressible("") and not compress.compressible("  ; charset=utf-8"))
+end
+
+local function test_server()
+    local json = "[" .. string.rep('{"name": "levent", "value": 12345},', 1000) .. "{}]"
+    local js = string.rep("function f() { return 1; }\n", 1000)
+    write_file("app.js", js)
+    write_file("app.js.gz", zlib.compress(js, 9))
+    write_file("plain.js", js)
+
+    local s = http.server("127.0.0.1", port, {compress = {min_size = 100}})
+    s:route("GET", "/json", function(rsp, req)
+        rsp:set_header("Content-Type", "application/json")
+        rsp:set_data(json)
+    end)
+    s:route("GET", "/small", function(rsp, req)
+        rsp:set_data("tiny")
+    end)
+    s:route("GET", "/png", function(rsp, req)
+        rsp:set_header("Content-Type", "image/png")
+        rsp:set_data(json)
+    end)
+    s:route("GET", "/stream", http.compress(function(rsp, req)
+        for i = 1, 10 do
+            rsp:write(json:sub((i - 1) * 1000 + 1, i * 1000))
+        end
+        rsp:write(json:sub(10001))
+    end, {level = 1}))
+    s:route("GET", "/off", http.compress(function(rsp, req)
+        rsp:set_data(json)
+    end, false))
+    s:route("GET", "/static/*path", http.static(root, {precompressed = true}))
+    levent.spawn(s.serve, s)
+    levent.sleep(0.1)
+
+    local url = "http://127.0.0.1:" .. port
+    local gzip = {["Accept-Encoding"] = "gzip, deflate"}
+
+    local rsp = assert(http.get(url .. "/json", gzip))
+    assert(header(rsp, "Content-Encoding") == "gzip")
+    assert(header(rsp, "Vary") == "Accept-Encoding")
+    local body = rsp:get_data()
+    assert(tonumber(header(rsp, "Content-Length")) == #body and #body < #json / 10)
+    assert(zlib.uncompress(body, "gzip") == json)
+
+    rsp = assert(http.get(url .. "/json", {["Accept-Encoding"] = "deflate"}))
+    assert(header(rsp, "Content-Encoding") == "deflate")
+    assert(zlib.uncompress(rsp:get_data(), "deflate") == json)
+
+    -- client not accepting any coding
+    rsp = assert(http.get(url .. "/json"))
+    assert(header(rsp, "Content-Encoding") == nil and rsp:get_data() == json)
+    assert(header(rsp, "Vary") == "Accept-Encoding")
+
+    rsp = assert(http.get(url .. "/small", gzip))
+    assert(header(rsp, "Content-Encoding") == nil and rsp:get_data() == "tiny")
+    rsp = assert(http.get(url .. "/png", gzip))
+    assert(header(rsp, "Content-Encoding") == nil and rsp:get_data() == json)
+    rsp = assert(http.get(url .. "/off", gzip))
+    assert(header(rsp, "Content-Encoding") == nil and rsp:get_data() == json)
+
+    -- chunked body compressed on the fly
+    rsp = assert(http.get(url .. "/stream", gzip))
+    assert(header(rsp, "Content-Encoding") == "gzip")
+    assert(header(rsp, "Transfer-Encoding") == "chunked")
+    assert(zlib.uncompress(rsp:get_data(), "gzip") == json)
+
+    -- precompressed static files
+    rsp = assert(http.get(url .. "/static/app.js", gzip))
+    assert(header(rsp, "Content-Encoding") == "gzip")
+    assert(header(rsp, "Content-Type") == "application/javascript; charset=utf-8")
+    assert(zlib.uncompress(rsp:get_data()) == js)
+    local etag = header(rsp, "Etag")
+    rsp = assert(http.get(url .. "/static/app.js"))
+    assert(header(rsp, "Content-Encoding") == nil and rsp:get_data() == js)
+    assert(header(rsp, "Vary") == "Accept-Encoding")
+    assert(etag and header(rsp, "Etag") ~= etag)
+    rsp = assert(http.get(url .. "/static/plain.js", gzip))
+    assert(header(rsp, "Content-Encoding") == nil and rsp:get_data() == js)
+
+    http.pool:close()
+    s:close()
+end
+
+function start()
+    test_codec()
+    test_server()
+    os.execute("rm -rf " .. root)
+    print("test pass")
+end
+
+levent.start(start)
@@ -0,0 +1,203 @@
+local levent    = require "levent.levent"
+local http      = require "levent.http"
+local util      = require "levent.http.util"
+local multipart = require "levent.http.multipart"
+
+local port = 8872
+
+local function test_codec()
+    assert(util.escape("a b&c=d/é~") == "a%20b%26c%3Dd%2F%C3%A9~")
+    assert(util.unescape("a%20b%2fc+d") == "a b/c+d")
+    assert(util.unescape("a+b", true) == "a b")
+    assert(util.unescape("100%") == "100%" and util.unescape("%zz") == "%zz")
+
+    local t = {}
+    util.parse_query_string("a=1&b=x+y&a=2;c=%41%42&empty=&flag&=skip&&a=3", t)
+    assert(type(t.a) == "table" and #t.a == 3 and t.a[1] == "1" and t.a[3] == "3")
+    assert(t.b == "x y" and t.c == "AB")
+    assert(t.empty == "" and t.flag == "")
+    assert(t[""] == nil)
+
+    local s = util.encode_query_string({k = {"1", "2"}, ["a b"] = "c&d", n = 3})
+    local back = {}
+    util.parse_query_string(s, back)
+    assert(back.k[1] == "1" and back.k[2] == "2", s)
+    assert(back["a b"] == "c&d" and back.n == "3", s)
+    assert(util.encode_query_string(nil) == "")
+    assert(util.encode_query_string({}) == "")
+
+    -- a big form
+    local form = {}
+    for i = 1, 10000 do
+        form["key" .. i] = "value " .. i
+    end
+    back = {}
+    util.parse_query_string(util.encode_query_string(form), back)
+    for i = 1, 10000 do
+        assert(back["key" .. i] == "value " .. i)
+    end
+end
+
+local BOUNDARY = "----levent7MA4YWxkTrZu0gW"
+
+local function build_body(file)
+    return table.concat({
+        "preamble\r\n",
+        "--" .. BOUNDARY .. "\r\n",
+        'Content-Disposition: form-data; name="title"\r\n\r\n',
+        "hello\r\nworld\r\n",
+        "--" .. BOUNDARY .. "\r\n",
+        'Content-Disposition: form-data; name="tag"\r\n\r\n',
+        "a\r\n",
+        "--" .. BOUNDARY .. "\r\n",
+        'Content-Disposition: form-data; name="tag"\r\n\r\n',
+        "b\r\n",
+        "--" .. BOUNDARY .. "\r\n",
+        'Content-Disposition: form-data; name="upload"; filename="a b.bin"\r\n',
+        "Content-Type: application/octet-stream\r\n\r\n",
+        file, "\r\n",
+        "--" .. BOUNDARY .. "--\r\n",
+        "epilogue",
+    })
+end
+
+-- feed body in pieces of size n
+local function reader(body, n)
+    local pos = 1
+    return function()
+        if pos > #body then
+            return nil
+        end
+        local s = body:sub(pos, pos + n - 1)
+        pos = pos + n
+        return s
+    end
+end
+
+local function test_multipart()
+    assert(multipart.boundary("multipart/form-data; boundary=" .. BOUNDARY) == BOUNDARY)
+    assert(multipart.boundary('multipart/form-data; charset=utf-8; Boundary="a b"') == "a b")
+    assert(multipart.boundary("application/x-www-form-urlencoded") == nil)
+
+    -- file data looks like a delimiter partially
+    local file = string.rep("\r\n--" .. BOUNDARY:sub(1, 10) .. "\0\255", 5000)
+    local body = build_body(file)
+    for _, n in ipairs({1, 7, 64, 4096, #body}) do
+        local mp = multipart.new(reader(body, n), BOUNDARY)
+        local files = {}
+        local form = assert(mp:read_form({
+            on_file = function(part)
+                files[#files + 1] = part
+                return {filename = part.filename, data = part:read_all()}
+            end
+        }))
+        assert(form.title == "hello\r\nworld", n)
+        assert(form.tag[1] == "a" and form.tag[2] == "b")
+        assert(form.upload.filename == "a b.bin")
+        assert(form.upload.data == file, n)
+        assert(files[1].content_type == "application/octet-stream")
+    end
+
+    -- parts are skipped when not read
+    local mp = multipart.new(reader(body, 100), BOUNDARY)
+    local names = {}
+    for part in mp:parts() do
+        names[#names + 1] = part.name
+    end
+    assert(not mp.err)
+    assert(table.concat(names, ",") == "title,tag,tag,upload")
+
+    -- truncated body
+    mp = multipart.new(reader(body:sub(1, 200), 50), BOUNDARY)
+    local form, err = mp:read_form()
+    assert(not form and err, err)
+
+    -- field too large
+    mp = multipart.new(reader(body, 100), BOUNDARY)
+    form, err = mp:read_form({max_field_size = 4})
+    assert(not form and err == "multipart field too large", err)
+
+    -- whole body too large, however it's split into parts
+    mp = multipart.new(reader(body, 100), BOUNDARY, {max_size = #body - 1})
+    form, err = mp:read_form({on_file = function(part) return part:read_all() end})
+    assert(not form and err == "multipart body too large", err)
+
+    mp = multipart.new(reader(body, 100), BOUNDARY)
+    form, err = mp:read_form({max_files = 0})
+    assert(not form and err == "too many files in multipart form", err)
+
+    -- temp files saved are removed when a later part fails
+    local tmpname = os.tmpname
+    local saved = {}
+    os.tmpname = function()
+        local path = tmpname()
+        saved[#saved + 1] = path
+        return path
+    end
+    local failing = body:gsub("%-%-" .. BOUNDARY:gsub("%-", "%%-") .. "%-%-", function()
+        return "--" .. BOUNDARY .. "\r\n" ..
+            'Content-Disposition: form-data; name="big"\r\n\r\n' .. string.rep("x", 100) ..
+            "\r\n--" .. BOUNDARY .. "--"
+    end)
+    mp = multipart.new(reader(failing, 100), BOUNDARY)
+    form, err = mp:read_form({max_field_size = 50})
+    os.tmpname = tmpname
+    assert(not form and err == "multipart field too large", err)
+    assert(#saved == 1 and io.open(saved[1]) == nil)
+end
+
+local function test_server()
+    local s = http.server("127.0.0.1", port, {max_body_size = 150000})
+    s:route("POST", "/form", function(rsp, req)
+        local form = req:get_form()
+        local up = form.upload
+        local f = assert(io.open(up.path, "rb"))
+        local data = f:read("a")
+        f:close()
+        os.remove(up.path)
+        rsp:set_data(string.format("%s|%s|%d|%s", form.title, up.filename, up.size, tostring(data == string.rep("z", 100000))))
+    end)
+    s:route("POST", "/form_err", function(rsp, req)
+        local form, err = req:get_form()
+        assert(next(form) == nil)
+        local _, again = req:get_form()
+        assert(again == err, again)
+        rsp:set_data(err)
+    end)
+    s:route("POST", "/urlencoded", function(rsp, req)
+        local form = req:get_form()
+        rsp:set_data(table.concat(form.v, ","))
+    end)
+    levent.spawn(s.serve, s)
+    levent.sleep(0.1)
+
+    local url = "http://127.0.0.1:" .. port
+    local rsp = assert(http.post(url .. "/form", build_body(string.rep("z", 100000)), {
+        ["Content-Type"] = "multipart/form-data; boundary=" .. BOUNDARY,
+    }))
+    assert(rsp:get_code() == 200, rsp:get_code())
+    assert(rsp:get_data() == "hello\r\nworld|a b.bin|100000|true", rsp:get_data())
+
+    -- multipart body is limited by max_body_size too
+    rsp = assert(http.post(url .. "/form_err", build_body(string.rep("z", 200000)), {
+        ["Content-Type"] = "multipart/form-data; boundary=" .. BOUNDARY,
+    }))
+    assert(rsp:get_data() == "multipart body too large", rsp:get_data())
+
+    rsp = assert(http.post(url .. "/urlencoded", "v=1&v=2+3&v=%34", {
+        ["Content-Type"] = "application/x-www-form-urlencoded",
+    }))
+    assert(rsp:get_data() == "1,2 3,4", rsp:get_data())
+
+    http.pool:close()
+    s:close()
+end
+
+function start()
+    test_codec()
+    test_multipart()
+    test_server()
+    print("test pass")
+end
+
+levent.start(start)
@@ -0,0 +1,289 @@
+local levent = require "levent.levent"
+local http   = require "levent.http"
+local h2     = require "levent.http.h2"
+local h2c    = require "levent.http.h2.c"
+local zlib   = require "levent.http.zlib.c"
+local socket_util = require "levent.socket_util"
+
+local port = 8871
+
+local DATA          = 0x0
+local HEADERS       = 0x1
+local RST_STREAM    = 0x3
+local SETTINGS      = 0x4
+local GOAWAY        = 0x7
+local WINDOW_UPDATE = 0x8
+local CONTINUATION  = 0x9
+local FLAG_END_STREAM  = 0x1
+local FLAG_END_HEADERS = 0x4
+
+-- minimal http/2 client, reads all streams until they end
+local client = {}
+client.__index = client
+
+function client.new(sock)
+    local obj = {
+        sock = sock,
+        encoder = h2c.new_encoder(),
+        decoder = h2c.new_decoder(65536),
+        buf = "",
+        streams = {},
+        next_id = 1,
+        -- RST_STREAM frames received
+        resets = 0,
+    }
+    return setmetatable(obj, client)
+end
+
+function client:start()
+    assert(self.sock:sendall(h2.PREFACE .. h2c.pack_frame(SETTINGS, 0, 0, "")))
+end
+
+-- headers: list of name, value
+function client:request(method, path, body, headers)
+    local id = self.next_id
+    self.next_id = id + 2
+    local list = {":method", method, ":scheme", "http", ":path", path, ":authority", "127.0.0.1"}
+    for _, v in ipairs(headers or {}) do
+        list[#list + 1] = v
+    end
+    local flags = FLAG_END_HEADERS | (body and 0 or FLAG_END_STREAM)
+    local frames = {h2c.pack_frame(HEADERS, flags, id, self.encoder:encode(list))}
+    if body then
+        local pos = 1
+        repeat
+            local piece = body:sub(pos, pos + 16383)
+            pos = pos + 16384
+            frames[#frames + 1] = h2c.pack_frame(DATA, pos > #body and FLAG_END_STREAM or 0, id, piece)
+        until pos > #body
+    end
+    assert(self.sock:sendall(table.concat(frames)))
+    self.streams[id] = {data = {}}
+    return id
+end
+
+function client:read_frame()
+    while true do
+        local len, ftype, flags, id = h2c.unpack_frame_header(self.buf, 0)
+        if len and #self.buf >= h2c.FRAME_HEADER_SIZE + len then
+            local payload = self.buf:sub(h2c.FRAME_HEADER_SIZE + 1, h2c.FRAME_HEADER_SIZE + len)
+            self.buf = self.buf:sub(h2c.FRAME_HEADER_SIZE + len + 1)
+            return ftype, flags, id, payload
+        end
+        local s = assert(self.sock:recv(65536))
+        assert(#s > 0, "connection closed")
+        self.buf = self.buf .. s
+    end
+end
+
+-- read frames until GOAWAY, return its error code
+function client:wait_goaway()
+    while true do
+        local ftype, _, _, payload = self:read_frame()
+        if ftype == GOAWAY then
+            return (string.unpack(">I4", payload, 5))
+        end
+    end
+end
+
+-- wait until all requested streams end
+function client:wait()
+    local pending = 0
+    for _, st in pairs(self.streams) do
+        if not st.ended then
+            pending = pending + 1
+        end
+    end
+    while pending > 0 do
+        local ftype, flags, id, payload = self:read_frame()
+        local st = self.streams[id]
+        if ftype == HEADERS then
+            local list = assert(self.decoder:decode(payload))
+            st.headers = {}
+            for i = 1, #list, 2 do
+                st.headers[list[i]] = list[i + 1]
+            end
+        elseif ftype == DATA then
+            st.data[#st.data + 1] = payload
+            -- give back window at once
+            if #payload > 0 then
+                local inc = string.pack(">I4", #payload)
+                self.sock:sendall(h2c.pack_frame(WINDOW_UPDATE, 0, 0, inc) .. h2c.pack_frame(WINDOW_UPDATE, 0, id, inc))
+            end
+        end
+        if st and flags & FLAG_END_STREAM ~= 0 and (ftype == HEADERS or ftype == DATA) then
+            st.ended = true
+            st.body = table.concat(st.data)
+            pending = pending - 1
+        end
+        if ftype == RST_STREAM then
+            self.resets = self.resets + 1
+        end
+    end
+end
+
+function start()
+    local big = string.rep("abcdefgh", 100000)
+    local s = http.server("127.0.0.1", port)
+    s:route("GET", "/hello/:name", function(rsp, req)
+        rsp:set_header("X-Proto", tostring(req.http_major))
+        rsp:set_data("hello " .. req.params.name)
+    end)
+    s:route("GET", "/big", function(rsp, req)
+        rsp:set_data(big)
+    end)
+    s:route("POST", "/echo", function(rsp, req)
+        for piece in req:body_chunks() do
+            rsp:write(piece)
+        end
+    end)
+    s:route("GET", "/gzip/:mode", http.compress(function(rsp, req)
+        if req.params.mode == "stream" then
+            rsp:write(big:sub(1, 1000))
+            rsp:write(big:sub(1001))
+        else
+            rsp:set_data(big)
+        end
+    end))
+    local running, max_running = 0, 0
+    local hold = true
+    s:route("GET", "/hold", function(rsp, req)
+        running = running + 1
+        max_running = math.max(max_running, running)
+        while hold do
+            levent.sleep(0.01)
+        end
+        running = running - 1
+        rsp:set_data("released")
+    end)
+    levent.spawn(s.serve, s)
+    levent.sleep(0.1)
+
+    -- prior knowledge, streams are multiplexed on one connection
+    local sock = assert(socket_util.create_connection("127.0.0.1", port))
+    local cli = client.new(sock)
+    cli:start()
+    local ids = {}
+    for i = 1, 10 do
+        ids[i] = cli:request("GET", "/hello/" .. i)
+    end
+    local big_id = cli:request("GET", "/big")
+    local body = string.rep("x", 60000)
+    local echo_id = cli:request("POST", "/echo", body)
+    cli:wait()
+    for i, id in ipairs(ids) do
+        local st = cli.streams[id]
+        assert(st.headers[":status"] == "200")
+        assert(st.headers["x-proto"] == "2")
+        assert(st.body == "hello " .. i, st.body)
+    end
+    assert(cli.streams[big_id].body == big)
+    assert(cli.streams[echo_id].body == body)
+
+    -- request on a used connection, missing route
+    local id = cli:request("GET", "/none")
+    cli:wait()
+    assert(cli.streams[id].headers[":status"] == "404")
+
+    -- compressed responses
+    local gzip = {"accept-encoding", "gzip"}
+    local whole_id = cli:request("GET", "/gzip/whole", nil, gzip)
+    local stream_id = cli:request("GET", "/gzip/stream", nil, gzip)
+    cli:wait()
+    for _, id in ipairs({whole_id, stream_id}) do
+        local st = cli.streams[id]
+        assert(st.headers["content-encoding"] == "gzip")
+        assert(#st.body < #big / 10 and zlib.uncompress(st.body) == big)
+    end
+    sock:close()
+
+    -- streams reset by client count until their handlers return
+    sock = assert(socket_util.create_connection("127.0.0.1", port))
+    sock:set_timeout(5)
+    cli = client.new(sock)
+    cli:start()
+    local frames = {}
+    local list = {":method", "GET", ":scheme", "http", ":path", "/hold", ":authority", "127.0.0.1"}
+    for i = 1, 150 do
+        local id = i * 2 - 1
+        frames[#frames + 1] = h2c.pack_frame(HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, id, cli.encoder:encode(list))
+        frames[#frames + 1] = h2c.pack_frame(RST_STREAM, 0, id, string.pack(">I4", 0x8))
+    end
+    assert(sock:sendall(table.concat(frames)))
+    levent.sleep(0.2)
+    assert(max_running == 100, max_running)
+    hold = false
+    while running > 0 do
+        levent.sleep(0.01)
+    end
+    cli.next_id = 301
+    id = cli:request("GET", "/hold")
+    cli:wait()
+    assert(cli.streams[id].body == "released")
+    sock:close()
+
+    -- data of closed streams is dropped without resetting them again
+    sock = assert(socket_util.create_connection("127.0.0.1", port))
+    sock:set_timeout(5)
+    cli = client.new(sock)
+    cli:start()
+    id = cli:request("GET", "/hello/closed")
+    cli:wait()
+    local date = cli.streams[id].headers["date"]
+    assert(date:match("^%a+, %d%d %a+ %d+ %d%d:%d%d:%d%d GMT$"), date)
+    frames = {}
+    for _ = 1, 10 do
+        frames[#frames + 1] = h2c.pack_frame(DATA, 0, id, string.rep("d", 1000))
+    end
+    assert(sock:sendall(table.concat(frames)))
+    id = cli:request("GET", "/hello/next")
+    cli:wait()
+    assert(cli.streams[id].body == "hello next")
+    assert(cli.resets == 0, cli.resets)
+    sock:close()
+
+    -- header block never ending is refused
+    sock = assert(socket_util.create_connection("127.0.0.1", port))
+    sock:set_timeout(5)
+    cli = client.new(sock)
+    cli:start()
+    frames = {h2c.pack_frame(HEADERS, FLAG_END_STREAM, 1, cli.encoder:encode(list))}
+    for _ = 1, 5 do
+        frames[#frames + 1] = h2c.pack_frame(CONTINUATION, 0, 1, string.rep("\0", 16384))
+    end
+    assert(sock:sendall(table.concat(frames)))
+    assert(cli:wait_goaway() == 0xb)
+    sock:close()
+
+    -- upgrade from http/1.1
+    sock = assert(socket_util.create_connection("127.0.0.1", port))
+    sock:sendall("GET /hello/up HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: Upgrade, HTTP2-Settings\r\n"
+        .. "Upgrade: h2c\r\nHTTP2-Settings: AAMAAABkAAQAAP__\r\n\r\n")
+    cli = client.new(sock)
+    while not cli.buf:find("\r\n\r\n", 1, true) do
+        cli.buf = cli.buf .. assert(sock:recv(4096))
+    end
+    local head, rest = cli.buf:match("^(.-\r\n\r\n)(.*)$")
+    assert(head:match("^HTTP/1.1 101"), head)
+    cli.buf = rest
+    cli:start()
+    cli.streams[1] = {data = {}}
+    cli.next_id = 3
+    cli:wait()
+    assert(cli.streams[1].body == "hello up")
+    id = cli:request("GET", "/hello/again")
+    cli:wait()
+    assert(cli.streams[id].body == "hello again")
+    sock:close()
+
+    -- plain http/1.1 still works
+    local rsp = assert(http.get("http://127.0.0.1:" .. port .. "/hello/h1"))
+    assert(rsp:get_code() == 200 and rsp:get_data() == "hello h1")
+    assert(rsp:get_headers()["X-Proto"] == "1")
+
+    http.pool:close()
+    s:close()
+    print("test pass")
+end
+
+levent.start(start)
@@ -0,0 +1,181 @@
+local levent = require "levent.levent"
+local hub    = require "levent.hub"
+local http   = require "levent.http"
+local h2     = require "levent.http.h2"
+local h2c    = require "levent.http.h2.c"
+local socket_util = require "levent.socket_util"
+
+local port = 8873
+local REQUEST = "GET /hello HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n"
+
+local function connect()
+    local conn = assert(socket_util.create_connection("127.0.0.1", port))
+    conn:set_timeout(5)
+    return conn
+end
+
+-- read a response of /hello
+local function read_response(conn)
+    local data = ""
+    while not data:find("hello$") do
+        local s = conn:recv(4096)
+        if not s or #s == 0 then
+            return nil, data
+        end
+        data = data .. s
+    end
+    return data
+end
+
+-- whether peer closed connection
+local function is_closed(conn)
+    local s = conn:recv(4096)
+    return s == nil or #s == 0
+end
+
+-- read until peer closes connection, return all data read
+local function read_all(conn)
+    local data = ""
+    while true do
+        local s = conn:recv(4096)
+        if not s or #s == 0 then
+            return data
+        end
+        data = data .. s
+    end
+end
+
+-- http/2 by prior knowledge, return conn and header encoder
+local function h2_connect()
+    local conn = connect()
+    conn:sendall(h2.PREFACE .. h2c.pack_frame(0x4, 0, 0, ""))
+    return conn, h2c.new_encoder()
+end
+
+-- HEADERS frame of a GET, the block is ended unless partial
+local function h2_request(encoder, id, path, partial, extra)
+    local list = {":method", "GET", ":scheme", "http", ":path", path, ":authority", "127.0.0.1"}
+    for _, v in ipairs(extra or {}) do
+        list[#list + 1] = v
+    end
+    return h2c.pack_frame(0x1, partial and 0x1 or 0x5, id, encoder:encode(list))
+end
+
+-- error code of GOAWAY in data, nil if there is none
+local function goaway_code(data)
+    local pos = 0
+    while true do
+        local len, ftype = h2c.unpack_frame_header(data, pos)
+        if not len then
+            return nil
+        end
+        if ftype == 0x7 then
+            return (string.unpack(">I4", data, pos + h2c.FRAME_HEADER_SIZE + 5))
+        end
+        pos = pos + h2c.FRAME_HEADER_SIZE + len
+    end
+end
+
+function start()
+    local s = http.server("127.0.0.1", port, {
+        idle_timeout = 0.3,
+        header_timeout = 0.3,
+        max_header_size = 1024,
+        max_requests = 2,
+        max_conns = 2,
+    })
+    s:route("GET", "/hello", function(rsp, req)
+        rsp:set_data("hello")
+    end)
+    s:route("GET", "/slow", function(rsp, req)
+        levent.sleep(1)
+        rsp:set_data("slow")
+    end)
+    levent.spawn(s.serve, s)
+    levent.sleep(0.1)
+
+    -- idle keep-alive connection is closed
+    local conn = connect()
+    conn:sendall(REQUEST)
+    assert(read_response(conn))
+    local t = hub.loop:now()
+    assert(is_closed(conn))
+    assert(hub.loop:now() - t >= 0.2)
+    conn:close()
+
+    -- slow request headers
+    conn = connect()
+    conn:sendall("GET /hello HTTP/1.1\r\n")
+    levent.sleep(0.1)
+    conn:sendall("Host: 127.0.0.1\r\n")
+    assert(is_closed(conn))
+    conn:close()
+
+    -- too large headers
+    conn = connect()
+    conn:sendall("GET /hello HTTP/1.1\r\nX-Big: " .. string.rep("x", 2000) .. "\r\n\r\n")
+    assert(is_closed(conn))
+    conn:close()
+
+    -- max requests per connection
+    conn = connect()
+    conn:sendall(REQUEST)
+    local data = assert(read_response(conn))
+    assert(not data:find("Connection: close", 1, true))
+    conn:sendall(REQUEST)
+    data = assert(read_response(conn))
+    assert(data:find("Connection: close", 1, true), data)
+    assert(is_closed(conn))
+    conn:close()
+
+    -- at capacity, the third connection waits for a free slot
+    local c1, c2 = connect(), connect()
+    levent.sleep(0.05)
+    local c3 = connect()
+    t = hub.loop:now()
+    c3:sendall(REQUEST)
+    assert(read_response(c3))
+    assert(hub.loop:now() - t >= 0.2, hub.loop:now() - t)
+    assert(is_closed(c1) and is_closed(c2))
+    c1:close()
+    c2:close()
+    c3:close()
+
+    -- idle http/2 connection is closed
+    conn = h2_connect()
+    t = hub.loop:now()
+    assert(goaway_code(read_all(conn)) == 0)
+    assert(hub.loop:now() - t < 1)
+    conn:close()
+
+    -- but not while a stream is running
+    local encoder
+    conn, encoder = h2_connect()
+    conn:sendall(h2_request(encoder, 1, "/slow"))
+    t = hub.loop:now()
+    data = read_all(conn)
+    assert(data:find("slow", 1, true))
+    assert(hub.loop:now() - t >= 1)
+    conn:close()
+
+    -- slow header block, even if a stream is running
+    conn, encoder = h2_connect()
+    conn:sendall(h2_request(encoder, 1, "/slow") .. h2_request(encoder, 3, "/hello", true))
+    t = hub.loop:now()
+    assert(goaway_code(read_all(conn)) == 0)
+    assert(hub.loop:now() - t < 0.8)
+    conn:close()
+
+    -- too large http/2 headers
+    conn, encoder = h2_connect()
+    conn:sendall(h2_request(encoder, 1, "/hello", false, {"x-big", string.rep("x", 2000)}))
+    assert(goaway_code(read_all(conn)) == 0x9)
+    conn:close()
+
+    levent.sleep(0.1)
+    assert(s.nconn == 0, s.nconn)
+    s:close()
+    print("test pass")
+end
+
+levent.start(start)
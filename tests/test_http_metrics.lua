@@ -0,0 +1,94 @@
+local levent = require "levent.levent"
+local http   = require "levent.http"
+local log    = require "levent.log"
+
+local port = 8876
+
+local function test_log()
+    local path = os.tmpname()
+    local f = assert(io.open(path, "w"))
+    log.set_output(f)
+    log.set_level("info")
+    assert(log.enabled("warn") and not log.enabled("debug"))
+    log.debug("hidden")
+    log.info("hello", "k", 1, "msg", "a b", "empty", "", "err", 'x\n"y"')
+    log.set_level("off")
+    log.error("hidden")
+    log.set_level("info")
+    log.set_output(io.stderr)
+    f:close()
+
+    f = assert(io.open(path))
+    local data = f:read("a")
+    f:close()
+    os.remove(path)
+    assert(data:match('^%d+%-%d+%-%d+ %d+:%d+:%d+ INFO hello k=1 msg="a b" empty="" err="x\\n\\"y\\""\n$'), data)
+    assert(not pcall(log.set_level, "verbose"))
+end
+
+-- value of a sample in exposition
+local function sample(text, name)
+    local i, j = text:find("\n" .. name, 1, true)
+    assert(i, name)
+    return tonumber(text:match("^ (%S+)\n", j + 1))
+end
+
+local function test_server()
+    local s = http.server("127.0.0.1", port, {metrics = {path = "/metrics", buckets = {0.01, 1}}})
+    s:route("GET", "/hello/:name", function(rsp, req)
+        rsp:set_data("hello " .. req.params.name)
+    end)
+    s:route("GET", "/slow", function(rsp, req)
+        levent.sleep(0.05)
+        rsp:set_data("slow")
+    end)
+    s:route("GET", "/fail", function(rsp, req)
+        error("oops")
+    end)
+    levent.spawn(s.serve, s)
+    levent.sleep(0.1)
+
+    local url = "http://127.0.0.1:" .. port
+    for i = 1, 3 do
+        assert(http.get(url .. "/hello/" .. i))
+    end
+    assert(http.get(url .. "/slow"))
+    assert(http.get(url .. "/fail"):get_code() == 502)
+    assert(http.get(url .. "/none"):get_code() == 404)
+    assert(http.post(url .. "/slow", "x"):get_code() == 405)
+
+    local rsp = assert(http.get(url .. "/metrics"))
+    assert(rsp:get_headers()["Content-Type"]:find("text/plain", 1, true))
+    local text = rsp:get_data()
+    assert(text:find("# TYPE levent_http_requests_total counter\n", 1, true))
+    assert(text:find("# TYPE levent_http_request_duration_seconds histogram\n", 1, true))
+    assert(sample(text, 'levent_http_requests_total{route="/hello/:name",code="200"}') == 3)
+    assert(sample(text, 'levent_http_requests_total{route="/fail",code="502"}') == 1)
+    assert(sample(text, 'levent_http_requests_total{route="unmatched",code="404"}') == 1)
+    assert(sample(text, 'levent_http_requests_total{route="/slow",code="405"}') == 1)
+    assert(sample(text, 'levent_http_request_duration_seconds_bucket{route="/hello/:name",le="0.01"}') == 3)
+    assert(sample(text, 'levent_http_request_duration_seconds_bucket{route="/slow",le="0.01"}') == 1)
+    assert(sample(text, 'levent_http_request_duration_seconds_bucket{route="/slow",le="1"}') == 2)
+    assert(sample(text, 'levent_http_request_duration_seconds_bucket{route="/slow",le="+Inf"}') == 2)
+    assert(sample(text, 'levent_http_request_duration_seconds_count{route="/slow"}') == 2)
+    assert(sample(text, 'levent_http_request_duration_seconds_sum{route="/slow"}') >= 0.04)
+    -- the /metrics request itself is in flight
+    assert(sample(text, 'levent_http_requests_in_flight{route="/metrics"}') == 1)
+    assert(sample(text, 'levent_http_requests_in_flight{route="/slow"}') == 0)
+    assert(sample(text, "levent_http_connections_open") >= 1)
+    assert(sample(text, "levent_http_connections_total") >= 1)
+
+    http.pool:close()
+    levent.sleep(0.1)
+    text = s:expose_metrics()
+    assert(sample(text, "levent_http_connections_open") == 0)
+    s:close()
+end
+
+function start()
+    test_log()
+    test_server()
+    print("test pass")
+end
+
+levent.start(start)
@@ -0,0 +1,55 @@
+local c = require "levent.http.c"
+
+-- canonical header key
+local keys = {
+    ["content-type"] = "Content-Type",
+    ["Content-Type"] = "Content-Type",
+    ["CONTENT-LENGTH"] = "Content-Length",
+    ["x-real-ip"] = "X-Real-Ip",
+    ["host"] = "Host",
+    ["a--b"] = "A--B",
+    ["x_y-1z"] = "X_y-1z",
+}
+for k, v in pairs(keys) do
+    assert(c.canonical_header_key(k) == v, k)
+end
+
+assert(c.status_text(200) == "OK")
+assert(c.status_text(404) == "Not Found")
+assert(c.status_text(999) == nil)
+assert(c.status_text(429) == "Too Many Requests")
+-- codes not known get the reason phrase of their class
+assert(c.status_text(299) == "Success" and c.status_text(599) == "Server Error")
+assert(c.status_text(99) == nil)
+
+-- response
+local now = 1400000000
+local s = c.pack_response(200, {["Content-Length"] = 5}, "hello", now)
+print(s)
+assert(s == "HTTP/1.1 200 OK\r\n" ..
+    "Content-Length: 5\r\n" ..
+    "Date: Tue, 13 May 2014 16:53:20 GMT\r\n" ..
+    "\r\n" ..
+    "hello")
+
+-- header only, given Date is kept
+s = c.pack_response(404, {Date = "today"}, nil, now)
+assert(s == "HTTP/1.1 404 Not Found\r\nDate: today\r\n\r\n")
+
+-- date alone, as http/2 responses take it
+assert(c.http_date(now) == "Tue, 13 May 2014 16:53:20 GMT")
+assert(c.http_date(0) == "Thu, 01 Jan 1970 00:00:00 GMT")
+assert(not pcall(c.pack_response, 999, {}))
+assert(c.pack_response(499, {}) == "HTTP/1.1 499 Client Error\r\n\r\n")
+
+-- request
+s = c.pack_request("GET", "/index?a=1", {Host = "localhost"})
+assert(s == "GET /index?a=1 HTTP/1.1\r\nHost: localhost\r\n\r\n")
+s = c.pack_request("POST", "/", {["Content-Length"] = 3}, "a=1")
+assert(s == "POST / HTTP/1.1\r\nContent-Length: 3\r\n\r\na=1")
+
+-- large body
+local body = string.rep("x", 1024 * 1024)
+s = c.pack_response(200, {}, body)
+assert(#s == #"HTTP/1.1 200 OK\r\n\r\n" + #body)
+print("test pass")
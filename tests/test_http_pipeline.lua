@@ -0,0 +1,114 @@
+local levent      = require "levent.levent"
+local socket_util = require "levent.socket_util"
+local http        = require "levent.http"
+local hub         = require "levent.hub"
+
+local port = 8862
+
+function echo(rsp, req)
+    rsp:set_data(req:get_args()["n"])
+end
+
+local BIG = string.rep("\1", 8 * 1024 * 1024)
+local PIECE = string.rep("\2", 100000)
+local NPIECE = 20
+
+-- more than kernel buffer holds, finish blocks in flush with data queued
+function big(rsp, req)
+    rsp:set_data(BIG)
+end
+
+function stream(rsp, req)
+    for _ = 1, NPIECE do
+        assert(rsp:write(PIECE))
+    end
+end
+
+-- a queued response followed by a streamed one, to a reader slower than
+-- both of them
+local function test_queued_then_stream()
+    -- write watcher can't be taken by both the writer and the drain
+    local failed
+    local handle_error = hub.loop.handle_error
+    hub.loop.handle_error = function(loop, watcher, msg)
+        failed = msg
+        return handle_error(loop, watcher, msg)
+    end
+    local conn = assert(socket_util.create_connection("127.0.0.1", port))
+    conn:set_timeout(5)
+    conn:sendall("GET /big HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n" ..
+        "GET /stream HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n")
+    levent.sleep(0.2)
+    local t = {}
+    while true do
+        local s = conn:recv(65536)
+        if not s or #s == 0 then
+            break
+        end
+        t[#t + 1] = s
+        levent.sleep(0.001)
+    end
+    conn:close()
+    hub.loop.handle_error = handle_error
+    assert(not failed, failed)
+    local data = table.concat(t)
+    local _, nbig = data:gsub("\1", "")
+    local _, nstream = data:gsub("\2", "")
+    assert(nbig == #BIG, nbig)
+    assert(nstream == #PIECE * NPIECE, nstream)
+    assert(data:sub(-5) == "0\r\n\r\n")
+end
+
+function start()
+    local s = http.server("127.0.0.1", port)
+    s:register {
+        ["/echo"] = echo,
+        ["/big"] = big,
+        ["/stream"] = stream,
+    }
+    levent.spawn(s.serve, s)
+    levent.sleep(0.1)
+
+    -- send all requests in one segment
+    local t = {}
+    local n = 32
+    for i = 1, n do
+        t[#t + 1] = string.format("GET /echo?n=%d HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", i)
+    end
+    local conn = assert(socket_util.create_connection("127.0.0.1", port))
+    conn:sendall(table.concat(t))
+
+    -- responses come back in order
+    local data = ""
+    local recv_times = 0
+    local got = {}
+    while #got < n do
+        local s = conn:recv(65536)
+        assert(s and #s > 0)
+        recv_times = recv_times + 1
+        data = data .. s
+        while true do
+            local header, body_start = data:match("^(.-\r\n)\r\n()")
+            if not header then
+                break
+            end
+            local len = tonumber(header:match("Content%-Length: (%d+)\r\n"))
+            if #data < body_start + len - 1 then
+                break
+            end
+            got[#got + 1] = data:sub(body_start, body_start + len - 1)
+            data = data:sub(body_start + len)
+        end
+    end
+    print("responses:", #got, "recv times:", recv_times)
+    for i = 1, n do
+        assert(got[i] == tostring(i), got[i])
+    end
+
+    conn:close()
+
+    test_queued_then_stream()
+    s:close()
+end
+
+levent.start(start)
@@ -0,0 +1,173 @@
+local levent = require "levent.levent"
+local http   = require "levent.http"
+local socket_util = require "levent.socket_util"
+
+local port = 8865
+local backend_ports = {8866, 8867}
+-- nothing listens here
+local dead_port = 8868
+-- answers with interim responses before the final one
+local raw_port = 8869
+
+local function backend(name, ports)
+    local s = http.server("127.0.0.1", backend_ports[name])
+    s:route("GET", "/who", function(rsp, req)
+        ports[req.remote_port] = true
+        rsp:set_header("X-Backend", name)
+        rsp:set_data(tostring(name))
+    end)
+    s:route("POST", "/echo", function(rsp, req)
+        rsp:set_header("X-Forwarded-For", req:get_header("X-Forwarded-For"))
+        for piece in req:body_chunks() do
+            rsp:write(piece)
+        end
+    end)
+    s:route("GET", "/status/:code", function(rsp, req)
+        rsp:set_code(tonumber(req.params.code))
+        rsp:set_data(req.params.code)
+    end)
+    s:route("GET", "/stream", function(rsp, req)
+        for i = 1, 10 do
+            rsp:write(string.rep(tostring(i % 10), 1000))
+        end
+    end)
+    levent.spawn(s.serve, s)
+    return s
+end
+
+local function raw_backend()
+    local ln = assert(socket_util.listen("127.0.0.1", raw_port))
+    levent.spawn(function()
+        while true do
+            local conn = ln:accept()
+            if not conn then
+                return
+            end
+            local data = ""
+            while not data:find("\r\n\r\n", 1, true) do
+                data = data .. assert(conn:recv(4096))
+            end
+            conn:sendall("HTTP/1.1 100 Continue\r\n\r\n" ..
+                "HTTP/1.1 103 Early Hints\r\nLink: </style.css>\r\n\r\n" ..
+                "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: close\r\n\r\nfinal")
+            conn:close()
+        end
+    end)
+    return ln
+end
+
+local function head(path)
+    local conn = assert(socket_util.create_connection("127.0.0.1", port))
+    conn:sendall("HEAD " .. path .. " HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n")
+    local data = ""
+    while not data:find("\r\n\r\n", 1, true) do
+        data = data .. assert(conn:recv(4096))
+    end
+    conn:close()
+    return data
+end
+
+function start()
+    local ports = {}
+    local b1 = backend(1, ports)
+    local b2 = backend(2, ports)
+
+    local servers = {
+        "127.0.0.1:" .. backend_ports[1],
+        "127.0.0.1:" .. backend_ports[2],
+        "127.0.0.1:" .. dead_port,
+    }
+    local s = http.server("127.0.0.1", port)
+    local rr, rr_proxy = http.proxy(servers, {max_fails = 1, fail_timeout = 60, retries = 2})
+    local hash, hash_proxy = http.proxy(servers, {
+        balance = "hash",
+        hash_key = function(req) return req:get_args().key end,
+    })
+    s:route(nil, "/rr/*path", rr)
+    s:route(nil, "/hash/*path", hash)
+    s:route(nil, "/dead/*path", http.proxy({"127.0.0.1:" .. dead_port}))
+    local raw = raw_backend()
+    s:route(nil, "/raw/*path", http.proxy({"127.0.0.1:" .. raw_port}))
+    local strip = function(req) return "/" .. req.params.path end
+    rr_proxy.rewrite = strip
+    hash_proxy.rewrite = function(req) return strip(req) .. "?" .. req.query_string end
+    levent.spawn(s.serve, s)
+    levent.sleep(0.1)
+
+    local url = "http://127.0.0.1:" .. port
+
+    -- dead server is ejected at its first failure, requests go on
+    local count = {}
+    for i = 1, 20 do
+        local rsp = assert(http.get(url .. "/rr/who"))
+        assert(rsp:get_code() == 200, rsp:get_code())
+        local name = rsp:get_data()
+        count[name] = (count[name] or 0) + 1
+    end
+    print("round robin:", count["1"], count["2"])
+    assert(count["1"] >= 9 and count["2"] >= 9)
+    local stats = rr_proxy:stats()
+    assert(not stats[1].ejected and not stats[2].ejected and stats[3].ejected)
+
+    -- upstream connections are kept alive
+    local n = 0
+    for _ in pairs(ports) do
+        n = n + 1
+    end
+    print("upstream connections:", n)
+    assert(n <= 2)
+
+    -- consistent hash
+    for _, key in ipairs({"a", "b", "c", "d"}) do
+        local first
+        for i = 1, 5 do
+            local rsp = assert(http.get(url .. "/hash/who?key=" .. key))
+            assert(rsp:get_code() == 200, rsp:get_code())
+            first = first or rsp:get_data()
+            assert(rsp:get_data() == first)
+        end
+    end
+
+    -- request and response bodies are streamed
+    local body = string.rep("x", 1024 * 1024)
+    local rsp = assert(http.post(url .. "/rr/echo", body))
+    assert(rsp:get_code() == 200)
+    assert(rsp:get_data() == body)
+    assert(rsp:get_headers()["X-Forwarded-For"] == "127.0.0.1")
+
+    rsp = assert(http.get(url .. "/rr/stream"))
+    assert(rsp:get_code() == 200)
+    assert(#rsp:get_data() == 10000)
+
+    -- HEAD response has headers only
+    local data = head("/rr/who")
+    assert(data:match("^HTTP/1.1 200"), data)
+    assert(data:match("Content%-Length: 1\r\n"), data)
+    assert(data:sub(-4) == "\r\n\r\n", data)
+
+    -- status codes are passed through, known to parser or not
+    for _, code in ipairs({308, 422, 429, 451, 299, 599}) do
+        rsp = assert(http.get(url .. "/rr/status/" .. code))
+        assert(rsp:get_code() == code, rsp:get_code())
+        assert(rsp:get_data() == tostring(code))
+    end
+
+    -- interim responses of upstream aren't forwarded
+    rsp = assert(http.get(url .. "/raw/any"))
+    assert(rsp:get_code() == 200 and rsp:get_data() == "final", rsp:get_code())
+
+    -- no server available
+    rsp = assert(http.get(url .. "/dead/who"))
+    assert(rsp:get_code() == 502, rsp:get_code())
+
+    raw:close()
+    rr_proxy:close()
+    hash_proxy:close()
+    b1:close()
+    b2:close()
+    http.pool:close()
+    s:close()
+    print("test pass")
+end
+
+levent.start(start)
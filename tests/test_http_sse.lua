@@ -0,0 +1,170 @@
+local levent = require "levent.levent"
+local http   = require "levent.http"
+local socket_util = require "levent.socket_util"
+
+local port = 8874
+
+local client = {}
+client.__index = client
+
+function client.new(path, last_id)
+    local conn = assert(socket_util.create_connection("127.0.0.1", port))
+    conn:set_timeout(5)
+    local head = "GET " .. path .. " HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+    if last_id then
+        head = head .. "Last-Event-ID: " .. last_id .. "\r\n"
+    end
+    conn:sendall(head .. "\r\n")
+    return setmetatable({conn = conn, data = ""}, client)
+end
+
+-- read until pattern is found, return false if connection is closed
+function client:expect(pattern)
+    while not self.data:find(pattern, 1, true) do
+        local s = self.conn:recv(65536)
+        if not s or #s == 0 then
+            return false
+        end
+        self.data = self.data .. s
+    end
+    return true
+end
+
+function client:close()
+    self.conn:close()
+end
+
+local function wait_count(bus, topic, n)
+    for _ = 1, 100 do
+        if bus:count(topic) == n then
+            return
+        end
+        levent.sleep(0.01)
+    end
+    error(string.format("%d subscribers expected, got %d", n, bus:count(topic)))
+end
+
+-- line breaks can't inject fields
+local function test_format()
+    local sse = require "levent.http.sse"
+    local s = sse.format({id = "1\nevent: evil", event = "up\r\ndata: evil\0", data = "a\rb\r\nc"})
+    assert(s == "id: 1event: evil\nevent: updata: evil\ndata: a\ndata: b\ndata: c\n\n", s)
+end
+
+function start()
+    test_format()
+    local bus = http.broadcaster({history = 4, max_queue = 64 * 1024})
+    local drop_bus = http.broadcaster({max_queue = 64 * 1024, policy = "drop"})
+    local s = http.server("127.0.0.1", port)
+    s:route("GET", "/events/:topic", function(rsp, req)
+        local stream = http.sse(rsp, req, {retry = 1000})
+        local b = req.params.topic == "drop" and drop_bus or bus
+        b:subscribe(req.params.topic, stream, req:get_header("Last-Event-ID"))
+        stream:wait()
+    end)
+    s:route("GET", "/poll", function(rsp, req)
+        local events = bus:poll("news", req:get_args().since, 1)
+        local t = {}
+        for _, e in ipairs(events) do
+            t[#t + 1] = e.id .. ":" .. e.data
+        end
+        rsp:set_data(table.concat(t, ","))
+    end)
+    levent.spawn(s.serve, s)
+    levent.sleep(0.1)
+
+    -- every subscriber gets each event
+    local clients = {}
+    for i = 1, 3 do
+        clients[i] = client.new("/events/news")
+        assert(clients[i]:expect("retry: 1000\n\n"))
+        assert(clients[i].data:find("Content-Type: text/event-stream", 1, true))
+    end
+    wait_count(bus, "news", 3)
+    bus:publish("news", "one")
+    bus:publish("news", {event = "update", data = "two\nlines"})
+    for _, c in ipairs(clients) do
+        assert(c:expect("id: 1\ndata: one\n\n"))
+        assert(c:expect("id: 2\nevent: update\ndata: two\ndata: lines\n\n"), c.data)
+    end
+
+    -- gone subscribers are removed
+    clients[1]:close()
+    clients[2]:close()
+    wait_count(bus, "news", 1)
+
+    -- reconnect with Last-Event-ID replays events from history
+    bus:publish("news", "three")
+    local c = client.new("/events/news", "1")
+    assert(c:expect("data: three\n\n"))
+    assert(c.data:find("data: two", 1, true) and not c.data:find("data: one", 1, true))
+    c:close()
+
+    -- long poll
+    local polled
+    levent.spawn(function()
+        local rsp = assert(http.get("http://127.0.0.1:" .. port .. "/poll"))
+        polled = rsp:get_data()
+    end)
+    levent.sleep(0.1)
+    assert(polled == nil)
+    bus:publish("news", "four")
+    levent.sleep(0.1)
+    assert(polled == "4:four", polled)
+    local rsp = assert(http.get("http://127.0.0.1:" .. port .. "/poll?since=2"))
+    assert(rsp:get_data() == "3:three,4:four", rsp:get_data())
+
+    -- a subscriber not reading is closed at last, others go on
+    local fast = clients[3]
+    local fast_size, fast_closed = 0, false
+    levent.spawn(function()
+        while true do
+            local s = fast.conn:recv(65536)
+            if not s or #s == 0 then
+                break
+            end
+            fast_size = fast_size + #s
+        end
+        fast_closed = true
+    end)
+    local slow = client.new("/events/news")
+    assert(slow:expect("retry: 1000\n\n"))
+    wait_count(bus, "news", 2)
+    local big = string.rep("x", 256 * 1024)
+    for _ = 1, 100 do
+        bus:publish("news", big)
+        levent.sleep(0)
+        if bus:count("news") < 2 then
+            break
+        end
+    end
+    wait_count(bus, "news", 1)
+    assert(fast_size > 256 * 1024)
+    slow:close()
+
+    -- or events are dropped for it
+    slow = client.new("/events/drop")
+    assert(slow:expect("retry: 1000\n\n"))
+    wait_count(drop_bus, "drop", 1)
+    local stream = next(drop_bus.topics.drop.subscribers)
+    for _ = 1, 100 do
+        drop_bus:publish("drop", big)
+        levent.sleep(0)
+    end
+    assert(stream.dropped > 0)
+    assert(drop_bus:count("drop") == 1)
+    slow:close()
+    wait_count(drop_bus, "drop", 0)
+
+    -- closing broadcaster ends streams
+    bus:close()
+    levent.sleep(0.1)
+    assert(fast_closed)
+    fast:close()
+
+    http.pool:close()
+    s:close()
+    print("test pass")
+end
+
+levent.start(start)
@@ -0,0 +1,97 @@
+local levent = require "levent.levent"
+local http   = require "levent.http"
+local socket_util = require "levent.socket_util"
+
+local port = 8864
+local root = os.tmpname()
+os.remove(root)
+os.execute("mkdir -p " .. root .. "/sub")
+
+local function write_file(path, data)
+    local f = assert(io.open(root .. "/" .. path, "wb"))
+    f:write(data)
+    f:close()
+end
+
+local function header(rsp, name)
+    return rsp:get_headers()[name]
+end
+
+function start()
+    local content = string.rep("0123456789", 10000)
+    write_file("a.txt", content)
+    write_file("sub/index.html", "<html></html>")
+
+    local s = http.server("127.0.0.1", port)
+    s:route(nil, "/static/*path", http.static(root, {max_age = 60}))
+    levent.spawn(s.serve, s)
+    levent.sleep(0.1)
+
+    local url = "http://127.0.0.1:" .. port .. "/static/"
+
+    -- whole file
+    local rsp = assert(http.get(url .. "a.txt"))
+    assert(rsp:get_code() == 200, rsp:get_code())
+    assert(rsp:get_data() == content)
+    assert(header(rsp, "Content-Type"):find("text/plain"))
+    assert(header(rsp, "Cache-Control") == "max-age=60")
+    local etag = header(rsp, "Etag") or header(rsp, "ETag")
+    local last_modified = header(rsp, "Last-Modified")
+    assert(etag and last_modified)
+
+    -- conditional requests
+    rsp = assert(http.get(url .. "a.txt", {["If-None-Match"] = etag}))
+    assert(rsp:get_code() == 304, rsp:get_code())
+    assert((rsp:get_data() or "") == "")
+    rsp = assert(http.get(url .. "a.txt", {["If-Modified-Since"] = last_modified}))
+    assert(rsp:get_code() == 304, rsp:get_code())
+    rsp = assert(http.get(url .. "a.txt", {["If-None-Match"] = '"other"'}))
+    assert(rsp:get_code() == 200)
+
+    -- ranges
+    rsp = assert(http.get(url .. "a.txt", {Range = "bytes=10-19"}))
+    assert(rsp:get_code() == 206, rsp:get_code())
+    assert(rsp:get_data() == "0123456789")
+    assert(header(rsp, "Content-Range") == "bytes 10-19/100000")
+    rsp = assert(http.get(url .. "a.txt", {Range = "bytes=-5"}))
+    assert(rsp:get_code() == 206 and rsp:get_data() == "56789")
+    rsp = assert(http.get(url .. "a.txt", {Range = "bytes=99995-"}))
+    assert(rsp:get_code() == 206 and rsp:get_data() == "56789")
+    rsp = assert(http.get(url .. "a.txt", {Range = "bytes=200000-"}))
+    assert(rsp:get_code() == 416, rsp:get_code())
+    rsp = assert(http.get(url .. "a.txt", {Range = "bytes=0-1", ["If-Range"] = '"other"'}))
+    assert(rsp:get_code() == 200 and #rsp:get_data() == #content)
+
+    -- HEAD, index file, missing file, escaping root
+    local conn = assert(socket_util.create_connection("127.0.0.1", port))
+    conn:sendall("HEAD /static/a.txt HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n")
+    local head = ""
+    while not head:find("\r\n\r\n", 1, true) do
+        head = head .. assert(conn:recv(4096))
+    end
+    assert(head:match("^HTTP/1.1 200"), head)
+    assert(head:match("Content%-Length: (%d+)") == tostring(#content), head)
+    assert(head:sub(-4) == "\r\n\r\n", head)
+    conn:close()
+    rsp = assert(http.get(url .. "sub/"))
+    assert(rsp:get_code() == 200 and rsp:get_data() == "<html></html>")
+    assert(header(rsp, "Content-Type"):find("text/html"))
+    rsp = assert(http.get(url .. "none.txt"))
+    assert(rsp:get_code() == 404)
+    rsp = assert(http.get(url .. "sub/%2e%2e/%2e%2e/etc/passwd"))
+    assert(rsp:get_code() == 403, rsp:get_code())
+
+    -- cached file is dropped once changed
+    write_file("a.txt", "changed")
+    levent.sleep(1.5)
+    rsp = assert(http.get(url .. "a.txt", {["If-None-Match"] = etag}))
+    assert(rsp:get_code() == 200, rsp:get_code())
+    assert(rsp:get_data() == "changed")
+
+    http.pool:close()
+    s:close()
+    os.execute("rm -rf " .. root)
+    print("test pass")
+end
+
+levent.start(start)
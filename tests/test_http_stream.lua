@@ -0,0 +1,123 @@
+local levent = require "levent.levent"
+local http   = require "levent.http"
+local socket_util = require "levent.socket_util"
+
+local port = 8861
+local body = string.rep("0123456789abcdef", 64 * 1024) -- 1MB
+
+function upload(rsp, req)
+    local size, pieces = 0, 0
+    for chunk in req:body_chunks(8192) do
+        assert(#chunk <= 8192)
+        size = size + #chunk
+        pieces = pieces + 1
+    end
+    print("upload size:", size, "pieces:", pieces)
+    rsp:set_data(tostring(size))
+end
+
+function download(rsp, req)
+    rsp:set_data(body)
+end
+
+-- echo body read piece by piece as parsed
+function echo(rsp, req)
+    local t = {}
+    for chunk in req:body_chunks() do
+        t[#t + 1] = chunk
+    end
+    rsp:set_data(table.concat(t))
+end
+
+function generate(rsp, req)
+    rsp:set_header("Content-Type", "application/octet-stream")
+    assert(rsp:write_header(200))
+    for i = 1, 64 do
+        assert(rsp:write(string.rep("x", 16 * 1024)))
+    end
+    assert(rsp:finish())
+end
+
+function form(rsp, req)
+    rsp:set_data(req:get_args()["name"] or "none")
+end
+
+function start()
+    local s = http.server("127.0.0.1", port, {max_body_size = 64 * 1024})
+    s:register {
+        ["/upload"] = upload,
+        ["/download"] = download,
+        ["/form"] = form,
+        ["/echo"] = echo,
+        ["/generate"] = generate,
+    }
+    levent.spawn(s.serve, s)
+    levent.sleep(0.1)
+
+    local url = "http://127.0.0.1:" .. port
+    local cli = http.client("127.0.0.1", port)
+
+    -- streamed request body is larger than max_body_size
+    assert(cli:send(http.new_request("POST", url .. "/upload", body)))
+    local rsp = assert(cli:get_response())
+    assert(rsp:get_data() == tostring(#body), rsp:get_data())
+
+    -- buffered body still works
+    assert(cli:send(http.new_request("POST", url .. "/form", {name = "levent"})))
+    rsp = assert(cli:get_response())
+    assert(rsp:get_data() == "levent", rsp:get_data())
+
+    -- streamed response body
+    assert(cli:send(http.new_request("GET", url .. "/download")))
+    rsp = assert(cli:get_response({stream = true}))
+    local size = 0
+    for chunk in rsp:body_chunks() do
+        size = size + #chunk
+    end
+    print("download size:", size)
+    assert(size == #body)
+
+    -- chunked response written piece by piece
+    assert(cli:send(http.new_request("GET", url .. "/generate")))
+    rsp = assert(cli:get_response())
+    print("chunked:", rsp:get_headers()["Transfer-Encoding"], #rsp:get_data())
+    assert(rsp:get_data() == string.rep("x", 64 * 16 * 1024))
+
+    -- limited in-memory response body
+    assert(cli:send(http.new_request("GET", url .. "/download")))
+    local rsp, err = cli:get_response({max_body_size = 1024})
+    print("limited download:", rsp, err)
+    assert(not rsp and err == "body too large")
+
+    cli:close()
+
+    -- chunked request body of many pieces parsed by one read
+    local parts = {}
+    for i = 1, 300 do
+        parts[i] = string.rep(string.char(65 + i % 26), i)
+    end
+    local t = {"POST /echo HTTP/1.1\r\nHost: 127.0.0.1\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n"}
+    for _, part in ipairs(parts) do
+        t[#t + 1] = string.format("%x\r\n%s\r\n", #part, part)
+    end
+    t[#t + 1] = "0\r\n\r\n"
+    local conn = assert(socket_util.create_connection("127.0.0.1", port))
+    conn:set_timeout(5)
+    conn:sendall(table.concat(t))
+    local data = ""
+    while true do
+        local s = conn:recv(65536)
+        if not s or #s == 0 then
+            break
+        end
+        data = data .. s
+    end
+    conn:close()
+    local expected = table.concat(parts)
+    assert(data:sub(-#expected) == expected, "chunked pieces lost")
+    print("chunked upload pieces:", #parts)
+
+    s:close()
+end
+
+levent.start(start)
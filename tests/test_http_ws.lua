@@ -0,0 +1,414 @@
+local levent      = require "levent.levent"
+local http        = require "levent.http"
+local crypto      = require "crypto"
+local socket_util = require "levent.socket_util"
+local websocket   = require "levent.http.websocket"
+local config      = require "levent.http.config"
+local c           = require "levent.http.ws.c"
+local timeout     = require "levent.timeout"
+
+local port = 8877
+local server_port = 8878
+
+local function accept_key(key)
+    local hex = crypto.digest("sha1", key .. config.WebSocket.GUID)
+    return crypto.base64((hex:gsub("%x%x", function(h)
+        return string.char(tonumber(h, 16))
+    end)))
+end
+
+local function test_codec()
+    local key = "\1\2\3\4"
+    for _, n in ipairs({0, 1, 7, 8, 9, 125, 126, 65535, 65536, 1000003}) do
+        local data = string.rep("levent!", n // 7 + 1):sub(1, n)
+        local masked = c.mask(data, key)
+        assert(#masked == n and (n == 0 or masked ~= data))
+        assert(c.mask(masked, key) == data)
+
+        for _, k in ipairs({false, key}) do
+            local frame = c.pack_frame(0x2, data, true, k or nil)
+            local fin, opcode, len, hsize, fkey = c.unpack_frame_header(frame)
+            assert(fin == true and opcode == 0x2 and len == n, n)
+            assert(hsize + len == #frame)
+            assert(fkey == (k or nil))
+            local payload = fkey and c.mask(frame, fkey, hsize, len) or frame:sub(hsize + 1)
+            assert(payload == data)
+            local header = c.pack_header(0x2, n, true, k or nil)
+            assert(header .. (k and c.mask(data, k) or data) == frame)
+            -- header split anywhere needs more data
+            assert(c.unpack_frame_header(frame:sub(1, hsize - 1)) == nil)
+        end
+    end
+
+    -- masking is relative to start of payload whatever the offset
+    local data = string.rep("0123456789", 10)
+    local frame = "xyz" .. c.pack_frame(0x1, data, false, "abcd")
+    local fin, opcode, len, hsize, key = c.unpack_frame_header(frame, 3)
+    assert(fin == false and opcode == 0x1 and len == 100 and key == "abcd")
+    assert(c.mask(frame, key, 3 + hsize, len) == data)
+
+    local ok, err = c.unpack_frame_header("\xc1\x00")
+    assert(ok == nil and err == "reserved bits set")
+    -- a fragment
+    local frag = c.pack_frame(0x0, "abc", false)
+    assert(c.unpack_frame_header(frag) == false)
+    assert(not pcall(c.mask, "data", "abc"))
+    assert(not pcall(c.mask, "data", "abcd", 5))
+end
+
+-- frames of each message received by echo_server
+local frame_counts = {}
+
+-- a bare echo server: it answers handshake, then echoes each message
+-- unfragmented, right after handshake it sends a greeting in the same write
+local function echo_server(ln)
+    local conn = ln:accept()
+    local buf = ""
+    while not buf:find("\r\n\r\n", 1, true) do
+        buf = buf .. conn:recv(65536)
+    end
+    local from = select(2, buf:lower():find("sec-websocket-key: ", 1, true))
+    local key = buf:match("[^\r]+", from + 1)
+    conn:sendall("HTTP/1.1 101 Switching Protocols\r\n" ..
+        "Upgrade: websocket\r\nConnection: Upgrade\r\n" ..
+        "Sec-WebSocket-Accept: " .. accept_key(key) .. "\r\n\r\n" ..
+        c.pack_frame(0x1, "hello"))
+
+    buf = ""
+    local parts = {}
+    while true do
+        local fin, opcode, len, hsize, mkey = c.unpack_frame_header(buf)
+        if fin ~= nil and #buf >= hsize + len then
+            assert(mkey, "client frames must be masked")
+            local payload = c.mask(buf, mkey, hsize, len)
+            buf = buf:sub(hsize + len + 1)
+            if opcode == 0x8 then
+                conn:sendall(c.pack_frame(0x8, payload))
+                conn:close()
+                return
+            elseif opcode == 0x9 then
+                conn:sendall(c.pack_frame(0xA, payload))
+            else
+                parts[#parts + 1] = payload
+                if fin then
+                    frame_counts[#frame_counts + 1] = #parts
+                    conn:sendall(c.pack_frame(opcode == 0 and 0x1 or opcode, table.concat(parts)))
+                    parts = {}
+                end
+            end
+        else
+            local s = conn:recv(65536)
+            if not s or #s == 0 then
+                conn:close()
+                return
+            end
+            buf = buf .. s
+        end
+    end
+end
+
+local function test_client()
+    local ln = assert(socket_util.listen("127.0.0.1", port))
+    levent.spawn(echo_server, ln)
+
+    local cli = websocket.client("ws://127.0.0.1:" .. port .. "/echo", {fragment_size = 1000})
+    local got
+    local function wait()
+        for _ = 1, 500 do
+            if got ~= nil then
+                local v = got
+                got = nil
+                return v
+            end
+            levent.sleep(0.01)
+        end
+    end
+    function cli:on_message(opcode, message)
+        got = message
+    end
+    function cli:on_pong(payload)
+        got = payload
+    end
+
+    assert(wait() == "hello")
+
+    cli:text("ping me")
+    assert(wait() == "ping me")
+
+    -- large binary message crossing many reads
+    local big = string.rep("\0\1\2\3levent", 100000)
+    cli:binary(big)
+    assert(wait() == big)
+    assert(frame_counts[#frame_counts] == 1000)
+
+    cli:set_fragment_size(false)
+    cli:binary(big)
+    assert(wait() == big)
+    assert(frame_counts[#frame_counts] == 1)
+    cli:set_fragment_size(1000)
+
+    cli:ping("abc")
+    assert(wait() == "abc")
+
+    cli:close()
+    ln:close()
+end
+
+-- wait until f returns a value, at most 5 seconds
+local function wait_for(f)
+    for _ = 1, 500 do
+        local v = f()
+        if v then
+            return v
+        end
+        levent.sleep(0.01)
+    end
+end
+
+-- raw client speaking http/1.1 handshake, frames are read by c codec
+local raw = {}
+raw.__index = raw
+
+function raw.new(headers, extra, path)
+    local conn = assert(socket_util.create_connection("127.0.0.1", server_port))
+    conn:set_timeout(5)
+    conn:sendall("GET " .. (path or "/ws") .. " HTTP/1.1\r\nHost: 127.0.0.1\r\n" .. headers .. "\r\n" .. (extra or ""))
+    local obj = setmetatable({conn = conn, buf = ""}, raw)
+    while not obj.buf:find("\r\n\r\n", 1, true) do
+        local s = conn:recv(65536)
+        if not s or #s == 0 then
+            break
+        end
+        obj.buf = obj.buf .. s
+    end
+    local stop = obj.buf:find("\r\n\r\n", 1, true)
+    obj.head = obj.buf:sub(1, stop + 3)
+    obj.buf = obj.buf:sub(stop + 4)
+    return obj
+end
+
+-- next frame: fin, opcode, payload; nil if connection is closed
+function raw:frame()
+    while true do
+        local fin, opcode, len, hsize, key = c.unpack_frame_header(self.buf)
+        if fin ~= nil and #self.buf >= hsize + len then
+            assert(key == nil, "server frames must be unmasked")
+            local payload = self.buf:sub(hsize + 1, hsize + len)
+            self.buf = self.buf:sub(hsize + len + 1)
+            return fin, opcode, payload
+        end
+        local s = self.conn:recv(65536)
+        if not s or #s == 0 then
+            return nil
+        end
+        self.buf = self.buf .. s
+    end
+end
+
+-- code of the close frame that ends the connection
+function raw:close_code()
+    while true do
+        local fin, opcode, payload = self:frame()
+        assert(fin ~= nil, "closed without close frame")
+        if opcode == 0x8 then
+            return (string.unpack(">I2", payload))
+        end
+    end
+end
+
+local HANDSHAKE = "Upgrade: websocket\r\nConnection: keep-alive, Upgrade\r\n" ..
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n"
+
+-- a peer that stops reading blocks neither the reader of a group member,
+-- nor a send for longer than write timeout
+local function test_stuck_peer(s)
+    local room = websocket.group({max_queue = 1 << 30})
+    local done, sent, closed
+    s:route("GET", "/stuck", function(rsp, req)
+        local sock = websocket.upgrade(rsp, req, {write_timeout = 0.3})
+        if not sock then
+            return
+        end
+        if req:get_header("X-Group") then
+            room:add(sock)
+        end
+        function sock:on_message(opcode, message)
+            if message == "fill" then
+                local big = string.rep("x", 1 << 20)
+                if next(self.groups) then
+                    while self:queued_bytes() < 16 * (1 << 20) do
+                        room:broadcast(big)
+                    end
+                else
+                    sent = table.pack(self:binary(string.rep(big, 16)))
+                end
+            elseif message == "done" then
+                done = true
+            end
+        end
+        function sock:on_close(code)
+            closed = code
+        end
+        sock:run()
+    end)
+
+    -- pong is queued behind broadcast frames, the next message is still read
+    local r = raw.new(HANDSHAKE .. "X-Group: 1\r\n", nil, "/stuck")
+    r.conn:sendall(c.pack_frame(0x1, "fill", true, "abcd") .. c.pack_frame(0x9, "ping", true, "abcd")
+        .. c.pack_frame(0x1, "done", true, "abcd"))
+    assert(wait_for(function() return done end))
+    r.conn:close()
+
+    -- blocking send gives up, the connection is aborted
+    r = raw.new(HANDSHAKE, c.pack_frame(0x1, "fill", true, "abcd"), "/stuck")
+    assert(wait_for(function() return sent end))
+    assert(sent[1] == nil and timeout.is_timeout(sent[2]), tostring(sent[2]))
+    assert(wait_for(function() return closed end) == websocket.codes.CLOSE_ABNORMAL)
+    r.conn:close()
+end
+
+local function test_server()
+    local room = websocket.group()
+    local closed = {}
+    local s = http.server("127.0.0.1", server_port)
+    s:route("GET", "/ws", function(rsp, req)
+        local sock = websocket.upgrade(rsp, req, {protocols = {"chat", "superchat"},
+            fragment_size = 4096, max_message_size = 20000})
+        if not sock then
+            return
+        end
+        room:add(sock)
+        function sock:on_message(opcode, message)
+            if message == "broadcast" then
+                room:broadcast("to all")
+            else
+                self:send(opcode, message)
+            end
+        end
+        function sock:on_close(code)
+            closed[#closed + 1] = code
+        end
+        sock:run()
+    end)
+    levent.spawn(s.serve, s)
+    levent.sleep(0.1)
+
+    -- handshake accepted, with the example key of RFC 6455
+    local r = raw.new(HANDSHAKE .. "Sec-WebSocket-Protocol: superchat, chat\r\n",
+        c.pack_frame(0x1, "sent with handshake", true, "abcd"))
+    assert(r.head:find("^HTTP/1.1 101"), r.head)
+    assert(r.head:find("Sec-Websocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", 1, true), r.head)
+    assert(r.head:find("Sec-Websocket-Protocol: chat", 1, true), r.head)
+    local fin, opcode, payload = r:frame()
+    assert(fin and opcode == 0x1 and payload == "sent with handshake")
+
+    -- fragmented message is reassembled
+    r.conn:sendall(c.pack_frame(0x2, "frag", false, "abcd") .. c.pack_frame(0x0, "mented", true, "wxyz"))
+    fin, opcode, payload = r:frame()
+    assert(fin and opcode == 0x2 and payload == "fragmented", tostring(fin) .. tostring(opcode) .. tostring(payload))
+
+    -- sent as fragments of at most 4096 bytes
+    local data = string.rep("0123456789", 1000)
+    r.conn:sendall(c.pack_frame(0x1, data, true, "abcd"))
+    local frames = {}
+    repeat
+        fin, opcode, payload = r:frame()
+        frames[#frames + 1] = {opcode, payload}
+    until fin
+    assert(#frames == 3 and frames[1][1] == 0x1 and frames[2][1] == 0x0 and frames[3][1] == 0x0)
+    assert(#frames[1][2] == 4096 and #frames[3][2] == 10000 - 8192)
+    assert(frames[1][2] .. frames[2][2] .. frames[3][2] == data)
+
+    -- control frames are never fragmented
+    r.conn:sendall(c.pack_frame(0x9, string.rep("p", 125), true, "abcd"))
+    fin, opcode, payload = r:frame()
+    assert(fin and opcode == 0xA and payload == string.rep("p", 125))
+
+    -- ws.client against ws.upgrade
+    local got = {}
+    local clients = {}
+    for i = 1, 3 do
+        local cli = websocket.client("ws://127.0.0.1:" .. server_port .. "/ws")
+        function cli:on_message(opcode, message)
+            got[i] = message
+        end
+        clients[i] = cli
+    end
+    assert(wait_for(function() return room:size() == 4 end))
+    clients[1]:text("echo")
+    assert(wait_for(function() return got[1] end) == "echo")
+
+    -- one frame queued to every member
+    got = {}
+    clients[2]:text("broadcast")
+    assert(wait_for(function() return got[1] and got[2] and got[3] end))
+    assert(got[1] == "to all" and got[2] == "to all" and got[3] == "to all")
+    fin, opcode, payload = r:frame()
+    assert(fin and opcode == 0x1 and payload == "to all")
+
+    -- member closing leaves the group
+    clients[3]:close()
+    assert(wait_for(function() return room:size() == 3 end))
+
+    -- member not reading is aborted once too much is queued
+    room.max_queue = 64 * 1024
+    local big = string.rep("x", 60000)
+    for _ = 1, 1000 do
+        room:broadcast(big)
+        if room:size() < 3 then
+            break
+        end
+        levent.sleep(0)
+    end
+    assert(room:size() == 2, room:size())
+    assert(wait_for(function() return #closed >= 2 end))
+    r.conn:close()
+
+    -- bad handshakes are rejected
+    local rsp = assert(http.get("http://127.0.0.1:" .. server_port .. "/ws"))
+    assert(rsp:get_code() == 400)
+    local bad = raw.new(HANDSHAKE:gsub("Version: 13", "Version: 8"))
+    assert(bad.head:find("^HTTP/1.1 426"), bad.head)
+    assert(bad.head:find("Sec-Websocket-Version: 13", 1, true), bad.head)
+    bad.conn:close()
+
+    -- too large message is refused before it's read, declared length is enough
+    local codes = websocket.codes
+    r = raw.new(HANDSHAKE, c.pack_header(0x2, 1 << 40, true, "abcd"))
+    assert(r:close_code() == codes.CLOSE_TOO_LARGE)
+    r.conn:close()
+    r = raw.new(HANDSHAKE)
+    local piece = string.rep("x", 8000)
+    r.conn:sendall(c.pack_frame(0x1, piece, false, "abcd") .. c.pack_frame(0x0, piece, false, "abcd")
+        .. c.pack_frame(0x0, piece, true, "abcd"))
+    assert(r:close_code() == codes.CLOSE_TOO_LARGE)
+    r.conn:close()
+
+    -- frames of client must be masked
+    r = raw.new(HANDSHAKE, c.pack_frame(0x1, "unmasked"))
+    assert(r:close_code() == codes.CLOSE_PROTOCOL_ERROR)
+    r.conn:close()
+
+    -- reserved opcodes are refused
+    for _, opcode in ipairs({0x3, 0x7, 0xB, 0xF}) do
+        r = raw.new(HANDSHAKE, c.pack_frame(opcode, "reserved", true, "abcd"))
+        assert(r:close_code() == codes.CLOSE_PROTOCOL_ERROR, opcode)
+        r.conn:close()
+    end
+
+    for i = 1, 2 do
+        clients[i]:close()
+    end
+    test_stuck_peer(s)
+    http.pool:close()
+    s:close()
+end
+
+function start()
+    test_codec()
+    test_client()
+    test_server()
+    print("test pass")
+end
+
+levent.start(start)
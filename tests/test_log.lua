@@ -0,0 +1,72 @@
+local levent = require "levent.levent"
+local log    = require "levent.log"
+
+local function read_file(path)
+    local f = io.open(path)
+    if not f then
+        return ""
+    end
+    local data = f:read("a")
+    f:close()
+    return data
+end
+
+function start()
+    local path = os.tmpname()
+    assert(log.open(path))
+
+    -- written by the loop, not by the caller
+    log.info("first", "n", 1)
+    log.warn("second", "msg", "a b")
+    log.debug("hidden")
+    assert(log.stats().pending > 0)
+    assert(read_file(path) == "")
+    levent.sleep(0.01)
+    assert(log.stats().pending == 0)
+    local data = read_file(path)
+    assert(data:find("INFO first n=1\n", 1, true), data)
+    assert(data:find('WARN second msg="a b"\n', 1, true), data)
+    assert(not data:find("hidden", 1, true))
+
+    -- errors of coroutines go to the log too
+    levent.spawn(function() error("boom") end)
+    levent.sleep(0.01)
+    assert(read_file(path):find("ERROR .*boom"))
+
+    -- reopen after the file is moved away
+    local moved = path .. ".1"
+    log.info("before reopen")
+    levent.sleep(0.01)
+    assert(os.rename(path, moved))
+    assert(log.reopen())
+    log.info("after reopen")
+    levent.sleep(0.01)
+    assert(read_file(moved):find("before reopen", 1, true))
+    assert(read_file(path):find("after reopen", 1, true))
+    assert(not read_file(path):find("before reopen", 1, true))
+    os.remove(moved)
+
+    -- messages are dropped once the buffer is full
+    os.remove(path)
+    assert(log.open(path, {max_buffer = 1000}))
+    for i = 1, 100 do
+        log.info("message", "i", i)
+    end
+    local stats = log.stats()
+    assert(stats.dropped > 0 and stats.pending <= 1000, stats.dropped)
+    log.flush()
+    data = read_file(path)
+    assert(data:find("message i=1\n", 1, true))
+    assert(not data:find("message i=100\n", 1, true))
+    log.info("later")
+    log.flush()
+    data = read_file(path)
+    assert(data:find("WARN log messages dropped count=" .. stats.dropped .. "\n", 1, true), data)
+    assert(data:find("INFO later\n", 1, true))
+
+    log.close()
+    os.remove(path)
+    print("test pass")
+end
+
+levent.start(start)
@@ -0,0 +1,68 @@
+local levent = require "levent.levent"
+local socket = require "levent.socket"
+local pool   = require "levent.pool"
+
+local port = 8860
+
+function echo(csock)
+    while true do
+        local data = csock:recv(1024)
+        if not data or #data == 0 then
+            break
+        end
+        csock:sendall(data)
+    end
+    csock:close()
+end
+
+function serve(sock)
+    while true do
+        local csock, err = sock:accept()
+        if not csock then
+            break
+        end
+        levent.spawn(echo, csock)
+    end
+end
+
+function start()
+    local sock, err = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    assert(sock, err)
+    assert(sock:bind("0.0.0.0", port))
+    sock:listen()
+    levent.spawn(serve, sock)
+
+    local p = pool.new({max_idle = 1, max_active = 2})
+    local c1 = assert(p:get("127.0.0.1", port))
+    c1:sendall("hello")
+    assert(c1:recv(1024) == "hello")
+    p:put(c1)
+
+    -- idle connection is reused
+    local c2 = assert(p:get("127.0.0.1", port))
+    assert(c1 == c2)
+
+    -- max_active reached
+    local c3 = assert(p:get("127.0.0.1", port))
+    assert(c3 ~= c2)
+    local c4, err = p:get("127.0.0.1", port, 0.1)
+    print("wait for active slot:", c4, err)
+    assert(not c4)
+
+    -- only max_idle connections are kept
+    p:put(c2)
+    p:put(c3)
+    local stats = p:stats()
+    print("idle:", stats.idle, "active:", stats.active)
+    assert(stats.idle == 1 and stats.active == 0)
+
+    -- broken connection is dropped
+    local c5 = assert(p:get("127.0.0.1", port))
+    p:put(c5, true)
+    assert(p:stats().idle == 0)
+
+    p:close()
+    sock:close()
+end
+
+levent.start(start)
@@ -0,0 +1,61 @@
+local router = require "levent.http.router"
+
+local function handler(name)
+    return function() return name end
+end
+
+local r = router.new()
+assert(r:add(nil, "/", handler("root")))
+assert(r:add("GET", "/users", handler("list users")))
+assert(r:add("POST", "/users", handler("create user")))
+assert(r:add("GET", "/users/:id", handler("get user")))
+assert(r:add("GET", "/users/new", handler("new user")))
+assert(r:add("GET", "/users/:id/files/:file", handler("get file")))
+assert(r:add(nil, "/static/*path", handler("static")))
+assert(r:add(nil, "/user", handler("user")))
+
+-- bad patterns
+print("repeated:", r:add("GET", "/users", handler("x")))
+assert(not r:add("GET", "/users", handler("x")))
+print("conflict:", r:add("GET", "/users/:name/x", handler("x")))
+assert(not r:add("GET", "/users/:name/x", handler("x")))
+assert(not r:add(nil, "/a/*path/b", handler("x")))
+assert(not r:add(nil, "no-slash", handler("x")))
+
+local cases = {
+    {"GET", "/", "root"},
+    {"DELETE", "/", "root"},
+    {"GET", "/users", "list users"},
+    {"POST", "/users", "create user"},
+    {"DELETE", "/users", nil, 405},
+    {"GET", "/user", "user"},
+    {"GET", "/users/new", "new user"},
+    {"GET", "/users/42", "get user", {id = "42"}},
+    {"GET", "/users/42/files/a.txt", "get file", {id = "42", file = "a.txt"}},
+    {"GET", "/users/new/files/b", "get file", {id = "new", file = "b"}},
+    {"GET", "/users/42/files", nil, 404},
+    {"GET", "/static/js/app.js", "static", {path = "js/app.js"}},
+    {"GET", "/nothing", nil, 404},
+}
+
+for _, case in ipairs(cases) do
+    local method, path, name, expect = case[1], case[2], case[3], case[4]
+    local h, params = r:match(method, path)
+    if name then
+        assert(h and h() == name, path)
+        for k, v in pairs(expect or {}) do
+            assert(params[k] == v, string.format("%s: %s ~= %s", path, params[k], v))
+        end
+    else
+        assert(not h and params == expect, path)
+    end
+end
+
+-- many routes
+local big = router.new()
+for i = 1, 10000 do
+    assert(big:add("GET", "/api/v1/item" .. i .. "/:id", handler(i)))
+end
+local h, params = big:match("GET", "/api/v1/item9999/abc")
+assert(h() == 9999 and params.id == "abc")
+print("test pass")
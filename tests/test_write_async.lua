@@ -0,0 +1,154 @@
+local levent = require "levent.levent"
+local socket = require "levent.socket"
+
+local port = 8862
+local nclient = 10
+local msg = string.rep("x", 1024)
+local nmsg = 1000
+
+local received = {}
+
+function reader(i)
+    local sock, err = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    assert(sock, err)
+    assert(sock:connect("127.0.0.1", port))
+    local total = 0
+    while true do
+        local data = sock:recv(65536)
+        if not data or #data == 0 then
+            break
+        end
+        total = total + #data
+    end
+    received[i] = total
+    sock:close()
+end
+
+-- connected pair, reader counts bytes until close, pausing while paused
+local function pair(ln)
+    local r = assert(socket.socket(socket.AF_INET, socket.SOCK_STREAM))
+    assert(r:connect("127.0.0.1", port))
+    local w = assert(ln:accept())
+    local st = {total = 0, paused = true, reading = true}
+    levent.spawn(function()
+        while true do
+            while st.paused do
+                levent.sleep(0.01)
+            end
+            local data = r:recv(65536)
+            if not data or #data == 0 then
+                break
+            end
+            st.total = st.total + #data
+        end
+        st.reading = false
+        r:close()
+    end)
+    return w, st
+end
+
+local function wait_closed(st)
+    while st.reading do
+        levent.sleep(0.01)
+    end
+end
+
+-- a coroutine blocked in flush while another queues more
+local function test_blocked_writer(ln)
+    local w, st = pair(ln)
+    local big = 8 * 1024 * 1024
+    assert(w:write_async(string.rep("x", big)) ~= nil)
+    levent.sleep(0.01)
+    local flushed
+    levent.spawn(function()
+        flushed = w:flush()
+    end)
+    levent.sleep(0.01)
+    assert(w:write_async("x") ~= nil)
+    levent.sleep(0.01)
+    st.paused = false
+    assert(w:wait_writable_below(0, 5), w:queued_bytes())
+    assert(flushed)
+
+    -- and later data still drains by write watcher
+    st.paused = true
+    levent.sleep(0.01)
+    assert(w:write_async(string.rep("x", big)) ~= nil)
+    levent.sleep(0.05)
+    st.paused = false
+    assert(w:wait_writable_below(0, 5), w:queued_bytes())
+    w:close()
+    wait_closed(st)
+    assert(st.total == big * 2 + 1, st.total)
+end
+
+-- a socket failing in a batch of flush doesn't hold up the others
+local function test_failed_drain(ln)
+    local bad, bad_st = pair(ln)
+    local good, good_st = pair(ln)
+    bad_st.paused = false
+    good_st.paused = false
+    bad._drain = function()
+        error("drain fails")
+    end
+    for _ = 1, 10 do
+        bad:write_async("bad")
+        good:write_async("good")
+    end
+    assert(good:wait_writable_below(0, 1), good:queued_bytes())
+    bad._drain = nil
+    bad:close()
+    good:close()
+    wait_closed(good_st)
+    assert(good_st.total == 40, good_st.total)
+end
+
+function start()
+    local ln, err = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    assert(ln, err)
+    assert(ln:bind("0.0.0.0", port))
+    ln:listen()
+
+    for i=1, nclient do
+        levent.spawn(reader, i)
+    end
+
+    local conns = {}
+    local drained = 0
+    for i=1, nclient do
+        local conn = assert(ln:accept())
+        conn:set_watermarks(16384, 4096)
+        conn:on_drain(function()
+            drained = drained + 1
+        end)
+        conns[i] = conn
+    end
+
+    -- broadcast from one coroutine
+    for _=1, nmsg do
+        for _, conn in ipairs(conns) do
+            local ok, err = conn:write_async(msg)
+            assert(ok ~= nil, err)
+            if not ok then
+                assert(conn:queued_bytes() >= 16384)
+                assert(conn:wait_writable_below())
+            end
+        end
+    end
+
+    for _, conn in ipairs(conns) do
+        assert(conn:wait_writable_below(0))
+        conn:close()
+    end
+    levent.sleep(0.1)
+    print("drained:", drained)
+    for i=1, nclient do
+        assert(received[i] == #msg * nmsg, received[i])
+    end
+
+    test_blocked_writer(ln)
+    test_failed_drain(ln)
+    ln:close()
+end
+
+levent.start(start)
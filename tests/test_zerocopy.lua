@@ -0,0 +1,74 @@
+local levent = require "levent.levent"
+local socket_util = require "levent.socket_util"
+
+local port = 8879
+local THRESHOLD = 4096
+
+-- read exactly n bytes
+local function read(conn, n)
+    local t = {}
+    local size = 0
+    while size < n do
+        local s = assert(conn:recv(n - size))
+        assert(#s > 0, "connection closed")
+        t[#t + 1] = s
+        size = size + #s
+    end
+    return table.concat(t)
+end
+
+-- completions arrive in error queue after peer acks data
+local function wait_reaped(sock)
+    for _ = 1, 100 do
+        sock:_reap_zerocopy()
+        if sock:zerocopy_pending() == 0 then
+            return true
+        end
+        levent.sleep(0.01)
+    end
+    return false
+end
+
+function start()
+    local ln = assert(socket_util.listen("127.0.0.1", port))
+    local peer = assert(socket_util.create_connection("127.0.0.1", port))
+    peer:set_timeout(5)
+    local sock = assert(ln:accept())
+    ln:close()
+
+    local ok, err = sock:set_zerocopy(THRESHOLD)
+    if not ok then
+        print("skip, zerocopy is not supported:", err)
+        sock:close()
+        peer:close()
+        return
+    end
+    assert(sock:zerocopy_pending() == 0)
+
+    -- below threshold, copied as usual
+    local small = string.rep("s", THRESHOLD - 1)
+    assert(sock:send(small) == #small)
+    assert(sock:zerocopy_pending() == 0)
+    assert(read(peer, #small) == small)
+
+    -- above threshold, data is pinned until completion is reaped
+    local big = string.rep("0123456789abcdef", 16384)
+    local n = assert(sock:send(big))
+    assert(sock:zerocopy_pending() == 1, sock:zerocopy_pending())
+    assert(read(peer, n) == big:sub(1, n))
+    assert(wait_reaped(sock), "zerocopy completion is never reaped")
+
+    -- loopback copies data anyway, so it's turned off by the completion
+    -- above. pinned data of a closed socket is kept by itself
+    assert(sock:set_zerocopy(THRESHOLD))
+    n = assert(sock:send(big))
+    assert(sock:zerocopy_pending() == 1, sock:zerocopy_pending())
+    sock:close()
+    assert(sock:zerocopy_pending() == 0)
+    assert(read(peer, n) == big:sub(1, n))
+
+    peer:close()
+    print("test pass")
+end
+
+levent.start(start)